@@ -6,6 +6,7 @@
 
 #define WIN_FONT_RENDER_IMPLEMENTATION
 #include "WinFontRender.h"
+#include "Tests.h"
 
 #include <Windows.h>
 
@@ -18,6 +19,8 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstdlib>
+#include <cstdio>
+#include <cwchar>
 
 #include <cassert>
 
@@ -471,8 +474,40 @@ LRESULT WINAPI WndProc(HWND wnd, UINT msg, WPARAM wParam, LPARAM lParam)
     return DefWindowProc(wnd, msg, wParam, lParam);
 }
 
-int WINAPI wWinMain(HINSTANCE, HINSTANCE, LPWSTR, int)
+// If command line starts with option, returns the rest of it with leading spaces skipped. Otherwise returns null.
+static const wchar_t* FindCommandLineOption(const wchar_t* cmdLine, const wchar_t* option)
 {
+    const size_t optionLen = wcslen(option);
+    if(wcsncmp(cmdLine, option, optionLen) != 0 || (cmdLine[optionLen] != L'\0' && cmdLine[optionLen] != L' '))
+        return nullptr;
+    cmdLine += optionLen;
+    while(*cmdLine == L' ')
+        ++cmdLine;
+    return cmdLine;
+}
+
+// The application uses Windows subsystem, so text is printed to the console it was started from, or to a new one.
+static void OpenConsole()
+{
+    if(!AttachConsole(ATTACH_PARENT_PROCESS))
+        AllocConsole();
+    FILE* file = nullptr;
+    freopen_s(&file, "CONOUT$", "w", stdout);
+}
+
+int WINAPI wWinMain(HINSTANCE, HINSTANCE, LPWSTR cmdLine, int)
+{
+    if(const wchar_t* benchmarkName = FindCommandLineOption(cmdLine, L"-benchmark"))
+    {
+        OpenConsole();
+        return RunBenchmarks(benchmarkName);
+    }
+    if(FindCommandLineOption(cmdLine, L"-test"))
+    {
+        OpenConsole();
+        return RunTests();
+    }
+
     HINSTANCE instance = (HINSTANCE)GetModuleHandle(NULL);
 
     CCoInitializeGuard coInitializeObj;
@@ -0,0 +1,2210 @@
+// Defines for <Windows.h>
+#define STRICT
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#define VC_EXTRALEAN
+
+#include "WinFontRender.h"
+#include "Tests.h"
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cwchar>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+
+using namespace WinFontRender;
+
+namespace
+{
+
+typedef std::chrono::high_resolution_clock::time_point time_point;
+
+double GetMillisecondsSince(time_point beginTime)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - beginTime).count();
+}
+
+// Sets of characters used by benchmarks, from small to large.
+struct SCharRangeSet
+{
+    const char* Name;
+    const wchar_t* FaceName;
+    const wchar_t* CharRanges;
+    size_t CharRangeCount;
+};
+
+const wchar_t CHAR_RANGES_DEFAULT[] = { 32, 127 };
+const wchar_t CHAR_RANGES_LATIN_EXTENDED[] = { 32, 0x24F };
+const wchar_t CHAR_RANGES_CJK[] = { 32, 127, 0x4E00, 0x4E00 + 2999 };
+
+const SCharRangeSet CHAR_RANGE_SETS[] = {
+    { "default", L"Arial", CHAR_RANGES_DEFAULT, 1 },
+    { "latin extended", L"Arial", CHAR_RANGES_LATIN_EXTENDED, 1 },
+    { "CJK 3000", L"Microsoft YaHei", CHAR_RANGES_CJK, 2 },
+};
+
+void InitDesc(SFontDesc& outDesc, const SCharRangeSet& rangeSet, int height)
+{
+    outDesc = SFontDesc();
+    outDesc.FaceName = wstr_view(rangeSet.FaceName);
+    outDesc.Height = height;
+    outDesc.CharRanges = rangeSet.CharRanges;
+    outDesc.CharRangeCount = rangeSet.CharRangeCount;
+}
+
+// Appends all characters of the ranges, in order.
+void GetRangeChars(std::vector<wchar_t>& outChars, const SCharRangeSet& rangeSet)
+{
+    for(size_t rangeIndex = 0; rangeIndex < rangeSet.CharRangeCount; ++rangeIndex)
+    {
+        for(uint32_t ch = rangeSet.CharRanges[rangeIndex * 2]; ch <= rangeSet.CharRanges[rangeIndex * 2 + 1]; ++ch)
+            outChars.push_back((wchar_t)ch);
+    }
+}
+
+// Fills outText with characters chosen from chars pseudo-randomly, the same every time.
+void GenerateRandomText(std::vector<wchar_t>& outText, const std::vector<wchar_t>& chars, size_t length)
+{
+    outText.resize(length);
+    uint32_t random = 1;
+    for(size_t i = 0; i < length; ++i)
+    {
+        random = random * 1664525u + 1013904223u;
+        outText[i] = chars[(random >> 8) % chars.size()];
+    }
+}
+
+// Copy of texture data of a font, all pages, to compare it with another one or find texels changed later.
+struct STextureSnapshot
+{
+    std::vector<uint8_t> Data;
+    uvec2 Size;
+    size_t RowPitch;
+    uint32_t PageCount;
+};
+
+void TakeTextureSnapshot(STextureSnapshot& outSnapshot, const CFont& font)
+{
+    const void* data;
+    font.GetTextureData(data, outSnapshot.Size, outSnapshot.RowPitch);
+    outSnapshot.PageCount = font.GetTexturePageCount();
+    // With TEXTURE_FORMAT_BC4, rows are rows of blocks.
+    const uint32_t rowCount = font.GetTextureFormat() == TEXTURE_FORMAT_BC4 ? outSnapshot.Size.y / 4 : outSnapshot.Size.y;
+    const uint8_t* const bytes = (const uint8_t*)data;
+    outSnapshot.Data.assign(bytes, bytes + outSnapshot.RowPitch * rowCount * outSnapshot.PageCount);
+}
+
+/*
+Calls lookup(i) for i = 0..count-1 and sums the results, so the calls can't be optimized away.
+Repeats it a few times and returns the shortest time per call, in nanoseconds.
+*/
+template<typename LookupFunc>
+double MeasureLookups(float& outSum, size_t count, LookupFunc lookup)
+{
+    const int repeatCount = 3;
+    double bestMilliseconds = DBL_MAX;
+    for(int repeat = 0; repeat < repeatCount; ++repeat)
+    {
+        float sum = 0.f;
+        const time_point beginTime = std::chrono::high_resolution_clock::now();
+        for(size_t i = 0; i < count; ++i)
+            sum += lookup(i);
+        bestMilliseconds = std::min(bestMilliseconds, GetMillisecondsSince(beginTime));
+        outSum = sum;
+    }
+    return count ? bestMilliseconds * 1e6 / count : 0.0;
+}
+
+const size_t LOOKUP_COUNT = 1000000;
+
+/*
+Compares memory used by character information of a font with the flat array of CHAR_COUNT elements it replaced,
+and the time of looking up characters of a random text in both.
+*/
+bool BenchmarkCharInfo()
+{
+    bool success = true;
+    const size_t charCount = 0x10000;
+    printf("%-16s %6s %12s %12s %12s %14s %14s\n",
+        "Range", "Pages", "Bytes", "Flat bytes", "Font bytes", "Lookup ns", "Flat lookup ns");
+    for(size_t setIndex = 0; setIndex < _countof(CHAR_RANGE_SETS); ++setIndex)
+    {
+        const SCharRangeSet& rangeSet = CHAR_RANGE_SETS[setIndex];
+        SFontDesc desc;
+        InitDesc(desc, rangeSet, 32);
+        CFont font;
+        if(!font.Init(desc))
+        {
+            printf("%-16s Init failed\n", rangeSet.Name);
+            success = false;
+            continue;
+        }
+        CFont::SStatistics stats;
+        font.GetStatistics(stats);
+
+        std::vector<wchar_t> chars, text;
+        GetRangeChars(chars, rangeSet);
+        GenerateRandomText(text, chars, LOOKUP_COUNT);
+        std::vector<CFont::SCharMetrics> flatMetrics(charCount);
+        for(size_t i = 0; i < charCount; ++i)
+            flatMetrics[i] = font.GetCharMetrics((wchar_t)i);
+
+        float sum, flatSum;
+        const double lookupNs = MeasureLookups(sum, text.size(),
+            [&](size_t i) -> float { return font.GetCharMetrics(text[i]).Advance; });
+        const double flatLookupNs = MeasureLookups(flatSum, text.size(),
+            [&](size_t i) -> float { return flatMetrics[text[i]].Advance; });
+
+        printf("%-16s %6zu %12zu %12zu %12zu %14.3f %14.3f\n",
+            rangeSet.Name, stats.CharInfoPageCount, stats.CharInfoBytes,
+            charCount * (sizeof(CFont::SCharInfo) + sizeof(CFont::SCharMetrics)),
+            stats.TotalBytes, lookupNs, flatLookupNs);
+        if(sum != flatSum)
+        {
+            printf("    Lookup results differ: %g, %g\n", sum, flatSum);
+            success = false;
+        }
+    }
+    return success;
+}
+
+/*
+Splits lines like CFont::LineSplit with FLAG_WRAP_NORMAL did before SCharMetrics, reading whole SCharInfo
+from a flat array of CHAR_COUNT elements. Lines end at '\n' only. Returns false at the end of text.
+*/
+bool FlatLineSplit(size_t& outBegin, size_t& outEnd, float& outWidth, size_t& inoutIndex,
+    const std::vector<CFont::SCharInfo>& flatCharInfo, const CFont& font, const std::vector<wchar_t>& text, float fontSize)
+{
+    if(inoutIndex >= text.size())
+        return false;
+    outBegin = inoutIndex;
+    outWidth = 0.f;
+    wchar_t prevCh = 0;
+    for(; inoutIndex < text.size() && text[inoutIndex] != L'\n'; ++inoutIndex)
+    {
+        const wchar_t currCh = text[inoutIndex];
+        const float charWidth = flatCharInfo[currCh].Advance * fontSize;
+        const float kerning = prevCh ? font.GetKerning(prevCh, currCh, fontSize) : 0.f;
+        outWidth += charWidth + kerning;
+        prevCh = currCh;
+    }
+    outEnd = inoutIndex;
+    if(inoutIndex < text.size())
+        ++inoutIndex;
+    return true;
+}
+
+/*
+Measures CalcTextExtent and CalcQuadCount of a long text with lines of about 60 characters, per character,
+compared with the same calculations using FlatLineSplit.
+*/
+bool BenchmarkLayout()
+{
+    bool success = true;
+    const size_t charCount = 0x10000;
+    const float fontSize = 32.f;
+    const uint32_t flags = CFont::FLAG_HLEFT | CFont::FLAG_VTOP | CFont::FLAG_WRAP_NORMAL;
+    printf("%-16s %12s %14s %12s %14s\n",
+        "Range", "Extent ns", "Flat extent ns", "Quads ns", "Flat quads ns");
+    for(size_t setIndex = 0; setIndex < _countof(CHAR_RANGE_SETS); ++setIndex)
+    {
+        const SCharRangeSet& rangeSet = CHAR_RANGE_SETS[setIndex];
+        SFontDesc desc;
+        InitDesc(desc, rangeSet, 32);
+        CFont font;
+        if(!font.Init(desc))
+        {
+            printf("%-16s Init failed\n", rangeSet.Name);
+            success = false;
+            continue;
+        }
+        std::vector<CFont::SCharInfo> flatCharInfo(charCount);
+        for(size_t i = 0; i < charCount; ++i)
+            flatCharInfo[i] = font.GetCharInfo((wchar_t)i);
+
+        std::vector<wchar_t> chars, text;
+        GetRangeChars(chars, rangeSet);
+        GenerateRandomText(text, chars, LOOKUP_COUNT);
+        for(size_t i = 59; i < text.size(); i += 60)
+            text[i] = L'\n';
+        const wstr_view textView = wstr_view(text.data(), text.size());
+
+        vec2 extent, flatExtent;
+        size_t quadCount = 0, flatQuadCount = 0;
+        float sum;
+        const double extentNs = MeasureLookups(sum, 1, [&](size_t) -> float {
+            font.CalcTextExtent(extent, textView, fontSize, flags, 0.f);
+            return extent.x;
+        }) / text.size();
+        const double flatExtentNs = MeasureLookups(sum, 1, [&](size_t) -> float {
+            size_t lineBegin, lineEnd, index = 0;
+            float lineWidth;
+            float lineCount = 0.f;
+            flatExtent.x = 0.f;
+            while(FlatLineSplit(lineBegin, lineEnd, lineWidth, index, flatCharInfo, font, text, fontSize))
+            {
+                lineCount += 1.f;
+                flatExtent.x = std::max(flatExtent.x, lineWidth);
+            }
+            flatExtent.y = (lineCount + (lineCount - 1.f) * font.GetLineGap()) * fontSize;
+            return flatExtent.x;
+        }) / text.size();
+        const double quadsNs = MeasureLookups(sum, 1, [&](size_t) -> float {
+            quadCount = font.CalcQuadCount(textView, fontSize, flags, 0.f);
+            return (float)quadCount;
+        }) / text.size();
+        const double flatQuadsNs = MeasureLookups(sum, 1, [&](size_t) -> float {
+            size_t lineBegin, lineEnd, index = 0;
+            float lineWidth;
+            flatQuadCount = 0;
+            while(FlatLineSplit(lineBegin, lineEnd, lineWidth, index, flatCharInfo, font, text, fontSize))
+            {
+                for(size_t i = lineBegin; i < lineEnd; ++i)
+                {
+                    if(text[i] != L' ')
+                        ++flatQuadCount;
+                }
+            }
+            return (float)flatQuadCount;
+        }) / text.size();
+
+        printf("%-16s %12.3f %14.3f %12.3f %14.3f\n",
+            rangeSet.Name, extentNs, flatExtentNs, quadsNs, flatQuadsNs);
+        if(extent.x != flatExtent.x || extent.y != flatExtent.y || quadCount != flatQuadCount)
+        {
+            printf("    Results differ: %g x %g, %g x %g, %zu, %zu\n",
+                extent.x, extent.y, flatExtent.x, flatExtent.y, quadCount, flatQuadCount);
+            success = false;
+        }
+    }
+    return success;
+}
+
+// Pair of characters with nonzero kerning.
+struct SKerningPair
+{
+    wchar_t First, Second;
+    float Amount;
+};
+
+/*
+Kerning lookup as it was before the hash table: linear scan of pairs sorted by first, then second character,
+starting at the first pair of firstCh.
+*/
+float ScanKerning(const std::vector<SKerningPair>& pairs, const std::vector<uint32_t>& firstIndices, wchar_t firstCh, wchar_t secondCh)
+{
+    for(size_t i = firstIndices[firstCh]; i < pairs.size() && pairs[i].First == firstCh; ++i)
+    {
+        if(pairs[i].Second == secondCh)
+            return pairs[i].Amount;
+        if(pairs[i].Second > secondCh)
+            break;
+    }
+    return 0.f;
+}
+
+/*
+Reads kerning pairs of the font described by desc directly from GDI, like CFont::Init does: pairs of two of chars,
+which must be sorted, with nonzero amount scaled to font size = 1.0, sorted by first, then second character,
+keeping the first one if a pair is repeated. Returns false if GDI fails.
+*/
+bool GetGdiKerningPairs(std::vector<SKerningPair>& outPairs, const SFontDesc& desc, const std::vector<wchar_t>& chars)
+{
+    outPairs.clear();
+    const HDC dc = CreateCompatibleDC(NULL);
+    if(dc == NULL)
+        return false;
+    const HFONT font = CreateFont(desc.Height, 0, 0, 0,
+        (desc.Flags & SFontDesc::FLAG_BOLD) ? FW_BOLD : FW_NORMAL, (desc.Flags & SFontDesc::FLAG_ITALIC) ? TRUE : FALSE, FALSE, FALSE,
+        desc.CharSet, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS, ANTIALIASED_QUALITY, desc.PitchAndFamily, desc.FaceName.c_str());
+    if(font == NULL)
+    {
+        DeleteDC(dc);
+        return false;
+    }
+    const HGDIOBJ oldFont = SelectObject(dc, font);
+    std::vector<KERNINGPAIR> kerningPairs(GetKerningPairs(dc, 0, NULL));
+    if(!kerningPairs.empty())
+        kerningPairs.resize(GetKerningPairs(dc, (DWORD)kerningPairs.size(), kerningPairs.data()));
+    SelectObject(dc, oldFont);
+    DeleteObject(font);
+    DeleteDC(dc);
+
+    auto isChar = [&chars](wchar_t ch) -> bool { return std::binary_search(chars.begin(), chars.end(), ch); };
+    const float fontSizeInv = 1.f / (float)desc.Height;
+    for(size_t i = 0; i < kerningPairs.size(); ++i)
+    {
+        const KERNINGPAIR& pair = kerningPairs[i];
+        if(pair.iKernAmount != 0 && isChar(pair.wFirst) && isChar(pair.wSecond))
+            outPairs.push_back(SKerningPair{ pair.wFirst, pair.wSecond, (float)pair.iKernAmount * fontSizeInv });
+    }
+    std::stable_sort(outPairs.begin(), outPairs.end(), [](const SKerningPair& lhs, const SKerningPair& rhs) -> bool {
+        return lhs.First < rhs.First || (lhs.First == rhs.First && lhs.Second < rhs.Second);
+    });
+    outPairs.erase(std::unique(outPairs.begin(), outPairs.end(), [](const SKerningPair& lhs, const SKerningPair& rhs) -> bool {
+        return lhs.First == rhs.First && lhs.Second == rhs.Second;
+    }), outPairs.end());
+    return true;
+}
+
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+// Prints where lookups counted in stats ended, in percent of all lookups.
+void PrintKerningStatistics(const char* name, const CFont::SKerningStatistics& stats)
+{
+    const double percent = stats.LookupCount ? 100.0 / (double)stats.LookupCount : 0.0;
+    printf("    %-6s %10llu lookups: rejected by second %5.1f%%, class matrix %5.1f%%, rejected by first %5.1f%%, "
+        "rejected by bloom %5.1f%%, hash hit %5.1f%%, hash miss %5.1f%%\n",
+        name, (unsigned long long)stats.LookupCount,
+        stats.RejectedBySecondCount * percent, stats.ClassMatrixCount * percent, stats.RejectedByFirstCount * percent,
+        stats.RejectedByBloomCount * percent, stats.HashHitCount * percent, stats.HashMissCount * percent);
+}
+#endif
+
+/*
+Compares GetKerning with ScanKerning over pairs read from GDI by GetGdiKerningPairs, for fonts with small and large kerning tables:
+for every pair of characters of the font, then timing two sequences of pairs: neighbors in a random text made of characters
+of the font, which mostly have no kerning, and random pairs that have it.
+With WIN_FONT_RENDER_KERNING_STATISTICS, also prints how GetKerning resolved lookups of both sequences.
+*/
+bool BenchmarkKerning()
+{
+    bool success = true;
+    printf("%-16s %8s %14s %14s %14s %14s\n",
+        "Range", "Pairs", "Text ns", "Text scan ns", "Pairs ns", "Pairs scan ns");
+    for(size_t setIndex = 0; setIndex < _countof(CHAR_RANGE_SETS); ++setIndex)
+    {
+        const SCharRangeSet& rangeSet = CHAR_RANGE_SETS[setIndex];
+        SFontDesc desc;
+        InitDesc(desc, rangeSet, 32);
+        CFont font;
+        if(!font.Init(desc))
+        {
+            printf("%-16s Init failed\n", rangeSet.Name);
+            success = false;
+            continue;
+        }
+
+        std::vector<wchar_t> chars, text;
+        GetRangeChars(chars, rangeSet);
+        GenerateRandomText(text, chars, LOOKUP_COUNT + 1);
+        std::vector<SKerningPair> pairs;
+        if(!GetGdiKerningPairs(pairs, desc, chars))
+        {
+            printf("%-16s GDI failed\n", rangeSet.Name);
+            success = false;
+            continue;
+        }
+        std::vector<uint32_t> firstIndices(0x10000, UINT32_MAX);
+        for(size_t i = pairs.size(); i-- > 0; )
+            firstIndices[pairs[i].First] = (uint32_t)i;
+        // Every pair of characters, so pairs missing in the font are found as well as extra ones.
+        size_t mismatchCount = 0;
+        for(size_t firstIndex = 0; firstIndex < chars.size(); ++firstIndex)
+        {
+            for(size_t secondIndex = 0; secondIndex < chars.size(); ++secondIndex)
+            {
+                if(font.GetKerning(chars[firstIndex], chars[secondIndex]) !=
+                    ScanKerning(pairs, firstIndices, chars[firstIndex], chars[secondIndex]))
+                    ++mismatchCount;
+            }
+        }
+        std::vector<SKerningPair> kernedPairs(pairs.empty() ? 0 : LOOKUP_COUNT);
+        for(size_t i = 0; i < kernedPairs.size(); ++i)
+            kernedPairs[i] = pairs[(size_t)text[i] * 7919 % pairs.size()];
+
+        float sums[4];
+        CFont::SKerningStatistics textStats, pairsStats;
+        font.ResetKerningStatistics();
+        const double textNs = MeasureLookups(sums[0], LOOKUP_COUNT,
+            [&](size_t i) -> float { return font.GetKerning(text[i], text[i + 1]); });
+        font.GetKerningStatistics(textStats);
+        const double textScanNs = MeasureLookups(sums[1], LOOKUP_COUNT,
+            [&](size_t i) -> float { return ScanKerning(pairs, firstIndices, text[i], text[i + 1]); });
+        font.ResetKerningStatistics();
+        const double pairsNs = MeasureLookups(sums[2], kernedPairs.size(),
+            [&](size_t i) -> float { return font.GetKerning(kernedPairs[i].First, kernedPairs[i].Second); });
+        font.GetKerningStatistics(pairsStats);
+        const double pairsScanNs = MeasureLookups(sums[3], kernedPairs.size(),
+            [&](size_t i) -> float { return ScanKerning(pairs, firstIndices, kernedPairs[i].First, kernedPairs[i].Second); });
+
+        printf("%-16s %8zu %14.3f %14.3f %14.3f %14.3f\n",
+            rangeSet.Name, pairs.size(), textNs, textScanNs, pairsNs, pairsScanNs);
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+        PrintKerningStatistics("Text", textStats);
+        PrintKerningStatistics("Pairs", pairsStats);
+#endif
+        if(mismatchCount > 0 || sums[0] != sums[1] || sums[2] != sums[3])
+        {
+            printf("    Lookup results differ: %zu mismatched pairs, %g, %g, %g, %g\n",
+                mismatchCount, sums[0], sums[1], sums[2], sums[3]);
+            success = false;
+        }
+    }
+    return success;
+}
+
+// Compares packing algorithms by efficiency of the texture and time of packing, for each set of characters.
+bool BenchmarkPacking()
+{
+    bool success = true;
+    const SFontDesc::PACKING packings[] = {
+        SFontDesc::PACKING_SHELF, SFontDesc::PACKING_SKYLINE, SFontDesc::PACKING_MAX_RECTS };
+    const char* const packingNames[] = { "shelf", "skyline", "max rects" };
+    printf("%-16s %-10s %6s %6s %6s %12s %12s\n",
+        "Range", "Packing", "Width", "Height", "Pages", "Efficiency", "Packing ms");
+    for(size_t setIndex = 0; setIndex < _countof(CHAR_RANGE_SETS); ++setIndex)
+    {
+        const SCharRangeSet& rangeSet = CHAR_RANGE_SETS[setIndex];
+        for(size_t packingIndex = 0; packingIndex < _countof(packings); ++packingIndex)
+        {
+            SFontDesc desc;
+            InitDesc(desc, rangeSet, 32);
+            desc.Packing = packings[packingIndex];
+            CFont font;
+            if(!font.Init(desc))
+            {
+                printf("%-16s %-10s Init failed\n", rangeSet.Name, packingNames[packingIndex]);
+                success = false;
+                continue;
+            }
+            CFont::SStatistics stats;
+            font.GetStatistics(stats);
+            const void* data;
+            uvec2 size;
+            size_t rowPitch;
+            font.GetTextureData(data, size, rowPitch);
+            printf("%-16s %-10s %6u %6u %6u %11.1f%% %12.3f\n",
+                rangeSet.Name, packingNames[packingIndex], size.x, size.y, font.GetTexturePageCount(),
+                stats.AtlasTotalTexels ? (double)stats.AtlasUsedTexels * 100.0 / (double)stats.AtlasTotalTexels : 0.0,
+                stats.PackingTime * 1000.0);
+        }
+    }
+    return success;
+}
+
+/*
+Measures Init for a grid of CharRanges: different numbers of ranges of different lengths, in the CJK block,
+with a gap of one character between ranges so they don't merge. Time should grow with the total number of characters only.
+*/
+bool BenchmarkCreation()
+{
+    bool success = true;
+    const size_t rangeCounts[] = { 1, 16, 256, 2048 };
+    const uint32_t rangeLengths[] = { 1, 4, 8 };
+    printf("%8s %8s %8s %12s %12s %12s %12s\n",
+        "Ranges", "Length", "Chars", "Init ms", "Raster ms", "Packing ms", "Compose ms");
+    for(size_t rangeCountIndex = 0; rangeCountIndex < _countof(rangeCounts); ++rangeCountIndex)
+    {
+        for(size_t rangeLengthIndex = 0; rangeLengthIndex < _countof(rangeLengths); ++rangeLengthIndex)
+        {
+            const size_t rangeCount = rangeCounts[rangeCountIndex];
+            const uint32_t rangeLength = rangeLengths[rangeLengthIndex];
+            // Basic Latin first, as '?' is required.
+            std::vector<wchar_t> charRanges = { 32, 127 };
+            for(size_t i = 0; i < rangeCount; ++i)
+            {
+                const wchar_t rangeBegin = (wchar_t)(0x4E00 + i * (rangeLength + 1));
+                charRanges.push_back(rangeBegin);
+                charRanges.push_back((wchar_t)(rangeBegin + rangeLength - 1));
+            }
+            SFontDesc desc;
+            desc.FaceName = L"Microsoft YaHei";
+            desc.Height = 16;
+            desc.CharRanges = charRanges.data();
+            desc.CharRangeCount = charRanges.size() / 2;
+            CFont font;
+            const time_point beginTime = std::chrono::high_resolution_clock::now();
+            const bool initSuccess = font.Init(desc);
+            const double initMilliseconds = GetMillisecondsSince(beginTime);
+            const size_t charCount = 96 + rangeCount * rangeLength;
+            if(!initSuccess)
+            {
+                printf("%8zu %8u %8zu Init failed\n", rangeCount, rangeLength, charCount);
+                success = false;
+                continue;
+            }
+            CFont::SStatistics stats;
+            font.GetStatistics(stats);
+            printf("%8zu %8u %8zu %12.3f %12.3f %12.3f %12.3f\n",
+                rangeCount, rangeLength, charCount, initMilliseconds,
+                stats.RasterizationTime * 1000.0, stats.PackingTime * 1000.0, stats.CompositionTime * 1000.0);
+        }
+    }
+    return success;
+}
+
+/*
+Creates a font with the whole CJK Unified Ideographs block on one thread and on all hardware threads,
+to show the speedup of rasterization and composition, which are limited by SFontDesc::MaxThreadCount.
+*/
+bool BenchmarkLargeRanges()
+{
+    bool success = true;
+    const wchar_t charRanges[] = { 32, 127, 0x4E00, 0x9FFF };
+    const uint32_t maxThreadCounts[] = { 1, 0 };
+    const size_t charCount = (127 - 32 + 1) + (0x9FFF - 0x4E00 + 1);
+    printf("%8s %8s %12s %12s %12s %12s\n",
+        "Threads", "Chars", "Init ms", "Raster ms", "Packing ms", "Compose ms");
+    for(size_t i = 0; i < _countof(maxThreadCounts); ++i)
+    {
+        SFontDesc desc;
+        desc.FaceName = L"Microsoft YaHei";
+        desc.Height = 16;
+        desc.CharRanges = charRanges;
+        desc.CharRangeCount = _countof(charRanges) / 2;
+        desc.MaxThreadCount = maxThreadCounts[i];
+        CFont font;
+        const time_point beginTime = std::chrono::high_resolution_clock::now();
+        const bool initSuccess = font.Init(desc);
+        const double initMilliseconds = GetMillisecondsSince(beginTime);
+        if(!initSuccess)
+        {
+            printf("%8u Init failed\n", maxThreadCounts[i]);
+            success = false;
+            continue;
+        }
+        CFont::SStatistics stats;
+        font.GetStatistics(stats);
+        printf("%8u %8zu %12.3f %12.3f %12.3f %12.3f\n",
+            stats.RasterizationThreadCount, charCount, initMilliseconds,
+            stats.RasterizationTime * 1000.0, stats.PackingTime * 1000.0, stats.CompositionTime * 1000.0);
+    }
+    return success;
+}
+
+/*
+Creates fonts from each set of characters with SFontDesc::MaxThreadCount 1, 2, 4... up to number of hardware threads,
+printing the scaling of rasterization and total Init time. Texture must be identical to the one created by 1 thread.
+*/
+bool BenchmarkThreadScaling()
+{
+    bool success = true;
+    const uint32_t hardwareThreadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    printf("%-16s %12s %8s %12s %12s %10s %10s\n",
+        "Range", "Max threads", "Threads", "Raster ms", "Init ms", "Speedup", "Identical");
+    for(size_t setIndex = 0; setIndex < _countof(CHAR_RANGE_SETS); ++setIndex)
+    {
+        const SCharRangeSet& rangeSet = CHAR_RANGE_SETS[setIndex];
+        // Warm up, so the first measured font isn't slower for other reasons.
+        {
+            SFontDesc desc;
+            InitDesc(desc, rangeSet, 32);
+            CFont font;
+            font.Init(desc);
+        }
+        STextureSnapshot firstSnapshot;
+        float firstInitTime = 0.f;
+        for(uint32_t maxThreadCount = 1; ; maxThreadCount = std::min(maxThreadCount * 2, hardwareThreadCount))
+        {
+            SFontDesc desc;
+            InitDesc(desc, rangeSet, 32);
+            desc.MaxThreadCount = maxThreadCount;
+            CFont font;
+            if(!font.Init(desc))
+            {
+                printf("%-16s %8u Init failed\n", rangeSet.Name, maxThreadCount);
+                success = false;
+                break;
+            }
+            CFont::SStatistics stats;
+            font.GetStatistics(stats);
+            STextureSnapshot snapshot;
+            TakeTextureSnapshot(snapshot, font);
+            if(maxThreadCount == 1)
+            {
+                firstSnapshot = snapshot;
+                firstInitTime = stats.InitTime;
+            }
+            const bool identical = all(snapshot.Size == firstSnapshot.Size) && snapshot.PageCount == firstSnapshot.PageCount &&
+                snapshot.Data == firstSnapshot.Data;
+            printf("%-16s %12u %8u %12.3f %12.3f %9.2fx %10s\n",
+                rangeSet.Name, maxThreadCount, stats.RasterizationThreadCount, stats.RasterizationTime * 1000.0, stats.InitTime * 1000.0,
+                stats.InitTime > 0.f ? firstInitTime / stats.InitTime : 0.f, identical ? "yes" : "NO");
+            success &= identical;
+            if(maxThreadCount == hardwareThreadCount)
+                break;
+        }
+    }
+    return success;
+}
+
+/*
+Creates fonts with SFontDesc::FLAG_SDF from each set of characters, on one thread and on all hardware threads,
+printing time of calculating distance fields per 1000 characters.
+*/
+bool BenchmarkSdf()
+{
+    bool success = true;
+    const uint32_t maxThreadCounts[] = { 1, 0 };
+    printf("%-16s %8s %8s %12s %14s %12s\n",
+        "Range", "Threads", "Chars", "SDF ms", "ms per 1000", "Init ms");
+    for(size_t setIndex = 0; setIndex < _countof(CHAR_RANGE_SETS); ++setIndex)
+    {
+        const SCharRangeSet& rangeSet = CHAR_RANGE_SETS[setIndex];
+        for(size_t i = 0; i < _countof(maxThreadCounts); ++i)
+        {
+            SFontDesc desc;
+            InitDesc(desc, rangeSet, 32);
+            desc.Flags = SFontDesc::FLAG_SDF;
+            desc.MaxThreadCount = maxThreadCounts[i];
+            CFont font;
+            if(!font.Init(desc))
+            {
+                printf("%-16s %8u Init failed\n", rangeSet.Name, maxThreadCounts[i]);
+                success = false;
+                continue;
+            }
+            CFont::SStatistics stats;
+            font.GetStatistics(stats);
+            printf("%-16s %8u %8u %12.3f %14.3f %12.3f\n",
+                rangeSet.Name, stats.RasterizationThreadCount, stats.SdfCharCount, stats.SdfTime * 1000.0,
+                stats.SdfCharCount ? stats.SdfTime * 1e6 / stats.SdfCharCount : 0.0, stats.InitTime * 1000.0);
+        }
+    }
+    return success;
+}
+
+/*
+Builds CFontAtlas from typical sets of fonts, printing texels of the atlas compared with the sum of textures
+the fonts would have if each was created separately, see CFontAtlas::SStatistics::SeparateTotalTexels.
+*/
+bool BenchmarkAtlas()
+{
+    bool success = true;
+    struct SFontParams
+    {
+        size_t RangeSetIndex;
+        int Height;
+        uint32_t Flags;
+    };
+    const SFontParams uiFonts[] = { { 0, 12, 0 }, { 0, 16, 0 }, { 0, 16, SFontDesc::FLAG_BOLD }, { 0, 24, 0 } };
+    const SFontParams latinFonts[] = { { 1, 16, 0 }, { 1, 24, 0 }, { 1, 32, 0 }, { 1, 48, 0 } };
+    const SFontParams cjkFonts[] = { { 2, 16, 0 }, { 2, 24, 0 } };
+    const struct
+    {
+        const char* Name;
+        const SFontParams* Fonts;
+        size_t FontCount;
+    } cases[] = {
+        { "UI", uiFonts, _countof(uiFonts) },
+        { "latin extended", latinFonts, _countof(latinFonts) },
+        { "CJK 3000", cjkFonts, _countof(cjkFonts) },
+    };
+    printf("%-16s %6s %8s %12s %12s %14s %8s %12s %12s\n",
+        "Fonts", "Count", "Chars", "Used texels", "Atlas texels", "Separate texels", "Saving", "Packing ms", "Compose ms");
+    for(size_t caseIndex = 0; caseIndex < _countof(cases); ++caseIndex)
+    {
+        CFontAtlas atlas;
+        atlas.Init(SFontAtlasDesc());
+        std::vector<CFont> fonts(cases[caseIndex].FontCount);
+        bool initSuccess = true;
+        for(size_t fontIndex = 0; fontIndex < fonts.size() && initSuccess; ++fontIndex)
+        {
+            const SFontParams& params = cases[caseIndex].Fonts[fontIndex];
+            SFontDesc desc;
+            InitDesc(desc, CHAR_RANGE_SETS[params.RangeSetIndex], params.Height);
+            desc.Flags = params.Flags;
+            desc.Atlas = &atlas;
+            initSuccess = fonts[fontIndex].Init(desc);
+        }
+        if(!initSuccess || !atlas.Build())
+        {
+            printf("%-16s %s failed\n", cases[caseIndex].Name, initSuccess ? "Build" : "Init");
+            success = false;
+            continue;
+        }
+        CFontAtlas::SStatistics stats;
+        atlas.GetStatistics(stats);
+        if(stats.SeparateTotalTexels == SIZE_MAX)
+        {
+            printf("%-16s %6zu %8zu %12zu %12zu %14s\n",
+                cases[caseIndex].Name, stats.FontCount, stats.CharCount, stats.AtlasUsedTexels, stats.AtlasTotalTexels, "don't fit");
+            continue;
+        }
+        printf("%-16s %6zu %8zu %12zu %12zu %14zu %7.1f%% %12.3f %12.3f\n",
+            cases[caseIndex].Name, stats.FontCount, stats.CharCount, stats.AtlasUsedTexels, stats.AtlasTotalTexels,
+            stats.SeparateTotalTexels,
+            stats.SeparateTotalTexels ? 100.0 - (double)stats.AtlasTotalTexels * 100.0 / (double)stats.SeparateTotalTexels : 0.0,
+            stats.PackingTime * 1000.0, stats.CompositionTime * 1000.0);
+    }
+    return success;
+}
+
+struct SBenchmark
+{
+    const wchar_t* Name;
+    // Returns false if Init failed or results are wrong.
+    bool (*Func)();
+};
+
+const SBenchmark BENCHMARKS[] = {
+    { L"charinfo", &BenchmarkCharInfo },
+    { L"layout", &BenchmarkLayout },
+    { L"kerning", &BenchmarkKerning },
+    { L"packing", &BenchmarkPacking },
+    { L"creation", &BenchmarkCreation },
+    { L"largeranges", &BenchmarkLargeRanges },
+    { L"threads", &BenchmarkThreadScaling },
+    { L"sdf", &BenchmarkSdf },
+    { L"atlas", &BenchmarkAtlas },
+};
+
+// Appends closed contour of straight lines through points, in order.
+void AddPolygon(std::vector<SShapeSegment>& outSegments, const vec2* points, size_t pointCount)
+{
+    for(size_t i = 0; i < pointCount; ++i)
+    {
+        const vec2& p0 = points[i];
+        const vec2& p2 = points[(i + 1) % pointCount];
+        outSegments.push_back(SShapeSegment{ { p0, vec2((p0.x + p2.x) * 0.5f, (p0.y + p2.y) * 0.5f), p2 } });
+    }
+}
+
+// Distance from point p to line segment from a to b.
+float DistanceToLine(const vec2& p, const vec2& a, const vec2& b)
+{
+    const float abX = b.x - a.x, abY = b.y - a.y;
+    const float t = std::min(std::max(((p.x - a.x) * abX + (p.y - a.y) * abY) / (abX * abX + abY * abY), 0.f), 1.f);
+    const float dx = a.x + abX * t - p.x, dy = a.y + abY * t - p.y;
+    return std::sqrt(dx * dx + dy * dy);
+}
+
+uint8_t Median(uint8_t r, uint8_t g, uint8_t b)
+{
+    return std::max(std::min(r, g), std::min(std::max(r, g), b));
+}
+
+/*
+Compares multi-channel distance field of size x size texels calculated by CalcMultiChannelSignedDistanceField from contours
+with signedDistance(texelCenter), positive inside. Alpha must match it within maxError texels, and median of RGB must be
+on the same side of the edge wherever the texel center is at least 0.5 texel away from it.
+Also samples points between texel centers, as a shader would with bilinear filtering. There, median of RGB must be on
+the correct side wherever the point is at least 0.1 texel away from the edge, including at corners, which alpha rounds.
+*/
+template<typename SignedDistanceFunc>
+bool CheckMultiChannelDistanceField(const char* name, const std::vector<SShapeContour>& contours, uint32_t size, float spread,
+    float maxError, SignedDistanceFunc signedDistance)
+{
+    std::vector<uint8_t> texels(size * size * 4);
+    CalcMultiChannelSignedDistanceField(texels.data(), size * 4, uvec2(size, size), contours.data(), contours.size(), spread);
+    size_t alphaErrorCount = 0, medianErrorCount = 0;
+    float maxAlphaError = 0.f;
+    for(uint32_t y = 0; y < size; ++y)
+    {
+        for(uint32_t x = 0; x < size; ++x)
+        {
+            const uint8_t* texel = &texels[(y * size + x) * 4];
+            const float distance = signedDistance(vec2((float)x + 0.5f, (float)y + 0.5f));
+            const float clampedDistance = std::min(std::max(distance, -spread), spread);
+            const float alphaError = std::abs(((float)texel[3] - 128.f) * spread / 127.f - clampedDistance);
+            maxAlphaError = std::max(maxAlphaError, alphaError);
+            if(alphaError > maxError)
+                ++alphaErrorCount;
+            if(std::abs(distance) >= 0.5f && (Median(texel[0], texel[1], texel[2]) >= 128) != (distance > 0.f))
+                ++medianErrorCount;
+        }
+    }
+
+    const uint32_t samplesPerTexel = 8;
+    size_t alphaSampleErrorCount = 0, medianSampleErrorCount = 0;
+    for(uint32_t sampleY = samplesPerTexel / 2; sampleY < (size - 1) * samplesPerTexel + samplesPerTexel / 2; ++sampleY)
+    {
+        for(uint32_t sampleX = samplesPerTexel / 2; sampleX < (size - 1) * samplesPerTexel + samplesPerTexel / 2; ++sampleX)
+        {
+            const vec2 pos = vec2(((float)sampleX + 0.5f) / samplesPerTexel, ((float)sampleY + 0.5f) / samplesPerTexel);
+            const float distance = signedDistance(pos);
+            // Too close to the edge to tell the side reliably after quantization.
+            if(std::abs(distance) < 0.1f)
+                continue;
+            const uint32_t x0 = (uint32_t)(pos.x - 0.5f), y0 = (uint32_t)(pos.y - 0.5f);
+            const float fx = pos.x - 0.5f - (float)x0, fy = pos.y - 0.5f - (float)y0;
+            float filtered[4];
+            for(uint32_t channel = 0; channel < 4; ++channel)
+            {
+                auto texel = [&](uint32_t x, uint32_t y) -> float { return (float)texels[(y * size + x) * 4 + channel]; };
+                filtered[channel] =
+                    (texel(x0, y0) * (1.f - fx) + texel(x0 + 1, y0) * fx) * (1.f - fy) +
+                    (texel(x0, y0 + 1) * (1.f - fx) + texel(x0 + 1, y0 + 1) * fx) * fy;
+            }
+            const float median = std::max(std::min(filtered[0], filtered[1]), std::min(std::max(filtered[0], filtered[1]), filtered[2]));
+            if((filtered[3] >= 128.f) != (distance > 0.f))
+                ++alphaSampleErrorCount;
+            if((median >= 128.f) != (distance > 0.f))
+                ++medianSampleErrorCount;
+        }
+    }
+
+    printf("    %-26s max alpha error %.3f texels, %zu alpha errors, %zu median errors, %zu filtered median errors (alpha: %zu)\n",
+        name, maxAlphaError, alphaErrorCount, medianErrorCount, medianSampleErrorCount, alphaSampleErrorCount);
+    return alphaErrorCount == 0 && medianErrorCount == 0 && medianSampleErrorCount == 0;
+}
+
+/*
+CalcMultiChannelSignedDistanceField on synthetic shapes whose exact distance is known: square with square hole, which also has
+its orientation reversed, triangle with sharp corners, and circle made of quadratic curves.
+*/
+bool TestMultiChannelDistanceField()
+{
+    const uint32_t size = 32;
+    const float spread = 4.f;
+    // Encoded value has 127 / spread steps per texel, plus rounding.
+    const float maxError = spread / 127.f;
+    bool success = true;
+
+    // Outer square clockwise on screen, as y points down, hole counterclockwise.
+    const vec2 outer[] = { vec2(4.f, 4.f), vec2(28.f, 4.f), vec2(28.f, 28.f), vec2(4.f, 28.f) };
+    const vec2 hole[] = { vec2(12.f, 12.f), vec2(12.f, 20.f), vec2(20.f, 20.f), vec2(20.f, 12.f) };
+    auto squareDistance = [](const vec2& p, float min, float max) -> float {
+        const float inside = std::min(std::min(p.x - min, max - p.x), std::min(p.y - min, max - p.y));
+        if(inside >= 0.f)
+            return inside;
+        const float dx = std::max(std::max(min - p.x, p.x - max), 0.f), dy = std::max(std::max(min - p.y, p.y - max), 0.f);
+        return -std::sqrt(dx * dx + dy * dy);
+    };
+    auto frameDistance = [&squareDistance](const vec2& p) -> float {
+        return std::min(squareDistance(p, 4.f, 28.f), -squareDistance(p, 12.f, 20.f));
+    };
+    std::vector<SShapeSegment> segments;
+    AddPolygon(segments, outer, _countof(outer));
+    AddPolygon(segments, hole, _countof(hole));
+    std::vector<SShapeContour> contours = {
+        SShapeContour{ segments.data(), _countof(outer) },
+        SShapeContour{ segments.data() + _countof(outer), _countof(hole) } };
+    success &= CheckMultiChannelDistanceField("square with hole", contours, size, spread, maxError, frameDistance);
+
+    // Result mustn't depend on orientation of all contours, only on relation between them.
+    std::vector<SShapeSegment> reversedSegments;
+    for(size_t i = segments.size(); i--; )
+        reversedSegments.push_back(SShapeSegment{ { segments[i].P[2], segments[i].P[1], segments[i].P[0] } });
+    contours = {
+        SShapeContour{ reversedSegments.data(), _countof(hole) },
+        SShapeContour{ reversedSegments.data() + _countof(hole), _countof(outer) } };
+    success &= CheckMultiChannelDistanceField("reversed square with hole", contours, size, spread, maxError, frameDistance);
+
+    // Triangle with acute corners, where plain distance field rounds them most.
+    const vec2 triangle[] = { vec2(3.f, 27.f), vec2(16.f, 3.f), vec2(29.f, 27.f) };
+    auto triangleDistance = [&triangle](const vec2& p) -> float {
+        float distance = FLT_MAX;
+        bool inside = true;
+        for(size_t i = 0; i < _countof(triangle); ++i)
+        {
+            const vec2& a = triangle[i];
+            const vec2& b = triangle[(i + 1) % _countof(triangle)];
+            distance = std::min(distance, DistanceToLine(p, a, b));
+            inside &= (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x) > 0.f;
+        }
+        return inside ? distance : -distance;
+    };
+    segments.clear();
+    AddPolygon(segments, triangle, _countof(triangle));
+    contours = { SShapeContour{ segments.data(), segments.size() } };
+    success &= CheckMultiChannelDistanceField("triangle", contours, size, spread, maxError, triangleDistance);
+
+    // Circle of 8 quadratic curves. They deviate from the circle by up to 0.31% of its radius, in the middle of each curve.
+    const float radius = 11.f, centerXY = 16.f;
+    const float pi = 3.14159265f;
+    segments.clear();
+    for(uint32_t i = 0; i < 8; ++i)
+    {
+        const float angle0 = (float)i * pi / 4.f, angle1 = (float)(i + 1) * pi / 4.f, angleMid = (angle0 + angle1) * 0.5f;
+        const float controlRadius = radius / std::cos(pi / 8.f);
+        segments.push_back(SShapeSegment{ {
+            vec2(centerXY + radius * std::cos(angle0), centerXY + radius * std::sin(angle0)),
+            vec2(centerXY + controlRadius * std::cos(angleMid), centerXY + controlRadius * std::sin(angleMid)),
+            vec2(centerXY + radius * std::cos(angle1), centerXY + radius * std::sin(angle1)) } });
+    }
+    contours = { SShapeContour{ segments.data(), segments.size() } };
+    auto circleDistance = [radius, centerXY](const vec2& p) -> float {
+        const float dx = p.x - centerXY, dy = p.y - centerXY;
+        return radius - std::sqrt(dx * dx + dy * dy);
+    };
+    success &= CheckMultiChannelDistanceField("circle", contours, size, spread, maxError + radius * 0.0032f, circleDistance);
+
+    return success;
+}
+
+/*
+Creates a font with SFontDesc::FLAG_SDF and the same font without it, at Height * SdfSupersampling, which is the coverage
+the distance field is calculated from. For every texel of chars, calculates the distance field again by brute force:
+distance from each texel of the coverage to the nearest texel center on the other side of the edge, averaged over
+SdfSupersampling x SdfSupersampling texels. Returns number of texels that differ by more than rounding.
+*/
+size_t CountSdfErrors(const char* name, const SCharRangeSet& rangeSet, int height, uint32_t supersampling, uint32_t spread,
+    const std::vector<wchar_t>& chars)
+{
+    SFontDesc desc;
+    InitDesc(desc, rangeSet, height * (int)supersampling);
+    CFont coverageFont;
+    if(!coverageFont.Init(desc))
+    {
+        printf("    Init failed\n");
+        return SIZE_MAX;
+    }
+    desc.Height = height;
+    desc.Flags = SFontDesc::FLAG_SDF;
+    desc.SdfSupersampling = supersampling;
+    desc.SdfSpread = spread;
+    CFont font;
+    if(!font.Init(desc))
+    {
+        printf("    Init failed\n");
+        return SIZE_MAX;
+    }
+    STextureSnapshot snapshot, coverageSnapshot;
+    TakeTextureSnapshot(snapshot, font);
+    TakeTextureSnapshot(coverageSnapshot, coverageFont);
+
+    // Distances saturate closer than this, even averaged over supersampled texels, so the search can stop there.
+    const int32_t maxDistance = (int32_t)((spread + 2) * supersampling);
+    const int32_t padding = (int32_t)(spread * supersampling);
+    const float encodeScale = 127.f / ((float)spread * (float)(supersampling * supersampling) * (float)supersampling);
+    size_t errorCount = 0, texelCount = 0;
+    int32_t maxError = 0;
+    std::vector<uint8_t> inside;
+    for(size_t i = 0; i < chars.size(); ++i)
+    {
+        const CFont::SCharInfo& info = font.GetCharInfo(chars[i]);
+        const CFont::SCharInfo& coverageInfo = coverageFont.GetCharInfo(chars[i]);
+        const uint32_t x = (uint32_t)std::lround(info.TexCoordsRect.x * (float)snapshot.Size.x);
+        const uint32_t y = (uint32_t)std::lround(info.TexCoordsRect.y * (float)snapshot.Size.y);
+        const uint32_t sizeX = (uint32_t)std::lround((info.TexCoordsRect.z - info.TexCoordsRect.x) * (float)snapshot.Size.x);
+        const uint32_t sizeY = (uint32_t)std::lround((info.TexCoordsRect.w - info.TexCoordsRect.y) * (float)snapshot.Size.y);
+        const uint32_t coverageX = (uint32_t)std::lround(coverageInfo.TexCoordsRect.x * (float)coverageSnapshot.Size.x);
+        const uint32_t coverageY = (uint32_t)std::lround(coverageInfo.TexCoordsRect.y * (float)coverageSnapshot.Size.y);
+        const int32_t coverageSizeX = (int32_t)std::lround((coverageInfo.TexCoordsRect.z - coverageInfo.TexCoordsRect.x) * (float)coverageSnapshot.Size.x);
+        const int32_t coverageSizeY = (int32_t)std::lround((coverageInfo.TexCoordsRect.w - coverageInfo.TexCoordsRect.y) * (float)coverageSnapshot.Size.y);
+
+        // Texels at least half covered are inside, on a grid of the supersampled distance field, with the coverage at padding.
+        const int32_t gridSizeX = (int32_t)(sizeX * supersampling), gridSizeY = (int32_t)(sizeY * supersampling);
+        inside.assign((size_t)gridSizeX * gridSizeY, 0);
+        bool anyInside = false;
+        for(int32_t texelY = 0; texelY < coverageSizeY && texelY + padding < gridSizeY; ++texelY)
+        {
+            const uint8_t* const row = &coverageSnapshot.Data[
+                coverageSnapshot.RowPitch * (coverageSnapshot.Size.y * coverageInfo.TexturePage + coverageY + texelY) + coverageX];
+            for(int32_t texelX = 0; texelX < coverageSizeX && texelX + padding < gridSizeX; ++texelX)
+            {
+                inside[(size_t)(texelY + padding) * gridSizeX + texelX + padding] = row[texelX] >= 128 ? 1 : 0;
+                anyInside |= row[texelX] >= 128;
+            }
+        }
+        if(!anyInside)
+            continue;
+
+        for(uint32_t texelY = 0; texelY < sizeY; ++texelY)
+        {
+            for(uint32_t texelX = 0; texelX < sizeX; ++texelX)
+            {
+                float sum = 0.f;
+                for(int32_t gridY = (int32_t)(texelY * supersampling); gridY < (int32_t)((texelY + 1) * supersampling); ++gridY)
+                {
+                    for(int32_t gridX = (int32_t)(texelX * supersampling); gridX < (int32_t)((texelX + 1) * supersampling); ++gridX)
+                    {
+                        const uint8_t side = inside[(size_t)gridY * gridSizeX + gridX];
+                        int32_t minSquaredDistance = maxDistance * maxDistance;
+                        for(int32_t otherY = std::max(gridY - maxDistance, 0); otherY <= std::min(gridY + maxDistance, gridSizeY - 1); ++otherY)
+                        {
+                            for(int32_t otherX = std::max(gridX - maxDistance, 0); otherX <= std::min(gridX + maxDistance, gridSizeX - 1); ++otherX)
+                            {
+                                if(inside[(size_t)otherY * gridSizeX + otherX] != side)
+                                {
+                                    const int32_t squaredDistance = (otherX - gridX) * (otherX - gridX) + (otherY - gridY) * (otherY - gridY);
+                                    minSquaredDistance = std::min(minSquaredDistance, squaredDistance);
+                                }
+                            }
+                        }
+                        // Distance of texel center to the edge is half a texel less than to the center of nearest texel on the other side.
+                        const float distance = std::sqrt((float)minSquaredDistance) - 0.5f;
+                        sum += side ? distance : -distance;
+                    }
+                }
+                const float val = 128.f + sum * encodeScale;
+                const int32_t expected = (int32_t)std::min(std::max(val + 0.5f, 0.f), 255.f);
+                const int32_t actual = snapshot.Data[snapshot.RowPitch * (snapshot.Size.y * info.TexturePage + y + texelY) + x + texelX];
+                const int32_t error = std::abs(actual - expected);
+                maxError = std::max(maxError, error);
+                if(error > 1)
+                    ++errorCount;
+                ++texelCount;
+            }
+        }
+    }
+    printf("    %-26s %zu texels, max error %d, %zu errors\n", name, texelCount, maxError, errorCount);
+    return errorCount;
+}
+
+/*
+Compares distance fields of characters created with SFontDesc::FLAG_SDF with brute force calculation by CountSdfErrors,
+with and without supersampling.
+*/
+bool TestSignedDistanceField()
+{
+    std::vector<wchar_t> chars;
+    GetRangeChars(chars, CHAR_RANGE_SETS[0]);
+    // Every third character is enough, brute force is slow.
+    for(size_t i = 0; i * 3 < chars.size(); ++i)
+        chars[i] = chars[i * 3];
+    chars.resize((chars.size() + 2) / 3);
+    bool success = true;
+    success &= CountSdfErrors("supersampling 4, spread 4", CHAR_RANGE_SETS[0], 16, 4, 4, chars) == 0;
+    success &= CountSdfErrors("supersampling 1, spread 8", CHAR_RANGE_SETS[0], 24, 1, 8, chars) == 0;
+    return success;
+}
+
+/*
+Takes dirty rectangles of the font and checks that they don't overlap, point to the right place in texture data,
+and their union covers every texel that changed since prevSnapshot, which is then updated.
+If texture size changed, all texels count as changed, as do texels of new pages. Returns number of errors found.
+*/
+size_t CheckDirtyRects(CFont& font, STextureSnapshot& prevSnapshot, size_t& inoutChangedTexelCount, size_t& inoutDirtyTexelCount)
+{
+    std::vector<CFont::SDirtyRect> rects;
+    font.GetDirtyRects(rects);
+    STextureSnapshot snapshot;
+    TakeTextureSnapshot(snapshot, font);
+    const uvec2 size = snapshot.Size;
+    const size_t pageBytes = snapshot.RowPitch * size.y;
+    size_t errorCount = 0;
+
+    std::vector<uint8_t> covered((size_t)size.x * size.y * snapshot.PageCount, 0);
+    for(size_t i = 0; i < rects.size(); ++i)
+    {
+        const CFont::SDirtyRect& rect = rects[i];
+        if(rect.TexturePage >= snapshot.PageCount || rect.Pos.x + rect.Size.x > size.x || rect.Pos.y + rect.Size.y > size.y)
+        {
+            ++errorCount;
+            continue;
+        }
+        const void* data;
+        uvec2 dataSize;
+        size_t rowPitch;
+        font.GetTextureData(data, dataSize, rowPitch);
+        if(rect.RowPitch != rowPitch ||
+            rect.Data != (const uint8_t*)data + pageBytes * rect.TexturePage + rowPitch * rect.Pos.y + rect.Pos.x)
+            ++errorCount;
+        for(uint32_t y = rect.Pos.y; y < rect.Pos.y + rect.Size.y; ++y)
+        {
+            for(uint32_t x = rect.Pos.x; x < rect.Pos.x + rect.Size.x; ++x)
+            {
+                uint8_t& texelCovered = covered[((size_t)rect.TexturePage * size.y + y) * size.x + x];
+                if(texelCovered)
+                    ++errorCount;
+                texelCovered = 1;
+                ++inoutDirtyTexelCount;
+            }
+        }
+    }
+
+    const bool sizeChanged = size.x != prevSnapshot.Size.x || size.y != prevSnapshot.Size.y;
+    for(uint32_t page = 0; page < snapshot.PageCount; ++page)
+    {
+        for(uint32_t y = 0; y < size.y; ++y)
+        {
+            for(uint32_t x = 0; x < size.x; ++x)
+            {
+                const size_t offset = pageBytes * page + snapshot.RowPitch * y + x;
+                const bool changed = sizeChanged || page >= prevSnapshot.PageCount || snapshot.Data[offset] != prevSnapshot.Data[offset];
+                if(changed)
+                {
+                    ++inoutChangedTexelCount;
+                    if(!covered[((size_t)page * size.y + y) * size.x + x])
+                        ++errorCount;
+                }
+            }
+        }
+    }
+    prevSnapshot = std::move(snapshot);
+    return errorCount;
+}
+
+/*
+Changes texture data of fonts in ways that report dirty rectangles: CacheText with SFontDesc::FLAG_DYNAMIC_ATLAS
+evicting characters over many frames, and AddCharRanges, including growing the texture. Checks them with CheckDirtyRects.
+*/
+bool TestDirtyRects()
+{
+    bool success = true;
+    std::vector<CFont::SDirtyRect> rects;
+    STextureSnapshot snapshot;
+
+    {
+        SFontDesc desc;
+        desc.FaceName = L"Microsoft YaHei";
+        desc.Height = 24;
+        desc.MaxTextureSize = 256;
+        desc.Flags = SFontDesc::FLAG_DYNAMIC_ATLAS;
+        CFont font;
+        if(!font.Init(desc))
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+        font.GetDirtyRects(rects);
+        TakeTextureSnapshot(snapshot, font);
+        // 3000 CJK characters, many more than fit in the texture, so characters are evicted in most frames.
+        std::vector<wchar_t> chars;
+        GetRangeChars(chars, CHAR_RANGE_SETS[2]);
+        std::vector<wchar_t> text;
+        GenerateRandomText(text, chars, 20000);
+        const size_t frameCount = 200;
+        size_t errorCount = 0, changedTexelCount = 0, dirtyTexelCount = 0, textPos = 0;
+        for(size_t frame = 0; frame < frameCount; ++frame)
+        {
+            font.NewFrame();
+            // Some frames bring many new characters at once.
+            const size_t length = frame % 50 == 0 ? 100 : 1 + frame % 10;
+            font.CacheText(wstr_view(&text[textPos], length));
+            textPos = (textPos + length) % (text.size() - 100);
+            errorCount += CheckDirtyRects(font, snapshot, changedTexelCount, dirtyTexelCount);
+        }
+        CFont::SStatistics stats;
+        font.GetStatistics(stats);
+        printf("    %-26s %zu errors, %zu changed texels, %zu dirty texels, %llu evicted characters\n",
+            "dynamic atlas", errorCount, changedTexelCount, dirtyTexelCount, (unsigned long long)stats.DynamicEvictedCharCount);
+        success &= errorCount == 0 && changedTexelCount > 0;
+    }
+
+    {
+        SFontDesc desc;
+        InitDesc(desc, CHAR_RANGE_SETS[0], 24);
+        desc.MaxTextureSize = 512;
+        desc.MaxTexturePageCount = 4;
+        CFont font;
+        if(!font.Init(desc))
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+        font.GetDirtyRects(rects);
+        TakeTextureSnapshot(snapshot, font);
+        // From a few characters fitting in free space, up to new pages and growing the texture.
+        const wchar_t addedRanges[][2] = { { 0xA0, 0xBF }, { 0xC0, 0x24F }, { 0x370, 0x3FF }, { 0x4E00, 0x4E00 + 999 } };
+        size_t errorCount = 0, changedTexelCount = 0, dirtyTexelCount = 0, texCoordsChangedCount = 0;
+        for(size_t i = 0; i < _countof(addedRanges); ++i)
+        {
+            bool texCoordsChanged = false;
+            if(!font.AddCharRanges(addedRanges[i], 1, &texCoordsChanged))
+            {
+                printf("    AddCharRanges failed\n");
+                return false;
+            }
+            if(texCoordsChanged)
+                ++texCoordsChangedCount;
+            errorCount += CheckDirtyRects(font, snapshot, changedTexelCount, dirtyTexelCount);
+        }
+        printf("    %-26s %zu errors, %zu changed texels, %zu dirty texels, %zu of %zu calls changed texture coordinates\n",
+            "AddCharRanges", errorCount, changedTexelCount, dirtyTexelCount, texCoordsChangedCount, _countof(addedRanges));
+        success &= errorCount == 0 && changedTexelCount > 0;
+    }
+
+    return success;
+}
+
+/*
+Compares texels of each of chars of font created with SFontDesc::Atlas, in the texture of atlas,
+with the same character of font created alone with the same parameters, in TEXTURE_FORMAT_R8.
+With TEXTURE_FORMAT_R8G8B8A8 atlas, compares channel SCharInfo::TextureChannel. Returns number of characters that differ.
+*/
+size_t CountAtlasMismatches(const CFont& font, const CFontAtlas& atlas, const CFont& aloneFont, const std::vector<wchar_t>& chars)
+{
+    STextureSnapshot snapshot, aloneSnapshot;
+    {
+        const void* data;
+        atlas.GetTextureData(data, snapshot.Size, snapshot.RowPitch);
+        const uint8_t* const bytes = (const uint8_t*)data;
+        snapshot.Data.assign(bytes, bytes + snapshot.RowPitch * snapshot.Size.y * atlas.GetTexturePageCount());
+    }
+    TakeTextureSnapshot(aloneSnapshot, aloneFont);
+    const uint32_t bytesPerTexel = atlas.GetTextureFormat() == TEXTURE_FORMAT_R8G8B8A8 ? 4 : 1;
+    size_t mismatchCount = 0;
+    for(size_t i = 0; i < chars.size(); ++i)
+    {
+        const CFont::SCharInfo& info = font.GetCharInfo(chars[i]);
+        const CFont::SCharInfo& aloneInfo = aloneFont.GetCharInfo(chars[i]);
+        const uint32_t x = (uint32_t)std::lround(info.TexCoordsRect.x * (float)snapshot.Size.x);
+        const uint32_t y = (uint32_t)std::lround(info.TexCoordsRect.y * (float)snapshot.Size.y);
+        const uint32_t sizeX = (uint32_t)std::lround((info.TexCoordsRect.z - info.TexCoordsRect.x) * (float)snapshot.Size.x);
+        const uint32_t sizeY = (uint32_t)std::lround((info.TexCoordsRect.w - info.TexCoordsRect.y) * (float)snapshot.Size.y);
+        const uint32_t aloneX = (uint32_t)std::lround(aloneInfo.TexCoordsRect.x * (float)aloneSnapshot.Size.x);
+        const uint32_t aloneY = (uint32_t)std::lround(aloneInfo.TexCoordsRect.y * (float)aloneSnapshot.Size.y);
+        const uint32_t aloneSizeX = (uint32_t)std::lround((aloneInfo.TexCoordsRect.z - aloneInfo.TexCoordsRect.x) * (float)aloneSnapshot.Size.x);
+        const uint32_t aloneSizeY = (uint32_t)std::lround((aloneInfo.TexCoordsRect.w - aloneInfo.TexCoordsRect.y) * (float)aloneSnapshot.Size.y);
+        bool equal = sizeX == aloneSizeX && sizeY == aloneSizeY;
+        for(uint32_t texelY = 0; equal && texelY < sizeY; ++texelY)
+        {
+            const uint8_t* const row = &snapshot.Data[
+                snapshot.RowPitch * (snapshot.Size.y * info.TexturePage + y + texelY) + x * bytesPerTexel + info.TextureChannel];
+            const uint8_t* const aloneRow = &aloneSnapshot.Data[
+                aloneSnapshot.RowPitch * (aloneSnapshot.Size.y * aloneInfo.TexturePage + aloneY + texelY) + aloneX];
+            for(uint32_t texelX = 0; equal && texelX < sizeX; ++texelX)
+                equal = row[texelX * bytesPerTexel] == aloneRow[texelX];
+        }
+        if(!equal)
+            ++mismatchCount;
+    }
+    return mismatchCount;
+}
+
+/*
+Creates fonts in a shared atlas, one of them initialized twice and one destroyed before CFontAtlas::Build.
+Only the fonts alive at Build, as of their last Init, must be packed. Their characters must look the same as when created alone,
+and characters that don't exist in the font, the same as '?'.
+*/
+bool TestAtlas()
+{
+    CFontAtlas atlas;
+    atlas.Init(SFontAtlasDesc());
+    CFont fonts[2], aloneFonts[2];
+    const int heights[] = { 24, 32 };
+    const size_t rangeSetIndices[] = { 1, 0 };
+    for(size_t i = 0; i < 2; ++i)
+    {
+        SFontDesc desc;
+        InitDesc(desc, CHAR_RANGE_SETS[rangeSetIndices[i]], heights[i]);
+        if(!aloneFonts[i].Init(desc))
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+        desc.Atlas = &atlas;
+        if(i == 0)
+        {
+            // Characters of this Init must not be packed.
+            SFontDesc firstDesc = desc;
+            firstDesc.Height = 16;
+            firstDesc.CharRanges = CHAR_RANGE_SETS[2].CharRanges;
+            firstDesc.CharRangeCount = CHAR_RANGE_SETS[2].CharRangeCount;
+            if(!fonts[i].Init(firstDesc))
+            {
+                printf("    Init failed\n");
+                return false;
+            }
+        }
+        if(!fonts[i].Init(desc))
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+    }
+    {
+        SFontDesc desc;
+        InitDesc(desc, CHAR_RANGE_SETS[2], 40);
+        desc.Atlas = &atlas;
+        CFont destroyedFont;
+        if(!destroyedFont.Init(desc))
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+    }
+    if(!atlas.Build())
+    {
+        printf("    Build failed\n");
+        return false;
+    }
+    CFontAtlas::SStatistics stats;
+    atlas.GetStatistics(stats);
+
+    size_t mismatchCount = 0, missingCharErrorCount = 0;
+    for(size_t i = 0; i < 2; ++i)
+    {
+        std::vector<wchar_t> chars;
+        GetRangeChars(chars, CHAR_RANGE_SETS[rangeSetIndices[i]]);
+        mismatchCount += CountAtlasMismatches(fonts[i], atlas, aloneFonts[i], chars);
+        // Outside of the ranges, on the fallback page and on an own page.
+        const wchar_t missingChars[] = { 0x4E00, 0x250, 0x1F };
+        const CFont::SCharInfo& questionMarkInfo = fonts[i].GetCharInfo(L'?');
+        for(size_t j = 0; j < _countof(missingChars); ++j)
+        {
+            const CFont::SCharInfo& info = fonts[i].GetCharInfo(missingChars[j]);
+            if(memcmp(&info.TexCoordsRect, &questionMarkInfo.TexCoordsRect, sizeof(vec4)) != 0 ||
+                info.TexturePage != questionMarkInfo.TexturePage)
+                ++missingCharErrorCount;
+        }
+    }
+    printf("    %-26s %zu fonts, %zu characters, %zu mismatched characters, %zu wrong missing characters\n",
+        "re-Init, destroyed font", stats.FontCount, stats.CharCount, mismatchCount, missingCharErrorCount);
+    bool success = stats.FontCount == 2 && mismatchCount == 0 && missingCharErrorCount == 0;
+
+    // Characters of fonts in different channels overlap, composed on multiple threads.
+    {
+        SFontAtlasDesc atlasDesc;
+        atlasDesc.Flags = SFontAtlasDesc::FLAG_CHANNEL_PACKING;
+        atlasDesc.TextureFormat = TEXTURE_FORMAT_R8G8B8A8;
+        CFontAtlas channelAtlas;
+        channelAtlas.Init(atlasDesc);
+        const int channelHeights[] = { 16, 20, 24, 28 };
+        CFont channelFonts[4], channelAloneFonts[4];
+        for(size_t i = 0; i < 4; ++i)
+        {
+            SFontDesc desc;
+            InitDesc(desc, CHAR_RANGE_SETS[2], channelHeights[i]);
+            if(!channelAloneFonts[i].Init(desc))
+            {
+                printf("    Init failed\n");
+                return false;
+            }
+            desc.Atlas = &channelAtlas;
+            if(!channelFonts[i].Init(desc))
+            {
+                printf("    Init failed\n");
+                return false;
+            }
+        }
+        if(!channelAtlas.Build())
+        {
+            printf("    Build failed\n");
+            return false;
+        }
+        channelAtlas.GetStatistics(stats);
+        std::vector<wchar_t> chars;
+        GetRangeChars(chars, CHAR_RANGE_SETS[2]);
+        mismatchCount = 0;
+        for(size_t i = 0; i < 4; ++i)
+            mismatchCount += CountAtlasMismatches(channelFonts[i], channelAtlas, channelAloneFonts[i], chars);
+        printf("    %-26s %zu fonts, %zu characters, %zu mismatched characters\n",
+            "FLAG_CHANNEL_PACKING", stats.FontCount, stats.CharCount, mismatchCount);
+        success &= stats.FontCount == 4 && mismatchCount == 0;
+    }
+
+    return success;
+}
+
+/*
+Decodes texture data of a font in TEXTURE_FORMAT_BC4, all pages, to one byte per texel, like the GPU does.
+Also counts blocks in the mode of 6 values plus exact 0 and 255.
+*/
+void DecodeBc4Texture(STextureSnapshot& outSnapshot, size_t& outSixValueBlockCount, const CFont& font)
+{
+    STextureSnapshot compressed;
+    TakeTextureSnapshot(compressed, font);
+    outSnapshot.Size = compressed.Size;
+    outSnapshot.RowPitch = compressed.Size.x;
+    outSnapshot.PageCount = compressed.PageCount;
+    outSnapshot.Data.resize((size_t)compressed.Size.x * compressed.Size.y * compressed.PageCount);
+    outSixValueBlockCount = 0;
+    const uint32_t blockRowCount = compressed.Size.y / 4 * compressed.PageCount;
+    for(uint32_t blockY = 0; blockY < blockRowCount; ++blockY)
+    {
+        for(uint32_t blockX = 0; blockX < compressed.Size.x / 4; ++blockX)
+        {
+            const uint8_t* const block = &compressed.Data[compressed.RowPitch * blockY + blockX * 8];
+            const uint32_t red0 = block[0], red1 = block[1];
+            uint32_t palette[8] = { red0, red1 };
+            if(red0 > red1)
+            {
+                for(uint32_t i = 1; i < 7; ++i)
+                    palette[i + 1] = ((7 - i) * red0 + i * red1 + 3) / 7;
+            }
+            else
+            {
+                for(uint32_t i = 1; i < 5; ++i)
+                    palette[i + 1] = ((5 - i) * red0 + i * red1 + 2) / 5;
+                palette[6] = 0;
+                palette[7] = 255;
+                ++outSixValueBlockCount;
+            }
+            uint64_t indices = 0;
+            for(uint32_t i = 0; i < 6; ++i)
+                indices |= (uint64_t)block[i + 2] << (i * 8);
+            for(uint32_t i = 0; i < 16; ++i)
+            {
+                outSnapshot.Data[((size_t)blockY * 4 + i / 4) * outSnapshot.RowPitch + blockX * 4 + i % 4] =
+                    (uint8_t)palette[(indices >> (i * 3)) & 7];
+            }
+        }
+    }
+}
+
+/*
+Creates fonts in TEXTURE_FORMAT_BC4, decodes them and compares texels of all characters with the same font
+in TEXTURE_FORMAT_R8. Quality must be high, and texels 0 and 255, common on edges of characters, must stay exact.
+*/
+bool TestBc4()
+{
+    bool success = true;
+    const struct
+    {
+        const char* Name;
+        size_t RangeSetIndex;
+        int Height;
+        uint32_t Flags;
+    } cases[] = {
+        { "latin extended", 1, 24, 0 },
+        { "CJK 3000", 2, 16, 0 },
+        { "latin extended, SDF", 1, 32, SFontDesc::FLAG_SDF },
+    };
+    for(size_t caseIndex = 0; caseIndex < _countof(cases); ++caseIndex)
+    {
+        SFontDesc desc;
+        InitDesc(desc, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex], cases[caseIndex].Height);
+        desc.Flags = cases[caseIndex].Flags;
+        CFont font, uncompressedFont;
+        if(!uncompressedFont.Init(desc))
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+        desc.TextureFormat = TEXTURE_FORMAT_BC4;
+        if(!font.Init(desc))
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+        STextureSnapshot decoded, uncompressed;
+        size_t sixValueBlockCount;
+        DecodeBc4Texture(decoded, sixValueBlockCount, font);
+        TakeTextureSnapshot(uncompressed, uncompressedFont);
+
+        std::vector<wchar_t> chars;
+        GetRangeChars(chars, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex]);
+        uint64_t squaredError = 0;
+        size_t texelCount = 0, wrongExtremeCount = 0, wrongSizeCount = 0;
+        for(size_t i = 0; i < chars.size(); ++i)
+        {
+            const CFont::SCharInfo& info = font.GetCharInfo(chars[i]);
+            const CFont::SCharInfo& uncompressedInfo = uncompressedFont.GetCharInfo(chars[i]);
+            const uint32_t x = (uint32_t)std::lround(info.TexCoordsRect.x * (float)decoded.Size.x);
+            const uint32_t y = (uint32_t)std::lround(info.TexCoordsRect.y * (float)decoded.Size.y);
+            const uint32_t sizeX = (uint32_t)std::lround((info.TexCoordsRect.z - info.TexCoordsRect.x) * (float)decoded.Size.x);
+            const uint32_t sizeY = (uint32_t)std::lround((info.TexCoordsRect.w - info.TexCoordsRect.y) * (float)decoded.Size.y);
+            const uint32_t uncompressedX = (uint32_t)std::lround(uncompressedInfo.TexCoordsRect.x * (float)uncompressed.Size.x);
+            const uint32_t uncompressedY = (uint32_t)std::lround(uncompressedInfo.TexCoordsRect.y * (float)uncompressed.Size.y);
+            if(sizeX != (uint32_t)std::lround((uncompressedInfo.TexCoordsRect.z - uncompressedInfo.TexCoordsRect.x) * (float)uncompressed.Size.x) ||
+                sizeY != (uint32_t)std::lround((uncompressedInfo.TexCoordsRect.w - uncompressedInfo.TexCoordsRect.y) * (float)uncompressed.Size.y))
+            {
+                ++wrongSizeCount;
+                continue;
+            }
+            for(uint32_t texelY = 0; texelY < sizeY; ++texelY)
+            {
+                const uint8_t* const row = &decoded.Data[decoded.RowPitch * (decoded.Size.y * info.TexturePage + y + texelY) + x];
+                const uint8_t* const uncompressedRow = &uncompressed.Data[
+                    uncompressed.RowPitch * (uncompressed.Size.y * uncompressedInfo.TexturePage + uncompressedY + texelY) + uncompressedX];
+                for(uint32_t texelX = 0; texelX < sizeX; ++texelX)
+                {
+                    const int32_t diff = (int32_t)row[texelX] - (int32_t)uncompressedRow[texelX];
+                    squaredError += (uint64_t)(diff * diff);
+                    if((uncompressedRow[texelX] == 0 || uncompressedRow[texelX] == 255) && diff != 0)
+                        ++wrongExtremeCount;
+                }
+                texelCount += sizeX;
+            }
+        }
+        const double psnr = squaredError ?
+            10.0 * std::log10(255.0 * 255.0 * (double)texelCount / (double)squaredError) : INFINITY;
+        printf("    %-26s PSNR %.2f dB, %zu 6-value blocks, %zu wrong 0 or 255 texels, %zu wrong sizes\n",
+            cases[caseIndex].Name, psnr, sixValueBlockCount, wrongExtremeCount, wrongSizeCount);
+        success &= psnr >= 25.0 && sixValueBlockCount > 0 && wrongExtremeCount == 0 && wrongSizeCount == 0;
+    }
+    return success;
+}
+
+// Returns true if textures of both fonts have the same format, size and data of all pages and mip levels.
+bool AreTexturesIdentical(const CFont& lhs, const CFont& rhs)
+{
+    if(lhs.GetTextureFormat() != rhs.GetTextureFormat() || lhs.GetMipLevelCount() != rhs.GetMipLevelCount() ||
+        lhs.GetTexturePageCount() != rhs.GetTexturePageCount())
+        return false;
+    for(uint32_t level = 0; level < lhs.GetMipLevelCount(); ++level)
+    {
+        const void* lhsData;
+        const void* rhsData;
+        uvec2 lhsSize, rhsSize;
+        size_t lhsRowPitch, rhsRowPitch;
+        lhs.GetTextureData(level, lhsData, lhsSize, lhsRowPitch);
+        rhs.GetTextureData(level, rhsData, rhsSize, rhsRowPitch);
+        const uint32_t rowCount = lhs.GetTextureFormat() == TEXTURE_FORMAT_BC4 ? lhsSize.y / 4 : lhsSize.y;
+        if(any(lhsSize != rhsSize) || lhsRowPitch != rhsRowPitch ||
+            memcmp(lhsData, rhsData, lhsRowPitch * rowCount * lhs.GetTexturePageCount()) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Returns number of chars whose SCharInfo or SCharMetrics::Advance differ between the fonts.
+size_t CountCharMismatches(const CFont& lhs, const CFont& rhs, const std::vector<wchar_t>& chars)
+{
+    size_t mismatchCount = 0;
+    for(size_t i = 0; i < chars.size(); ++i)
+    {
+        const CFont::SCharInfo& lhsInfo = lhs.GetCharInfo(chars[i]);
+        const CFont::SCharInfo& rhsInfo = rhs.GetCharInfo(chars[i]);
+        if(any(lhsInfo.TexCoordsRect != rhsInfo.TexCoordsRect) || lhsInfo.Advance != rhsInfo.Advance ||
+            any(lhsInfo.Offset != rhsInfo.Offset) || any(lhsInfo.Size != rhsInfo.Size) ||
+            lhsInfo.TexturePage != rhsInfo.TexturePage || lhsInfo.TextureChannel != rhsInfo.TextureChannel ||
+            lhs.GetCharMetrics(chars[i]).Advance != rhs.GetCharMetrics(chars[i]).Advance)
+            ++mismatchCount;
+    }
+    return mismatchCount;
+}
+
+// Returns number of pairs of chars whose GetKerning differs between the fonts.
+size_t CountKerningMismatches(const CFont& lhs, const CFont& rhs, const std::vector<wchar_t>& chars)
+{
+    size_t mismatchCount = 0;
+    for(size_t firstIndex = 0; firstIndex < chars.size(); ++firstIndex)
+    {
+        for(size_t secondIndex = 0; secondIndex < chars.size(); ++secondIndex)
+        {
+            if(lhs.GetKerning(chars[firstIndex], chars[secondIndex]) != rhs.GetKerning(chars[firstIndex], chars[secondIndex]))
+                ++mismatchCount;
+        }
+    }
+    return mismatchCount;
+}
+
+/*
+Creates fonts with and without SFontDesc::FLAG_LOW_PEAK_MEMORY, which must give the same texture, all mip levels,
+and the same characters, while SStatistics::InitPeakBytes must be lower with the flag.
+*/
+bool TestLowPeakMemory()
+{
+    bool success = true;
+    const struct
+    {
+        const char* Name;
+        size_t RangeSetIndex;
+        uint32_t Flags;
+        TEXTURE_FORMAT TextureFormat;
+        uint32_t MipLevelCount;
+    } cases[] = {
+        { "default", 0, 0, TEXTURE_FORMAT_R8, 1 },
+        { "latin extended", 1, 0, TEXTURE_FORMAT_R8, 1 },
+        { "CJK 3000", 2, 0, TEXTURE_FORMAT_R8, 1 },
+        { "latin extended, SDF", 1, SFontDesc::FLAG_SDF, TEXTURE_FORMAT_R8, 1 },
+        { "latin extended, MSDF", 1, SFontDesc::FLAG_MSDF, TEXTURE_FORMAT_R8, 1 },
+        { "CJK 3000, BC4, 3 mips", 2, 0, TEXTURE_FORMAT_BC4, 3 },
+    };
+    for(size_t caseIndex = 0; caseIndex < _countof(cases); ++caseIndex)
+    {
+        CFont fonts[2];
+        CFont::SStatistics stats[2];
+        bool initSuccess = true;
+        for(size_t i = 0; i < 2; ++i)
+        {
+            SFontDesc desc;
+            InitDesc(desc, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex], 24);
+            desc.Flags = cases[caseIndex].Flags | (i ? SFontDesc::FLAG_LOW_PEAK_MEMORY : 0);
+            desc.TextureFormat = cases[caseIndex].TextureFormat;
+            desc.MipLevelCount = cases[caseIndex].MipLevelCount;
+            initSuccess &= fonts[i].Init(desc);
+            fonts[i].GetStatistics(stats[i]);
+        }
+        if(!initSuccess)
+        {
+            printf("    Init failed\n");
+            return false;
+        }
+
+        const bool identical = AreTexturesIdentical(fonts[0], fonts[1]);
+        std::vector<wchar_t> chars;
+        GetRangeChars(chars, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex]);
+        const size_t charMismatchCount = CountCharMismatches(fonts[0], fonts[1], chars);
+        printf("    %-26s peak %zu -> %zu bytes, texture %s, %zu mismatched characters\n",
+            cases[caseIndex].Name, stats[0].InitPeakBytes, stats[1].InitPeakBytes, identical ? "identical" : "DIFFERS", charMismatchCount);
+        success &= identical && charMismatchCount == 0 && stats[1].InitPeakBytes < stats[0].InitPeakBytes;
+    }
+    return success;
+}
+
+/*
+Saves fonts with CFont::Save and loads them with Load, which must recreate the same metrics, kerning and texture.
+Load must fail, leaving the font unchanged, with a damaged payload, desc other than the one used by Save, or truncated data.
+*/
+bool TestCache()
+{
+    bool success = true;
+    const struct
+    {
+        const char* Name;
+        size_t RangeSetIndex;
+        uint32_t Flags;
+        TEXTURE_FORMAT TextureFormat;
+        uint32_t MipLevelCount;
+    } cases[] = {
+        { "latin extended", 1, 0, TEXTURE_FORMAT_R8, 1 },
+        { "latin extended, MSDF", 1, SFontDesc::FLAG_MSDF, TEXTURE_FORMAT_R8, 1 },
+        { "CJK 3000, BC4, 3 mips", 2, 0, TEXTURE_FORMAT_BC4, 3 },
+    };
+    for(size_t caseIndex = 0; caseIndex < _countof(cases); ++caseIndex)
+    {
+        SFontDesc desc;
+        InitDesc(desc, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex], 24);
+        desc.Flags = cases[caseIndex].Flags;
+        desc.TextureFormat = cases[caseIndex].TextureFormat;
+        desc.MipLevelCount = cases[caseIndex].MipLevelCount;
+        CFont font;
+        std::vector<uint8_t> data;
+        if(!font.Init(desc) || !font.Save(data, desc))
+        {
+            printf("    Init or Save failed\n");
+            return false;
+        }
+        CFont loadedFont;
+        if(!loadedFont.Load(data.data(), data.size(), desc))
+        {
+            printf("    %-26s Load failed\n", cases[caseIndex].Name);
+            success = false;
+            continue;
+        }
+        std::vector<wchar_t> chars;
+        GetRangeChars(chars, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex]);
+        // Characters outside of the ranges too, which use the fallback page.
+        const wchar_t otherChars[] = { 0, 31, 0x3000, 0xFFFF };
+        chars.insert(chars.end(), otherChars, otherChars + _countof(otherChars));
+        const bool identical = AreTexturesIdentical(font, loadedFont) && font.GetLineGap() == loadedFont.GetLineGap() &&
+            all(font.GetFillTexCoords() == loadedFont.GetFillTexCoords()) && font.GetFillTexturePage() == loadedFont.GetFillTexturePage();
+        const size_t charMismatchCount = CountCharMismatches(font, loadedFont, chars);
+        const size_t kerningMismatchCount = CountKerningMismatches(font, loadedFont, chars);
+
+        // Each must be rejected, and the loaded font must stay as it was.
+        size_t acceptedCount = 0;
+        std::vector<uint8_t> damagedData = data;
+        damagedData[CACHE_HEADER_SIZE + (damagedData.size() - CACHE_HEADER_SIZE) / 2] ^= 0x10;
+        acceptedCount += CFont::ValidateCache(damagedData.data(), damagedData.size()) ? 1 : 0;
+        acceptedCount += loadedFont.Load(damagedData.data(), damagedData.size(), desc) ? 1 : 0;
+        // Desc hash in the header, which the checksum doesn't cover.
+        damagedData = data;
+        damagedData[8] ^= 0x01;
+        acceptedCount += loadedFont.Load(damagedData.data(), damagedData.size(), desc) ? 1 : 0;
+        SFontDesc otherDesc = desc;
+        otherDesc.Height = desc.Height + 1;
+        acceptedCount += loadedFont.Load(data.data(), data.size(), otherDesc) ? 1 : 0;
+        const size_t truncatedSizes[] = { data.size() - 1, data.size() / 2, CACHE_HEADER_SIZE, CACHE_HEADER_SIZE - 1, 0 };
+        for(size_t i = 0; i < _countof(truncatedSizes); ++i)
+        {
+            acceptedCount += CFont::ValidateCache(data.data(), truncatedSizes[i]) ? 1 : 0;
+            acceptedCount += loadedFont.Load(data.data(), truncatedSizes[i], desc) ? 1 : 0;
+        }
+        const bool unchanged = AreTexturesIdentical(font, loadedFont) && CountCharMismatches(font, loadedFont, chars) == 0;
+
+        printf("    %-26s %zu bytes, texture %s, %zu mismatched characters, %zu mismatched kerning pairs, "
+            "%zu of 15 damaged accepted, %s after rejection\n",
+            cases[caseIndex].Name, data.size(), identical ? "identical" : "DIFFERS", charMismatchCount, kerningMismatchCount,
+            acceptedCount, unchanged ? "unchanged" : "CHANGED");
+        success &= identical && charMismatchCount == 0 && kerningMismatchCount == 0 && acceptedCount == 0 && unchanged;
+    }
+    return success;
+}
+
+// Returns tokens of the initializer of variable of given name in C++ code written by CFont::WriteBakedFont, ignoring braces of structures.
+bool ParseBakedInitializer(std::vector<std::string>& outTokens, const std::string& code, const char* name)
+{
+    outTokens.clear();
+    size_t pos = code.find(std::string(" ") + name + "[");
+    if(pos == std::string::npos)
+        pos = code.find(std::string(" ") + name + " =");
+    if(pos == std::string::npos || (pos = code.find("= {", pos)) == std::string::npos)
+        return false;
+    const size_t endPos = code.find("};", pos);
+    if(endPos == std::string::npos)
+        return false;
+    std::string token;
+    for(size_t i = pos + 3; i <= endPos; ++i)
+    {
+        const char c = code[i];
+        if(c == ' ' || c == '\n' || c == ',' || c == '{' || c == '}')
+        {
+            if(!token.empty())
+                outTokens.push_back(token);
+            token.clear();
+        }
+        else
+            token += c;
+    }
+    return true;
+}
+
+// Converts a token of baked font code, like "12u", "SIZE_MAX" or "(WinFontRender::TEXTURE_FORMAT)2".
+uint64_t BakedTokenToUint(const std::string& token)
+{
+    if(token == "SIZE_MAX")
+        return SIZE_MAX;
+    const size_t castEndPos = token.find(')');
+    return strtoull(token.c_str() + (castEndPos == std::string::npos ? 0 : castEndPos + 1), nullptr, 10);
+}
+float BakedTokenToFloat(const std::string& token) { return strtof(token.c_str(), nullptr); }
+
+// Arrays of a font read back from code written by CFont::WriteBakedFont, as the compiler would define them.
+struct SParsedBakedFont
+{
+    std::vector<uint16_t> CharPageIndices;
+    std::vector<CFont::SCharInfo> CharInfoPages;
+    std::vector<CFont::SCharMetrics> CharMetricsPages;
+    std::vector<CFont::SKerningBucket> KerningBuckets;
+    std::vector<int16_t> KerningClassMatrix;
+    std::vector<CFont::SKerningHashSlot> KerningHash;
+    std::vector<CFont::SKerningEntry> KerningEntries;
+    std::vector<uint16_t> KerningSecondPages;
+    std::vector<uint32_t> KerningSecondBits;
+    std::vector<std::vector<uint8_t>> TextureMipLevels;
+    std::vector<size_t> TextureMipLevelRowPitches;
+    // Points to the vectors above.
+    CFont::SBakedFont Font;
+};
+
+bool ParseBakedFont(SParsedBakedFont& out, const std::string& code, uint32_t mipLevelCount)
+{
+    std::vector<std::string> tokens;
+    if(!ParseBakedInitializer(tokens, code, "CharPageIndices") || tokens.size() != 256)
+        return false;
+    for(size_t i = 0; i < tokens.size(); ++i)
+        out.CharPageIndices.push_back((uint16_t)BakedTokenToUint(tokens[i]));
+    if(!ParseBakedInitializer(tokens, code, "CharInfoPages") || tokens.size() % 12 != 0)
+        return false;
+    out.CharInfoPages.resize(tokens.size() / 12);
+    for(size_t i = 0; i < out.CharInfoPages.size(); ++i)
+    {
+        const std::string* t = &tokens[i * 12];
+        CFont::SCharInfo& info = out.CharInfoPages[i];
+        info.TexCoordsRect = vec4(BakedTokenToFloat(t[0]), BakedTokenToFloat(t[1]), BakedTokenToFloat(t[2]), BakedTokenToFloat(t[3]));
+        info.Advance = BakedTokenToFloat(t[4]);
+        info.Offset = vec2(BakedTokenToFloat(t[5]), BakedTokenToFloat(t[6]));
+        info.Size = vec2(BakedTokenToFloat(t[7]), BakedTokenToFloat(t[8]));
+        info.KerningEntryFirstIndex = (size_t)BakedTokenToUint(t[9]);
+        info.TexturePage = (uint32_t)BakedTokenToUint(t[10]);
+        info.TextureChannel = (uint32_t)BakedTokenToUint(t[11]);
+    }
+    if(!ParseBakedInitializer(tokens, code, "CharMetricsPages") || tokens.size() != out.CharInfoPages.size() * 4)
+        return false;
+    out.CharMetricsPages.resize(tokens.size() / 4);
+    for(size_t i = 0; i < out.CharMetricsPages.size(); ++i)
+    {
+        CFont::SCharMetrics& metrics = out.CharMetricsPages[i];
+        metrics.Advance = BakedTokenToFloat(tokens[i * 4]);
+        metrics.KerningBucket = (uint16_t)BakedTokenToUint(tokens[i * 4 + 1]);
+        metrics.KerningLeftClass = (uint8_t)BakedTokenToUint(tokens[i * 4 + 2]);
+        metrics.KerningRightClass = (uint8_t)BakedTokenToUint(tokens[i * 4 + 3]);
+    }
+    if(!ParseBakedInitializer(tokens, code, "KerningBuckets") || tokens.size() % 3 != 0)
+        return false;
+    for(size_t i = 0; i < tokens.size(); i += 3)
+    {
+        const CFont::SKerningBucket bucket = { (uint32_t)BakedTokenToUint(tokens[i]), (uint32_t)BakedTokenToUint(tokens[i + 1]),
+            (uint32_t)BakedTokenToUint(tokens[i + 2]) };
+        out.KerningBuckets.push_back(bucket);
+    }
+    if(!ParseBakedInitializer(tokens, code, "KerningClassMatrix"))
+        return false;
+    for(size_t i = 0; i < tokens.size(); ++i)
+        out.KerningClassMatrix.push_back((int16_t)strtol(tokens[i].c_str(), nullptr, 10));
+    // Written only when used.
+    if(ParseBakedInitializer(tokens, code, "KerningHash"))
+    {
+        for(size_t i = 0; i + 1 < tokens.size(); i += 2)
+        {
+            const CFont::SKerningHashSlot slot = { (uint32_t)BakedTokenToUint(tokens[i]), BakedTokenToFloat(tokens[i + 1]) };
+            out.KerningHash.push_back(slot);
+        }
+    }
+    if(ParseBakedInitializer(tokens, code, "KerningEntries"))
+    {
+        for(size_t i = 0; i + 2 < tokens.size(); i += 3)
+        {
+            const CFont::SKerningEntry entry = { (wchar_t)BakedTokenToUint(tokens[i]), (wchar_t)BakedTokenToUint(tokens[i + 1]),
+                BakedTokenToFloat(tokens[i + 2]) };
+            out.KerningEntries.push_back(entry);
+        }
+    }
+    if(!ParseBakedInitializer(tokens, code, "KerningSecondPages") || tokens.size() != 256)
+        return false;
+    for(size_t i = 0; i < tokens.size(); ++i)
+        out.KerningSecondPages.push_back((uint16_t)BakedTokenToUint(tokens[i]));
+    if(!ParseBakedInitializer(tokens, code, "KerningSecondBits"))
+        return false;
+    for(size_t i = 0; i < tokens.size(); ++i)
+        out.KerningSecondBits.push_back((uint32_t)BakedTokenToUint(tokens[i]));
+    out.TextureMipLevels.resize(mipLevelCount);
+    for(uint32_t level = 0; level < mipLevelCount; ++level)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "TextureMipLevel%u", level);
+        if(!ParseBakedInitializer(tokens, code, name))
+            return false;
+        for(size_t i = 0; i < tokens.size(); ++i)
+            out.TextureMipLevels[level].push_back((uint8_t)BakedTokenToUint(tokens[i]));
+    }
+    if(!ParseBakedInitializer(tokens, code, "TextureMipLevelRowPitches") || tokens.size() != mipLevelCount)
+        return false;
+    for(size_t i = 0; i < tokens.size(); ++i)
+        out.TextureMipLevelRowPitches.push_back((size_t)BakedTokenToUint(tokens[i]));
+
+    if(!ParseBakedInitializer(tokens, code, "Font") || tokens.size() != 26)
+        return false;
+    CFont::SBakedFont& font = out.Font;
+    font.LineGap = BakedTokenToFloat(tokens[0]);
+    font.FillTexCoords = vec2(BakedTokenToFloat(tokens[1]), BakedTokenToFloat(tokens[2]));
+    font.FillTexturePage = (uint32_t)BakedTokenToUint(tokens[3]);
+    font.CharPageIndices = out.CharPageIndices.data();
+    font.CharInfoPages = out.CharInfoPages.data();
+    font.CharMetricsPages = out.CharMetricsPages.data();
+    font.KerningBuckets = out.KerningBuckets.data();
+    font.KerningClassMatrix = out.KerningClassMatrix.data();
+    font.KerningRightClassCount = (uint32_t)BakedTokenToUint(tokens[9]);
+    font.KerningClassScale = BakedTokenToFloat(tokens[10]);
+    font.KerningHash = tokens[11] == "nullptr" ? nullptr : out.KerningHash.data();
+    font.KerningHashShift = (uint32_t)BakedTokenToUint(tokens[12]);
+    font.KerningEntries = tokens[13] == "nullptr" ? nullptr : out.KerningEntries.data();
+    font.KerningSecondPages = out.KerningSecondPages.data();
+    font.KerningSecondBits = out.KerningSecondBits.data();
+    font.TextureSize = uvec2((uint32_t)BakedTokenToUint(tokens[16]), (uint32_t)BakedTokenToUint(tokens[17]));
+    font.TexturePageCount = (uint32_t)BakedTokenToUint(tokens[18]);
+    font.TextureFormat = (TEXTURE_FORMAT)BakedTokenToUint(tokens[19]);
+    font.KerningBucketCount = (uint32_t)BakedTokenToUint(tokens[20]);
+    font.KerningClassMatrixSize = (uint32_t)BakedTokenToUint(tokens[21]);
+    font.KerningHashSize = (uint32_t)BakedTokenToUint(tokens[22]);
+    font.KerningEntryCount = (uint32_t)BakedTokenToUint(tokens[23]);
+    font.KerningSecondBitsCount = (uint32_t)BakedTokenToUint(tokens[24]);
+    font.KerningExceptionCount = (uint32_t)BakedTokenToUint(tokens[25]);
+    // Element counts stated in the font must match the arrays.
+    return font.KerningBucketCount == out.KerningBuckets.size() && font.KerningClassMatrixSize == out.KerningClassMatrix.size() &&
+        font.KerningHashSize == out.KerningHash.size() && font.KerningEntryCount == (font.KerningEntries ? out.KerningEntries.size() : 0) &&
+        font.KerningSecondBitsCount == out.KerningSecondBits.size();
+}
+
+/*
+Writes fonts with CFont::WriteBakedFont, reads the arrays back from the code and passes them to InitBaked.
+The baked font must have the same metrics, kerning, statistics of kerning and text layout as the original, and the code the same texture.
+*/
+bool TestBakedFont()
+{
+    bool success = true;
+    const struct
+    {
+        const char* Name;
+        size_t RangeSetIndex;
+        uint32_t Flags;
+        TEXTURE_FORMAT TextureFormat;
+        uint32_t MipLevelCount;
+    } cases[] = {
+        { "default", 0, 0, TEXTURE_FORMAT_R8, 1 },
+        { "latin extended, SDF", 1, SFontDesc::FLAG_SDF, TEXTURE_FORMAT_R8, 1 },
+        { "CJK 3000, BC4, 3 mips", 2, 0, TEXTURE_FORMAT_BC4, 3 },
+    };
+    for(size_t caseIndex = 0; caseIndex < _countof(cases); ++caseIndex)
+    {
+        SFontDesc desc;
+        InitDesc(desc, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex], 24);
+        desc.Flags = cases[caseIndex].Flags;
+        desc.TextureFormat = cases[caseIndex].TextureFormat;
+        desc.MipLevelCount = cases[caseIndex].MipLevelCount;
+        CFont font;
+        std::string code;
+        if(!font.Init(desc) || !font.WriteBakedFont(code, "TestFont"))
+        {
+            printf("    Init or WriteBakedFont failed\n");
+            return false;
+        }
+        SParsedBakedFont parsed;
+        if(!ParseBakedFont(parsed, code, font.GetMipLevelCount()))
+        {
+            printf("    %-26s parsing baked font failed\n", cases[caseIndex].Name);
+            success = false;
+            continue;
+        }
+
+        bool textureIdentical = true;
+        for(uint32_t level = 0; level < font.GetMipLevelCount(); ++level)
+        {
+            const void* data;
+            uvec2 size;
+            size_t rowPitch;
+            font.GetTextureData(level, data, size, rowPitch);
+            const uint32_t rowCount = font.GetTextureFormat() == TEXTURE_FORMAT_BC4 ? size.y / 4 : size.y;
+            const size_t byteCount = rowPitch * rowCount * font.GetTexturePageCount();
+            // Empty level is written as one element, because C++ doesn't allow empty arrays.
+            textureIdentical = textureIdentical && parsed.TextureMipLevelRowPitches[level] == rowPitch &&
+                parsed.TextureMipLevels[level].size() == std::max<size_t>(byteCount, 1) &&
+                memcmp(parsed.TextureMipLevels[level].data(), data, byteCount) == 0;
+        }
+
+        CFont bakedFont;
+        bakedFont.InitBaked(parsed.Font);
+        const void* bakedData;
+        uvec2 bakedSize;
+        size_t bakedRowPitch;
+        bakedFont.GetTextureData(bakedData, bakedSize, bakedRowPitch);
+        const void* data;
+        uvec2 size;
+        size_t rowPitch;
+        font.GetTextureData(data, size, rowPitch);
+        const bool paramsIdentical = bakedData == nullptr && all(parsed.Font.TextureSize == size) &&
+            bakedFont.GetTextureFormat() == font.GetTextureFormat() && bakedFont.GetTexturePageCount() == font.GetTexturePageCount() &&
+            bakedFont.GetLineGap() == font.GetLineGap() && all(bakedFont.GetFillTexCoords() == font.GetFillTexCoords()) &&
+            bakedFont.GetFillTexturePage() == font.GetFillTexturePage();
+
+        std::vector<wchar_t> chars;
+        GetRangeChars(chars, CHAR_RANGE_SETS[cases[caseIndex].RangeSetIndex]);
+        // Characters outside of the ranges too, which use the fallback page.
+        const wchar_t otherChars[] = { 0, 31, 0x3000, 0xFFFF };
+        chars.insert(chars.end(), otherChars, otherChars + _countof(otherChars));
+        const size_t charMismatchCount = CountCharMismatches(font, bakedFont, chars);
+        const size_t kerningMismatchCount = CountKerningMismatches(font, bakedFont, chars);
+
+        CFont::SStatistics stats, bakedStats;
+        font.GetStatistics(stats);
+        bakedFont.GetStatistics(bakedStats);
+        const bool statsIdentical = bakedStats.KerningLeftClassCount == stats.KerningLeftClassCount &&
+            bakedStats.KerningRightClassCount == stats.KerningRightClassCount &&
+            bakedStats.KerningClassMatrixBytes == stats.KerningClassMatrixBytes &&
+            bakedStats.KerningExceptionCount == stats.KerningExceptionCount;
+
+        std::vector<wchar_t> text;
+        GenerateRandomText(text, chars, 10000);
+        for(size_t i = 59; i < text.size(); i += 60)
+            text[i] = L'\n';
+        const uint32_t flags = CFont::FLAG_HLEFT | CFont::FLAG_VTOP | CFont::FLAG_WRAP_NORMAL;
+        vec2 extent, bakedExtent;
+        font.CalcTextExtent(extent, wstr_view(text.data(), text.size()), 16.f, flags, 0.f);
+        bakedFont.CalcTextExtent(bakedExtent, wstr_view(text.data(), text.size()), 16.f, flags, 0.f);
+
+        printf("    %-26s %zu bytes of code, texture %s, parameters %s, %zu mismatched characters, "
+            "%zu mismatched kerning pairs, statistics %s, text extent %s\n",
+            cases[caseIndex].Name, code.size(), textureIdentical ? "identical" : "DIFFERS", paramsIdentical ? "identical" : "DIFFER",
+            charMismatchCount, kerningMismatchCount, statsIdentical ? "identical" : "DIFFER",
+            all(extent == bakedExtent) ? "identical" : "DIFFERS");
+        success &= textureIdentical && paramsIdentical && charMismatchCount == 0 && kerningMismatchCount == 0 &&
+            statsIdentical && all(extent == bakedExtent);
+    }
+    return success;
+}
+
+// Texture destination of TEXTURE_FORMAT_R8 that keeps the background thread of CFont::InitAsync waiting until Release.
+struct SGatedTextureDestination
+{
+    std::atomic<bool> Requested = {false};
+    std::atomic<bool> Released = {false};
+    std::vector<uint8_t> Data;
+    size_t RowPitch = 0;
+
+    void Release() { Released = true; }
+
+    static bool GetTextureDestination(void* userData, const uvec2& textureSize, uint32_t texturePageCount, TEXTURE_FORMAT textureFormat,
+        STextureDestination& outDestination)
+    {
+        SGatedTextureDestination* gate = (SGatedTextureDestination*)userData;
+        gate->Requested = true;
+        // Gives up after a while, so a failing test can't hang.
+        const time_point beginTime = std::chrono::high_resolution_clock::now();
+        while(!gate->Released && GetMillisecondsSince(beginTime) < 10000.0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if(textureFormat != TEXTURE_FORMAT_R8)
+            return false;
+        gate->RowPitch = textureSize.x;
+        gate->Data.assign(gate->RowPitch * textureSize.y * texturePageCount, 0);
+        outDestination.Data = gate->Data.data();
+        outDestination.RowPitch = gate->RowPitch;
+        outDestination.PageStride = gate->RowPitch * textureSize.y;
+        return true;
+    }
+};
+
+// Waits until condition returns true, for at most 10 seconds. Returns its last result.
+template<typename Condition>
+bool WaitFor(Condition condition)
+{
+    const time_point beginTime = std::chrono::high_resolution_clock::now();
+    while(!condition())
+    {
+        if(GetMillisecondsSince(beginTime) >= 10000.0)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Returns number of mismatches in methods that measure text, which can be called before InitAsync finishes the texture.
+size_t CountLayoutMismatches(const CFont& lhs, const CFont& rhs, const std::vector<wchar_t>& chars)
+{
+    size_t mismatchCount = CountKerningMismatches(lhs, rhs, chars);
+    for(size_t i = 0; i < chars.size(); ++i)
+    {
+        if(lhs.GetCharMetrics(chars[i]).Advance != rhs.GetCharMetrics(chars[i]).Advance)
+            ++mismatchCount;
+    }
+    std::vector<wchar_t> text;
+    GenerateRandomText(text, chars, 10000);
+    for(size_t i = 59; i < text.size(); i += 60)
+        text[i] = L'\n';
+    const wstr_view textView = wstr_view(text.data(), text.size());
+    const uint32_t flags = CFont::FLAG_HLEFT | CFont::FLAG_VTOP | CFont::FLAG_WRAP_WORD;
+    vec2 lhsExtent, rhsExtent;
+    lhs.CalcTextExtent(lhsExtent, textView, 16.f, flags, 300.f);
+    rhs.CalcTextExtent(rhsExtent, textView, 16.f, flags, 300.f);
+    if(any(lhsExtent != rhsExtent) || lhs.GetLineGap() != rhs.GetLineGap() ||
+        lhs.CalcQuadCount(textView, 16.f, flags, 300.f) != rhs.CalcQuadCount(textView, 16.f, flags, 300.f))
+        ++mismatchCount;
+    return mismatchCount;
+}
+
+/*
+Creates fonts with CFont::InitAsync, holding the background thread in SFontDesc::GetTextureDestination.
+Text measured after AreMetricsReady, while the texture is not finished, must be the same as with Init, and so must the finished font.
+CancelInit must make InitAsync fail with INIT_RESULT_CANCELED, both right after the start and after metrics are ready.
+*/
+bool TestInitAsync()
+{
+    bool success = true;
+    SFontDesc desc;
+    InitDesc(desc, CHAR_RANGE_SETS[1], 24);
+    CFont referenceFont;
+    if(!referenceFont.Init(desc))
+    {
+        printf("    Init failed\n");
+        return false;
+    }
+    std::vector<wchar_t> chars;
+    GetRangeChars(chars, CHAR_RANGE_SETS[1]);
+    const void* referenceData;
+    uvec2 referenceSize;
+    size_t referenceRowPitch;
+    referenceFont.GetTextureData(referenceData, referenceSize, referenceRowPitch);
+    const size_t referenceByteCount = referenceRowPitch * referenceSize.y * referenceFont.GetTexturePageCount();
+
+    {
+        SGatedTextureDestination gate;
+        SFontDesc asyncDesc = desc;
+        asyncDesc.GetTextureDestination = &SGatedTextureDestination::GetTextureDestination;
+        asyncDesc.GetTextureDestinationUserData = &gate;
+        CFont font;
+        std::shared_future<bool> future = font.InitAsync(asyncDesc);
+        // Progress must not go back or exceed the number of characters.
+        bool progressValid = true;
+        uint32_t lastRasterizedCharCount = 0;
+        const bool metricsReady = WaitFor([&]() -> bool {
+            uint32_t rasterizedCharCount, charCount;
+            font.GetInitProgress(rasterizedCharCount, charCount);
+            progressValid &= rasterizedCharCount >= lastRasterizedCharCount && rasterizedCharCount <= charCount;
+            lastRasterizedCharCount = rasterizedCharCount;
+            return font.AreMetricsReady();
+        });
+        uint32_t rasterizedCharCount, charCount;
+        font.GetInitProgress(rasterizedCharCount, charCount);
+        progressValid &= charCount > 0 && rasterizedCharCount == charCount;
+        const bool textureUnfinished = future.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+        const size_t layoutMismatchCount = metricsReady ? CountLayoutMismatches(referenceFont, font, chars) : SIZE_MAX;
+        gate.Release();
+        const bool initSuccess = future.get() && font.GetInitResult() == CFont::INIT_RESULT_SUCCESS;
+        const bool identical = initSuccess && gate.RowPitch == referenceRowPitch && gate.Data.size() == referenceByteCount &&
+            memcmp(gate.Data.data(), referenceData, referenceByteCount) == 0 && CountCharMismatches(referenceFont, font, chars) == 0;
+        printf("    %-26s metrics %s, progress %s, texture %s, %zu mismatches in layout, result %s, font %s\n",
+            "metrics before texture", metricsReady ? "ready" : "NOT READY", progressValid ? "valid" : "INVALID",
+            textureUnfinished ? "unfinished" : "FINISHED", layoutMismatchCount, initSuccess ? "success" : "FAILED",
+            identical ? "identical" : "DIFFERS");
+        success &= metricsReady && progressValid && textureUnfinished && layoutMismatchCount == 0 && initSuccess && identical;
+    }
+
+    {
+        SGatedTextureDestination gate;
+        SFontDesc asyncDesc = desc;
+        asyncDesc.GetTextureDestination = &SGatedTextureDestination::GetTextureDestination;
+        asyncDesc.GetTextureDestinationUserData = &gate;
+        CFont font;
+        std::shared_future<bool> future = font.InitAsync(asyncDesc);
+        const bool requested = WaitFor([&]() -> bool { return gate.Requested; });
+        font.CancelInit();
+        gate.Release();
+        const bool canceled = !future.get() && font.GetInitResult() == CFont::INIT_RESULT_CANCELED;
+        // Metrics stay after failing while creating the texture.
+        const size_t layoutMismatchCount = font.AreMetricsReady() ? CountLayoutMismatches(referenceFont, font, chars) : SIZE_MAX;
+        // CancelInit must not affect the next Init.
+        const bool reinitSuccess = font.Init(desc) && AreTexturesIdentical(referenceFont, font);
+        printf("    %-26s texture %s, result %s, %zu mismatches in layout, next Init %s\n",
+            "cancel after metrics", requested ? "requested" : "NOT REQUESTED", canceled ? "canceled" : "NOT CANCELED",
+            layoutMismatchCount, reinitSuccess ? "success" : "FAILED");
+        success &= requested && canceled && layoutMismatchCount == 0 && reinitSuccess;
+    }
+
+    {
+        SGatedTextureDestination gate;
+        SFontDesc asyncDesc = desc;
+        asyncDesc.GetTextureDestination = &SGatedTextureDestination::GetTextureDestination;
+        asyncDesc.GetTextureDestinationUserData = &gate;
+        CFont font;
+        std::shared_future<bool> future = font.InitAsync(asyncDesc);
+        font.CancelInit();
+        gate.Release();
+        const bool canceled = !future.get() && font.GetInitResult() == CFont::INIT_RESULT_CANCELED;
+        uint32_t rasterizedCharCount, charCount;
+        font.GetInitProgress(rasterizedCharCount, charCount);
+        printf("    %-26s result %s, %u of %u characters rasterized\n",
+            "cancel right away", canceled ? "canceled" : "NOT CANCELED", rasterizedCharCount, charCount);
+        success &= canceled && rasterizedCharCount <= charCount;
+    }
+    return success;
+}
+
+struct STest
+{
+    const wchar_t* Name;
+    bool (*Func)();
+};
+
+const STest TESTS[] = {
+    { L"msdf", &TestMultiChannelDistanceField },
+    { L"sdf", &TestSignedDistanceField },
+    { L"dirtyrects", &TestDirtyRects },
+    { L"atlas", &TestAtlas },
+    { L"bc4", &TestBc4 },
+    { L"lowpeakmemory", &TestLowPeakMemory },
+    { L"cache", &TestCache },
+    { L"baked", &TestBakedFont },
+    { L"initasync", &TestInitAsync },
+};
+
+} // namespace
+
+int RunTests()
+{
+    int failedCount = 0;
+    for(size_t i = 0; i < _countof(TESTS); ++i)
+    {
+        printf("Test %ls\n", TESTS[i].Name);
+        const bool success = TESTS[i].Func();
+        printf("    %s\n", success ? "Passed" : "FAILED");
+        if(!success)
+            ++failedCount;
+    }
+    printf("%d of %zu tests failed\n", failedCount, _countof(TESTS));
+    return failedCount;
+}
+
+int RunBenchmarks(const wchar_t* name)
+{
+    bool found = false;
+    int failedCount = 0;
+    for(size_t i = 0; i < _countof(BENCHMARKS); ++i)
+    {
+        if(*name == L'\0' || wcscmp(name, BENCHMARKS[i].Name) == 0)
+        {
+            printf("Benchmark %ls\n", BENCHMARKS[i].Name);
+            if(!BENCHMARKS[i].Func())
+            {
+                printf("    FAILED\n");
+                ++failedCount;
+            }
+            printf("\n");
+            found = true;
+        }
+    }
+    if(!found)
+    {
+        printf("Unknown benchmark %ls. Available:", name);
+        for(size_t i = 0; i < _countof(BENCHMARKS); ++i)
+            printf(" %ls", BENCHMARKS[i].Name);
+        printf("\n");
+        return 1;
+    }
+    return failedCount;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+Benchmarks of WinFontRender, run by the sample application from command line instead of opening its window:
+
+    D3d11Sample.exe -benchmark [name]
+
+They print results to the console. Without name, all benchmarks are run.
+Returns 1 if name is unknown, otherwise number of benchmarks that failed: Init failed or results were wrong.
+*/
+int RunBenchmarks(const wchar_t* name);
+
+/*
+Tests of WinFontRender, run by the sample application from command line:
+
+    D3d11Sample.exe -test
+
+They print results to the console. Returns number of tests that failed.
+*/
+int RunTests();
@@ -41,6 +41,138 @@ SOFTWARE.
 #ifndef WIN_FONT_RENDER_H
 #define WIN_FONT_RENDER_H
 
+/*
+Define before including this file to get only the font cache section below, without <Windows.h> and the rest of the library.
+It is meant for tools on other platforms, e.g. asset servers, that validate or read data written by CFont::Save.
+With WIN_FONT_RENDER_IMPLEMENTATION, only implementation of this section is compiled.
+*/
+//#define WIN_FONT_RENDER_CACHE_ONLY
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#pragma region Font cache
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// Binary format of the font cache. Doesn't depend on <Windows.h>.
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace WinFontRender
+{
+
+/*
+Layout of data written by CFont::Save. All numbers are little-endian, floats stored as their IEEE 754 bits.
+
+Header:
+    char[4] "WFRC"
+    uint32 CACHE_VERSION
+    uint64 CFont::CalcDescHash of desc
+    uint64 size of the payload, which follows the header up to the end of data
+    uint64 CalcCacheChecksum of the payload
+Payload:
+    float line gap, fill texcoords x, y; uint32 fill texture page
+    uint32 N = number of pages of characters, including the fallback page 0
+    uint16[256] index of page of SCharInfo and SCharMetrics, < N, for every 256 characters
+    N * 256 SCharInfo: float[4] TexCoordsRect, float Advance, float[2] Offset, float[2] Size,
+        uint32 KerningEntryFirstIndex (UINT32_MAX meaning SIZE_MAX), uint32 TexturePage, uint32 TextureChannel
+    N * 256 SCharMetrics: float Advance, uint16 KerningBucket, uint8 KerningLeftClass, uint8 KerningRightClass
+    uint32 count, count * (uint16 First, uint16 Second, float Amount) - kerning entries not in the class matrix, all of them with shift 0 below
+    uint32 count, count * (uint32 FirstIndex, uint32 Count, uint32 SecondBloom) - kerning buckets
+    uint32 right class count, float scale, uint32 count, count * int16 - kerning class matrix
+    uint32 shift, uint32 count, count * (uint32 Key, float Amount) - kerning hash table, empty with shift 0 if pairs are searched in kerning entries
+    uint16[256] kerning second pages, uint32 count, count * uint32 - kerning second bits
+    uint32 texture size x, y, page count, TEXTURE_FORMAT, mip level count, uint64 atlas used texels
+    For every mip level: uint64 size, size * uint8 - texture data of all pages, with the row pitch CFont::GetTextureData returns
+*/
+static const uint8_t CACHE_MAGIC[4] = { 'W', 'F', 'R', 'C' };
+// Increment when the layout above or the meaning of any value changes.
+static const uint32_t CACHE_VERSION = 2;
+static const size_t CACHE_HEADER_SIZE = 32;
+
+// FNV-1a processing 8 bytes at a time. Detects accidental damage, not deliberate tampering.
+uint64_t CalcCacheChecksum(const uint8_t* data, size_t size);
+/*
+Returns true if data has valid header and checksum of data written by CFont::Save. Optionally returns CFont::CalcDescHash of its desc.
+Same as CFont::ValidateCache. The payload can then be read with CCacheReader.
+*/
+bool ValidateFontCache(const void* data, size_t dataSize, uint64_t* outDescHash = nullptr);
+
+// Appends numbers to data in the layout of the font cache.
+class CCacheWriter
+{
+public:
+    explicit CCacheWriter(std::vector<uint8_t>& data) : m_Data(data) { }
+
+    void WriteU8(uint8_t value) { m_Data.push_back(value); }
+    void WriteU16(uint16_t value) { WriteU8((uint8_t)value); WriteU8((uint8_t)(value >> 8)); }
+    void WriteU32(uint32_t value) { WriteU16((uint16_t)value); WriteU16((uint16_t)(value >> 16)); }
+    void WriteU64(uint64_t value) { WriteU32((uint32_t)value); WriteU32((uint32_t)(value >> 32)); }
+    void WriteFloat(float value) { uint32_t bits; memcpy(&bits, &value, 4); WriteU32(bits); }
+    void WriteBytes(const void* data, size_t size)
+    {
+        m_Data.insert(m_Data.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+    }
+
+private:
+    std::vector<uint8_t>& m_Data;
+};
+
+// Reads numbers written by CCacheWriter. Reading past the end returns zeros and makes IsValid return false.
+class CCacheReader
+{
+public:
+    CCacheReader(const uint8_t* data, size_t size) : m_Ptr(data), m_End(data + size) { }
+
+    bool IsValid() const { return m_Valid; }
+    bool IsAtEnd() const { return m_Ptr == m_End; }
+
+    // Returns null if there are less than size bytes left.
+    const uint8_t* ReadBytes(size_t size)
+    {
+        if((size_t)(m_End - m_Ptr) < size)
+        {
+            m_Valid = false;
+            m_Ptr = m_End;
+            return nullptr;
+        }
+        const uint8_t* const result = m_Ptr;
+        m_Ptr += size;
+        return result;
+    }
+    uint8_t ReadU8() { const uint8_t* const p = ReadBytes(1); return p ? p[0] : 0; }
+    uint16_t ReadU16() { const uint16_t lo = ReadU8(); return (uint16_t)(lo | (ReadU8() << 8)); }
+    uint32_t ReadU32() { const uint32_t lo = ReadU16(); return lo | ((uint32_t)ReadU16() << 16); }
+    uint64_t ReadU64() { const uint64_t lo = ReadU32(); return lo | ((uint64_t)ReadU32() << 32); }
+    float ReadFloat() { const uint32_t bits = ReadU32(); float value; memcpy(&value, &bits, 4); return value; }
+    // Reads number of elements that follow, failing if there is not enough data left for them, before anything is allocated.
+    uint32_t ReadCount(size_t elementSize)
+    {
+        const uint32_t count = ReadU32();
+        if((size_t)(m_End - m_Ptr) / elementSize < count)
+        {
+            m_Valid = false;
+            m_Ptr = m_End;
+            return 0;
+        }
+        return count;
+    }
+
+private:
+    const uint8_t* m_Ptr;
+    const uint8_t* const m_End;
+    bool m_Valid = true;
+};
+
+} // namespace WinFontRender
+
+#pragma endregion
+
+#ifndef WIN_FONT_RENDER_CACHE_ONLY
+
 #ifndef NOMINMAX
 #define NOMINMAX // For windows.h
 #endif
@@ -49,6 +181,8 @@ SOFTWARE.
 #include <vector>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <future>
 
 #include <cstdint>
 
@@ -918,7 +1052,7 @@ struct base_vec2
 
     // Uninitialized.
     base_vec2() { }
-    base_vec2(T newX, T newY) : x(newX), y(newY) { }
+    constexpr base_vec2(T newX, T newY) : x(newX), y(newY) { }
     // Must be array of 2 elements.
     base_vec2(const T* arr) : x(arr[0]), y(arr[1]) { }
 
@@ -980,7 +1114,7 @@ struct base_vec4
 
     // Uninitialized.
     base_vec4() { }
-    base_vec4(T newX, T newY, T newZ, T newW) : x(newX), y(newY), z(newZ), w(newW) { }
+    constexpr base_vec4(T newX, T newY, T newZ, T newW) : x(newX), y(newY), z(newZ), w(newW) { }
     // Must be array of 4 elements.
     base_vec4(const T* arr) : x(arr[0]), y(arr[1]), z(arr[2]), w(arr[3]) { }
 
@@ -1059,6 +1193,22 @@ typedef base_vec4<uint32_t> uvec4;
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+/*
+Define to 1 to count kerning lookups and the stage at which each of them was resolved.
+See CFont::GetKerningStatistics. It adds atomic increments to every lookup, so use it only for profiling.
+*/
+#ifndef WIN_FONT_RENDER_KERNING_STATISTICS
+    #define WIN_FONT_RENDER_KERNING_STATISTICS 0
+#endif
+
+/*
+Define to 0 to disable SSE2, AVX2 and NEON code paths used while creating the texture, leaving only plain C++.
+AVX2 is used only if the CPU supports it, as detected at runtime.
+*/
+#ifndef WIN_FONT_RENDER_USE_SIMD
+    #define WIN_FONT_RENDER_USE_SIMD 1
+#endif
+
 namespace WinFontRender
 {
 
@@ -1077,6 +1227,8 @@ enum VERTEX_BUFFER_FLAGS
     // Primitive topology is triangle strip. Each quad is made of 4 vertices.
     // Quads are separated by degenerate triangles created by duplicating 2 vertices or indices.
     VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_DEGENERATE_TRIANGLES = 0x40,
+    // Vertices have additional attribute with index of texture page, see CFont::GetTexturePageCount.
+    VERTEX_BUFFER_FLAG_TEXTURE_PAGE = 0x100,
 };
 
 // Describes specific vertex buffer and optional index buffer.
@@ -1095,6 +1247,12 @@ struct SVertexBufferDesc
     // Pointer to first index in index buffer.
     // Ignored if vbFlags don't indicate that index buffer is in use.
     void* FirstIndex;
+    // Pointer to texture page attribute of first vertex.
+    // Texture pages must be of type float, so it can also be third component of texture coordinates, pointing after vec2.
+    // Ignored if vbFlags don't contain VERTEX_BUFFER_FLAG_TEXTURE_PAGE.
+    void* FirstTexturePage;
+    // Step to take between texture pages of subsequent vertices, in bytes.
+    size_t TexturePageStrideBytes;
 };
 
 // Returns true if given combination of VERTEX_BUFFER_FLAG_* is valid.
@@ -1111,20 +1269,97 @@ class CQuadVertexWriter
 public:
     // desc object must remain alive and unchanged as long as this object is in use.
     CQuadVertexWriter(const SVertexBufferDesc& desc) : m_Desc(desc) { }
+    // Quads of other texture pages are skipped. UINT32_MAX to write quads of all pages.
+    void SetTexturePageFilter(uint32_t texturePage) { m_TexturePageFilter = texturePage; }
     // positions/texCoords xy - left top, positions/texCoords.zw - right bottom
-    __forceinline void PostQuad(const vec4& positions, const vec4& texCoords);
+    __forceinline void PostQuad(const vec4& positions, const vec4& texCoords, uint32_t texturePage);
 
 private:
     const SVertexBufferDesc& m_Desc;
     uint32_t m_QuadIndex = 0;
+    uint32_t m_TexturePageFilter = UINT32_MAX;
 
-    __forceinline void SetVertex(size_t vertexIndex, const vec2& pos, const vec2& texCoord);
+    __forceinline void SetVertex(size_t vertexIndex, const vec2& pos, const vec2& texCoord, uint32_t texturePage);
     __forceinline void SetPositionOnlyVertex(size_t vertexIndex, const vec2& pos);
     __forceinline const vec2& GetPosition(size_t vertexIndex) const;
     __forceinline void SetRestartIndex(size_t indexIndex);
     __forceinline void SetIndices(size_t firstIndexIndex, const int16_t* indices, size_t count, uint32_t vertexOffset);
 };
 
+// Format of texture data returned by CFont::GetTextureData.
+enum TEXTURE_FORMAT
+{
+    // 1 byte per texel. Can be interpreted as DXGI_FORMAT_R8_UNORM or DXGI_FORMAT_A8_UNORM.
+    TEXTURE_FORMAT_R8,
+    /*
+    4 bytes per texel, in order R, G, B, A. Can be interpreted as DXGI_FORMAT_R8G8B8A8_UNORM.
+    Used by FLAG_MSDF. Otherwise, each texel has the same value in all 4 channels, for APIs that don't support single-channel textures,
+    or each channel belongs to a different font - see SFontAtlasDesc::FLAG_CHANNEL_PACKING.
+    */
+    TEXTURE_FORMAT_R8G8B8A8,
+    /*
+    Single component compressed in blocks of 4x4 texels, 8 bytes each. Can be interpreted as DXGI_FORMAT_BC4_UNORM.
+    Texture size is a multiple of 4, and rows of texture data are rows of blocks.
+    */
+    TEXTURE_FORMAT_BC4,
+    /*
+    4 bits per texel 0..15, 2 texels per byte, left one in lower 4 bits. Rows are padded to 4 bytes.
+    Coverage from GDI has only 65 levels anyway. No graphics API format matches it directly -
+    it can be uploaded as DXGI_FORMAT_R8_UINT texture of half the width and unpacked in the shader.
+    */
+    TEXTURE_FORMAT_R4,
+};
+
+/*
+Segment of a shape outline: quadratic Bezier curve from P[0] with control point P[1] to P[2].
+Straight line has P[1] in the middle.
+*/
+struct SShapeSegment
+{
+    vec2 P[3];
+};
+// Closed contour. Each segment starts where previous one ends, first one where the last one ends.
+struct SShapeContour
+{
+    const SShapeSegment* Segments;
+    size_t SegmentCount;
+};
+
+/*
+Calculates multi-channel signed distance field of a shape, like SFontDesc::FLAG_MSDF does for characters.
+Doesn't depend on GDI, so it can be used for any shape, e.g. synthetic ones for testing.
+Coordinates of contours are in texels of dst, with y pointing down and texel centers at +0.5.
+Contours of filled areas and holes must have opposite orientation, as in TrueType fonts.
+dst receives size.x * size.y texels in TEXTURE_FORMAT_R8G8B8A8: RGB is multi-channel distance, A is true distance,
+each 128 on the edge, more inside, less outside, saturating at spread texels from the edge.
+*/
+void CalcMultiChannelSignedDistanceField(
+    uint8_t* dst, size_t dstRowPitch, const uvec2& size,
+    const SShapeContour* contours, size_t contourCount, float spread);
+
+class CFontAtlas;
+
+// Memory provided by the user to write texture data to, see SFontDesc::GetTextureDestination.
+struct STextureDestination
+{
+    // Where texture page 0 starts.
+    void* Data = nullptr;
+    /*
+    Step between rows, in bytes. Must be at least the row pitch CFont::GetTextureData would return,
+    but can be larger, e.g. aligned to D3D12_TEXTURE_DATA_PITCH_ALIGNMENT = 256.
+    */
+    size_t RowPitch = 0;
+    // Step between texture pages, in bytes. Must be at least RowPitch * number of rows.
+    size_t PageStride = 0;
+};
+
+/*
+Called once texture size is known, to get memory where the texture should be written, e.g. mapped upload buffer.
+Rows are rows of blocks with TEXTURE_FORMAT_BC4. Return false to make the creation fail.
+*/
+typedef bool (*PFN_GET_TEXTURE_DESTINATION)(void* userData, const uvec2& textureSize, uint32_t texturePageCount,
+    TEXTURE_FORMAT textureFormat, STextureDestination& outDestination);
+
 // Describes parameters of font to be created.
 struct SFontDesc
 {
@@ -1139,6 +1374,45 @@ struct SFontDesc
         FLAG_TEXTURE_FROM_LEFT_BOTTOM = 0x10,
         // Texture extents must be rounded up to a power of 2.
         FLAG_TEXTURE_POW2 = 0x20,
+        /*
+        Characters are rasterized on demand by CFont::CacheText into texture of constant size MaxTextureSize x MaxTextureSize,
+        evicting least recently used ones when it is full. CharRanges are only the characters rasterized initially.
+        MaxTextureSize must not be 0. MaxTexturePageCount is ignored.
+        Besides the texture, such font keeps state of every possible character, 4 bytes each, 256 KB in total.
+        */
+        FLAG_DYNAMIC_ATLAS = 0x40,
+        /*
+        Texture contains signed distance field instead of coverage: 128 on the edge of a character, more inside, less outside,
+        saturating at SdfSpread texels from the edge. Such font can be drawn at any fontSize using a shader that thresholds
+        the value around 0.5, e.g. with smoothstep. Can't be used together with FLAG_DYNAMIC_ATLAS.
+        */
+        FLAG_SDF = 0x80,
+        /*
+        Texture contains multi-channel signed distance field calculated from outlines of characters, in TEXTURE_FORMAT_R8G8B8A8.
+        Take median of R, G, B in the shader and threshold it like with FLAG_SDF. Unlike FLAG_SDF, it keeps sharp corners
+        at large magnification. A contains plain signed distance field. Slower to create than FLAG_SDF.
+        Can't be used together with FLAG_SDF or FLAG_DYNAMIC_ATLAS.
+        */
+        FLAG_MSDF = 0x100,
+        /*
+        Lowers peak memory of CFont::Init, at the cost of querying GDI twice per character. Sizes of all characters are
+        measured first. Then they are packed, the texture is allocated, and each character is rasterized right into its place,
+        so bitmaps of all characters never exist at the same time. The result is the same as without this flag.
+        Progress returned by CFont::GetInitProgress covers measuring. Ignored with FLAG_DYNAMIC_ATLAS or Atlas.
+        */
+        FLAG_LOW_PEAK_MEMORY = 0x200,
+    };
+
+    // Algorithm used to pack characters into the texture.
+    enum PACKING
+    {
+        // Characters are placed in rows, sorted by height. Fastest.
+        PACKING_SHELF,
+        // Skyline bottom-left. Each character is placed as low as possible on the outline of already placed ones.
+        // Tighter than PACKING_SHELF when characters differ in height.
+        PACKING_SKYLINE,
+        // MaxRects with bottom-left rule. Tracks all free rectangles. Tightest, but slowest for large CharRanges.
+        PACKING_MAX_RECTS,
     };
 
     // Name of the font as installed in the current system, e.g. "Arial".
@@ -1161,6 +1435,66 @@ struct SFontDesc
     */
     size_t CharRangeCount = 0;
     const wchar_t* CharRanges = nullptr;
+
+    PACKING Packing = PACKING_SHELF;
+    /*
+    Maximum width and height of the texture, in pixels, e.g. 4096.
+    If 0, texture width is Height * 8 and height grows as needed.
+    Otherwise, Init tries multiple texture widths and chooses the one giving smallest texture area.
+    With FLAG_TEXTURE_POW2, only power of 2 widths are tried.
+    */
+    uint32_t MaxTextureSize = 0;
+    /*
+    Maximum number of equally sized texture pages, to be used e.g. as slices of a texture array.
+    Characters that don't fit in one page of MaxTextureSize go to next pages.
+    Used only when MaxTextureSize is not 0.
+    */
+    uint32_t MaxTexturePageCount = 1;
+    /*
+    Number of mip levels to generate, see CFont::GetTextureData with level parameter. 1 means only the full resolution.
+    Each level is an average of 2x2 texels of the previous one (box filter). No other filter is available.
+    Characters are then packed in blocks of 2^(MipLevelCount - 1) texels, with a gutter of half of that size around them,
+    so downsampling never mixes texels of different characters and bilinear filtering on the smallest level stays inside the block.
+    This costs texture space, growing quickly with each level.
+    Limited to 1 + log2(MaxTextureSize), so the block fits in the texture, or to 16 when MaxTextureSize is 0.
+    Ignored with Atlas. Must be 1 with FLAG_DYNAMIC_ATLAS.
+    */
+    uint32_t MipLevelCount = 1;
+    /*
+    Format of texture data to create: TEXTURE_FORMAT_R8, TEXTURE_FORMAT_R4, TEXTURE_FORMAT_R8G8B8A8 or TEXTURE_FORMAT_BC4.
+    With TEXTURE_FORMAT_BC4, characters are packed in blocks of 4 texels, so no BC4 block spans multiple characters.
+    Ignored with FLAG_MSDF, which always creates TEXTURE_FORMAT_R8G8B8A8, and with Atlas - see SFontAtlasDesc::TextureFormat.
+    Must be TEXTURE_FORMAT_R8 or TEXTURE_FORMAT_R8G8B8A8 with FLAG_DYNAMIC_ATLAS.
+    */
+    TEXTURE_FORMAT TextureFormat = TEXTURE_FORMAT_R8;
+    /*
+    Optional atlas shared with other fonts. If not null, characters of this font are packed into texture of the atlas
+    by CFontAtlas::Build, together with characters of other fonts. Until then, the font can be used only for measuring text.
+    FLAG_TEXTURE_*, Packing, MaxTextureSize, MaxTexturePageCount are then ignored - taken from SFontAtlasDesc instead.
+    Can't be used together with FLAG_DYNAMIC_ATLAS.
+    */
+    CFontAtlas* Atlas = nullptr;
+    /*
+    Optional. If not null, Init calls it after packing characters and writes the texture directly to the memory it returns,
+    without allocating own copy - then CFont::GetTextureData returns null, like after FreeTextureData.
+    All bytes of each row up to the row pitch GetTextureData would return are written, padding up to RowPitch is not touched.
+    Can't be used together with FLAG_DYNAMIC_ATLAS, Atlas or MipLevelCount greater than 1.
+    */
+    PFN_GET_TEXTURE_DESTINATION GetTextureDestination = nullptr;
+    void* GetTextureDestinationUserData = nullptr;
+    /*
+    Used only with FLAG_SDF or FLAG_MSDF. Distance from the edge of a character, in texels, at which the distance field saturates.
+    Each character is padded by this many texels on each side, which is included in SCharInfo::Offset and Size.
+    */
+    uint32_t SdfSpread = 4;
+    // Used only with FLAG_SDF or FLAG_MSDF. Characters are rasterized at Height * SdfSupersampling and their distance field downsampled to Height.
+    uint32_t SdfSupersampling = 4;
+    /*
+    Maximum number of threads used by CFont::Init and AddCharRanges, calling thread included, for rasterizing characters,
+    each with its own GDI font, calculating distance fields, copying characters to the texture and compressing it.
+    0 means number of hardware threads. The result doesn't depend on it.
+    */
+    uint32_t MaxThreadCount = 0;
 };
 
 // Main class that keeps texture and parameters of created font.
@@ -1212,8 +1546,30 @@ public:
         vec2 Offset;
         // Size of the quad to draw. Scaled to font size = 1.0.
         vec2 Size;
-        // Index to first entry in m_KerningEntries which has First equal to this character. SIZE_MAX if no kerning for this character.
+        // Index to first entry in m_KerningEntries which has First equal to this character. SIZE_MAX if there is none.
         size_t KerningEntryFirstIndex;
+        // Index of texture page that contains this character.
+        uint32_t TexturePage;
+        // Index of channel R, G, B, A = 0..3 that contains this character, with SFontAtlasDesc::FLAG_CHANNEL_PACKING. 0 otherwise.
+        uint32_t TextureChannel;
+    };
+
+    /*
+    Compact subset of SCharInfo used by text layout: measurement, line splitting, hit testing.
+    Kept in a separate table so that these loops touch 8 bytes per character instead of the whole SCharInfo.
+    */
+    struct SCharMetrics
+    {
+        // Step to next character. Scaled to font size = 1.0. Same as SCharInfo::Advance.
+        float Advance;
+        // Index to m_KerningBuckets describing kerning entries which have First equal to this character.
+        // 0 if there are none - bucket 0 is always empty and rejects everything.
+        uint16_t KerningBucket;
+        // Row of m_KerningClassMatrix used when this character is First.
+        // 0 if no kerning for this character, KERNING_CLASS_EXCEPTION if its pairs are only in the hash table.
+        uint8_t KerningLeftClass;
+        // Column of m_KerningClassMatrix used when this character is Second. Same special values as above.
+        uint8_t KerningRightClass;
     };
 
     struct SKerningEntry
@@ -1222,34 +1578,303 @@ public:
         // Scaled to font size = 1.0.
         float Amount;
     };
+    // Range of m_KerningEntries that have the same First character.
+    struct SKerningBucket
+    {
+        uint32_t FirstIndex;
+        uint32_t Count;
+        // Bit KerningBloomBit(Second) is set for every Second in this range.
+        uint32_t SecondBloom;
+    };
+
+    // Slot of the kerning hash table.
+    struct SKerningHashSlot
+    {
+        // (First << 16) | Second. 0 if slot is empty.
+        uint32_t Key;
+        float Amount;
+    };
+
+    /*
+    Font data in static arrays, as written by WriteBakedFont, to be passed to InitBaked.
+    Arrays are referenced by the font, not copied, so they must stay alive as long as it is used.
+    */
+    struct SBakedFont
+    {
+        float LineGap;
+        vec2 FillTexCoords;
+        uint32_t FillTexturePage;
+        // For every 256 characters, index of their page in CharInfoPages and CharMetricsPages.
+        const uint16_t* CharPageIndices;
+        // Pages of 256 characters each. Not modified by the font.
+        SCharInfo* CharInfoPages;
+        SCharMetrics* CharMetricsPages;
+        const SKerningBucket* KerningBuckets;
+        const int16_t* KerningClassMatrix;
+        uint32_t KerningRightClassCount;
+        float KerningClassScale;
+        // Null if there are no kerning pairs outside of the class matrix.
+        const SKerningHashSlot* KerningHash;
+        uint32_t KerningHashShift;
+        // Null unless KerningHashShift is 0, when pairs outside of the class matrix are searched here instead of KerningHash.
+        const SKerningEntry* KerningEntries;
+        // 256 elements.
+        const uint16_t* KerningSecondPages;
+        const uint32_t* KerningSecondBits;
+        // Texture data is not included, but its parameters are, for GetTextureFormat and GetTexturePageCount.
+        uvec2 TextureSize;
+        uint32_t TexturePageCount;
+        TEXTURE_FORMAT TextureFormat;
+        // Numbers of elements of KerningBuckets, KerningClassMatrix, KerningHash, KerningEntries, KerningSecondBits, for GetStatistics.
+        uint32_t KerningBucketCount, KerningClassMatrixSize, KerningHashSize, KerningEntryCount, KerningSecondBitsCount;
+        // Number of kerning pairs not covered by KerningClassMatrix, for GetStatistics.
+        uint32_t KerningExceptionCount;
+    };
 
     // Returns true if given set of CFont::FLAG_* flags is valid.
     static bool ValidateFlags(uint32_t flags);
 
     CFont();
     ~CFont();
+    /*
+    If it fails before metrics are ready, see AreMetricsReady, the font is left empty, with no characters and kerning.
+    If it fails later, e.g. with INIT_RESULT_TEXTURE_TOO_SMALL, metrics and kerning stay, but there is no texture.
+    */
     bool Init(const SFontDesc& desc);
 
-    const SCharInfo& GetCharInfo(wchar_t ch) const { return m_CharInfo[ch]; }
+    // Result of the last call to Init, telling why it failed.
+    enum INIT_RESULT
+    {
+        INIT_RESULT_SUCCESS,
+        // Creating font or rendering characters using GDI failed.
+        INIT_RESULT_GDI_ERROR,
+        // Character '?' or '-' is missing from CharRanges or from the font.
+        INIT_RESULT_MISSING_REQUIRED_CHARACTER,
+        // A single character doesn't fit in SFontDesc::MaxTextureSize.
+        INIT_RESULT_CHARACTER_TOO_LARGE,
+        // All characters don't fit in texture of SFontDesc::MaxTextureSize.
+        INIT_RESULT_TEXTURE_TOO_SMALL,
+        // SFontDesc::GetTextureDestination returned false.
+        INIT_RESULT_NO_TEXTURE_DESTINATION,
+        // CancelInit was called.
+        INIT_RESULT_CANCELED,
+    };
+    INIT_RESULT GetInitResult() const { return m_InitResult; }
+
+    /*
+    Like Init, but creates the font on a background thread and returns immediately. desc is copied, including FaceName and CharRanges.
+    Returned future becomes ready with the value Init would return when the font is finished, so it can be waited for,
+    or polled using wait_for(std::chrono::seconds(0)). SFontDesc::GetTextureDestination is called on the background thread.
+    Until then, only methods below can be called and, once AreMetricsReady returns true, methods that measure text:
+    CalcSingleLineTextWidth, LineSplit, CalcTextExtent, CalcSingleLineQuadCount, CalcQuadCount, HitTestSingleLine, HitTest,
+    GetCharMetrics, GetCharWidth_, GetKerning, GetLineGap. With SFontDesc::Atlas, call CFontAtlas::Build only after it is finished.
+    */
+    std::shared_future<bool> InitAsync(const SFontDesc& desc);
+    /*
+    Returns true when metrics and kerning of all characters are final, so text can be measured,
+    even if InitAsync is still creating the texture. Stays true if creation fails or is canceled after that point.
+    */
+    bool AreMetricsReady() const { return m_MetricsReady; }
+    // Number of characters rasterized so far by Init, InitAsync or AddCharRanges, out of outCharCount, which is 0 until it is known.
+    void GetInitProgress(uint32_t& outRasterizedCharCount, uint32_t& outCharCount) const;
+    /*
+    Makes InitAsync stop as soon as possible and fail with INIT_RESULT_CANCELED. Does nothing if it's already finished.
+    Called from another thread during AddCharRanges, makes it return false, leaving the font unchanged.
+    */
+    void CancelInit() { m_InitCanceled = true; }
+
+    const SCharInfo& GetCharInfo(wchar_t ch) const { return m_CharInfoPages[ch >> CHAR_PAGE_SHIFT][ch & CHAR_PAGE_MASK]; }
+    const SCharMetrics& GetCharMetrics(wchar_t ch) const { return m_CharMetricsPages[ch >> CHAR_PAGE_SHIFT][ch & CHAR_PAGE_MASK]; }
     // Get texture coordinates of the place on the texture that is surely filled, so it can be used to draw filled rectangle using font texture.
     const vec2& GetFillTexCoords() const { return m_FillTexCoords; }
+    // Index of texture page that GetFillTexCoords refer to.
+    uint32_t GetFillTexturePage() const { return m_FillTexturePage; }
 
     float GetLineGap() const { return m_LineGap; }
     float GetLineGap(float fontSize) const { return m_LineGap * fontSize; }
     // Additional '_' is used because stupid Windows.h defines "GetCharWidth" as macro :(
-    float GetCharWidth_(wchar_t ch) const { return m_CharInfo[(int)ch].Advance; }
-    float GetCharWidth_(wchar_t ch, float fontSize) const { return m_CharInfo[(int)ch].Advance * fontSize; }
-    float GetKerning(wchar_t firstCh, wchar_t secondCh) const;
+    float GetCharWidth_(wchar_t ch) const { return GetCharMetrics(ch).Advance; }
+    float GetCharWidth_(wchar_t ch, float fontSize) const { return GetCharMetrics(ch).Advance * fontSize; }
+    inline float GetKerning(wchar_t firstCh, wchar_t secondCh) const;
     float GetKerning(wchar_t firstCh, wchar_t secondCh, float fontSize) const { return GetKerning(firstCh, secondCh) * fontSize; }
 
+    // Counters of kerning lookups, filled only if WIN_FONT_RENDER_KERNING_STATISTICS is 1.
+    struct SKerningStatistics
+    {
+        // Total number of calls to GetKerning.
+        uint64_t LookupCount;
+        // Lookups rejected because second character doesn't appear as Second in any kerning pair.
+        uint64_t RejectedBySecondCount;
+        // Lookups resolved by the class matrix.
+        uint64_t ClassMatrixCount;
+        // Lookups rejected because first character doesn't appear as First in any kerning pair.
+        uint64_t RejectedByFirstCount;
+        // Lookups rejected by bloom bits of the first character.
+        uint64_t RejectedByBloomCount;
+        // Lookups that reached the hash table and found a pair.
+        uint64_t HashHitCount;
+        // Lookups that reached the hash table and didn't find a pair.
+        uint64_t HashMissCount;
+    };
+    void GetKerningStatistics(SKerningStatistics& outStats) const;
+    void ResetKerningStatistics();
+
     /* Returns pointer and parameters of internal buffer with texture data.
     Pixels are row-major, from top to bottom, from left to right.
-    Each pixel is single byte 0..255.
+    Each pixel is single byte 0..255, or other format chosen by SFontDesc::TextureFormat or required by SFontDesc::FLAG_MSDF - see GetTextureFormat.
     outRowPitch is step between rows, in bytes.
+    If there are multiple texture pages, they follow each other, each taking outSize.y * outRowPitch bytes.
+    With TEXTURE_FORMAT_BC4, outRowPitch is step between rows of blocks, and each page takes outSize.y / 4 * outRowPitch bytes.
     */
     void GetTextureData(const void*& outData, uvec2& outSize, size_t& outRowPitch) const;
+    // Like above, for given mip level, 0 being the full resolution. Level must be less than GetMipLevelCount.
+    void GetTextureData(uint32_t level, const void*& outData, uvec2& outSize, size_t& outRowPitch) const;
+    // Number of mip levels, always 1 unless SFontDesc::MipLevelCount was greater than 1.
+    uint32_t GetMipLevelCount() const { return 1 + (uint32_t)m_TextureMipLevels.size(); }
+    // Number of texture pages, always 1 unless SFontDesc::MaxTexturePageCount was greater than 1.
+    uint32_t GetTexturePageCount() const { return m_TexturePageCount; }
+    TEXTURE_FORMAT GetTextureFormat() const { return m_TextureFormat; }
+    // Don't call it with SFontDesc::FLAG_DYNAMIC_ATLAS.
     void FreeTextureData();
 
+    /*
+    Writes the font to binary data, e.g. to be saved in a file, so it can be recreated by Load much faster than by Init.
+    Contains metrics and kerning of all characters and the texture with all mip levels.
+    desc must be the one passed to Init. Returns false if the font doesn't own its texture data:
+    with SFontDesc::FLAG_DYNAMIC_ATLAS, Atlas or GetTextureDestination, or after FreeTextureData.
+    */
+    bool Save(std::vector<uint8_t>& outData, const SFontDesc& desc) const;
+    /*
+    Recreates the font from data written by Save, instead of Init. Doesn't use GDI.
+    data can point e.g. to a memory-mapped file. It is not referenced after the call.
+    desc must be equal to the one passed to Save, except SFontDesc::GetTextureDestination - if set, the texture is copied there.
+    Returns false, leaving the font unchanged, if data is damaged, was written by a different version of this library
+    or with different desc. Call Init then. Changes of the font installed in the system are not detected.
+    */
+    bool Load(const void* data, size_t dataSize, const SFontDesc& desc);
+    // Returns true if data has valid header and checksum of data written by Save. Optionally returns CalcDescHash of its desc.
+    static bool ValidateCache(const void* data, size_t dataSize, uint64_t* outDescHash = nullptr);
+    // Hash of members of desc that affect the result of Init, stored in data written by Save.
+    static uint64_t CalcDescHash(const SFontDesc& desc);
+    /*
+    Writes C++ code of a header that defines the font in static arrays: SBakedFont in namespace of given name,
+    together with the texture to upload. It can be used in a tool run at build time, for fonts that never change.
+    Returns false for fonts that don't own their texture data, like Save.
+    */
+    bool WriteBakedFont(std::string& outCode, const char* name) const;
+    /*
+    Makes the font use arrays of a baked font written by WriteBakedFont, instead of Init.
+    It doesn't use GDI, allocate any memory or copy the arrays, so the font can be used for text layout
+    and generating vertices right away. GetTextureData returns null, like after FreeTextureData.
+    */
+    void InitBaked(const SBakedFont& baked);
+
+    // Region of texture data modified since last call to GetDirtyRects.
+    struct SDirtyRect
+    {
+        // Pointer to the left top texel of the region inside texture data returned by GetTextureData.
+        const void* Data;
+        size_t RowPitch;
+        uint32_t TexturePage;
+        // Left top corner and size of the region, in texels.
+        uvec2 Pos;
+        uvec2 Size;
+    };
+    /*
+    Returns list of regions of the texture modified since last call, so only them can be uploaded, and clears the list.
+    Only mip level 0 is reported.
+    After Init, whole texture is dirty. Then, with SFontDesc::FLAG_DYNAMIC_ATLAS, cells of characters added by CacheText,
+    or regions changed by AddCharRanges.
+    Regions don't overlap with each other.
+    */
+    void GetDirtyRects(std::vector<SDirtyRect>& outRects);
+
+    /*
+    Adds characters of given ranges to the font, with their kerning, rasterizing only those not requested before.
+    charRanges has 2 elements per range, inclusive both sides, like SFontDesc::CharRanges.
+    New characters are packed into free space of the texture, so texture coordinates of existing characters don't change.
+    If they don't fit, new texture pages are added, up to SFontDesc::MaxTexturePageCount, and then the texture grows in height
+    and width, up to SFontDesc::MaxTextureSize. Only then texture coordinates of all characters change, which is returned as outTexCoordsChanged.
+    Modified regions of the texture are returned by GetDirtyRects - the whole texture if its size changed.
+    Only for fonts created by Init that own their texture data, without SFontDesc::FLAG_DYNAMIC_ATLAS, Atlas,
+    GetTextureDestination, MipLevelCount greater than 1 or TEXTURE_FORMAT_BC4.
+    Returns false, leaving the font unchanged, for other fonts, if GDI fails, if the characters don't fit, or after CancelInit.
+    */
+    bool AddCharRanges(const wchar_t* charRanges, size_t charRangeCount, bool* outTexCoordsChanged = nullptr);
+
+    /*
+    Only with SFontDesc::FLAG_DYNAMIC_ATLAS.
+    Makes sure all characters of given text are in the texture, rasterizing missing ones,
+    and marks them as used in current frame, so they won't be evicted until next NewFrame.
+    Call it for every text before measuring it or generating its vertices in a frame.
+    Characters not cached are treated like '?'. Control characters are skipped.
+    Returns false if some characters didn't fit because the texture is full of characters used in current frame.
+    */
+    bool CacheText(const wstr_view& text);
+    // Only with SFontDesc::FLAG_DYNAMIC_ATLAS. Starts new frame. Characters used so far become candidates for eviction.
+    void NewFrame();
+    // Only with SFontDesc::FLAG_DYNAMIC_ATLAS. Returns characters added to the texture by CacheText since last NewFrame.
+    // If not empty, texture data changed and needs to be uploaded again.
+    void GetAddedChars(const wchar_t*& outChars, size_t& outCount) const;
+
+    // Statistics about memory used by the font object and its creation, for diagnostic purposes.
+    struct SStatistics
+    {
+        // Number of allocated pages of 256 characters each, including the shared fallback page.
+        size_t CharInfoPageCount;
+        // Bytes used by the page directories and the pages of SCharInfo and SCharMetrics.
+        size_t CharInfoBytes;
+        // Bytes used by kerning data. After InitBaked, size of kerning arrays of SBakedFont.
+        size_t KerningBytes;
+        // Number of rows and columns of the kerning class matrix, including class 0.
+        uint32_t KerningLeftClassCount, KerningRightClassCount;
+        // Bytes used by the kerning class matrix.
+        size_t KerningClassMatrixBytes;
+        // Number of kerning pairs not covered by the class matrix, looked up in the hash table instead.
+        size_t KerningExceptionCount;
+        // Bytes used by texture data, including mip levels. 0 after FreeTextureData.
+        size_t TextureBytes;
+        // Sum of areas of all characters packed into the texture, in texels, without margins.
+        size_t AtlasUsedTexels;
+        // Area of the whole texture, in texels, summed over all texture pages. AtlasUsedTexels / AtlasTotalTexels is efficiency of the packing.
+        size_t AtlasTotalTexels;
+        // Time spent rasterizing characters using GDI during Init, in seconds, and number of threads that did it.
+        float RasterizationTime;
+        uint32_t RasterizationThreadCount;
+        // Time spent packing characters into the texture during Init, in seconds.
+        float PackingTime;
+        // Time spent copying characters into the texture during Init, converting them to texture format, in seconds.
+        float CompositionTime;
+        /*
+        Only with SFontDesc::FLAG_SDF or FLAG_MSDF: number of characters whose distance field was calculated during Init and time it took, in seconds.
+        With FLAG_LOW_PEAK_MEMORY, distance fields are calculated while composing, so SdfTime is their time summed over threads
+        divided by number of threads, a part of CompositionTime.
+        */
+        uint32_t SdfCharCount;
+        float SdfTime;
+        /*
+        Only with TEXTURE_FORMAT_BC4: time spent compressing all mip levels during Init, in seconds,
+        and peak signal-to-noise ratio of level 0 compared to uncompressed data, in dB. INFINITY if no information was lost.
+        */
+        float CompressionTime;
+        float CompressionPsnr;
+        // Total time of last successful Init, in seconds, including the stages above, kerning and everything else.
+        float InitTime;
+        /*
+        Largest amount of memory allocated at the same time during last Init for bitmaps of characters, distance fields,
+        texture data including mip levels and temporary copies of them, in bytes. Smaller allocations are not included.
+        Texture written to SFontDesc::GetTextureDestination is not included. See SFontDesc::FLAG_LOW_PEAK_MEMORY.
+        */
+        size_t InitPeakBytes;
+        // Only with SFontDesc::FLAG_DYNAMIC_ATLAS: number of cells in the texture and cells occupied by characters.
+        uint32_t DynamicCellCount, DynamicUsedCellCount;
+        // Only with SFontDesc::FLAG_DYNAMIC_ATLAS: characters added by CacheText and evicted to make space for them, since Init.
+        uint64_t DynamicAddedCharCount, DynamicEvictedCharCount;
+        // Sum of all the above plus remaining members of CFont.
+        size_t TotalBytes;
+    };
+    void GetStatistics(SStatistics& outStats) const;
+
     float CalcSingleLineTextWidth(const wstr_view& text, float fontSize) const;
     /*
     Split text into lines. Call iteratively to get subsequent lines of text.
@@ -1270,6 +1895,9 @@ public:
     size_t CalcSingleLineQuadCount(const wstr_view& text, uint32_t flags) const;
     // Calculates number of quads needed to draw given text.
     size_t CalcQuadCount(const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const;
+    // Calculates number of quads of each texture page needed to draw given text.
+    // outQuadCounts must point to array of GetTexturePageCount() elements.
+    void CalcTexturePageQuadCounts(size_t* outQuadCounts, const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const;
     // Returns index of character, and percent of its width, of a single line text hit by point hitX.
     // Returns false if hitX is out of range of the text and hit cannot be found.
     // outPercent is optional. Pass null if you don't need this information.
@@ -1287,26 +1915,429 @@ public:
         const SVertexBufferDesc& vbDesc, const vec4& positions) const;
     template<uint32_t vbFlags> void GetSingleLineTextVertices(
         const SVertexBufferDesc& vbDesc, const vec2& pos, const wstr_view& text, float fontSize) const;
+    // With multiple texture pages, quads are ordered by texture page,
+    // so quads of each page are contiguous and can be drawn as a separate batch, see CalcTexturePageQuadCounts.
     template<uint32_t vbFlags> void GetTextVertices(
         const SVertexBufferDesc& vbDesc, const vec2& pos, const wstr_view& text, float fontSize, uint32_t fontFlags, float textWidth) const;
 
 private:
     static const size_t CHAR_COUNT = 0x10000;
-    // Information about all characters.
-    SCharInfo m_CharInfo[CHAR_COUNT];
-    // Sorted by first, then second, ascending.
+    static const size_t CHAR_PAGE_SHIFT = 8;
+    static const size_t CHAR_PAGE_SIZE = 1 << CHAR_PAGE_SHIFT;
+    static const size_t CHAR_PAGE_MASK = CHAR_PAGE_SIZE - 1;
+    static const size_t CHAR_PAGE_COUNT = CHAR_COUNT / CHAR_PAGE_SIZE;
+
+    /*
+    Information about all characters, as a two-level table indexed by high and low byte of the character.
+    Pages that contain no requested characters point to a single shared fallback page filled with '?'.
+    Before successful Init, all point to a static page of zeros, see ResetCharPages.
+    */
+    SCharInfo* m_CharInfoPages[CHAR_PAGE_COUNT];
+    // Same layout as m_CharInfoPages, but with layout-only data.
+    SCharMetrics* m_CharMetricsPages[CHAR_PAGE_COUNT];
+    // Own all pages pointed by m_CharInfoPages, m_CharMetricsPages. Element 0 is the fallback page.
+    std::vector<std::unique_ptr<SCharInfo[]>> m_CharInfoPageStorage;
+    std::vector<std::unique_ptr<SCharMetrics[]>> m_CharMetricsPageStorage;
+
+    // Every key can be found within this number of slots from its hashed position.
+    static const uint32_t KERNING_HASH_MAX_PROBE = 4;
+    // Largest hash table tried has 2^KERNING_HASH_MAX_SIZE_LOG2 slots.
+    static const uint32_t KERNING_HASH_MAX_SIZE_LOG2 = 20;
+    // Kerning class of characters whose pairs are not in m_KerningClassMatrix.
+    static const uint8_t KERNING_CLASS_EXCEPTION = UINT8_MAX;
+
+    /*
+    Sorted by first, then second, ascending.
+    Once kerning is built, only pairs not covered by m_KerningClassMatrix, which are also in m_KerningHash.
+    All pairs only if m_KerningHashShift is 0, as they are then searched here.
+    */
     std::vector<SKerningEntry> m_KerningEntries;
+    // Element 0 is always empty, for characters with no kerning.
+    std::vector<SKerningBucket> m_KerningBuckets;
+    /*
+    Kerning amounts of pairs of classes, in pixels, to be multiplied by m_KerningClassScale.
+    Row = SCharMetrics::KerningLeftClass of First, column = SCharMetrics::KerningRightClass of Second.
+    Characters with identical kerning against all other characters share a class, like in OpenType class-pair kerning.
+    Row 0 and column 0 are all zeros.
+    */
+    std::vector<int16_t> m_KerningClassMatrix;
+    uint32_t m_KerningRightClassCount = 1;
+    float m_KerningClassScale = 0.f;
+    /*
+    Open addressing hash table of m_KerningEntries that are not covered by m_KerningClassMatrix, with linear probing.
+    Has power of 2 slots + additional (KERNING_HASH_MAX_PROBE - 1) slots at the end, so probing never needs to wrap around.
+    If no table of up to 2^KERNING_HASH_MAX_SIZE_LOG2 slots fits all keys within KERNING_HASH_MAX_PROBE,
+    it is empty and m_KerningHashShift is 0. These pairs are then found by binary search in m_KerningEntries.
+    */
+    std::vector<SKerningHashSlot> m_KerningHash;
+    uint32_t m_KerningHashShift = 32;
+
+    /*
+    Bitset of characters that appear as Second in any kerning pair, as a two-level table.
+    For every page of 256 characters, index of 8 subsequent uint32_t in m_KerningSecondBits.
+    Index 0 is a page of zeros shared by all pages with no such characters.
+    */
+    uint16_t m_KerningSecondPages[CHAR_PAGE_COUNT] = {};
+    std::vector<uint32_t> m_KerningSecondBits;
+
+    // Data of m_KerningEntries, m_KerningBuckets, m_KerningClassMatrix, m_KerningHash, m_KerningSecondBits used by lookups,
+    // or arrays of SBakedFont given to InitBaked.
+    const SKerningEntry* m_KerningEntryData = nullptr;
+    const SKerningBucket* m_KerningBucketData = nullptr;
+    const int16_t* m_KerningClassMatrixData = nullptr;
+    const SKerningHashSlot* m_KerningHashData = nullptr;
+    const uint32_t* m_KerningSecondBitsData = nullptr;
+    // Only after InitBaked, when the vectors above are empty: bytes of kerning arrays of SBakedFont and counts from it, for GetStatistics.
+    size_t m_BakedKerningBytes = 0;
+    size_t m_BakedKerningClassMatrixSize = 0;
+    size_t m_BakedKerningExceptionCount = 0;
+
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+    struct SKerningCounters
+    {
+        std::atomic<uint64_t> Lookup, RejectedBySecond, ClassMatrix, RejectedByFirst, RejectedByBloom, HashHit, HashMiss;
+    };
+    mutable SKerningCounters m_KerningCounters = {};
+#endif
     // Texture coordinates for drawing filled rectangle.
     vec2 m_FillTexCoords = VEC2_ZERO;
+    uint32_t m_FillTexturePage = 0;
     float m_LineGap = 0.f;
 
-    uvec2 m_TextureSize;
-    size_t m_TextureRowPitch;
+    uvec2 m_TextureSize = UVEC2_ZERO;
+    size_t m_TextureRowPitch = 0;
+    uint32_t m_TexturePageCount = 0;
+    TEXTURE_FORMAT m_TextureFormat = TEXTURE_FORMAT_R8;
     std::vector<uint8_t> m_TextureData;
+    // Levels 1 and further, each in the same layout as m_TextureData.
+    std::vector<std::vector<uint8_t>> m_TextureMipLevels;
+    size_t m_AtlasUsedTexels = 0;
+    float m_RasterizationTime = 0.f;
+    uint32_t m_RasterizationThreadCount = 0;
+    float m_PackingTime = 0.f;
+    uint32_t m_SdfCharCount = 0;
+    float m_SdfTime = 0.f;
+    float m_CompositionTime = 0.f;
+    float m_CompressionTime = 0.f;
+    float m_CompressionPsnr = 0.f;
+    float m_InitTime = 0.f;
+    size_t m_InitPeakBytes = 0;
+    INIT_RESULT m_InitResult = INIT_RESULT_SUCCESS;
+
+    // Running or finished InitAsync. Invalid if there was none.
+    std::shared_future<bool> m_InitFuture;
+    std::atomic<bool> m_InitCanceled = {false};
+    std::atomic<bool> m_MetricsReady = {false};
+    std::atomic<uint32_t> m_InitRasterizedCharCount = {0};
+    std::atomic<uint32_t> m_InitCharCount = {0};
+
+    // Like SDirtyRect, without pointer. xy = left top, zw = right bottom.
+    struct SDirtyRegion
+    {
+        uint32_t TexturePage;
+        uvec4 Rect;
+    };
+    // Above this number of regions, regions of the same page are merged into one.
+    static const size_t DIRTY_REGION_MAX_COUNT = 64;
+    std::vector<SDirtyRegion> m_DirtyRegions;
+
+    // Cell of the texture in SFontDesc::FLAG_DYNAMIC_ATLAS mode, able to hold any character.
+    struct SDynamicCell
+    {
+        // 0 if cell is free.
+        wchar_t Char;
+        // UINT32_MAX for cells of '?' and '-', which are never evicted.
+        uint32_t LastUsedFrame;
+        // Neighbors on the LRU list, most recently used first. UINT32_MAX at the ends of the list.
+        uint32_t Prev, Next;
+    };
+    // Values of SDynamicAtlas::CharCells other than cell index.
+    static const uint32_t DYNAMIC_CHAR_UNKNOWN = UINT32_MAX; // Not rasterized yet.
+    static const uint32_t DYNAMIC_CHAR_MISSING = UINT32_MAX - 1; // Missing in the font or larger than cell. Treated like '?'.
+    static const uint32_t DYNAMIC_CHAR_NO_SPRITE = UINT32_MAX - 2; // Has no pixels, like ' ', so needs no cell.
+    // State of SFontDesc::FLAG_DYNAMIC_ATLAS mode. GDI objects are kept alive to rasterize characters on demand.
+    struct SDynamicAtlas
+    {
+        HDC DC;
+        HBITMAP DummyBitmap;
+        HFONT Font;
+        HGDIOBJ OldBitmap, OldFont;
+        int FontSize;
+        LONG Ascent;
+        bool TextureFromLeftBottom;
+        uvec2 CellSize;
+        uint32_t CellCountX;
+        std::vector<SDynamicCell> Cells;
+        uint32_t LruFirst, LruLast;
+        // For each character: index of its cell or DYNAMIC_CHAR_*.
+        std::vector<uint32_t> CharCells;
+        std::vector<wchar_t> AddedChars;
+        uint32_t Frame;
+        uint64_t AddedCharCount, EvictedCharCount;
+        // Temporary buffer for glyph bitmap.
+        std::vector<uint8_t> GlyphData;
+    };
+    std::unique_ptr<SDynamicAtlas> m_Dynamic;
 
+    // Character rasterized by GDI in Init or AddCharRanges.
+    struct SRasterizedGlyph
+    {
+        wchar_t Char;
+        GLYPHMETRICS Metrics;
+        // False if GDI doesn't know the character.
+        bool Exists;
+        // In glyph data, with rows aligned to 4 bytes. DataSize is 0 if the character has no pixels.
+        size_t DataOffset;
+        size_t DataSize;
+        uvec2 BlackBoxSize;
+        ivec2 GlyphOrigin;
+
+        bool HasSprite() const { return DataSize && BlackBoxSize.x && BlackBoxSize.y; }
+    };
+    // Place of a character in the texture, in texels.
+    struct SPackedGlyph
+    {
+        wchar_t Char;
+        uint32_t TexturePage;
+        uvec2 Pos;
+        uvec2 Size;
+    };
+    // State kept after Init for AddCharRanges, only for fonts it supports.
+    struct SAddCharsState
+    {
+        // FaceName points to the copy below. CharRanges is null.
+        SFontDesc Desc;
+        std::wstring FaceName;
+        LONG Ascent;
+        // Sorted ascending. Existing are the requested ones that GDI knows.
+        std::vector<uint16_t> RequestedChars;
+        std::vector<uint16_t> ExistingChars;
+        std::vector<SPackedGlyph> PackedGlyphs;
+    };
+    std::unique_ptr<SAddCharsState> m_AddChars;
+    // SFontDesc::Atlas of last Init, until CFontAtlas::Build. Characters of the font, sorted ascending, for SetAtlasTexCoords.
+    CFontAtlas* m_Atlas = nullptr;
+    std::vector<uint16_t> m_AtlasExistingChars;
+
+    template<uint32_t vbFlags> void PostTextQuads(CQuadVertexWriter<vbFlags>& writer,
+        const vec2& pos, const wstr_view& text, float fontSize, uint32_t fontFlags, float textWidth) const;
+    // Body of Init, also called by InitAsync on the background thread.
+    bool InitInternal(const SFontDesc& desc);
+    // Waits for InitAsync, if any, as it writes to the same members.
+    void WaitInitAsync();
+    /*
+    Rasterizes given characters on multiple threads, one of them using dc with the font already selected.
+    outGlyphs receives them in the same order, with their bitmaps following each other in outGlyphData in that order too.
+    With measureOnly, only sizes of the bitmaps are queried, DataOffset is 0 and outGlyphData stays empty.
+    inoutPeakBytes is raised to the memory used, as described in SStatistics::InitPeakBytes.
+    */
+    bool RasterizeGlyphs(std::vector<SRasterizedGlyph>& outGlyphs, std::vector<uint8_t>& outGlyphData, uint32_t& outThreadCount,
+        HDC dc, const SFontDesc& desc, int gdiHeight, UINT glyphDataFormat, const uint16_t* chars, size_t charCount,
+        bool measureOnly, size_t& inoutPeakBytes);
+    // Replaces data of glyphs that have pixels with their distance field, downsampled by sdfScale and padded. Returns number of such glyphs.
+    uint32_t CalcGlyphDistanceFields(std::vector<SRasterizedGlyph>& glyphs, std::vector<uint8_t>& glyphData,
+        bool msdf, uint32_t sdfScale, uint32_t sdfSpread, uint32_t maxThreadCount, size_t& inoutPeakBytes);
+    /*
+    Second pass of SFontDesc::FLAG_LOW_PEAK_MEMORY. Rasterizes characters of glyphs measured by RasterizeGlyphs with measureOnly,
+    given by indices to it in sprite order, and composes them right into the texture at spritePositions, spritePages.
+    With distance field, it is calculated from each bitmap or outline on the way, and outSdfTime receives time it took,
+    summed over threads and divided by their number. otherBytes is memory allocated by the caller.
+    */
+    bool StreamGlyphs(const std::vector<SRasterizedGlyph>& glyphs, const std::vector<uint32_t>& sortIndex,
+        const std::vector<uvec2>& spritePositions, const std::vector<uint32_t>& spritePages,
+        uint8_t* dstData, size_t dstRowPitch, size_t dstPageBytes, TEXTURE_FORMAT dstFormat,
+        const SFontDesc& desc, int gdiHeight, uint32_t sdfScale, size_t otherBytes, size_t& inoutPeakBytes, float& outSdfTime);
+    // Fills SCharInfo and SCharMetrics of a rasterized character, except texture coordinates and kerning. sdfPadding is 0 without distance field.
+    void SetRasterizedCharInfo(const SRasterizedGlyph& glyph, LONG ascent, float fontSizeInv, uint32_t sdfPadding, uint32_t sdfScale);
+    // Copies '?' to characters on own pages that don't exist in the font, except their kerning. existingChars must be sorted.
+    void FillMissingCharMetrics(const std::vector<uint16_t>& existingChars);
+    void FillMissingCharInfo(const std::vector<uint16_t>& existingChars);
+    // Frees all pages of character information and points m_CharInfoPages, m_CharMetricsPages to a static page of zeros.
+    void ResetCharPages();
+    // Makes kerning empty, with GetKerning returning 0 for all pairs.
+    void ResetKerning();
+    // Makes sure character has its own pages in m_CharInfoPages, m_CharMetricsPages, not the fallback page.
+    void EnsureCharPage(wchar_t ch);
+    void InitDynamicCells(const uint16_t* chars, size_t charCount);
+    // Returns false if there is no free cell nor cell that can be evicted.
+    bool CacheChar(wchar_t ch);
+    void EvictDynamicCell(uint32_t cellIndex);
+    void TouchDynamicCell(uint32_t cellIndex);
+    uvec2 GetDynamicCellPos(uint32_t cellIndex) const;
+    void ReleaseDynamicAtlas();
+    // Removes the font from m_Atlas, so its next CFontAtlas::Build doesn't pack characters of the previous Init.
+    void RemoveFromAtlas();
+    void AddDirtyRect(uint32_t texturePage, const uvec2& pos, const uvec2& size);
+    friend class CFontAtlas;
+    // Called by CFontAtlas::Build after packing characters of this font, given as range of its glyphs.
+    void SetAtlasTexCoords(const CFontAtlas& atlas, size_t firstGlyphIndex, size_t glyphCount);
+
+    SCharInfo& AccessCharInfo(wchar_t ch) { return m_CharInfoPages[ch >> CHAR_PAGE_SHIFT][ch & CHAR_PAGE_MASK]; }
+    SCharMetrics& AccessCharMetrics(wchar_t ch) { return m_CharMetricsPages[ch >> CHAR_PAGE_SHIFT][ch & CHAR_PAGE_MASK]; }
+    bool IsKerningSecond(wchar_t ch) const
+    {
+        const size_t lowBits = ch & CHAR_PAGE_MASK;
+        return (m_KerningSecondBitsData[m_KerningSecondPages[ch >> CHAR_PAGE_SHIFT] * (CHAR_PAGE_SIZE / 32) + (lowBits >> 5)] >> (lowBits & 31)) & 1;
+    }
+    static uint32_t KerningBloomBit(wchar_t ch) { return 1u << (((uint32_t)ch * 0x9E3779B9u) >> 27); }
+    // Slow path of GetKerning, called when second character appears in some kerning pair.
+    float FindKerning(wchar_t firstCh, wchar_t secondCh) const;
+    // Builds all kerning data from pairs of the font selected in dc: those of existingChars, which must be sorted, or all with dynamic.
+    void BuildKerning(HDC dc, const std::vector<uint16_t>& existingChars, float fontSizeInv, float fontSize, bool dynamic);
     void SortKerningEntries();
+    void BuildKerningClasses(float fontSize);
+    bool IsKerningException(const SKerningEntry& entry) const;
+    void BuildKerningHash();
+    // Leaves in m_KerningEntries and m_KerningBuckets only pairs not covered by m_KerningClassMatrix, after the hash table is built.
+    void RemoveClassMatrixKerningEntries();
+    // Points m_Kerning*Data to own vectors, after they are built.
+    void UseOwnKerningData();
+    void BuildKerningFilters();
+};
+
+// Describes parameters of CFontAtlas.
+struct SFontAtlasDesc
+{
+    enum FLAGS
+    {
+        /*
+        Fonts are stored in separate channels R, G, B, A of the texture, which must be TEXTURE_FORMAT_R8G8B8A8,
+        so up to 4 fonts take the space of one. Font number i in order of CFont::Init calls uses channel i % 4,
+        and characters of fonts sharing a channel are packed together. See CFont::SCharInfo::TextureChannel.
+        Can't be used with fonts with SFontDesc::FLAG_MSDF.
+        */
+        FLAG_CHANNEL_PACKING = 0x10000,
+    };
+
+    // Use SFontDesc::FLAG_TEXTURE_* and FLAG_* bitflags.
+    uint32_t Flags = 0;
+    SFontDesc::PACKING Packing = SFontDesc::PACKING_SHELF;
+    // Like SFontDesc::MaxTextureSize. If 0, texture width is 8 * largest SFontDesc::Height.
+    uint32_t MaxTextureSize = 0;
+    // Like SFontDesc::MaxTexturePageCount.
+    uint32_t MaxTexturePageCount = 1;
+    /*
+    Format of texture data: TEXTURE_FORMAT_R8, TEXTURE_FORMAT_R4 or TEXTURE_FORMAT_R8G8B8A8.
+    Ignored when fonts use SFontDesc::FLAG_MSDF, which always creates TEXTURE_FORMAT_R8G8B8A8.
+    */
+    TEXTURE_FORMAT TextureFormat = TEXTURE_FORMAT_R8;
+    // Like SFontDesc::GetTextureDestination, called by Build.
+    PFN_GET_TEXTURE_DESTINATION GetTextureDestination = nullptr;
+    void* GetTextureDestinationUserData = nullptr;
+};
+
+/*
+Texture shared by multiple fonts, so text of all of them can be drawn with a single texture.
+Usage: call Init, then CFont::Init of each font with SFontDesc::Atlas pointing to this object, then Build.
+Fonts must remain alive until Build. Characters of all fonts are packed together.
+Initializing a font again or destroying it before Build removes it from the atlas.
+*/
+class CFontAtlas
+{
+public:
+    CFontAtlas();
+    ~CFontAtlas();
+    // Starts new atlas, forgetting fonts and texture of previous one.
+    void Init(const SFontAtlasDesc& desc);
+    // Packs characters of all fonts initialized with this atlas and creates the texture.
+    // On failure, GetBuildResult tells why.
+    bool Build();
+    CFont::INIT_RESULT GetBuildResult() const { return m_BuildResult; }
+
+    // Like CFont::GetTextureData.
+    void GetTextureData(const void*& outData, uvec2& outSize, size_t& outRowPitch) const;
+    uint32_t GetTexturePageCount() const { return m_TexturePageCount; }
+    // Format of texture data. All fonts of the atlas must have the same one.
+    TEXTURE_FORMAT GetTextureFormat() const { return m_TextureFormat; }
+    void FreeTextureData();
+
+    struct SStatistics
+    {
+        // Number of fonts and characters packed by last Build.
+        size_t FontCount;
+        size_t CharCount;
+        // Sum of areas of all characters, in texels, without margins.
+        size_t AtlasUsedTexels;
+        // Area of the whole texture, in texels, summed over all texture pages, and over channels with FLAG_CHANNEL_PACKING.
+        size_t AtlasTotalTexels;
+        /*
+        Sum of areas of textures that the fonts would have if each was packed separately with the same parameters.
+        Calculated by packing each font again, so it takes some time.
+        SIZE_MAX if some of the fonts wouldn't fit.
+        */
+        size_t SeparateTotalTexels;
+        // Time spent packing characters in Build, in seconds.
+        float PackingTime;
+        // Time spent copying characters into the texture in Build, in seconds.
+        float CompositionTime;
+    };
+    void GetStatistics(SStatistics& outStats) const;
+
+private:
+    friend class CFont;
+
+    struct SGlyph
+    {
+        wchar_t Char;
+        uvec2 Size;
+        size_t DataOffset;
+        uvec2 TexturePos;
+        uint32_t TexturePage;
+        uint32_t TextureChannel;
+    };
+    struct SFontRange
+    {
+        CFont* Font;
+        int Height;
+        size_t FirstGlyphIndex;
+        size_t GlyphCount;
+    };
+
+    SFontAtlasDesc m_Desc;
+    // Glyphs of each font are contiguous, in order of m_Fonts.
+    std::vector<SGlyph> m_Glyphs;
+    std::vector<SFontRange> m_Fonts;
+    // Bitmaps of glyphs waiting for Build, in m_GlyphFormat: TEXTURE_FORMAT_R8, or TEXTURE_FORMAT_R8G8B8A8 with SFontDesc::FLAG_MSDF.
+    std::vector<uint8_t> m_GlyphData;
+    TEXTURE_FORMAT m_GlyphFormat = TEXTURE_FORMAT_R8;
+    CFont::INIT_RESULT m_BuildResult = CFont::INIT_RESULT_SUCCESS;
+
+    uvec2 m_TextureSize = UVEC2_ZERO;
+    size_t m_TextureRowPitch = 0;
+    uint32_t m_TexturePageCount = 0;
+    TEXTURE_FORMAT m_TextureFormat = TEXTURE_FORMAT_R8;
+    uint32_t m_TextureChannelCount = 1;
+    std::vector<uint8_t> m_TextureData;
+    size_t m_AtlasUsedTexels = 0;
+    float m_PackingTime = 0.f;
+    float m_CompositionTime = 0.f;
+
+    // Called by CFont::Init. Glyphs must be sorted by height, descending.
+    // data is in GGO_GRAY8_BITMAP format if gray8, otherwise already in glyphFormat.
+    void AddFont(CFont* font, int height, TEXTURE_FORMAT glyphFormat, bool gray8,
+        const uint16_t* chars, const uvec2* sizes, const uint8_t* const* data, size_t count);
+    // Called by CFont when it is initialized again or destroyed before Build. Forgets its glyphs and their data.
+    void RemoveFont(CFont* font);
+    // Clears CFont::m_Atlas of all fonts, so they don't call RemoveFont any more. Called by Build, Init and destructor.
+    void ForgetFonts();
 };
 
+inline float CFont::GetKerning(wchar_t firstCh, wchar_t secondCh) const
+{
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+    m_KerningCounters.Lookup.fetch_add(1, std::memory_order_relaxed);
+#endif
+    // Most pairs in real text have no kerning. A single bit test rejects most of them.
+    if(!IsKerningSecond(secondCh))
+    {
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+        m_KerningCounters.RejectedBySecond.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return 0.f;
+    }
+    return FindKerning(firstCh, secondCh);
+}
+
 
 template<uint32_t vbFlags>
 void QuadCountToVertexCount(size_t& outVertexCount, size_t& outIndexCount, size_t quadCount)
@@ -1352,28 +2383,31 @@ void QuadCountToVertexCount(size_t& outVertexCount, size_t& outIndexCount, size_
 }
 
 template<uint32_t vbFlags>
-__forceinline void CQuadVertexWriter<vbFlags>::PostQuad(const vec4& positions, const vec4& texCoords)
+__forceinline void CQuadVertexWriter<vbFlags>::PostQuad(const vec4& positions, const vec4& texCoords, uint32_t texturePage)
 {
+    if(m_TexturePageFilter != UINT32_MAX && texturePage != m_TexturePageFilter)
+        return;
+
     constexpr uint32_t anyIbFlags = VERTEX_BUFFER_FLAG_USE_INDEX_BUFFER_16BIT | VERTEX_BUFFER_FLAG_USE_INDEX_BUFFER_32BIT;
     constexpr bool useIb = (vbFlags & anyIbFlags) != 0;
     if(useIb)
     {
         if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_LIST)
         {
-            SetVertex(m_QuadIndex * 4 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y));
-            SetVertex(m_QuadIndex * 4 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y));
-            SetVertex(m_QuadIndex * 4 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w));
-            SetVertex(m_QuadIndex * 4 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w));
+            SetVertex(m_QuadIndex * 4 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 4 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 4 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w), texturePage);
+            SetVertex(m_QuadIndex * 4 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w), texturePage);
 
             const int16_t indices[] = {0, 1, 2, 2, 1, 3};
             SetIndices(m_QuadIndex * 6, indices, _countof(indices), m_QuadIndex * 4);
         }
         else if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_RESTART_INDEX)
         {
-            SetVertex(m_QuadIndex * 4 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y));
-            SetVertex(m_QuadIndex * 4 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y));
-            SetVertex(m_QuadIndex * 4 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w));
-            SetVertex(m_QuadIndex * 4 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w));
+            SetVertex(m_QuadIndex * 4 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 4 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 4 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w), texturePage);
+            SetVertex(m_QuadIndex * 4 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w), texturePage);
 
             if(m_QuadIndex > 0)
                 SetRestartIndex(m_QuadIndex * 5 - 1);
@@ -1382,10 +2416,10 @@ __forceinline void CQuadVertexWriter<vbFlags>::PostQuad(const vec4& positions, c
         }
         else if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_DEGENERATE_TRIANGLES)
         {
-            SetVertex(m_QuadIndex * 4 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y));
-            SetVertex(m_QuadIndex * 4 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y));
-            SetVertex(m_QuadIndex * 4 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w));
-            SetVertex(m_QuadIndex * 4 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w));
+            SetVertex(m_QuadIndex * 4 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 4 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 4 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w), texturePage);
+            SetVertex(m_QuadIndex * 4 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w), texturePage);
 
             if(m_QuadIndex > 0)
             {
@@ -1402,13 +2436,13 @@ __forceinline void CQuadVertexWriter<vbFlags>::PostQuad(const vec4& positions, c
     {
         if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_LIST)
         {
-            SetVertex(m_QuadIndex * 6 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y));
-            SetVertex(m_QuadIndex * 6 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y));
-            SetVertex(m_QuadIndex * 6 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w));
+            SetVertex(m_QuadIndex * 6 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 6 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 6 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w), texturePage);
 
-            SetVertex(m_QuadIndex * 6 + 3, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w));
-            SetVertex(m_QuadIndex * 6 + 4, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y));
-            SetVertex(m_QuadIndex * 6 + 5, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w));
+            SetVertex(m_QuadIndex * 6 + 3, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w), texturePage);
+            SetVertex(m_QuadIndex * 6 + 4, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 6 + 5, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w), texturePage);
         }
         else if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_DEGENERATE_TRIANGLES)
         {
@@ -1418,10 +2452,10 @@ __forceinline void CQuadVertexWriter<vbFlags>::PostQuad(const vec4& positions, c
                 SetPositionOnlyVertex(m_QuadIndex * 6 - 1, vec2(positions.x, positions.y));
             }
 
-            SetVertex(m_QuadIndex * 6 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y));
-            SetVertex(m_QuadIndex * 6 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y));
-            SetVertex(m_QuadIndex * 6 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w));
-            SetVertex(m_QuadIndex * 6 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w));
+            SetVertex(m_QuadIndex * 6 + 0, vec2(positions.x, positions.y), vec2(texCoords.x, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 6 + 1, vec2(positions.z, positions.y), vec2(texCoords.z, texCoords.y), texturePage);
+            SetVertex(m_QuadIndex * 6 + 2, vec2(positions.x, positions.w), vec2(texCoords.x, texCoords.w), texturePage);
+            SetVertex(m_QuadIndex * 6 + 3, vec2(positions.z, positions.w), vec2(texCoords.z, texCoords.w), texturePage);
         }
         else
             assert(0);
@@ -1431,10 +2465,12 @@ __forceinline void CQuadVertexWriter<vbFlags>::PostQuad(const vec4& positions, c
 }
 
 template<uint32_t vbFlags>
-__forceinline void CQuadVertexWriter<vbFlags>::SetVertex(size_t vertexIndex, const vec2& pos, const vec2& texCoord)
+__forceinline void CQuadVertexWriter<vbFlags>::SetVertex(size_t vertexIndex, const vec2& pos, const vec2& texCoord, uint32_t texturePage)
 {
     *(vec2*)( (char*)m_Desc.FirstPosition + vertexIndex * m_Desc.PositionStrideBytes ) = pos;
     *(vec2*)( (char*)m_Desc.FirstTexCoord + vertexIndex * m_Desc.TexCoordStrideBytes ) = texCoord;
+    if(vbFlags & VERTEX_BUFFER_FLAG_TEXTURE_PAGE)
+        *(float*)( (char*)m_Desc.FirstTexturePage + vertexIndex * m_Desc.TexturePageStrideBytes ) = (float)texturePage;
 }
 
 template<uint32_t vbFlags>
@@ -1490,7 +2526,7 @@ template<uint32_t vbFlags> void CFont::GetFillVertices(const SVertexBufferDesc&
 {
     assert(ValidateVertexBufferFlags(vbFlags) && vbDesc.FirstPosition && vbDesc.FirstTexCoord);
     CQuadVertexWriter<vbFlags> writer(vbDesc);
-    writer.PostQuad(positions, vec4(m_FillTexCoords, m_FillTexCoords));
+    writer.PostQuad(positions, vec4(m_FillTexCoords, m_FillTexCoords), m_FillTexturePage);
 }
 
 template<uint32_t vbFlags>
@@ -1509,8 +2545,29 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
     assert(ValidateVertexBufferFlags(vbFlags));
     assert(ValidateFlags(fontFlags));
     assert(vbDesc.FirstPosition && vbDesc.FirstTexCoord);
+    assert(!(vbFlags & VERTEX_BUFFER_FLAG_TEXTURE_PAGE) || vbDesc.FirstTexturePage);
     CQuadVertexWriter<vbFlags> writer(vbDesc);
 
+    if(m_TexturePageCount <= 1)
+    {
+        PostTextQuads<vbFlags>(writer, pos, text, fontSize, fontFlags, textWidth);
+    }
+    else
+    {
+        // Layout is repeated for each page, writing only quads of that page.
+        for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+        {
+            writer.SetTexturePageFilter(texturePage);
+            PostTextQuads<vbFlags>(writer, pos, text, fontSize, fontFlags, textWidth);
+        }
+    }
+}
+
+template<uint32_t vbFlags>
+void CFont::PostTextQuads(CQuadVertexWriter<vbFlags>& writer,
+    const vec2& pos, const wstr_view& text,
+    float fontSize, uint32_t fontFlags, float textWidth) const
+{
     size_t lineBeg, lineEnd, lineIndex = 0, i;
     float lineWidth;
     float startX, currX, currY;
@@ -1556,7 +2613,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                             currY + charInfo.Offset.y*fontSize,
                             currX + (charInfo.Offset.x+charInfo.Size.x)*fontSize,
                             currY + (charInfo.Offset.y+charInfo.Size.y)*fontSize),
-                        charInfo.TexCoordsRect);
+                        charInfo.TexCoordsRect, charInfo.TexturePage);
                 }
                 currX += charInfo.Advance * fontSize;
                 if(prevCh)
@@ -1575,7 +2632,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY1 = lineY2 - fontSize * lineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+lineWidth, lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
                 else if (fontFlags & FLAG_DOUBLE_UNDERLINE)
                 {
@@ -1583,12 +2640,12 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY1 = lineY2 - fontSize * doubleLineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+lineWidth, lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                     lineY2 -= fontSize * doubleLineHeight * 2.f;
                     lineY1 -= fontSize * doubleLineHeight * 2.f;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+lineWidth, lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
                 if (fontFlags & FLAG_OVERLINE)
                 {
@@ -1596,7 +2653,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY2 = lineY1 + fontSize * lineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+lineWidth, lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
                 if (fontFlags & FLAG_STRIKEOUT)
                 {
@@ -1604,7 +2661,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY2 = lineY1 + fontSize * lineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+lineWidth, lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
             }
 
@@ -1658,7 +2715,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                             currY + charInfo.Offset.y*fontSize,
                             currX + (charInfo.Offset.x+charInfo.Size.x)*fontSize,
                             currY + (charInfo.Offset.y+charInfo.Size.y)*fontSize),
-                        charInfo.TexCoordsRect);
+                        charInfo.TexCoordsRect, charInfo.TexturePage);
                 }
                 currX += charInfo.Advance * fontSize;
                 if(prevCh)
@@ -1677,7 +2734,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY1 = lineY2 - fontSize * lineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+widths[Line], lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
                 else if (fontFlags & FLAG_DOUBLE_UNDERLINE)
                 {
@@ -1685,12 +2742,12 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY1 = lineY2 - fontSize * doubleLineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+widths[Line], lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                     lineY2 -= fontSize * doubleLineHeight * 2.f;
                     lineY1 -= fontSize * doubleLineHeight * 2.f;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+widths[Line], lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
                 if (fontFlags & FLAG_OVERLINE)
                 {
@@ -1698,7 +2755,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY2 = lineY1 + fontSize * lineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+widths[Line], lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
                 if (fontFlags & FLAG_STRIKEOUT)
                 {
@@ -1706,7 +2763,7 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
                     lineY2 = lineY1 + fontSize * lineHeight;
                     writer.PostQuad(
                         vec4(startX, lineY1, startX+widths[Line], lineY2),
-                        vec4(GetFillTexCoords(), GetFillTexCoords()));
+                        vec4(GetFillTexCoords(), GetFillTexCoords()), m_FillTexturePage);
                 }
             }
 
@@ -1719,6 +2776,8 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
 
 #pragma endregion
 
+#endif // #ifndef WIN_FONT_RENDER_CACHE_ONLY
+
 #endif // #ifdef WIN_FONT_RENDER_H
 
 // For Visual Studio IntelliSense.
@@ -1729,17 +2788,92 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
 #ifdef WIN_FONT_RENDER_IMPLEMENTATION
 #undef WIN_FONT_RENDER_IMPLEMENTATION
 
-#pragma region WinFontRender Implementation
+#pragma region Font cache implementation
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 //
-// WinFontRender library - CPP part
+// Font cache - CPP part
 //
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-#include <cassert>
-
+namespace WinFontRender
+{
+
+uint64_t CalcCacheChecksum(const uint8_t* data, size_t size)
+{
+    const uint64_t prime = 0x100000001B3ull;
+    uint64_t hash = 0xCBF29CE484222325ull;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 32;
+    }
+    for(; i < size; ++i)
+        hash = (hash ^ data[i]) * prime;
+    return hash;
+}
+
+bool ValidateFontCache(const void* data, size_t dataSize, uint64_t* outDescHash)
+{
+    if(dataSize < CACHE_HEADER_SIZE)
+        return false;
+    CCacheReader reader((const uint8_t*)data, CACHE_HEADER_SIZE);
+    const uint8_t* const magic = reader.ReadBytes(sizeof(CACHE_MAGIC));
+    const uint32_t version = reader.ReadU32();
+    const uint64_t descHash = reader.ReadU64();
+    const uint64_t payloadSize = reader.ReadU64();
+    const uint64_t checksum = reader.ReadU64();
+    if(memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || version != CACHE_VERSION ||
+        payloadSize != dataSize - CACHE_HEADER_SIZE ||
+        checksum != CalcCacheChecksum((const uint8_t*)data + CACHE_HEADER_SIZE, dataSize - CACHE_HEADER_SIZE))
+        return false;
+    if(outDescHash)
+        *outDescHash = descHash;
+    return true;
+}
+
+} // namespace WinFontRender
+
+#pragma endregion
+
+#ifndef WIN_FONT_RENDER_CACHE_ONLY
+
+#pragma region WinFontRender Implementation
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// WinFontRender library - CPP part
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+#if WIN_FONT_RENDER_USE_SIMD
+    #if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        #define WIN_FONT_RENDER_SIMD_X86 1
+        #include <immintrin.h>
+        #ifdef _MSC_VER
+            #include <intrin.h>
+            #define WIN_FONT_RENDER_TARGET_AVX2
+        #else
+            #define WIN_FONT_RENDER_TARGET_AVX2 __attribute__((target("avx2")))
+        #endif
+    #elif defined(_M_ARM64) || defined(__aarch64__)
+        #define WIN_FONT_RENDER_SIMD_NEON 1
+        #include <arm_neon.h>
+    #endif
+#endif
+
 // Just in case <Windows.h> was included before without #define NOMINMAX
 #undef min
 #undef max
@@ -1747,6 +2881,96 @@ void CFont::GetTextVertices(const SVertexBufferDesc& vbDesc,
 namespace WinFontRender
 {
 
+// Converts count texels of GGO_GRAY8_BITMAP from range 0..64 to 0..255.
+static void ConvertGray8RowScalar(uint8_t* dst, const uint8_t* src, uint32_t count)
+{
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        const uint8_t val = src[i];
+        dst[i] = val >= 64 ? 255 : val * 4;
+    }
+}
+
+// SIMD versions double the value twice with unsigned saturation, which gives exactly the same result.
+#if WIN_FONT_RENDER_SIMD_X86
+
+static void ConvertGray8RowSse2(uint8_t* dst, const uint8_t* src, uint32_t count)
+{
+    uint32_t i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        __m128i val = _mm_loadu_si128((const __m128i*)(src + i));
+        val = _mm_adds_epu8(val, val);
+        val = _mm_adds_epu8(val, val);
+        _mm_storeu_si128((__m128i*)(dst + i), val);
+    }
+    ConvertGray8RowScalar(dst + i, src + i, count - i);
+}
+
+WIN_FONT_RENDER_TARGET_AVX2 static void ConvertGray8RowAvx2(uint8_t* dst, const uint8_t* src, uint32_t count)
+{
+    uint32_t i = 0;
+    for(; i + 32 <= count; i += 32)
+    {
+        __m256i val = _mm256_loadu_si256((const __m256i*)(src + i));
+        val = _mm256_adds_epu8(val, val);
+        val = _mm256_adds_epu8(val, val);
+        _mm256_storeu_si256((__m256i*)(dst + i), val);
+    }
+    ConvertGray8RowSse2(dst + i, src + i, count - i);
+}
+
+static bool IsAvx2Supported()
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 0);
+    if(regs[0] < 7)
+        return false;
+    __cpuid(regs, 1);
+    // AVX and OSXSAVE, then OS saving YMM registers.
+    const int avxOsxsaveMask = (1 << 28) | (1 << 27);
+    if((regs[2] & avxOsxsaveMask) != avxOsxsaveMask || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#elif WIN_FONT_RENDER_SIMD_NEON
+
+static void ConvertGray8RowNeon(uint8_t* dst, const uint8_t* src, uint32_t count)
+{
+    uint32_t i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        uint8x16_t val = vld1q_u8(src + i);
+        val = vqaddq_u8(val, val);
+        val = vqaddq_u8(val, val);
+        vst1q_u8(dst + i, val);
+    }
+    ConvertGray8RowScalar(dst + i, src + i, count - i);
+}
+
+#endif
+
+typedef void (*ConvertGray8RowFunc)(uint8_t* dst, const uint8_t* src, uint32_t count);
+
+// Returns the fastest version of ConvertGray8Row supported by current CPU, chosen once.
+static ConvertGray8RowFunc GetConvertGray8RowFunc()
+{
+#if WIN_FONT_RENDER_SIMD_X86
+    static const ConvertGray8RowFunc func = IsAvx2Supported() ? ConvertGray8RowAvx2 : ConvertGray8RowSse2;
+    return func;
+#elif WIN_FONT_RENDER_SIMD_NEON
+    return ConvertGray8RowNeon;
+#else
+    return ConvertGray8RowScalar;
+#endif
+}
+
 static void BlitGray8Bitmap(
     uint8_t* dstBitmap, size_t dstRowPitch, const uvec2& dstPos,
     const uint8_t* srcBitmap, size_t srcRowPitch, const uvec2& srcPos, const uvec2& size)
@@ -1754,166 +2978,348 @@ static void BlitGray8Bitmap(
     assert(dstPos.x + size.x <= dstRowPitch);
     uint8_t* dst = dstBitmap + dstPos.y * dstRowPitch + dstPos.x;
     const uint8_t* src = srcBitmap + srcPos.y * srcRowPitch + srcPos.x;
+    const ConvertGray8RowFunc convertRow = GetConvertGray8RowFunc();
     for(uint32_t iy = 0; iy < size.y; ++iy)
     {
-        for(uint32_t ix = 0; ix < size.x; ++ix)
-        {
-            const uint8_t val = src[ix];
-            // Input range is 0..64, output is 0..255.
-            dst[ix] = val >= 64 ? 255 : val * 4;
-        }
+        convertRow(dst, src, size.x);
         dst += dstRowPitch;
         src += srcRowPitch;
     }
 }
 
-bool ValidateVertexBufferFlags(uint32_t vbFlags)
+// Not valid for TEXTURE_FORMAT_BC4, TEXTURE_FORMAT_R4.
+static uint32_t GetTextureFormatBytesPerTexel(TEXTURE_FORMAT format)
 {
-    const bool useIb16 = (vbFlags & VERTEX_BUFFER_FLAG_USE_INDEX_BUFFER_16BIT) != 0;
-    const bool useIb32 = (vbFlags & VERTEX_BUFFER_FLAG_USE_INDEX_BUFFER_32BIT) != 0;
-    if(useIb16 && useIb32)
-        return false;
+    assert(format != TEXTURE_FORMAT_BC4 && format != TEXTURE_FORMAT_R4);
+    return format == TEXTURE_FORMAT_R8G8B8A8 ? 4 : 1;
+}
 
-    uint8_t topologyCounter = 0;
-    if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_LIST)
-        ++topologyCounter;
-    if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_RESTART_INDEX)
+// Value of dstChannel parameter of BlitBitmapToFormat that writes all channels.
+static const uint32_t TEXTURE_CHANNEL_ALL = UINT32_MAX;
+
+// Copies bitmap already in texture format.
+static void BlitBitmap(
+    uint8_t* dstBitmap, size_t dstRowPitch, const uvec2& dstPos,
+    const uint8_t* srcBitmap, size_t srcRowPitch, const uvec2& srcPos, const uvec2& size, uint32_t bytesPerTexel)
+{
+    assert((dstPos.x + size.x) * bytesPerTexel <= dstRowPitch);
+    uint8_t* dst = dstBitmap + dstPos.y * dstRowPitch + dstPos.x * bytesPerTexel;
+    const uint8_t* src = srcBitmap + srcPos.y * srcRowPitch + srcPos.x * bytesPerTexel;
+    for(uint32_t iy = 0; iy < size.y; ++iy)
     {
-        ++topologyCounter;
-        if(!useIb16 && !useIb32)
-            return false;
+        memcpy(dst, src, size.x * bytesPerTexel);
+        dst += dstRowPitch;
+        src += srcRowPitch;
     }
-    if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_DEGENERATE_TRIANGLES)
-        ++topologyCounter;
-    return topologyCounter == 1;
 }
 
-// Find smallest power of two greater or equal to given number.
-static inline uint32_t NextPow2(uint32_t v)
+// Converts source texel of BlitBitmapToFormat, 0..64 as returned by GGO_GRAY8_BITMAP if srcGray8, otherwise 0..255.
+template<bool srcGray8>
+static inline uint32_t BlitTexelToR8(uint32_t val)
 {
-    v--;
-    v |= v >> 1; v |= v >> 2; v |= v >> 4; v |= v >> 8;
-    v |= v >> 16;
-    v++;
-    return v;
+    return srcGray8 ? (val >= 64 ? 255 : val * 4) : val;
+}
+template<bool srcGray8>
+static inline uint32_t BlitTexelToR4(uint32_t val)
+{
+    return (BlitTexelToR8<srcGray8>(val) * 15 + 127) / 255;
 }
 
-// Align given value up to nearest multiply of align value.
-// For example: AlignUp(11, 8) = 16. Use types like uint32_t, uint64_t as T.
-template <typename T>
-constexpr inline T AlignUp(T val, T align)
+/*
+Converts count texels of a source row of BlitBitmapToFormat to row dstRow of the texture, starting from texel dstX.
+dstChannel is used only by BlitRowRgba8Channel*.
+*/
+typedef void (*BlitRowFunc)(uint8_t* dstRow, uint32_t dstX, uint32_t dstChannel, const uint8_t* src, uint32_t count);
+
+// TEXTURE_FORMAT_R8G8B8A8, the same value in all channels.
+template<bool srcGray8>
+static void BlitRowRgba8Scalar(uint8_t* dstRow, uint32_t dstX, uint32_t /*dstChannel*/, const uint8_t* src, uint32_t count)
 {
-    return (val + align - 1) / align * align;
+    uint8_t* const dst = dstRow + dstX * 4;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        const uint32_t val = BlitTexelToR8<srcGray8>(src[i]) * 0x01010101u;
+        memcpy(dst + i * 4, &val, 4);
+    }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Internal class CSpritePacker
+/*
+TEXTURE_FORMAT_R8G8B8A8, only dstChannel 0..3. Stores single bytes on purpose, with no SIMD version: with
+SFontAtlasDesc::FLAG_CHANNEL_PACKING, characters composed in parallel overlap in other channels of the same texels.
+*/
+template<bool srcGray8>
+static void BlitRowRgba8ChannelScalar(uint8_t* dstRow, uint32_t dstX, uint32_t dstChannel, const uint8_t* src, uint32_t count)
+{
+    uint8_t* const dst = dstRow + dstX * 4 + dstChannel;
+    for(uint32_t i = 0; i < count; ++i)
+        dst[i * 4] = (uint8_t)BlitTexelToR8<srcGray8>(src[i]);
+}
 
-class CSpritePacker
+// TEXTURE_FORMAT_R4. Odd first and last texel share their byte with a neighbor, which is preserved.
+template<bool srcGray8>
+static void BlitRowR4Scalar(uint8_t* dstRow, uint32_t dstX, uint32_t /*dstChannel*/, const uint8_t* src, uint32_t count)
 {
-public:
-    CSpritePacker(uint32_t textureSizeX, uint32_t margin, bool pow2) :
-        m_TextureSizeX(pow2 ? NextPow2(textureSizeX) : textureSizeX),
-        m_Margin(margin),
-        m_CurrPos(margin, margin),
-        m_TextureSizeY(margin),
-        m_Pow2(pow2)
+    uint32_t i = 0;
+    if(dstX % 2 && count > 0)
     {
+        dstRow[dstX / 2] = (uint8_t)((dstRow[dstX / 2] & 0x0F) | (BlitTexelToR4<srcGray8>(src[0]) << 4));
+        i = 1;
     }
+    uint8_t* const dstPairs = dstRow + (dstX + i) / 2;
+    const uint32_t pairCount = (count - i) / 2;
+    for(uint32_t pair = 0; pair < pairCount; ++pair)
+        dstPairs[pair] = (uint8_t)(BlitTexelToR4<srcGray8>(src[i + pair * 2]) | (BlitTexelToR4<srcGray8>(src[i + pair * 2 + 1]) << 4));
+    i += pairCount * 2;
+    if(i < count)
+        dstPairs[pairCount] = (uint8_t)((dstPairs[pairCount] & 0xF0) | BlitTexelToR4<srcGray8>(src[i]));
+}
 
-    uint32_t GetTextureSizeY() const { return m_Pow2 ? NextPow2(m_TextureSizeY + m_Margin) : m_TextureSizeY + m_Margin; }
+#if WIN_FONT_RENDER_SIMD_X86
 
-    void AddSprite(uvec2& outPos, const uvec2& size);
+// Loads 16 source texels converted to 0..255, like ConvertGray8RowSse2.
+template<bool srcGray8>
+static inline __m128i BlitLoadR8Sse2(const uint8_t* src)
+{
+    __m128i val = _mm_loadu_si128((const __m128i*)src);
+    if(srcGray8)
+    {
+        val = _mm_adds_epu8(val, val);
+        val = _mm_adds_epu8(val, val);
+    }
+    return val;
+}
 
-private:
-    const uint32_t m_TextureSizeX;
-    const uint32_t m_Margin;
-    uvec2 m_CurrPos;
-    uint32_t m_TextureSizeY;
-    bool m_Pow2;
-};
+template<bool srcGray8>
+static void BlitRowRgba8Sse2(uint8_t* dstRow, uint32_t dstX, uint32_t dstChannel, const uint8_t* src, uint32_t count)
+{
+    uint8_t* const dst = dstRow + dstX * 4;
+    uint32_t i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        // Each byte repeated 2 times, then 4 times.
+        const __m128i val = BlitLoadR8Sse2<srcGray8>(src + i);
+        const __m128i lo = _mm_unpacklo_epi8(val, val);
+        const __m128i hi = _mm_unpackhi_epi8(val, val);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_unpacklo_epi16(lo, lo));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_unpackhi_epi16(lo, lo));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 32), _mm_unpacklo_epi16(hi, hi));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 48), _mm_unpackhi_epi16(hi, hi));
+    }
+    BlitRowRgba8Scalar<srcGray8>(dstRow, dstX + i, dstChannel, src + i, count - i);
+}
 
-void CSpritePacker::AddSprite(uvec2& outPos, const uvec2& size)
+template<bool srcGray8>
+static void BlitRowR4Sse2(uint8_t* dstRow, uint32_t dstX, uint32_t dstChannel, const uint8_t* src, uint32_t count)
 {
-    assert(size.x + 2 * m_Margin <= m_TextureSizeX);
-    m_CurrPos.x += m_Margin;
-    if(m_CurrPos.x + size.x + m_Margin <= m_TextureSizeX)
+    // Odd first texel, so the rest starts at a whole byte.
+    uint32_t i = 0;
+    if(dstX % 2 && count > 0)
     {
-        outPos = m_CurrPos;
-        m_TextureSizeY = std::max(m_TextureSizeY, m_CurrPos.y + size.y);
-        m_CurrPos.x += size.x;
+        BlitRowR4Scalar<srcGray8>(dstRow, dstX, dstChannel, src, 1);
+        i = 1;
     }
-    else
+    uint8_t* const dstPairs = dstRow + (dstX + i) / 2;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i fifteen = _mm_set1_epi16(15);
+    const __m128i half = _mm_set1_epi16(127);
+    const __m128i lowByte = _mm_set1_epi32(0xFF);
+    // (val * 15 + 127) / 255 on 16-bit lanes, dividing as (x + 1 + (x >> 8)) >> 8, which is exact for these x.
+    auto toR4 = [&](__m128i val) -> __m128i {
+        const __m128i x = _mm_add_epi16(_mm_mullo_epi16(val, fifteen), half);
+        return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, one), _mm_srli_epi16(x, 8)), 8);
+    };
+    // Each 32-bit lane has a pair of texels in its 16-bit halves. Moves the second to bits 4..7 of the lane.
+    auto packPairs = [&](__m128i val) -> __m128i {
+        return _mm_and_si128(_mm_or_si128(val, _mm_srli_epi32(val, 12)), lowByte);
+    };
+    uint32_t pair = 0;
+    for(; i + 16 <= count; i += 16, pair += 8)
     {
-        // Start a new row.
-        m_CurrPos = uvec2(0, m_TextureSizeY + m_Margin);
-        AddSprite(outPos, size);
+        const __m128i val = BlitLoadR8Sse2<srcGray8>(src + i);
+        const __m128i lo = packPairs(toR4(_mm_unpacklo_epi8(val, zero)));
+        const __m128i hi = packPairs(toR4(_mm_unpackhi_epi8(val, zero)));
+        const __m128i packed = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i*)(dstPairs + pair), _mm_packus_epi16(packed, packed));
     }
+    BlitRowR4Scalar<srcGray8>(dstRow, dstX + i, dstChannel, src + i, count - i);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// class CFont
+#elif WIN_FONT_RENDER_SIMD_NEON
 
-bool CFont::ValidateFlags(uint32_t flags)
+// Converts 16 source texels to 0..255, like ConvertGray8RowNeon.
+template<bool srcGray8>
+static inline uint8x16_t BlitToR8Neon(uint8x16_t val)
 {
-    uint8_t count = 0;
-    if(flags & FLAG_WRAP_SINGLE_LINE) ++count;
-    if(flags & FLAG_WRAP_NORMAL) ++count;
-    if(flags & FLAG_WRAP_CHAR) ++count;
-    if(flags & FLAG_WRAP_WORD) ++count;
-    if(count != 1) return false;
+    if(srcGray8)
+    {
+        val = vqaddq_u8(val, val);
+        val = vqaddq_u8(val, val);
+    }
+    return val;
+}
 
-    count = 0;
-    if(flags & FLAG_HLEFT) ++count;
-    if(flags & FLAG_HCENTER) ++count;
-    if(flags & FLAG_HRIGHT) ++count;
-    if(count != 1) return false;
+template<bool srcGray8>
+static void BlitRowRgba8Neon(uint8_t* dstRow, uint32_t dstX, uint32_t dstChannel, const uint8_t* src, uint32_t count)
+{
+    uint8_t* const dst = dstRow + dstX * 4;
+    uint32_t i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        // Interleaving store writes the same value to all 4 channels.
+        const uint8x16_t val = BlitToR8Neon<srcGray8>(vld1q_u8(src + i));
+        const uint8x16x4_t texels = { { val, val, val, val } };
+        vst4q_u8(dst + i * 4, texels);
+    }
+    BlitRowRgba8Scalar<srcGray8>(dstRow, dstX + i, dstChannel, src + i, count - i);
+}
 
-    count = 0;
-    if(flags & FLAG_VTOP) ++count;
-    if(flags & FLAG_VMIDDLE) ++count;
-    if(flags & FLAG_VBOTTOM) ++count;
-    if(count != 1) return false;
+template<bool srcGray8>
+static void BlitRowR4Neon(uint8_t* dstRow, uint32_t dstX, uint32_t dstChannel, const uint8_t* src, uint32_t count)
+{
+    // Odd first texel, so the rest starts at a whole byte.
+    uint32_t i = 0;
+    if(dstX % 2 && count > 0)
+    {
+        BlitRowR4Scalar<srcGray8>(dstRow, dstX, dstChannel, src, 1);
+        i = 1;
+    }
+    uint8_t* const dstPairs = dstRow + (dstX + i) / 2;
+    const uint8x8_t fifteen = vdup_n_u8(15);
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint16x8_t half = vdupq_n_u16(127);
+    // (val * 15 + 127) / 255 on 16-bit lanes, dividing like BlitRowR4Sse2.
+    auto toR4 = [&](uint8x8_t val) -> uint8x8_t {
+        const uint16x8_t x = vmlal_u8(half, val, fifteen);
+        return vmovn_u16(vshrq_n_u16(vaddq_u16(vaddq_u16(x, one), vshrq_n_u16(x, 8)), 8));
+    };
+    uint32_t pair = 0;
+    for(; i + 32 <= count; i += 32, pair += 16)
+    {
+        // Deinterleaving load: even texels go to bits 0..3 of a byte, odd ones to bits 4..7.
+        const uint8x16x2_t val = vld2q_u8(src + i);
+        const uint8x16_t even = BlitToR8Neon<srcGray8>(val.val[0]);
+        const uint8x16_t odd = BlitToR8Neon<srcGray8>(val.val[1]);
+        const uint8x16_t evenR4 = vcombine_u8(toR4(vget_low_u8(even)), toR4(vget_high_u8(even)));
+        const uint8x16_t oddR4 = vcombine_u8(toR4(vget_low_u8(odd)), toR4(vget_high_u8(odd)));
+        vst1q_u8(dstPairs + pair, vsliq_n_u8(evenR4, oddR4, 4));
+    }
+    BlitRowR4Scalar<srcGray8>(dstRow, dstX + i, dstChannel, src + i, count - i);
+}
 
-    return true;
+#endif
+
+// Returns the fastest row function of BlitBitmapToFormat for given format, other than TEXTURE_FORMAT_R8.
+template<bool srcGray8>
+static BlitRowFunc GetBlitRowFunc(TEXTURE_FORMAT dstFormat, uint32_t dstChannel)
+{
+    assert(dstFormat == TEXTURE_FORMAT_R8G8B8A8 || dstFormat == TEXTURE_FORMAT_R4);
+#if WIN_FONT_RENDER_SIMD_X86
+    if(dstFormat == TEXTURE_FORMAT_R4)
+        return BlitRowR4Sse2<srcGray8>;
+    return dstChannel == TEXTURE_CHANNEL_ALL ? BlitRowRgba8Sse2<srcGray8> : BlitRowRgba8ChannelScalar<srcGray8>;
+#elif WIN_FONT_RENDER_SIMD_NEON
+    if(dstFormat == TEXTURE_FORMAT_R4)
+        return BlitRowR4Neon<srcGray8>;
+    return dstChannel == TEXTURE_CHANNEL_ALL ? BlitRowRgba8Neon<srcGray8> : BlitRowRgba8ChannelScalar<srcGray8>;
+#else
+    if(dstFormat == TEXTURE_FORMAT_R4)
+        return BlitRowR4Scalar<srcGray8>;
+    return dstChannel == TEXTURE_CHANNEL_ALL ? BlitRowRgba8Scalar<srcGray8> : BlitRowRgba8ChannelScalar<srcGray8>;
+#endif
 }
 
-CFont::CFont()
+/*
+Copies single-channel bitmap into texture of given format, converting texels in the same pass.
+Source texels are 0..64 as returned by GGO_GRAY8_BITMAP if srcGray8, otherwise 0..255.
+With TEXTURE_FORMAT_R8G8B8A8, value is written to dstChannel 0..3 only, or to all 4 channels if it is TEXTURE_CHANNEL_ALL.
+The function converting a row is chosen once per bitmap. TEXTURE_FORMAT_BC4 is not supported.
+*/
+template<bool srcGray8>
+static void BlitBitmapToFormat(
+    uint8_t* dstBitmap, size_t dstRowPitch, const uvec2& dstPos, TEXTURE_FORMAT dstFormat, uint32_t dstChannel,
+    const uint8_t* srcBitmap, size_t srcRowPitch, const uvec2& srcPos, const uvec2& size)
 {
+    assert(dstFormat != TEXTURE_FORMAT_BC4);
+    if(dstFormat == TEXTURE_FORMAT_R8)
+    {
+        if(srcGray8)
+            BlitGray8Bitmap(dstBitmap, dstRowPitch, dstPos, srcBitmap, srcRowPitch, srcPos, size);
+        else
+            BlitBitmap(dstBitmap, dstRowPitch, dstPos, srcBitmap, srcRowPitch, srcPos, size, 1);
+        return;
+    }
+    const BlitRowFunc blitRow = GetBlitRowFunc<srcGray8>(dstFormat, dstChannel);
+    const uint8_t* src = srcBitmap + srcPos.y * srcRowPitch + srcPos.x;
+    uint8_t* dst = dstBitmap + dstPos.y * dstRowPitch;
+    for(uint32_t iy = 0; iy < size.y; ++iy)
+    {
+        blitRow(dst, dstPos.x, dstChannel, src, size.x);
+        dst += dstRowPitch;
+        src += srcRowPitch;
+    }
 }
 
-bool CFont::Init(const SFontDesc& desc)
+/*
+Calculates next mip level of a texture with size divisible by 2, averaging 2x2 texels.
+Rows are processed as plain arrays of bytes, so the loop vectorizes well.
+*/
+template<uint32_t bytesPerTexel>
+static void DownsampleBox(uint8_t* dst, size_t dstRowPitch, const uvec2& dstSize, const uint8_t* src, size_t srcRowPitch)
 {
-    assert(!desc.FaceName.empty() && desc.Height > 0);
+    const uint32_t rowBytes = dstSize.x * bytesPerTexel;
+    for(uint32_t y = 0; y < dstSize.y; ++y)
+    {
+        const uint8_t* const src0 = src + (y * 2) * srcRowPitch;
+        const uint8_t* const src1 = src0 + srcRowPitch;
+        uint8_t* const dstRow = dst + y * dstRowPitch;
+        for(uint32_t i = 0; i < rowBytes; ++i)
+        {
+            const uint32_t srcIndex = (i / bytesPerTexel) * (bytesPerTexel * 2) + i % bytesPerTexel;
+            dstRow[i] = (uint8_t)((src0[srcIndex] + src0[srcIndex + bytesPerTexel] +
+                src1[srcIndex] + src1[srcIndex + bytesPerTexel] + 2) >> 2);
+        }
+    }
+}
 
-    ZeroMemory(m_CharInfo, sizeof m_CharInfo);
+static vec4 CalcTexCoordsRect(const uvec2& pos, const uvec2& size, const vec2& textureSizeInv, bool fromLeftBottom)
+{
+    vec4 result = vec4(
+        (float)pos.x * textureSizeInv.x,
+        (float)pos.y * textureSizeInv.y,
+        (float)(pos.x + size.x) * textureSizeInv.x,
+        (float)(pos.y + size.y) * textureSizeInv.y);
+    if(fromLeftBottom)
+    {
+        result.y = 1.f - result.y;
+        result.w = 1.f - result.w;
+    }
+    return result;
+}
 
-    const ivec2 dummyBitmapSize = ivec2(32, 32);
-    // Rows top-down,
-    // for each row pixels from left to right,
-    // for each pixel components B, G, R = 0..255.
-    BITMAPINFO dummyBitmapInfo = { {
-            sizeof(BITMAPINFOHEADER), // biSize
-            dummyBitmapSize.x, -dummyBitmapSize.y, // biWidth, biHeight
-            1, // biPlanes
-            24, // biBitCount
-            BI_RGB, // biCompression
-            0, // biSizeImage
-            72, 72, // biXPelsPerMeter, biYPelsPerMeter
-            0, 0, // biClrUsed, biClrImportant
-        } };
-    unsigned char *dummyBitmapData = nullptr;
-    HBITMAP dummyBitmap = CreateDIBSection(NULL, &dummyBitmapInfo, DIB_RGB_COLORS, (void**)&dummyBitmapData, NULL, 0);
-    if(dummyBitmap == NULL)
-        return false;
-    HDC dc = CreateCompatibleDC(NULL);
-    if(dc == NULL)
-        return false;
-    HGDIOBJ oldBitmap = SelectObject(dc, dummyBitmap);
-    HGDIOBJ oldFont = NULL;
-    const float fontSizeInv = 1.f / (float)desc.Height;
-    HFONT font = CreateFont(
-        desc.Height, // cHeight
+// Limit of SFontDesc::MipLevelCount when MaxTextureSize is 0.
+static const uint32_t MAX_MIP_LEVEL_COUNT = 16;
+
+// Number of mip levels that Init creates for desc, see SFontDesc::MipLevelCount.
+static uint32_t CalcMipLevelCount(const SFontDesc& desc)
+{
+    if(desc.Atlas)
+        return 1;
+    uint32_t maxLevelCount = MAX_MIP_LEVEL_COUNT;
+    if(desc.MaxTextureSize)
+    {
+        maxLevelCount = 1;
+        while((desc.MaxTextureSize >> maxLevelCount) != 0)
+            ++maxLevelCount;
+    }
+    return std::min(std::max(desc.MipLevelCount, 1u), maxLevelCount);
+}
+
+// Creates GDI font of given height with other parameters taken from desc.
+static HFONT CreateGdiFont(const SFontDesc& desc, int gdiHeight)
+{
+    return CreateFont(
+        gdiHeight, // cHeight
         0, // cWidth
         0, // cEscapement
         0, // cOrientation
@@ -1927,711 +3333,5121 @@ bool CFont::Init(const SFontDesc& desc)
         ANTIALIASED_QUALITY, // iQuality
         desc.PitchAndFamily, // iPitchAndFamily
         desc.FaceName.c_str());
-    if(font == NULL)
-        return false;
-    oldFont = SelectObject(dc, font);
+}
+
+// DC with selected GDI font for each worker thread, so they can call GetGlyphOutline in parallel.
+class CGdiWorkerFonts
+{
+public:
+    // If dc is not null, thread 0 uses it instead of creating its own.
+    CGdiWorkerFonts(HDC dc, const SFontDesc& desc, int gdiHeight, uint32_t threadCount);
+    ~CGdiWorkerFonts();
+    // False if creating some DC or font failed.
+    bool IsValid() const { return m_Valid; }
+    HDC GetDC(uint32_t threadIndex) const { return m_Threads[threadIndex].DC; }
 
-    LONG ascent = 0, descent = 0;
+private:
+    struct SThread
     {
-        UINT size = GetOutlineTextMetrics(dc, 0, NULL);
-        assert(size >= sizeof(OUTLINETEXTMETRIC));
-        std::vector<char> buf(size);
-        GetOutlineTextMetrics(dc, size, (LPOUTLINETEXTMETRIC)buf.data());
-        const OUTLINETEXTMETRIC* outlineTextMetric = (const OUTLINETEXTMETRIC*)buf.data();
+        HDC DC;
+        HFONT Font;
+        HGDIOBJ OldFont;
+    };
+    std::vector<SThread> m_Threads;
+    // False if thread 0 uses DC given to the constructor.
+    bool m_OwnsFirstDC;
+    bool m_Valid = true;
 
-        ascent  = outlineTextMetric->otmTextMetrics.tmAscent;
-        descent = outlineTextMetric->otmTextMetrics.tmDescent;
+    CGdiWorkerFonts(const CGdiWorkerFonts&) = delete;
+    CGdiWorkerFonts& operator=(const CGdiWorkerFonts&) = delete;
+};
 
-        m_LineGap = outlineTextMetric->otmLineGap * fontSizeInv;
+CGdiWorkerFonts::CGdiWorkerFonts(HDC dc, const SFontDesc& desc, int gdiHeight, uint32_t threadCount) :
+    m_Threads(threadCount, SThread{NULL, NULL, NULL}),
+    m_OwnsFirstDC(dc == NULL)
+{
+    if(!m_OwnsFirstDC)
+        m_Threads[0].DC = dc;
+    for(uint32_t threadIndex = m_OwnsFirstDC ? 0 : 1; threadIndex < threadCount && m_Valid; ++threadIndex)
+    {
+        SThread& thread = m_Threads[threadIndex];
+        thread.DC = CreateCompatibleDC(NULL);
+        thread.Font = CreateGdiFont(desc, gdiHeight);
+        m_Valid = thread.DC != NULL && thread.Font != NULL;
+        if(m_Valid)
+            thread.OldFont = SelectObject(thread.DC, thread.Font);
     }
+}
 
-    struct SGlyphInfo
+CGdiWorkerFonts::~CGdiWorkerFonts()
+{
+    for(size_t threadIndex = m_OwnsFirstDC ? 0 : 1; threadIndex < m_Threads.size(); ++threadIndex)
     {
-        bool Requested = false;
-        size_t DataOffset = SIZE_MAX; // SIZE_MAX if glyph not present.
-        uvec2 BlackBoxSize = uvec2(0, 0); // (0, 0) if no actual glyph available.
-        uvec2 TexturePos = uvec2(0, 0);
+        SThread& thread = m_Threads[threadIndex];
+        if(thread.OldFont)
+            SelectObject(thread.DC, thread.OldFont);
+        if(thread.Font)
+            DeleteObject(thread.Font);
+        if(thread.DC)
+            DeleteDC(thread.DC);
+    }
+}
 
-        bool GlyphExists() const { return DataOffset != SIZE_MAX; }
-        bool HasSprite() const { return GlyphExists() && BlackBoxSize.x && BlackBoxSize.y; }
-    };
-    std::vector<uint8_t> glyphData;
-    std::vector<SGlyphInfo> glyphInfo(CHAR_COUNT);
+bool ValidateVertexBufferFlags(uint32_t vbFlags)
+{
+    const bool useIb16 = (vbFlags & VERTEX_BUFFER_FLAG_USE_INDEX_BUFFER_16BIT) != 0;
+    const bool useIb32 = (vbFlags & VERTEX_BUFFER_FLAG_USE_INDEX_BUFFER_32BIT) != 0;
+    if(useIb16 && useIb32)
+        return false;
 
-    uint32_t requestedCount = 0;
-    if(desc.CharRangeCount && desc.CharRanges)
-    {
-        for(size_t rangeIndex = 0; rangeIndex < desc.CharRangeCount; ++rangeIndex)
-        {
-            for(uint32_t i = desc.CharRanges[rangeIndex * 2]; i <= desc.CharRanges[rangeIndex * 2 + 1]; ++i)
-            {
-                if(!glyphInfo[i].Requested)
-                {
-                    glyphInfo[i].Requested = true;
-                    ++requestedCount;
-                }
-            }
-        }
-    }
-    else
+    uint8_t topologyCounter = 0;
+    if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_LIST)
+        ++topologyCounter;
+    if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_RESTART_INDEX)
     {
-        const size_t charMin = 32, charMax = 127;
-        for(size_t i = charMin; i <= charMax; ++i)
-        {
-            glyphInfo[i].Requested = true;
-            ++requestedCount;
-        }
+        ++topologyCounter;
+        if(!useIb16 && !useIb32)
+            return false;
     }
-    assert(requestedCount);
-
-    float existingGlyphCount = 0.f;
+    if(vbFlags & VERTEX_BUFFER_FLAG_TRIANGLE_STRIP_WITH_DEGENERATE_TRIANGLES)
+        ++topologyCounter;
+    return topologyCounter == 1;
+}
 
-    const MAT2 mat2 = { {0, 1}, {0, 0}, {0, 0}, {0, 1} };
-    for(size_t i = 1; i < CHAR_COUNT; ++i)
-    {
-        if(glyphInfo[i].Requested)
-        {
-            GLYPHMETRICS metrics = {};
-            DWORD res = GetGlyphOutline(dc, (UINT)i, GGO_METRICS, &metrics, 0, NULL, &mat2);
-            if(res != GDI_ERROR)
-            {
-                const size_t currGlyphDataOffset = glyphData.size();
-                glyphInfo[i].DataOffset = currGlyphDataOffset;
+// Find smallest power of two greater or equal to given number.
+static inline uint32_t NextPow2(uint32_t v)
+{
+    v--;
+    v |= v >> 1; v |= v >> 2; v |= v >> 4; v |= v >> 8;
+    v |= v >> 16;
+    v++;
+    return v;
+}
 
-                SCharInfo& charInfo = m_CharInfo[i];
-                //charInfo.TexCoordsRect still uninitialized.
-                charInfo.Advance = (float)metrics.gmCellIncX * fontSizeInv;
-                charInfo.Offset = vec2(
-                    (float)metrics.gmptGlyphOrigin.x * fontSizeInv,
-                    (float)(ascent - metrics.gmptGlyphOrigin.y) * fontSizeInv);
-                charInfo.Size = vec2(
-                    (float)metrics.gmBlackBoxX * fontSizeInv,
-                    (float)metrics.gmBlackBoxY * fontSizeInv);
-                charInfo.KerningEntryFirstIndex = SIZE_MAX;
+// Align given value up to nearest multiply of align value.
+// For example: AlignUp(11, 8) = 16. Use types like uint32_t, uint64_t as T.
+template <typename T>
+constexpr inline T AlignUp(T val, T align)
+{
+    return (val + align - 1) / align * align;
+}
 
-                if(metrics.gmBlackBoxX && metrics.gmBlackBoxY)
-                {
-                    DWORD currGlyphDataSize = GetGlyphOutline(dc, (UINT)i, GGO_GRAY8_BITMAP, &metrics, 0, NULL, &mat2);
-                    if(currGlyphDataSize > 0 && currGlyphDataSize != GDI_ERROR)
-                    {
-                        glyphData.resize(currGlyphDataOffset + currGlyphDataSize);
-                        glyphInfo[i].BlackBoxSize = uvec2(metrics.gmBlackBoxX, metrics.gmBlackBoxY);
+// Copies a character from glyph data to the texture: coverage in GGO_GRAY8_BITMAP format, or distance field with sdf or msdf.
+static void ComposeGlyph(uint8_t* dstPage, size_t dstRowPitch, const uvec2& dstPos, TEXTURE_FORMAT dstFormat,
+    const uint8_t* src, const uvec2& size, bool sdf, bool msdf)
+{
+    const uint32_t srcBytesPerTexel = GetTextureFormatBytesPerTexel(msdf ? TEXTURE_FORMAT_R8G8B8A8 : TEXTURE_FORMAT_R8);
+    const uint32_t srcRowPitch = AlignUp<uint32_t>(size.x * srcBytesPerTexel, 4);
+    // Multi-channel distance field is already in texture format.
+    if(msdf)
+        BlitBitmap(dstPage, dstRowPitch, dstPos, src, srcRowPitch, uvec2(0, 0), size, srcBytesPerTexel);
+    else if(sdf)
+        BlitBitmapToFormat<false>(dstPage, dstRowPitch, dstPos, dstFormat, TEXTURE_CHANNEL_ALL, src, srcRowPitch, uvec2(0, 0), size);
+    else
+        BlitBitmapToFormat<true>(dstPage, dstRowPitch, dstPos, dstFormat, TEXTURE_CHANNEL_ALL, src, srcRowPitch, uvec2(0, 0), size);
+}
 
-                        uint8_t* currGlyphData = glyphData.data() + currGlyphDataOffset;
-                        res = GetGlyphOutline(dc, (UINT)i, GGO_GRAY8_BITMAP, &metrics, currGlyphDataSize, currGlyphData, &mat2);
-                        if(res == 0 || res == GDI_ERROR)
-                            return false;
+/*
+Returns number of threads worth using for itemCount items, given that a thread should get at least minItemsPerThread.
+Not more than maxThreadCount, unless it is 0, like SFontDesc::MaxThreadCount.
+*/
+static uint32_t GetWorkerThreadCount(size_t itemCount, size_t minItemsPerThread, uint32_t maxThreadCount = 0)
+{
+    size_t threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    if(maxThreadCount)
+        threadCount = std::min<size_t>(threadCount, maxThreadCount);
+    return (uint32_t)std::max<size_t>(std::min(threadCount, itemCount / minItemsPerThread), 1);
+}
 
-                        ++existingGlyphCount;
-                    }
-                }
-            }
-        }
-    }
+// Calls func(itemIndex, threadIndex) for each item, distributed dynamically among threadCount threads, calling thread included.
+template<typename Func>
+static void ParallelFor(size_t itemCount, uint32_t threadCount, const Func& func)
+{
+    std::atomic<size_t> nextItemIndex(0);
+    auto worker = [&](uint32_t threadIndex) {
+        for(size_t itemIndex = nextItemIndex++; itemIndex < itemCount; itemIndex = nextItemIndex++)
+            func(itemIndex, threadIndex);
+    };
+    std::vector<std::thread> threads;
+    for(uint32_t threadIndex = 1; threadIndex < threadCount; ++threadIndex)
+        threads.emplace_back(worker, threadIndex);
+    worker(0);
+    for(size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+}
 
-    DWORD kerningPairCount = GetKerningPairs(dc, 0, NULL);
-    if(kerningPairCount)
-    {
-        std::vector<KERNINGPAIR> kerningPairs(kerningPairCount);
-        DWORD res = GetKerningPairs(dc, kerningPairCount, kerningPairs.data());
-        assert(res);
+// Rows of block compressed formats are rows of blocks.
+static size_t GetTextureRowPitch(TEXTURE_FORMAT format, uint32_t sizeX)
+{
+    if(format == TEXTURE_FORMAT_BC4)
+        return (size_t)(sizeX / 4) * 8;
+    if(format == TEXTURE_FORMAT_R4)
+        return AlignUp<uint32_t>((sizeX + 1) / 2, 4);
+    return AlignUp<uint32_t>(sizeX * GetTextureFormatBytesPerTexel(format), 4);
+}
+static uint32_t GetTextureRowCount(TEXTURE_FORMAT format, uint32_t sizeY)
+{
+    return format == TEXTURE_FORMAT_BC4 ? sizeY / 4 : sizeY;
+}
+// Offset in bytes from the beginning of a row to texel x, which must start a block or a byte.
+static size_t GetTextureRowOffset(TEXTURE_FORMAT format, uint32_t x)
+{
+    if(format == TEXTURE_FORMAT_BC4)
+        return (size_t)(x / 4) * 8;
+    if(format == TEXTURE_FORMAT_R4)
+        return x / 2;
+    return (size_t)x * GetTextureFormatBytesPerTexel(format);
+}
 
-        for(size_t i = 0; i < kerningPairCount; ++i)
-        {
-            if(kerningPairs[i].iKernAmount)
-            {
-                SKerningEntry entry;
-                entry.First = kerningPairs[i].wFirst;
-                entry.Second = kerningPairs[i].wSecond;
-                if(glyphInfo[entry.First].GlyphExists() && glyphInfo[entry.Second].GlyphExists() && kerningPairs[i].iKernAmount)
-                {
-                    entry.Amount = (float)kerningPairs[i].iKernAmount * fontSizeInv;
-                    m_KerningEntries.push_back(entry);
-                }
-            }
-        }
-        SortKerningEntries();
+////////////////////////////////////////////////////////////////////////////////
+// Block compression
 
-        for(size_t i = 0, count = m_KerningEntries.size(); i < count; ++i)
-        {
-            const SKerningEntry& kerningEntry = m_KerningEntries[i];
-            if(glyphInfo[kerningEntry.First].GlyphExists() && m_CharInfo[kerningEntry.First].KerningEntryFirstIndex == SIZE_MAX)
-            {
-                m_CharInfo[kerningEntry.First].KerningEntryFirstIndex = i;
-            }
-        }
+// Values of a BC4 block with given endpoints, as decoded by the GPU.
+static void GetBc4Palette(uint8_t outPalette[8], uint32_t red0, uint32_t red1)
+{
+    outPalette[0] = (uint8_t)red0;
+    outPalette[1] = (uint8_t)red1;
+    if(red0 > red1)
+    {
+        for(uint32_t i = 1; i < 7; ++i)
+            outPalette[i + 1] = (uint8_t)(((7 - i) * red0 + i * red1 + 3) / 7);
     }
+    else
+    {
+        for(uint32_t i = 1; i < 5; ++i)
+            outPalette[i + 1] = (uint8_t)(((5 - i) * red0 + i * red1 + 2) / 5);
+        outPalette[6] = 0;
+        outPalette[7] = 255;
+    }
+}
 
-    assert(glyphInfo[L'-'].HasSprite() && glyphInfo[L'?'].HasSprite());
-
-    SelectObject(dc, oldFont);
-    DeleteObject(font);
-    SelectObject(dc, oldBitmap);
-    DeleteDC(dc);
-    DeleteObject(dummyBitmap);
+/*
+Chooses nearest palette entry for each of 16 texels, the first one on a tie. Returns squared error.
+SIMD versions compare absolute differences of all 16 texels at once, which gives the same indices as squared differences.
+*/
+#if WIN_FONT_RENDER_SIMD_X86
 
-    std::vector<uint16_t> sortIndex;
-    sortIndex.reserve(requestedCount);
-    for(size_t i = 1; i < CHAR_COUNT; ++i)
+static uint32_t FindBc4IndicesSse2(uint8_t outIndices[16], const uint8_t texels[16], const uint8_t palette[8])
+{
+    const __m128i texelVec = _mm_loadu_si128((const __m128i*)texels);
+    __m128i bestError = _mm_set1_epi8((char)0xFF);
+    __m128i bestIndex = _mm_setzero_si128();
+    for(uint32_t paletteIndex = 0; paletteIndex < 8; ++paletteIndex)
     {
-        if(glyphInfo[i].HasSprite())
-        {
-            sortIndex.push_back((uint16_t)i);
-        }
+        const __m128i entry = _mm_set1_epi8((char)palette[paletteIndex]);
+        const __m128i diff = _mm_or_si128(_mm_subs_epu8(texelVec, entry), _mm_subs_epu8(entry, texelVec));
+        // There is no unsigned comparison of bytes: diff >= bestError where max(diff, bestError) == diff.
+        const __m128i notBetter = _mm_cmpeq_epi8(_mm_max_epu8(diff, bestError), diff);
+        bestIndex = _mm_or_si128(_mm_and_si128(notBetter, bestIndex),
+            _mm_andnot_si128(notBetter, _mm_set1_epi8((char)paletteIndex)));
+        bestError = _mm_min_epu8(bestError, diff);
     }
-    std::sort(sortIndex.begin(), sortIndex.end(), [&glyphInfo](uint16_t lhs, uint16_t rhs) -> bool {
-        return glyphInfo[lhs].BlackBoxSize.y > glyphInfo[rhs].BlackBoxSize.y;
-    });
+    _mm_storeu_si128((__m128i*)outIndices, bestIndex);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i errorLo = _mm_unpacklo_epi8(bestError, zero);
+    const __m128i errorHi = _mm_unpackhi_epi8(bestError, zero);
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(errorLo, errorLo), _mm_madd_epi16(errorHi, errorHi));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t)_mm_cvtsi128_si32(sum);
+}
 
-    m_TextureSize.x = (uint32_t)desc.Height * 8;
-    const bool pow2 = (desc.Flags & SFontDesc::FLAG_TEXTURE_POW2) != 0;
-    CSpritePacker packer{m_TextureSize.x, 1, pow2};
-    for(uint32_t i = 0; i < sortIndex.size(); ++i)
+#elif WIN_FONT_RENDER_SIMD_NEON
+
+static uint32_t FindBc4IndicesNeon(uint8_t outIndices[16], const uint8_t texels[16], const uint8_t palette[8])
+{
+    const uint8x16_t texelVec = vld1q_u8(texels);
+    uint8x16_t bestError = vdupq_n_u8(255);
+    uint8x16_t bestIndex = vdupq_n_u8(0);
+    for(uint32_t paletteIndex = 0; paletteIndex < 8; ++paletteIndex)
     {
-        const size_t glyphIndex = sortIndex[i];
-        assert(glyphInfo[glyphIndex].HasSprite());
-        packer.AddSprite(glyphInfo[glyphIndex].TexturePos, glyphInfo[glyphIndex].BlackBoxSize);
+        const uint8x16_t diff = vabdq_u8(texelVec, vdupq_n_u8(palette[paletteIndex]));
+        bestIndex = vbslq_u8(vcltq_u8(diff, bestError), vdupq_n_u8((uint8_t)paletteIndex), bestIndex);
+        bestError = vminq_u8(bestError, diff);
     }
+    vst1q_u8(outIndices, bestIndex);
+    const uint16x8_t errorLo = vmull_u8(vget_low_u8(bestError), vget_low_u8(bestError));
+    const uint16x8_t errorHi = vmull_u8(vget_high_u8(bestError), vget_high_u8(bestError));
+    return vaddvq_u32(vaddq_u32(vpaddlq_u16(errorLo), vpaddlq_u16(errorHi)));
+}
 
-    m_TextureSize.y = packer.GetTextureSizeY();
-    const vec2 textureSizeInv = vec2(1.f / (float)m_TextureSize.x, 1.f / (float)m_TextureSize.y);
-    m_TextureRowPitch = AlignUp<uint32_t>(m_TextureSize.x, 4);
-    m_TextureData.resize(m_TextureRowPitch * m_TextureSize.y);
+#else
 
-    for(size_t i = 1; i < CHAR_COUNT; ++i)
+static uint32_t FindBc4IndicesScalar(uint8_t outIndices[16], const uint8_t texels[16], const uint8_t palette[8])
+{
+    uint32_t error = 0;
+    for(uint32_t texelIndex = 0; texelIndex < 16; ++texelIndex)
     {
-        if(glyphInfo[i].HasSprite())
+        uint32_t bestIndex = 0, bestError = UINT32_MAX;
+        for(uint32_t paletteIndex = 0; paletteIndex < 8; ++paletteIndex)
         {
-            const uint32_t glyphDataRowPitch = AlignUp<uint32_t>(glyphInfo[i].BlackBoxSize.x, 4);
-            BlitGray8Bitmap(m_TextureData.data(), m_TextureRowPitch, glyphInfo[i].TexturePos,
-                glyphData.data() + glyphInfo[i].DataOffset, glyphDataRowPitch, uvec2(0, 0), glyphInfo[i].BlackBoxSize);
-            m_CharInfo[i].TexCoordsRect = vec4(
-                (float)glyphInfo[i].TexturePos.x * textureSizeInv.x,
-                (float)glyphInfo[i].TexturePos.y * textureSizeInv.y,
-                (float)(glyphInfo[i].TexturePos.x + glyphInfo[i].BlackBoxSize.x) * textureSizeInv.x,
-                (float)(glyphInfo[i].TexturePos.y + glyphInfo[i].BlackBoxSize.y) * textureSizeInv.y);
-            if(desc.Flags & SFontDesc::FLAG_TEXTURE_FROM_LEFT_BOTTOM)
+            const int32_t diff = (int32_t)texels[texelIndex] - (int32_t)palette[paletteIndex];
+            const uint32_t currError = (uint32_t)(diff * diff);
+            if(currError < bestError)
             {
-                m_CharInfo[i].TexCoordsRect.y = 1.f - m_CharInfo[i].TexCoordsRect.y;
-                m_CharInfo[i].TexCoordsRect.w = 1.f - m_CharInfo[i].TexCoordsRect.w;
+                bestError = currError;
+                bestIndex = paletteIndex;
             }
         }
+        outIndices[texelIndex] = (uint8_t)bestIndex;
+        error += bestError;
     }
-
-    if (!glyphInfo[L'?'].GlyphExists())
-        return false;
-    if (!glyphInfo[L'-'].GlyphExists())
-        return false;
-
-    // Take constant position from the center of '-' character as fill texcoord.
-    const SCharInfo& charInfo = m_CharInfo[L'-'];
-    m_FillTexCoords.x = (charInfo.TexCoordsRect.x + charInfo.TexCoordsRect.z) * 0.5f;
-    m_FillTexCoords.y = (charInfo.TexCoordsRect.y + charInfo.TexCoordsRect.w) * 0.5f;
-
-    // Replace unknown characters with '?' character.
-    for (size_t i = 0; i < CHAR_COUNT; i++)
-    {
-        if (!glyphInfo[i].GlyphExists())
-            m_CharInfo[i] = m_CharInfo[L'?'];
-    }
-
-    return true;
+    return error;
 }
 
-CFont::~CFont()
+#endif
+
+// Chooses nearest palette entry for each texel. Returns squared error.
+static uint32_t EncodeBc4BlockWithEndpoints(uint8_t outBlock[8], const uint8_t texels[16], uint32_t red0, uint32_t red1)
 {
+    uint8_t palette[8];
+    GetBc4Palette(palette, red0, red1);
+    uint8_t texelIndices[16];
+#if WIN_FONT_RENDER_SIMD_X86
+    const uint32_t error = FindBc4IndicesSse2(texelIndices, texels, palette);
+#elif WIN_FONT_RENDER_SIMD_NEON
+    const uint32_t error = FindBc4IndicesNeon(texelIndices, texels, palette);
+#else
+    const uint32_t error = FindBc4IndicesScalar(texelIndices, texels, palette);
+#endif
+    uint64_t indices = 0;
+    for(uint32_t texelIndex = 0; texelIndex < 16; ++texelIndex)
+        indices |= (uint64_t)texelIndices[texelIndex] << (texelIndex * 3);
+    outBlock[0] = (uint8_t)red0;
+    outBlock[1] = (uint8_t)red1;
+    for(uint32_t i = 0; i < 6; ++i)
+        outBlock[i + 2] = (uint8_t)(indices >> (i * 8));
+    return error;
 }
 
-float CFont::GetKerning(wchar_t firstCh, wchar_t secondCh) const
+/*
+Encodes block of 4x4 texels, trying both modes of BC4: 8 values between minimum and maximum,
+and 6 values between minimum and maximum excluding 0 and 255, plus exact 0 and 255, which suits antialiased edges well.
+Returns squared error.
+*/
+static uint32_t EncodeBc4Block(uint8_t outBlock[8], const uint8_t texels[16])
 {
-    size_t index = m_CharInfo[firstCh].KerningEntryFirstIndex;
-    if(index == SIZE_MAX)
-    {
-        return 0.f;
-    }
-    const size_t kerningEntryCount = m_KerningEntries.size();
-    for(; index < kerningEntryCount && m_KerningEntries[index].First == firstCh; ++index)
+    uint32_t minVal = 255, maxVal = 0, minInner = 255, maxInner = 0;
+    for(uint32_t i = 0; i < 16; ++i)
     {
-        if(m_KerningEntries[index].Second == secondCh)
+        const uint32_t val = texels[i];
+        minVal = std::min(minVal, val);
+        maxVal = std::max(maxVal, val);
+        if(val != 0 && val != 255)
         {
-            return m_KerningEntries[index].Amount;
+            minInner = std::min(minInner, val);
+            maxInner = std::max(maxInner, val);
         }
-        if(m_KerningEntries[index].Second > secondCh)
+    }
+    if(minVal == maxVal)
+        return EncodeBc4BlockWithEndpoints(outBlock, texels, minVal, maxVal);
+    uint32_t error = EncodeBc4BlockWithEndpoints(outBlock, texels, maxVal, minVal);
+    if(error > 0)
+    {
+        if(minInner > maxInner)
+            minInner = maxInner = minVal;
+        uint8_t block6[8];
+        const uint32_t error6 = EncodeBc4BlockWithEndpoints(block6, texels, minInner, maxInner);
+        if(error6 < error)
         {
-            break;
+            memcpy(outBlock, block6, 8);
+            error = error6;
         }
     }
-    return 0.f;
+    return error;
 }
 
-float CFont::CalcSingleLineTextWidth(const wstr_view& text, float fontSize) const
+/*
+Compresses texture of size divisible by 4 to BC4, in parallel over rows of blocks, on up to maxThreadCount threads if not 0.
+dstRowPitch is step between rows of blocks. Returns sum of squared errors of all texels.
+*/
+static uint64_t CompressBc4(uint8_t* dst, size_t dstRowPitch, const uint8_t* src, size_t srcRowPitch, const uvec2& size,
+    uint32_t maxThreadCount)
 {
-    float textWidth = 0.f;
-    wchar_t prevCh = 0;
-    for (size_t i = 0; i < text.length(); i++)
-    {
-        const wchar_t currCh = text[i];
-        textWidth += m_CharInfo[currCh].Advance;
-        if(prevCh)
+    const uvec2 blockCount = uvec2(size.x / 4, size.y / 4);
+    std::vector<uint64_t> rowErrors(blockCount.y);
+    ParallelFor(blockCount.y, GetWorkerThreadCount(blockCount.y, 16, maxThreadCount), [&](size_t blockY, uint32_t threadIndex) {
+        uint8_t texels[16];
+        uint64_t rowError = 0;
+        for(uint32_t blockX = 0; blockX < blockCount.x; ++blockX)
         {
-            textWidth += GetKerning(prevCh, currCh);
+            for(uint32_t y = 0; y < 4; ++y)
+                memcpy(texels + y * 4, src + (blockY * 4 + y) * srcRowPitch + blockX * 4, 4);
+            rowError += EncodeBc4Block(dst + blockY * dstRowPitch + blockX * 8, texels);
         }
-        prevCh = currCh;
-    }
-    return textWidth * fontSize;
+        rowErrors[blockY] = rowError;
+    });
+    uint64_t error = 0;
+    for(size_t i = 0; i < rowErrors.size(); ++i)
+        error += rowErrors[i];
+    return error;
 }
 
-void CFont::GetTextureData(const void*& outData, uvec2& outSize, size_t& outRowPitch) const
+////////////////////////////////////////////////////////////////////////////////
+// Baked fonts
+
+// Appends numbers to C++ code written by CFont::WriteBakedFont.
+static void AppendBakedUint(std::string& out, uint64_t value)
 {
-    if(!m_TextureData.empty())
+    char str[24];
+    snprintf(str, sizeof(str), "%llu", (unsigned long long)value);
+    out += str;
+}
+static void AppendBakedInt(std::string& out, int64_t value)
+{
+    char str[24];
+    snprintf(str, sizeof(str), "%lld", (long long)value);
+    out += str;
+}
+// With enough digits to be read back exactly.
+static void AppendBakedFloat(std::string& out, float value)
+{
+    assert(std::isfinite(value));
+    char str[32];
+    snprintf(str, sizeof(str), "%.9g", value);
+    out += str;
+    if(!strpbrk(str, ".e"))
+        out += '.';
+    out += 'f';
+}
+// Starts a new line every count elements of an array.
+static void AppendBakedSeparator(std::string& out, size_t index, size_t count)
+{
+    out += index % count == 0 ? "\n    " : " ";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Signed distance field
+
+static const float SDF_INFINITY = 1e20f;
+
+// Temporary buffers reused between characters processed by one thread.
+struct SSdfScratch
+{
+    std::vector<float> DistToInside, DistToOutside;
+    std::vector<float> Line, EnvelopeBounds;
+    std::vector<uint32_t> EnvelopeParabolas;
+    // Used with SFontDesc::FLAG_MSDF.
+    std::vector<SShapeSegment> Segments;
+    std::vector<SShapeContour> Contours;
+};
+
+/*
+Exact 1D squared Euclidean distance transform by Felzenszwalb and Huttenlocher.
+Calculates the lower envelope of parabolas rooted at each of n samples of f, then samples it.
+*/
+static void DistanceTransform1D(float* outD, const float* f, uint32_t n, uint32_t* v, float* z)
+{
+    uint32_t k = 0;
+    v[0] = 0;
+    z[0] = -SDF_INFINITY;
+    z[1] = SDF_INFINITY;
+    for(uint32_t q = 1; q < n; ++q)
     {
-        outData = m_TextureData.data();
-        outSize = m_TextureSize;
-        outRowPitch = m_TextureRowPitch;
+        const float fq = f[q] + (float)q * (float)q;
+        float s = (fq - (f[v[k]] + (float)v[k] * (float)v[k])) / (float)(2 * q - 2 * v[k]);
+        // z[0] is -infinity, so k never goes below 0.
+        while(s <= z[k])
+        {
+            --k;
+            s = (fq - (f[v[k]] + (float)v[k] * (float)v[k])) / (float)(2 * q - 2 * v[k]);
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = SDF_INFINITY;
     }
-    else
+    k = 0;
+    for(uint32_t q = 0; q < n; ++q)
     {
-        outData = nullptr;
-        outSize = UVEC2_ZERO;
-        outRowPitch = 0;
+        while(z[k + 1] < (float)q)
+            ++k;
+        const float dq = (float)q - (float)v[k];
+        outD[q] = dq * dq + f[v[k]];
     }
 }
 
-void CFont::FreeTextureData()
+/*
+2D transform in place of grid containing only 0 and SDF_INFINITY.
+For such input the column pass reduces to distance to nearest 0 in the column, found by sweeping down and up.
+The sweeps go over whole rows, so they vectorize well. The row pass is the full 1D transform.
+*/
+static void DistanceTransform2D(float* grid, const uvec2& size, SSdfScratch& scratch)
 {
-    std::vector<uint8_t> tmp;
-    m_TextureData.swap(tmp);
+    for(uint32_t y = 1; y < size.y; ++y)
+    {
+        float* const row = grid + y * size.x;
+        const float* const prevRow = row - size.x;
+        for(uint32_t x = 0; x < size.x; ++x)
+            row[x] = std::min(row[x], prevRow[x] + 1.f);
+    }
+    for(uint32_t y = size.y - 1; y-- > 0; )
+    {
+        float* const row = grid + y * size.x;
+        const float* const nextRow = row + size.x;
+        for(uint32_t x = 0; x < size.x; ++x)
+            row[x] = std::min(row[x], nextRow[x] + 1.f);
+    }
+    const size_t texelCount = (size_t)size.x * size.y;
+    for(size_t i = 0; i < texelCount; ++i)
+        grid[i] = std::min(grid[i] * grid[i], SDF_INFINITY);
+
+    scratch.Line.resize(size.x);
+    scratch.EnvelopeParabolas.resize(size.x);
+    scratch.EnvelopeBounds.resize(size.x + 1);
+    for(uint32_t y = 0; y < size.y; ++y)
+    {
+        float* const row = grid + y * size.x;
+        memcpy(scratch.Line.data(), row, size.x * sizeof(float));
+        DistanceTransform1D(row, scratch.Line.data(), size.x,
+            scratch.EnvelopeParabolas.data(), scratch.EnvelopeBounds.data());
+    }
 }
 
-bool CFont::LineSplit(
-    size_t *outBegin, size_t *outEnd, float *outWidth, size_t *inoutIndex,
-    const wstr_view& text,
-    float fontSize, uint32_t flags, float textWidth) const
+/*
+Calculates signed distance field of a character.
+src is coverage in GGO_GRAY8_BITMAP format (0..64), of size srcSize, rasterized at scale times the target resolution.
+dst receives dstSize texels, 0..255 with 128 on the edge. srcSize + 2 * spread * scale must fit in dstSize * scale.
+*/
+static void CalcSignedDistanceField(
+    uint8_t* dst, size_t dstRowPitch, const uvec2& dstSize,
+    const uint8_t* src, size_t srcRowPitch, const uvec2& srcSize,
+    uint32_t scale, uint32_t spread, SSdfScratch& scratch)
 {
-    assert(ValidateFlags(flags));
-
-    const size_t textLen = text.length();
-
-    if (*inoutIndex >= textLen)
+    const uint32_t padding = spread * scale;
+    const uvec2 gridSize = uvec2(dstSize.x * scale, dstSize.y * scale);
+    assert(srcSize.x + padding * 2 <= gridSize.x && srcSize.y + padding * 2 <= gridSize.y);
+    const size_t gridTexelCount = (size_t)gridSize.x * gridSize.y;
+
+    // Texels at least half covered are inside.
+    scratch.DistToInside.assign(gridTexelCount, SDF_INFINITY);
+    scratch.DistToOutside.assign(gridTexelCount, 0.f);
+    for(uint32_t y = 0; y < srcSize.y; ++y)
     {
-        return false;
+        const uint8_t* srcRow = src + y * srcRowPitch;
+        const size_t gridRowOffset = (size_t)(y + padding) * gridSize.x + padding;
+        for(uint32_t x = 0; x < srcSize.x; ++x)
+        {
+            if(srcRow[x] >= 32)
+            {
+                scratch.DistToInside[gridRowOffset + x] = 0.f;
+                scratch.DistToOutside[gridRowOffset + x] = SDF_INFINITY;
+            }
+        }
     }
-
-    *outBegin = *inoutIndex;
-    *outWidth = 0.f;
-
-    // Single line - special fast mode.
-    if (flags & FLAG_WRAP_SINGLE_LINE)
+    DistanceTransform2D(scratch.DistToInside.data(), gridSize, scratch);
+    DistanceTransform2D(scratch.DistToOutside.data(), gridSize, scratch);
+
+    // Distance of texel center to the edge is half a texel less than to the center of nearest texel on the other side.
+    // Positive inside. Stored in DistToInside.
+    float* const dist = scratch.DistToInside.data();
+    const float* const distToOutside = scratch.DistToOutside.data();
+    for(size_t i = 0; i < gridTexelCount; ++i)
+        dist[i] = (std::sqrt(distToOutside[i]) - std::sqrt(dist[i])) + (dist[i] > 0.f ? 0.5f : -0.5f);
+
+    // Downsample by averaging scale x scale blocks, then map -spread..spread texels to 0..255.
+    const float encodeScale = 127.f / ((float)spread * (float)(scale * scale) * (float)scale);
+    for(uint32_t dstY = 0; dstY < dstSize.y; ++dstY)
     {
-        wchar_t prevCh = 0;
-        while (*inoutIndex < textLen)
+        uint8_t* const dstRow = dst + dstY * dstRowPitch;
+        for(uint32_t dstX = 0; dstX < dstSize.x; ++dstX)
         {
-            const wchar_t currCh = text[*inoutIndex];
-            *outWidth += m_CharInfo[currCh].Advance;
-            if(prevCh)
+            float sum = 0.f;
+            for(uint32_t blockY = 0; blockY < scale; ++blockY)
             {
-                *outWidth += GetKerning(prevCh, currCh);
+                const float* blockRow = dist + (size_t)(dstY * scale + blockY) * gridSize.x + dstX * scale;
+                for(uint32_t blockX = 0; blockX < scale; ++blockX)
+                    sum += blockRow[blockX];
             }
-            prevCh = currCh;
-            (*inoutIndex)++;
+            const float val = 128.f + sum * encodeScale;
+            dstRow[dstX] = (uint8_t)std::min(std::max(val + 0.5f, 0.f), 255.f);
         }
-        *outEnd = *inoutIndex;
-        *outWidth *= fontSize;
-        return true;
     }
+}
 
-    wchar_t prevCh = 0;
-    // Remembered state from last occurence ofspace.
-    // Could be useful in case of wrapping on word boundary.
-    size_t lastSpaceIndex = std::wstring::npos;
-    float widthWhenLastSpace = 0.f;
-    for (;;)
+////////////////////////////////////////////////////////////////////////////////
+// Multi-channel signed distance field
+
+/*
+Ported from msdfgen by Viktor Chlumsky - https://github.com/Chlumsky/msdfgen: equation solvers MsdfSolveQuadratic and MsdfSolveCubic,
+distance to edges in MsdfEdgeDistance and MsdfPseudoDistance, edge coloring in MsdfSwitchColor and MsdfColorContour with its constants,
+and choice of channels per texel in CalcMultiChannelSignedDistanceField. That code is distributed under the following license:
+
+MIT License
+
+Copyright (c) 2014 - 2024 Viktor Chlumsky
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Vector in double precision, as distance to curves needs it.
+struct SMsdfVec
+{
+    double x, y;
+};
+static inline SMsdfVec MsdfAdd(const SMsdfVec& a, const SMsdfVec& b) { return SMsdfVec{a.x + b.x, a.y + b.y}; }
+static inline SMsdfVec MsdfSub(const SMsdfVec& a, const SMsdfVec& b) { return SMsdfVec{a.x - b.x, a.y - b.y}; }
+static inline SMsdfVec MsdfMul(const SMsdfVec& a, double b) { return SMsdfVec{a.x * b, a.y * b}; }
+static inline double MsdfDot(const SMsdfVec& a, const SMsdfVec& b) { return a.x * b.x + a.y * b.y; }
+static inline double MsdfCross(const SMsdfVec& a, const SMsdfVec& b) { return a.x * b.y - a.y * b.x; }
+static inline double MsdfLength(const SMsdfVec& a) { return std::sqrt(MsdfDot(a, a)); }
+static inline SMsdfVec MsdfNormalize(const SMsdfVec& a)
+{
+    const double len = MsdfLength(a);
+    return len > 0.0 ? MsdfMul(a, 1.0 / len) : SMsdfVec{0.0, 1.0};
+}
+
+// Bit flags of channels an edge contributes to.
+enum MSDF_COLOR
+{
+    MSDF_COLOR_BLACK = 0,
+    MSDF_COLOR_RED = 1,
+    MSDF_COLOR_GREEN = 2,
+    MSDF_COLOR_YELLOW = 3,
+    MSDF_COLOR_BLUE = 4,
+    MSDF_COLOR_MAGENTA = 5,
+    MSDF_COLOR_CYAN = 6,
+    MSDF_COLOR_WHITE = 7,
+};
+
+struct SMsdfEdge
+{
+    SMsdfVec P[3];
+    uint32_t Color;
+
+    SMsdfVec Point(double t) const
     {
-        // End of text
-        if (*inoutIndex >= textLen)
+        const double u = 1.0 - t;
+        return MsdfAdd(MsdfAdd(MsdfMul(P[0], u * u), MsdfMul(P[1], 2.0 * u * t)), MsdfMul(P[2], t * t));
+    }
+    SMsdfVec Direction(double t) const
+    {
+        const SMsdfVec dir = MsdfAdd(MsdfMul(MsdfSub(P[1], P[0]), 1.0 - t), MsdfMul(MsdfSub(P[2], P[1]), t));
+        // Control point coincides with an end point.
+        if(dir.x == 0.0 && dir.y == 0.0)
+            return MsdfSub(P[2], P[0]);
+        return dir;
+    }
+    // Part of the curve between parameters t0 and t1.
+    SMsdfEdge Split(double t0, double t1) const
+    {
+        const SMsdfVec p0 = Point(t0);
+        const SMsdfVec dir0 = MsdfAdd(MsdfMul(MsdfSub(P[1], P[0]), 1.0 - t0), MsdfMul(MsdfSub(P[2], P[1]), t0));
+        return SMsdfEdge{ { p0, MsdfAdd(p0, MsdfMul(dir0, t1 - t0)), Point(t1) }, Color };
+    }
+};
+
+// Distance to an edge, compared first by magnitude, then by how perpendicular the edge is, so the closer to perpendicular wins at shared corners.
+struct SMsdfDistance
+{
+    double Distance = -1e240;
+    double Dot = 1.0;
+
+    bool operator<(const SMsdfDistance& rhs) const
+    {
+        const double lhsAbs = std::abs(Distance), rhsAbs = std::abs(rhs.Distance);
+        return lhsAbs < rhsAbs || (lhsAbs == rhsAbs && Dot < rhs.Dot);
+    }
+};
+
+// Real roots of a*x^2 + b*x + c = 0. Returns their number.
+static int MsdfSolveQuadratic(double x[2], double a, double b, double c)
+{
+    if(a == 0.0 || std::abs(b) > 1e12 * std::abs(a))
+    {
+        if(b == 0.0)
+            return 0;
+        x[0] = -c / b;
+        return 1;
+    }
+    double discriminant = b * b - 4.0 * a * c;
+    if(discriminant > 0.0)
+    {
+        discriminant = std::sqrt(discriminant);
+        x[0] = (-b + discriminant) / (2.0 * a);
+        x[1] = (-b - discriminant) / (2.0 * a);
+        return 2;
+    }
+    if(discriminant == 0.0)
+    {
+        x[0] = -b / (2.0 * a);
+        return 1;
+    }
+    return 0;
+}
+
+// Real roots of a*x^3 + b*x^2 + c*x + d = 0. Returns their number.
+static int MsdfSolveCubic(double x[3], double a, double b, double c, double d)
+{
+    // When a is relatively small, treating it as zero gives smaller numerical error.
+    if(a == 0.0 || std::abs(b / a) >= 1e6)
+        return MsdfSolveQuadratic(x, b, c, d);
+    b /= a;
+    c /= a;
+    d /= a;
+    const double b2 = b * b;
+    double q = (b2 - 3.0 * c) / 9.0;
+    const double r = (b * (2.0 * b2 - 9.0 * c) + 27.0 * d) / 54.0;
+    const double r2 = r * r;
+    const double q3 = q * q * q;
+    b /= 3.0;
+    if(r2 < q3)
+    {
+        // Three real roots, trigonometric method.
+        const double angle = std::acos(std::min(std::max(r / std::sqrt(q3), -1.0), 1.0));
+        const double pi = 3.14159265358979323846;
+        q = -2.0 * std::sqrt(q);
+        x[0] = q * std::cos(angle / 3.0) - b;
+        x[1] = q * std::cos((angle + 2.0 * pi) / 3.0) - b;
+        x[2] = q * std::cos((angle - 2.0 * pi) / 3.0) - b;
+        return 3;
+    }
+    const double u = (r < 0.0 ? 1.0 : -1.0) * std::pow(std::abs(r) + std::sqrt(r2 - q3), 1.0 / 3.0);
+    const double v = u == 0.0 ? 0.0 : q / u;
+    x[0] = (u + v) - b;
+    if(u == v || std::abs(u - v) < 1e-12 * std::abs(u + v))
+    {
+        x[1] = -0.5 * (u + v) - b;
+        return 2;
+    }
+    return 1;
+}
+
+static inline double MsdfNonZeroSign(double val) { return val > 0.0 ? 1.0 : -1.0; }
+
+// Signed distance from origin to the edge, and parameter t of the closest point, which may lie outside 0..1 for end points.
+static SMsdfDistance MsdfEdgeDistance(const SMsdfEdge& edge, const SMsdfVec& origin, double& outParam)
+{
+    const SMsdfVec qa = MsdfSub(edge.P[0], origin);
+    const SMsdfVec ab = MsdfSub(edge.P[1], edge.P[0]);
+    const SMsdfVec br = MsdfSub(MsdfSub(edge.P[2], edge.P[1]), ab);
+    const double a = MsdfDot(br, br);
+    const double b = 3.0 * MsdfDot(ab, br);
+    const double c = 2.0 * MsdfDot(ab, ab) + MsdfDot(qa, br);
+    const double d = MsdfDot(qa, ab);
+    double t[3];
+    const int solutionCount = MsdfSolveCubic(t, a, b, c, d);
+
+    SMsdfVec endDir = edge.Direction(0.0);
+    double minDistance = MsdfNonZeroSign(MsdfCross(endDir, qa)) * MsdfLength(qa);
+    outParam = -MsdfDot(qa, endDir) / MsdfDot(endDir, endDir);
+    {
+        endDir = edge.Direction(1.0);
+        const SMsdfVec bq = MsdfSub(edge.P[2], origin);
+        const double distance = MsdfLength(bq);
+        if(distance < std::abs(minDistance))
         {
-            *outEnd = textLen;
-            break;
+            minDistance = MsdfNonZeroSign(MsdfCross(endDir, bq)) * distance;
+            outParam = MsdfDot(MsdfSub(origin, edge.P[1]), endDir) / MsdfDot(endDir, endDir);
+        }
+    }
+    for(int i = 0; i < solutionCount; ++i)
+    {
+        if(t[i] > 0.0 && t[i] < 1.0)
+        {
+            const SMsdfVec qe = MsdfAdd(MsdfAdd(qa, MsdfMul(ab, 2.0 * t[i])), MsdfMul(br, t[i] * t[i]));
+            const double distance = MsdfLength(qe);
+            if(distance <= std::abs(minDistance))
+            {
+                minDistance = MsdfNonZeroSign(MsdfCross(MsdfAdd(ab, MsdfMul(br, t[i])), qe)) * distance;
+                outParam = t[i];
+            }
         }
+    }
 
-        // Fetch character
-        const wchar_t currCh = text[*inoutIndex];
+    SMsdfDistance result;
+    result.Distance = minDistance;
+    if(outParam >= 0.0 && outParam <= 1.0)
+        result.Dot = 0.0;
+    else if(outParam < 0.5)
+        result.Dot = std::abs(MsdfDot(MsdfNormalize(edge.Direction(0.0)), MsdfNormalize(qa)));
+    else
+        result.Dot = std::abs(MsdfDot(MsdfNormalize(edge.Direction(1.0)), MsdfNormalize(MsdfSub(edge.P[2], origin))));
+    return result;
+}
 
-        // End of line
-        if (currCh == L'\n')
+/*
+Beyond end points, distance to the line extending the edge is used instead, if it's closer.
+That's what keeps corners sharp: two channels see two different edges meeting at the corner as infinite lines.
+*/
+static double MsdfPseudoDistance(const SMsdfEdge& edge, const SMsdfVec& origin, double distance, double param)
+{
+    if(param < 0.0)
+    {
+        const SMsdfVec dir = MsdfNormalize(edge.Direction(0.0));
+        const SMsdfVec aq = MsdfSub(origin, edge.P[0]);
+        if(MsdfDot(aq, dir) < 0.0)
         {
-            *outEnd = *inoutIndex;
-            (*inoutIndex)++;
-            break;
+            const double pseudoDistance = MsdfCross(aq, dir);
+            if(std::abs(pseudoDistance) <= std::abs(distance))
+                return pseudoDistance;
         }
-        // End of line '\result'
-        else if (currCh == L'\r')
+    }
+    else if(param > 1.0)
+    {
+        const SMsdfVec dir = MsdfNormalize(edge.Direction(1.0));
+        const SMsdfVec bq = MsdfSub(origin, edge.P[2]);
+        if(MsdfDot(bq, dir) > 0.0)
         {
-            *outEnd = *inoutIndex;
-            (*inoutIndex)++;
-            // Sequenfce "\result\n" - skip '\n'
-            if (*inoutIndex < textLen && text[*inoutIndex] == L'\n')
+            const double pseudoDistance = MsdfCross(bq, dir);
+            if(std::abs(pseudoDistance) <= std::abs(distance))
+                return pseudoDistance;
+        }
+    }
+    return distance;
+}
+
+// Cycles through CYAN, MAGENTA, YELLOW. If banned color shares exactly one channel with current one, the result avoids it.
+static void MsdfSwitchColor(uint32_t& color, uint32_t banned)
+{
+    const uint32_t combined = color & banned;
+    if(combined == MSDF_COLOR_RED || combined == MSDF_COLOR_GREEN || combined == MSDF_COLOR_BLUE)
+        color = combined ^ MSDF_COLOR_WHITE;
+    else if(color == MSDF_COLOR_BLACK || color == MSDF_COLOR_WHITE)
+        color = MSDF_COLOR_CYAN;
+    else
+    {
+        const uint32_t shifted = color << 1;
+        color = (shifted | shifted >> 3) & MSDF_COLOR_WHITE;
+    }
+}
+
+/*
+Assigns colors to edges of one contour so that edges meeting at a corner never share more than one channel.
+Smooth contours get WHITE. A contour with only one corner is split into three parts.
+*/
+static void MsdfColorContour(std::vector<SMsdfEdge>& edges, size_t firstEdge)
+{
+    // Angle between edges above which it is a corner, as sine of 3 radians.
+    const double crossThreshold = 0.14112;
+    size_t edgeCount = edges.size() - firstEdge;
+    SMsdfEdge* contourEdges = edges.data() + firstEdge;
+
+    std::vector<size_t> corners;
+    SMsdfVec prevDir = MsdfNormalize(contourEdges[edgeCount - 1].Direction(1.0));
+    for(size_t i = 0; i < edgeCount; ++i)
+    {
+        const SMsdfVec currDir = MsdfNormalize(contourEdges[i].Direction(0.0));
+        if(MsdfDot(prevDir, currDir) <= 0.0 || std::abs(MsdfCross(prevDir, currDir)) > crossThreshold)
+            corners.push_back(i);
+        prevDir = MsdfNormalize(contourEdges[i].Direction(1.0));
+    }
+
+    if(corners.empty())
+    {
+        for(size_t i = 0; i < edgeCount; ++i)
+            contourEdges[i].Color = MSDF_COLOR_WHITE;
+    }
+    else if(corners.size() == 1)
+    {
+        // Teardrop: color thirds of the contour MAGENTA, WHITE, YELLOW, splitting edges if there are too few.
+        const size_t corner = corners[0];
+        if(edgeCount < 3)
+        {
+            std::vector<SMsdfEdge> parts;
+            for(size_t i = 0; i < edgeCount; ++i)
             {
-                (*inoutIndex)++;
+                const SMsdfEdge& edge = contourEdges[(corner + i) % edgeCount];
+                parts.push_back(edge.Split(0.0, 1.0 / 3.0));
+                parts.push_back(edge.Split(1.0 / 3.0, 2.0 / 3.0));
+                parts.push_back(edge.Split(2.0 / 3.0, 1.0));
             }
-            break;
+            edges.resize(firstEdge);
+            edges.insert(edges.end(), parts.begin(), parts.end());
+            edgeCount = parts.size();
+            contourEdges = edges.data() + firstEdge;
+            for(size_t i = 0; i < edgeCount; ++i)
+                contourEdges[i].Color = i < edgeCount / 3 ? MSDF_COLOR_MAGENTA : i < edgeCount * 2 / 3 ? MSDF_COLOR_WHITE : MSDF_COLOR_YELLOW;
         }
-        // Other character
         else
         {
-            // Character width
-            const float charWidth = GetCharWidth_(currCh, fontSize);
-            const float kerning = prevCh ? GetKerning(prevCh, currCh, fontSize) : 0.f;
-
-            /*
-            If automatic word wrap is not enabled or
-            if it all fits or
-            it is a first character (protection against infinite loop when textWidth < width of first character) -
-            include it no matter what.
-            */
-            if ((flags & FLAG_WRAP_NORMAL) || *outWidth + charWidth + kerning <= textWidth || *inoutIndex == *outBegin)
+            const uint32_t colors[3] = { MSDF_COLOR_MAGENTA, MSDF_COLOR_WHITE, MSDF_COLOR_YELLOW };
+            for(size_t i = 0; i < edgeCount; ++i)
             {
-                // If this is space - remembers its data.
-                if (currCh == L' ')
-                {
-                    lastSpaceIndex = *inoutIndex;
-                    widthWhenLastSpace = *outWidth;
-                }
-                *outWidth += charWidth + kerning;
-                (*inoutIndex)++;
+                const int third = (int)(3.0 + 2.875 * (double)i / (double)(edgeCount - 1) - 1.4375 + 0.5) - 3;
+                contourEdges[(corner + i) % edgeCount].Color = colors[third + 1];
             }
-            // If automatic word wrap is enabled and it doesn't fit
-            else
+        }
+    }
+    else
+    {
+        // Switch color at each corner. Last part must also differ from the first one, which it meets.
+        const size_t cornerCount = corners.size();
+        size_t spline = 0;
+        const size_t start = corners[0];
+        uint32_t color = MSDF_COLOR_WHITE;
+        MsdfSwitchColor(color, MSDF_COLOR_BLACK);
+        const uint32_t initialColor = color;
+        for(size_t i = 0; i < edgeCount; ++i)
+        {
+            const size_t index = (start + i) % edgeCount;
+            if(spline + 1 < cornerCount && corners[spline + 1] == index)
             {
-                // The character that doesn't fit is space
-                if (currCh == L' ')
-                {
-                    *outEnd = *inoutIndex;
-                    // We can just skip it
-                    (*inoutIndex)++;
-                    break;
-                }
-                // Previous character before this one is space
-                else if (*inoutIndex > *outBegin && text[(*inoutIndex)-1] == L' ')
-                {
-                    // End will be at this space
-                    *outEnd = lastSpaceIndex;
-                    *outWidth = widthWhenLastSpace;
-                    break;
-                }
+                ++spline;
+                MsdfSwitchColor(color, spline == cornerCount - 1 ? initialColor : MSDF_COLOR_BLACK);
+            }
+            contourEdges[index].Color = color;
+        }
+    }
+}
 
-                // Wrapping lines on word boundaries
-                if (flags & FLAG_WRAP_WORD)
+void CalcMultiChannelSignedDistanceField(
+    uint8_t* dst, size_t dstRowPitch, const uvec2& size,
+    const SShapeContour* contours, size_t contourCount, float spread)
+{
+    assert(spread > 0.f);
+    std::vector<SMsdfEdge> edges;
+    // Twice the signed area of the shape. Its sign tells orientation of filled contours.
+    double doubleArea = 0.0;
+    for(size_t contourIndex = 0; contourIndex < contourCount; ++contourIndex)
+    {
+        const SShapeContour& contour = contours[contourIndex];
+        const size_t firstEdge = edges.size();
+        for(size_t i = 0; i < contour.SegmentCount; ++i)
+        {
+            const SShapeSegment& segment = contour.Segments[i];
+            SMsdfEdge edge = {};
+            for(uint32_t j = 0; j < 3; ++j)
+                edge.P[j] = SMsdfVec{segment.P[j].x, segment.P[j].y};
+            // Skip degenerate segments.
+            if(edge.P[0].x == edge.P[2].x && edge.P[0].y == edge.P[2].y &&
+                edge.P[0].x == edge.P[1].x && edge.P[0].y == edge.P[1].y)
+                continue;
+            doubleArea += MsdfCross(edge.P[0], edge.P[2]) +
+                2.0 / 3.0 * MsdfCross(MsdfSub(edge.P[1], edge.P[0]), MsdfSub(edge.P[2], edge.P[0]));
+            edges.push_back(edge);
+        }
+        if(edges.size() > firstEdge)
+            MsdfColorContour(edges, firstEdge);
+    }
+
+    // Distances are positive inside.
+    const double orientation = doubleArea > 0.0 ? -1.0 : 1.0;
+    const double encodeScale = 127.0 / (double)spread;
+    auto encode = [encodeScale](double distance) -> uint8_t {
+        return (uint8_t)std::min(std::max(128.0 + distance * encodeScale + 0.5, 0.0), 255.0);
+    };
+    for(uint32_t y = 0; y < size.y; ++y)
+    {
+        uint8_t* dstTexel = dst + y * dstRowPitch;
+        for(uint32_t x = 0; x < size.x; ++x, dstTexel += 4)
+        {
+            const SMsdfVec origin = SMsdfVec{(double)x + 0.5, (double)y + 0.5};
+            SMsdfDistance minDistance, minChannelDistance[3];
+            size_t minChannelEdge[3] = { SIZE_MAX, SIZE_MAX, SIZE_MAX };
+            double minChannelParam[3] = { 0.0, 0.0, 0.0 };
+            for(size_t edgeIndex = 0; edgeIndex < edges.size(); ++edgeIndex)
+            {
+                double param;
+                const SMsdfDistance distance = MsdfEdgeDistance(edges[edgeIndex], origin, param);
+                if(distance < minDistance)
+                    minDistance = distance;
+                for(uint32_t channel = 0; channel < 3; ++channel)
                 {
-                    // There was a space
-                    if (lastSpaceIndex != std::wstring::npos)
+                    if((edges[edgeIndex].Color & (1u << channel)) && distance < minChannelDistance[channel])
                     {
-                        // The end will be at that space
-                        *outEnd = lastSpaceIndex;
-                        *inoutIndex = lastSpaceIndex+1;
-                        *outWidth = widthWhenLastSpace;
-                        break;
+                        minChannelDistance[channel] = distance;
+                        minChannelEdge[channel] = edgeIndex;
+                        minChannelParam[channel] = param;
                     }
-                    // There was no space - well, it will wrap on character boundary
                 }
+            }
 
-                *outEnd = *inoutIndex;
-                break;
+            double channelDistance[3];
+            for(uint32_t channel = 0; channel < 3; ++channel)
+            {
+                channelDistance[channel] = minChannelEdge[channel] == SIZE_MAX ? minChannelDistance[channel].Distance :
+                    MsdfPseudoDistance(edges[minChannelEdge[channel]], origin,
+                        minChannelDistance[channel].Distance, minChannelParam[channel]);
+                dstTexel[channel] = encode(channelDistance[channel] * orientation);
             }
+            dstTexel[3] = encode(minDistance.Distance * orientation);
+
+            // Median of the channels must tell inside or outside correctly, at least at texel centers. Otherwise fall back to plain distance.
+            const uint8_t median = std::max(std::min(dstTexel[0], dstTexel[1]), std::min(std::max(dstTexel[0], dstTexel[1]), dstTexel[2]));
+            if((median >= 128) != (dstTexel[3] >= 128))
+                dstTexel[0] = dstTexel[1] = dstTexel[2] = dstTexel[3];
         }
-        prevCh = currCh;
     }
-
-    return true;
 }
 
-void CFont::CalcTextExtent(vec2& outExtent, const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const
+/*
+Converts outline returned by GetGlyphOutline with GGO_NATIVE to contours.
+Point (x, y) of the outline, in pixels relative to glyph origin with y up, becomes ((x - offset.x) * scale, (offset.y - y) * scale).
+*/
+static void ParseGlyphOutline(std::vector<SShapeSegment>& outSegments, std::vector<SShapeContour>& outContours,
+    const uint8_t* data, size_t dataSize, const vec2& offset, float scale)
 {
-    assert(ValidateFlags(flags));
+    outSegments.clear();
+    outContours.clear();
+    auto convert = [&offset, scale](const POINTFX& point) -> vec2 {
+        const float x = (float)point.x.value + (float)point.x.fract * (1.f / 65536.f);
+        const float y = (float)point.y.value + (float)point.y.fract * (1.f / 65536.f);
+        return vec2((x - offset.x) * scale, (offset.y - y) * scale);
+    };
+    auto addSegment = [&outSegments](const vec2& p0, const vec2& p1, const vec2& p2) {
+        SShapeSegment segment;
+        segment.P[0] = p0;
+        segment.P[1] = p1;
+        segment.P[2] = p2;
+        outSegments.push_back(segment);
+    };
+    auto addLine = [&addSegment](const vec2& p0, const vec2& p2) {
+        if(p0.x != p2.x || p0.y != p2.y)
+            addSegment(p0, vec2((p0.x + p2.x) * 0.5f, (p0.y + p2.y) * 0.5f), p2);
+    };
+    /*
+    Cubic Bezier curve, split into equal parts in t, each approximated by quadratic curve with control point (3 * (c1 + c2) - p0 - p3) / 4.
+    Error of such approximation is at most sqrt(3) / 36 * |p3 - 3 * c2 + 3 * c1 - p0|, which falls with cube of the number of parts,
+    so there are as many of them as needed to keep it below CUBIC_MAX_ERROR texels of the distance field.
+    */
+    auto addCubic = [&addSegment](const vec2& p0, const vec2& c1, const vec2& c2, const vec2& p3) {
+        const float CUBIC_MAX_ERROR = 1.f / 64.f;
+        const uint32_t CUBIC_MAX_PART_COUNT = 16;
+        // Curve as p0 + a * t + b * t^2 + c * t^3.
+        const vec2 a = vec2(3.f * (c1.x - p0.x), 3.f * (c1.y - p0.y));
+        const vec2 b = vec2(3.f * (c2.x - 2.f * c1.x + p0.x), 3.f * (c2.y - 2.f * c1.y + p0.y));
+        const vec2 c = vec2(p3.x - 3.f * c2.x + 3.f * c1.x - p0.x, p3.y - 3.f * c2.y + 3.f * c1.y - p0.y);
+        const float error = 0.0481125f * std::sqrt(c.x * c.x + c.y * c.y);
+        const uint32_t partCount = std::min(std::max(
+            (uint32_t)std::ceil(std::cbrt(error / CUBIC_MAX_ERROR)), 1u), CUBIC_MAX_PART_COUNT);
+        const float dt = 1.f / (float)partCount;
+        vec2 prevPoint = p0, prevDerivative = a;
+        for(uint32_t i = 1; i <= partCount; ++i)
+        {
+            const float t = (float)i * dt;
+            const vec2 point = i == partCount ? p3 : vec2(
+                p0.x + t * (a.x + t * (b.x + t * c.x)),
+                p0.y + t * (a.y + t * (b.y + t * c.y)));
+            const vec2 derivative = vec2(
+                a.x + t * (2.f * b.x + t * 3.f * c.x),
+                a.y + t * (2.f * b.y + t * 3.f * c.y));
+            // Control points of the part are prevPoint + prevDerivative * dt / 3 and point - derivative * dt / 3.
+            addSegment(prevPoint, vec2(
+                (prevPoint.x + point.x) * 0.5f + (prevDerivative.x - derivative.x) * dt * 0.25f,
+                (prevPoint.y + point.y) * 0.5f + (prevDerivative.y - derivative.y) * dt * 0.25f), point);
+            prevPoint = point;
+            prevDerivative = derivative;
+        }
+    };
 
-    if(text.empty() || fontSize == 0.f)
+    // Contour ranges are remembered as indices, as outSegments grows.
+    std::vector<size_t> contourEnds;
+    const uint8_t* const dataEnd = data + dataSize;
+    while(data + sizeof(TTPOLYGONHEADER) <= dataEnd)
     {
-        outExtent = VEC2_ZERO;
-        return;
+        const TTPOLYGONHEADER* header = (const TTPOLYGONHEADER*)data;
+        const uint8_t* const contourEnd = data + header->cb;
+        const vec2 start = convert(header->pfxStart);
+        vec2 curr = start;
+        const uint8_t* curveData = data + sizeof(TTPOLYGONHEADER);
+        while(curveData < contourEnd)
+        {
+            const TTPOLYCURVE* curve = (const TTPOLYCURVE*)curveData;
+            const uint32_t pointCount = curve->cpfx;
+            if(curve->wType == TT_PRIM_LINE)
+            {
+                for(uint32_t i = 0; i < pointCount; ++i)
+                {
+                    const vec2 next = convert(curve->apfx[i]);
+                    addLine(curr, next);
+                    curr = next;
+                }
+            }
+            else if(curve->wType == TT_PRIM_QSPLINE)
+            {
+                // B-spline: on-curve points between consecutive control points are implied in the middle.
+                for(uint32_t i = 0; i + 1 < pointCount; ++i)
+                {
+                    const vec2 control = convert(curve->apfx[i]);
+                    vec2 next = convert(curve->apfx[i + 1]);
+                    if(i + 2 < pointCount)
+                        next = vec2((control.x + next.x) * 0.5f, (control.y + next.y) * 0.5f);
+                    addSegment(curr, control, next);
+                    curr = next;
+                }
+            }
+            else if(curve->wType == TT_PRIM_CSPLINE)
+            {
+                // Cubic Bezier curves.
+                for(uint32_t i = 0; i + 2 < pointCount; i += 3)
+                {
+                    const vec2 next = convert(curve->apfx[i + 2]);
+                    addCubic(curr, convert(curve->apfx[i]), convert(curve->apfx[i + 1]), next);
+                    curr = next;
+                }
+            }
+            curveData += sizeof(WORD) * 2 + sizeof(POINTFX) * pointCount;
+        }
+        addLine(curr, start);
+        contourEnds.push_back(outSegments.size());
+        data = contourEnd;
     }
 
-    size_t lineBeg, lineEnd, index = 0;
-    float lineWidth;
-    float lineCount = 0.f;
-    outExtent.x = 0.0f;
-    while (LineSplit(&lineBeg, &lineEnd, &lineWidth, &index, text, fontSize, flags, textWidth))
+    size_t contourBegin = 0;
+    for(size_t i = 0; i < contourEnds.size(); ++i)
     {
-        lineCount += 1.f;
-        outExtent.x = std::max(outExtent.x, lineWidth);
+        if(contourEnds[i] > contourBegin)
+            outContours.push_back(SShapeContour{outSegments.data() + contourBegin, contourEnds[i] - contourBegin});
+        contourBegin = contourEnds[i];
     }
+}
 
-    if(lineCount > 0.f)
+// Size of distance field of a character whose bitmap or outline has black box of srcSize, padded by sdfSpread and downsampled by sdfScale.
+static uvec2 CalcDistanceFieldSize(const uvec2& srcSize, uint32_t sdfScale, uint32_t sdfSpread)
+{
+    const uint32_t padding = sdfSpread * sdfScale;
+    return uvec2(
+        (srcSize.x + padding * 2 + sdfScale - 1) / sdfScale,
+        (srcSize.y + padding * 2 + sdfScale - 1) / sdfScale);
+}
+
+/*
+Calculates distance field of one character, of size returned by CalcDistanceFieldSize, from its bitmap in GGO_GRAY8_BITMAP format,
+or with msdf from its outline in GGO_NATIVE format. srcSize and glyphOrigin are black box and origin returned with that data.
+*/
+static void CalcGlyphDistanceField(uint8_t* dst, size_t dstRowPitch, const uvec2& dstSize,
+    const uint8_t* src, size_t srcDataSize, const uvec2& srcSize, const ivec2& glyphOrigin,
+    bool msdf, uint32_t sdfScale, uint32_t sdfSpread, SSdfScratch& scratch)
+{
+    const uint32_t padding = sdfSpread * sdfScale;
+    if(msdf)
     {
-        outExtent.y = (lineCount + (lineCount - 1.f) * m_LineGap) * fontSize;
+        const vec2 outlineOffset = vec2(
+            (float)glyphOrigin.x - (float)padding,
+            (float)glyphOrigin.y + (float)padding);
+        ParseGlyphOutline(scratch.Segments, scratch.Contours, src, srcDataSize, outlineOffset, 1.f / (float)sdfScale);
+        CalcMultiChannelSignedDistanceField(dst, dstRowPitch, dstSize, scratch.Contours.data(), scratch.Contours.size(), (float)sdfSpread);
     }
     else
-        outExtent.y = 0.f;
+    {
+        CalcSignedDistanceField(dst, dstRowPitch, dstSize, src, AlignUp<uint32_t>(srcSize.x, 4), srcSize,
+            sdfScale, sdfSpread, scratch);
+    }
 }
 
-size_t CFont::CalcSingleLineQuadCount(const wstr_view& text, uint32_t flags) const
-{
-    assert(ValidateFlags(flags));
-
+////////////////////////////////////////////////////////////////////////////////
+// Internal class CSpritePacker
+
+// Base class of algorithms that pack sprites into a texture of constant width and growing height.
+class CSpritePacker
+{
+public:
+    virtual ~CSpritePacker() { }
+
+    uint32_t GetTextureSizeX() const { return m_TextureSizeX; }
+    uint32_t GetTextureSizeY() const { return m_Pow2 ? NextPow2(m_TextureSizeY + m_Margin) : m_TextureSizeY + m_Margin; }
+
+    // Sprites are separated by at least margin texels from each other and from the texture edges.
+    virtual void AddSprite(uvec2& outPos, const uvec2& size) = 0;
+
+protected:
+    const uint32_t m_TextureSizeX;
+    const uint32_t m_Margin;
+    // Bottom edge of the lowest sprite added so far.
+    uint32_t m_TextureSizeY;
+    const bool m_Pow2;
+
+    CSpritePacker(uint32_t textureSizeX, uint32_t margin, bool pow2) :
+        m_TextureSizeX(pow2 ? NextPow2(textureSizeX) : textureSizeX),
+        m_Margin(margin),
+        m_TextureSizeY(margin),
+        m_Pow2(pow2)
+    {
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal class CShelfPacker
+
+class CShelfPacker : public CSpritePacker
+{
+public:
+    CShelfPacker(uint32_t textureSizeX, uint32_t margin, bool pow2) :
+        CSpritePacker(textureSizeX, margin, pow2),
+        m_CurrPos(margin, margin)
+    {
+    }
+
+    virtual void AddSprite(uvec2& outPos, const uvec2& size);
+
+private:
+    uvec2 m_CurrPos;
+};
+
+void CShelfPacker::AddSprite(uvec2& outPos, const uvec2& size)
+{
+    assert(size.x + 2 * m_Margin <= m_TextureSizeX);
+    m_CurrPos.x += m_Margin;
+    if(m_CurrPos.x + size.x + m_Margin <= m_TextureSizeX)
+    {
+        outPos = m_CurrPos;
+        m_TextureSizeY = std::max(m_TextureSizeY, m_CurrPos.y + size.y);
+        m_CurrPos.x += size.x;
+    }
+    else
+    {
+        // Start a new row.
+        m_CurrPos = uvec2(0, m_TextureSizeY + m_Margin);
+        AddSprite(outPos, size);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal class CSkylinePacker
+
+class CSkylinePacker : public CSpritePacker
+{
+public:
+    CSkylinePacker(uint32_t textureSizeX, uint32_t margin, bool pow2) :
+        CSpritePacker(textureSizeX, margin, pow2)
+    {
+        m_Skyline.push_back(SNode{margin, margin, m_TextureSizeX - margin});
+    }
+
+    virtual void AddSprite(uvec2& outPos, const uvec2& size);
+
+private:
+    // Horizontal segment of the outline of already placed sprites. Y is the first free row below it.
+    struct SNode
+    {
+        uint32_t X, Y, Width;
+    };
+    // Sorted by X, covering whole width of the texture except left margin.
+    std::vector<SNode> m_Skyline;
+
+    // Calculates Y at which a sprite of given width can be placed starting from given node.
+    bool Fit(size_t nodeIndex, uint32_t width, uint32_t& outY) const;
+};
+
+bool CSkylinePacker::Fit(size_t nodeIndex, uint32_t width, uint32_t& outY) const
+{
+    if(m_Skyline[nodeIndex].X + width > m_TextureSizeX)
+        return false;
+    outY = 0;
+    for(size_t i = nodeIndex; width > 0; ++i)
+    {
+        assert(i < m_Skyline.size());
+        outY = std::max(outY, m_Skyline[i].Y);
+        width -= std::min(width, m_Skyline[i].Width);
+    }
+    return true;
+}
+
+void CSkylinePacker::AddSprite(uvec2& outPos, const uvec2& size)
+{
+    // Every sprite reserves margin at its right and bottom side.
+    const uint32_t width = size.x + m_Margin;
+    const uint32_t height = size.y + m_Margin;
+    assert(width + m_Margin <= m_TextureSizeX);
+
+    size_t bestIndex = SIZE_MAX;
+    uint32_t bestBottom = UINT32_MAX, bestWidth = UINT32_MAX;
+    for(size_t i = 0; i < m_Skyline.size(); ++i)
+    {
+        uint32_t y;
+        if(Fit(i, width, y))
+        {
+            const uint32_t bottom = y + height;
+            if(bottom < bestBottom || (bottom == bestBottom && m_Skyline[i].Width < bestWidth))
+            {
+                bestIndex = i;
+                bestBottom = bottom;
+                bestWidth = m_Skyline[i].Width;
+                outPos = uvec2(m_Skyline[i].X, y);
+            }
+        }
+    }
+    assert(bestIndex != SIZE_MAX);
+    m_TextureSizeY = std::max(m_TextureSizeY, outPos.y + size.y);
+
+    // Insert new node and cut away the nodes that it covers.
+    m_Skyline.insert(m_Skyline.begin() + bestIndex, SNode{outPos.x, bestBottom, width});
+    const uint32_t newNodeEnd = outPos.x + width;
+    for(size_t i = bestIndex + 1; i < m_Skyline.size() && m_Skyline[i].X < newNodeEnd; )
+    {
+        SNode& node = m_Skyline[i];
+        const uint32_t cut = newNodeEnd - node.X;
+        if(node.Width <= cut)
+        {
+            m_Skyline.erase(m_Skyline.begin() + i);
+        }
+        else
+        {
+            node.X += cut;
+            node.Width -= cut;
+            break;
+        }
+    }
+
+    // Merge neighbouring nodes at the same height.
+    for(size_t i = 0; i + 1 < m_Skyline.size(); )
+    {
+        if(m_Skyline[i].Y == m_Skyline[i + 1].Y)
+        {
+            m_Skyline[i].Width += m_Skyline[i + 1].Width;
+            m_Skyline.erase(m_Skyline.begin() + i + 1);
+        }
+        else
+            ++i;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal class CMaxRectsPacker
+
+class CMaxRectsPacker : public CSpritePacker
+{
+public:
+    CMaxRectsPacker(uint32_t textureSizeX, uint32_t margin, bool pow2) :
+        CSpritePacker(textureSizeX, margin, pow2)
+    {
+        // Height is unlimited. X + Width and Y + Height never overflow.
+        m_FreeRects.push_back(SRect{margin, margin, m_TextureSizeX - margin, UINT32_MAX - margin});
+    }
+
+    virtual void AddSprite(uvec2& outPos, const uvec2& size);
+
+private:
+    struct SRect
+    {
+        uint32_t X, Y, Width, Height;
+    };
+    // Maximal free rectangles. They can overlap each other, but none is contained in another one.
+    std::vector<SRect> m_FreeRects;
+
+    void SplitFreeRects(const SRect& usedRect);
+    void PruneFreeRects();
+};
+
+void CMaxRectsPacker::AddSprite(uvec2& outPos, const uvec2& size)
+{
+    // Every sprite reserves margin at its right and bottom side.
+    const uint32_t width = size.x + m_Margin;
+    const uint32_t height = size.y + m_Margin;
+    assert(width + m_Margin <= m_TextureSizeX);
+
+    // Bottom-left rule: choose position with lowest bottom edge, then leftmost.
+    size_t bestIndex = SIZE_MAX;
+    uint32_t bestBottom = UINT32_MAX, bestX = UINT32_MAX;
+    for(size_t i = 0; i < m_FreeRects.size(); ++i)
+    {
+        const SRect& freeRect = m_FreeRects[i];
+        if(freeRect.Width >= width && freeRect.Height >= height)
+        {
+            const uint32_t bottom = freeRect.Y + height;
+            if(bottom < bestBottom || (bottom == bestBottom && freeRect.X < bestX))
+            {
+                bestIndex = i;
+                bestBottom = bottom;
+                bestX = freeRect.X;
+            }
+        }
+    }
+    assert(bestIndex != SIZE_MAX);
+    outPos = uvec2(m_FreeRects[bestIndex].X, m_FreeRects[bestIndex].Y);
+    m_TextureSizeY = std::max(m_TextureSizeY, outPos.y + size.y);
+
+    SplitFreeRects(SRect{outPos.x, outPos.y, width, height});
+    PruneFreeRects();
+}
+
+void CMaxRectsPacker::SplitFreeRects(const SRect& usedRect)
+{
+    const uint32_t usedRight = usedRect.X + usedRect.Width;
+    const uint32_t usedBottom = usedRect.Y + usedRect.Height;
+    for(size_t i = m_FreeRects.size(); i--; )
+    {
+        const SRect freeRect = m_FreeRects[i];
+        const uint32_t freeRight = freeRect.X + freeRect.Width;
+        const uint32_t freeBottom = freeRect.Y + freeRect.Height;
+        if(usedRect.X >= freeRight || usedRight <= freeRect.X || usedRect.Y >= freeBottom || usedBottom <= freeRect.Y)
+            continue;
+
+        m_FreeRects.erase(m_FreeRects.begin() + i);
+        if(usedRect.X > freeRect.X)
+            m_FreeRects.push_back(SRect{freeRect.X, freeRect.Y, usedRect.X - freeRect.X, freeRect.Height});
+        if(usedRight < freeRight)
+            m_FreeRects.push_back(SRect{usedRight, freeRect.Y, freeRight - usedRight, freeRect.Height});
+        if(usedRect.Y > freeRect.Y)
+            m_FreeRects.push_back(SRect{freeRect.X, freeRect.Y, freeRect.Width, usedRect.Y - freeRect.Y});
+        if(usedBottom < freeBottom)
+            m_FreeRects.push_back(SRect{freeRect.X, usedBottom, freeRect.Width, freeBottom - usedBottom});
+    }
+}
+
+void CMaxRectsPacker::PruneFreeRects()
+{
+    const auto contains = [](const SRect& outer, const SRect& inner) -> bool {
+        return inner.X >= outer.X && inner.Y >= outer.Y &&
+            inner.X + inner.Width <= outer.X + outer.Width &&
+            inner.Y + inner.Height <= outer.Y + outer.Height;
+    };
+    for(size_t i = 0; i < m_FreeRects.size(); ++i)
+    {
+        for(size_t j = i + 1; j < m_FreeRects.size(); )
+        {
+            if(contains(m_FreeRects[i], m_FreeRects[j]))
+            {
+                m_FreeRects.erase(m_FreeRects.begin() + j);
+            }
+            else if(contains(m_FreeRects[j], m_FreeRects[i]))
+            {
+                m_FreeRects.erase(m_FreeRects.begin() + i);
+                --i;
+                break;
+            }
+            else
+                ++j;
+        }
+    }
+}
+
+static std::unique_ptr<CSpritePacker> CreateSpritePacker(SFontDesc::PACKING packing, uint32_t textureSizeX, uint32_t margin, bool pow2)
+{
+    switch(packing)
+    {
+    case SFontDesc::PACKING_SKYLINE:
+        return std::unique_ptr<CSpritePacker>(new CSkylinePacker(textureSizeX, margin, pow2));
+    case SFontDesc::PACKING_MAX_RECTS:
+        return std::unique_ptr<CSpritePacker>(new CMaxRectsPacker(textureSizeX, margin, pow2));
+    default:
+        assert(packing == SFontDesc::PACKING_SHELF);
+        return std::unique_ptr<CSpritePacker>(new CShelfPacker(textureSizeX, margin, pow2));
+    }
+}
+
+/*
+Packs sprites of given sizes, in given order, into texture pages of given width.
+When a sprite would make the page taller than maxTextureSizeY, next page is started.
+All pages have the same size, returned as outTextureSize.
+Returns false if more than maxPageCount pages would be needed.
+*/
+static bool PackSprites(std::vector<uvec2>& outPositions, std::vector<uint32_t>& outPages,
+    uvec2& outTextureSize, uint32_t& outPageCount,
+    const std::vector<uvec2>& sizes, SFontDesc::PACKING packing,
+    uint32_t textureSizeX, uint32_t margin, bool pow2, uint32_t maxTextureSizeY, uint32_t maxPageCount)
+{
+    std::unique_ptr<CSpritePacker> packer = CreateSpritePacker(packing, textureSizeX, margin, pow2);
+    outPositions.resize(sizes.size());
+    outPages.resize(sizes.size());
+    outTextureSize = uvec2(packer->GetTextureSizeX(), 0);
+    outPageCount = 1;
+    uint32_t pageSizeY = packer->GetTextureSizeY();
+    for(size_t i = 0; i < sizes.size(); ++i)
+    {
+        packer->AddSprite(outPositions[i], sizes[i]);
+        if(packer->GetTextureSizeY() > maxTextureSizeY)
+        {
+            // Packers can only grow, so size before this sprite is final size of the page.
+            if(outPageCount == maxPageCount)
+                return false;
+            outTextureSize.y = std::max(outTextureSize.y, pageSizeY);
+            ++outPageCount;
+            packer = CreateSpritePacker(packing, textureSizeX, margin, pow2);
+            packer->AddSprite(outPositions[i], sizes[i]);
+            if(packer->GetTextureSizeY() > maxTextureSizeY)
+                return false;
+        }
+        outPages[i] = outPageCount - 1;
+        pageSizeY = packer->GetTextureSizeY();
+    }
+    outTextureSize.y = std::max(outTextureSize.y, pageSizeY);
+    return true;
+}
+
+/*
+Returns texture widths worth trying when packing sprites of given sizes with given maximum texture size.
+With pow2, these are all powers of 2 that fit the widest sprite.
+Otherwise, also the width of the widest sprite and widths around the square root of the total area, giving square-ish textures.
+Returns false if the widest sprite doesn't fit in maxTextureSize.
+*/
+static bool GetTextureSizeXCandidates(std::vector<uint32_t>& outSizesX,
+    const std::vector<uvec2>& sizes, uint32_t margin, bool pow2, uint32_t maxTextureSize)
+{
+    uint32_t minSizeX = 0;
+    uint64_t area = 0;
+    for(size_t i = 0; i < sizes.size(); ++i)
+    {
+        minSizeX = std::max(minSizeX, sizes[i].x + margin * 2);
+        area += (uint64_t)(sizes[i].x + margin) * (sizes[i].y + margin);
+    }
+
+    outSizesX.clear();
+    if(minSizeX > maxTextureSize)
+        return false;
+    for(uint64_t sizeX = NextPow2(minSizeX); sizeX <= maxTextureSize; sizeX *= 2)
+        outSizesX.push_back((uint32_t)sizeX);
+    if(!pow2)
+    {
+        outSizesX.push_back(minSizeX);
+        static const float squareFactors[] = { 0.85f, 1.f, 1.1f, 1.25f, 1.5f, 2.f, 3.f };
+        const float squareSizeX = sqrtf((float)area);
+        for(size_t i = 0; i < _countof(squareFactors); ++i)
+        {
+            // Widths narrower than the widest sprite can't pack it, so they are skipped rather than clamped.
+            const uint32_t sizeX = std::min(AlignUp<uint32_t>((uint32_t)(squareSizeX * squareFactors[i]), 4), maxTextureSize);
+            if(sizeX >= minSizeX)
+                outSizesX.push_back(sizeX);
+        }
+        std::sort(outSizesX.begin(), outSizesX.end());
+        outSizesX.erase(std::unique(outSizesX.begin(), outSizesX.end()), outSizesX.end());
+    }
+    return !outSizesX.empty();
+}
+
+/*
+Packs sprites of given sizes, sorted by height descending, into texture pages.
+If maxTextureSize is 0, texture has width textureSizeX and single page.
+Otherwise, multiple widths are tried and the one giving least pages, then smallest area is chosen.
+*/
+static CFont::INIT_RESULT PackAtlas(std::vector<uvec2>& outPositions, std::vector<uint32_t>& outPages,
+    uvec2& outTextureSize, uint32_t& outPageCount,
+    const std::vector<uvec2>& sizes, SFontDesc::PACKING packing, uint32_t textureSizeX,
+    uint32_t margin, bool pow2, uint32_t maxTextureSize, uint32_t maxPageCount)
+{
+    if(maxTextureSize == 0)
+    {
+        PackSprites(outPositions, outPages, outTextureSize, outPageCount, sizes, packing,
+            textureSizeX, margin, pow2, UINT32_MAX, 1);
+        return CFont::INIT_RESULT_SUCCESS;
+    }
+
+    // Sprite sizes are already known, so candidate widths are tried without involving GDI again.
+    std::vector<uint32_t> textureSizeXCandidates;
+    if(!GetTextureSizeXCandidates(textureSizeXCandidates, sizes, margin, pow2, maxTextureSize) ||
+        sizes[0].y + margin * 2 > maxTextureSize)
+        return CFont::INIT_RESULT_CHARACTER_TOO_LARGE;
+
+    maxPageCount = std::max(maxPageCount, 1u);
+    std::vector<uvec2> currPositions;
+    std::vector<uint32_t> currPages;
+    uvec2 currTextureSize;
+    uint32_t currPageCount;
+    uint32_t bestPageCount = UINT32_MAX;
+    uint64_t bestArea = UINT64_MAX;
+    for(size_t i = 0; i < textureSizeXCandidates.size(); ++i)
+    {
+        const uint32_t sizeX = textureSizeXCandidates[i];
+        // Texture can't be lower than the tallest sprite, which is first.
+        if(bestPageCount == 1 && (uint64_t)sizeX * (sizes[0].y + margin * 2) > bestArea)
+            continue;
+        if(PackSprites(currPositions, currPages, currTextureSize, currPageCount, sizes, packing,
+            sizeX, margin, pow2, maxTextureSize, maxPageCount))
+        {
+            const uint64_t currArea = (uint64_t)currTextureSize.x * currTextureSize.y * currPageCount;
+            // Prefer less pages, then smaller area, then more square texture.
+            if(currPageCount < bestPageCount ||
+                (currPageCount == bestPageCount && (currArea < bestArea ||
+                    (currArea == bestArea && std::max(currTextureSize.x, currTextureSize.y) < std::max(outTextureSize.x, outTextureSize.y)))))
+            {
+                bestPageCount = currPageCount;
+                bestArea = currArea;
+                outTextureSize = currTextureSize;
+                outPageCount = currPageCount;
+                outPositions.swap(currPositions);
+                outPages.swap(currPages);
+            }
+        }
+    }
+    if(bestPageCount == UINT32_MAX)
+        return CFont::INIT_RESULT_TEXTURE_TOO_SMALL;
+    return CFont::INIT_RESULT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// class CFont
+
+bool CFont::ValidateFlags(uint32_t flags)
+{
+    uint8_t count = 0;
+    if(flags & FLAG_WRAP_SINGLE_LINE) ++count;
+    if(flags & FLAG_WRAP_NORMAL) ++count;
+    if(flags & FLAG_WRAP_CHAR) ++count;
+    if(flags & FLAG_WRAP_WORD) ++count;
+    if(count != 1) return false;
+
+    count = 0;
+    if(flags & FLAG_HLEFT) ++count;
+    if(flags & FLAG_HCENTER) ++count;
+    if(flags & FLAG_HRIGHT) ++count;
+    if(count != 1) return false;
+
+    count = 0;
+    if(flags & FLAG_VTOP) ++count;
+    if(flags & FLAG_VMIDDLE) ++count;
+    if(flags & FLAG_VBOTTOM) ++count;
+    if(count != 1) return false;
+
+    return true;
+}
+
+CFont::CFont()
+{
+    ResetCharPages();
+    ResetKerning();
+}
+
+bool CFont::Init(const SFontDesc& desc)
+{
+    WaitInitAsync();
+    m_InitCanceled = false;
+    return InitInternal(desc);
+}
+
+std::shared_future<bool> CFont::InitAsync(const SFontDesc& desc)
+{
+    assert(!desc.FaceName.empty() && desc.Height > 0);
+    WaitInitAsync();
+    m_InitCanceled = false;
+    m_MetricsReady = false;
+    m_InitRasterizedCharCount = 0;
+    m_InitCharCount = 0;
+
+    // Strings and arrays pointed by desc may not live until the background thread uses them.
+    std::wstring faceName;
+    desc.FaceName.to_string(faceName);
+    std::vector<wchar_t> charRanges;
+    if(desc.CharRangeCount && desc.CharRanges)
+        charRanges.assign(desc.CharRanges, desc.CharRanges + desc.CharRangeCount * 2);
+    m_InitFuture = std::async(std::launch::async, [this, desc, faceName, charRanges]() -> bool {
+        SFontDesc asyncDesc = desc;
+        asyncDesc.FaceName = wstr_view(faceName);
+        asyncDesc.CharRanges = charRanges.empty() ? nullptr : charRanges.data();
+        return InitInternal(asyncDesc);
+    }).share();
+    return m_InitFuture;
+}
+
+void CFont::WaitInitAsync()
+{
+    if(m_InitFuture.valid())
+    {
+        m_InitFuture.wait();
+        m_InitFuture = std::shared_future<bool>();
+    }
+}
+
+void CFont::GetInitProgress(uint32_t& outRasterizedCharCount, uint32_t& outCharCount) const
+{
+    outCharCount = m_InitCharCount;
+    outRasterizedCharCount = std::min<uint32_t>(m_InitRasterizedCharCount, outCharCount);
+}
+
+bool CFont::InitInternal(const SFontDesc& desc)
+{
+    assert(!desc.FaceName.empty() && desc.Height > 0);
+    const auto initBeginTime = std::chrono::high_resolution_clock::now();
+    m_MetricsReady = false;
+    m_InitRasterizedCharCount = 0;
+    m_InitCharCount = 0;
+
+    // Nothing of the previous Init is left, even if this one fails.
+    ResetCharPages();
+    ResetKerning();
+    m_DirtyRegions.clear();
+    m_TextureData.clear();
+    m_TextureMipLevels.clear();
+    m_AddChars.reset();
+    ReleaseDynamicAtlas();
+    RemoveFromAtlas();
+    const bool dynamic = (desc.Flags & SFontDesc::FLAG_DYNAMIC_ATLAS) != 0;
+    assert(!dynamic || (desc.MaxTextureSize && !desc.Atlas && desc.MipLevelCount <= 1));
+    assert(!desc.GetTextureDestination || (!dynamic && !desc.Atlas && desc.MipLevelCount <= 1));
+    const uint32_t mipLevelCount = CalcMipLevelCount(desc);
+    const bool sdf = (desc.Flags & SFontDesc::FLAG_SDF) != 0;
+    const bool msdf = (desc.Flags & SFontDesc::FLAG_MSDF) != 0;
+    // Glyphs of a shared atlas are needed until CFontAtlas::Build, while dynamic atlas rasterizes its own way.
+    const bool lowPeakMemory = (desc.Flags & SFontDesc::FLAG_LOW_PEAK_MEMORY) != 0 && !dynamic && !desc.Atlas;
+    assert(!(sdf || msdf) || (!dynamic && desc.SdfSpread > 0));
+    assert(!(sdf && msdf));
+    // Distance fields are calculated in this format, before they are put in the texture.
+    const TEXTURE_FORMAT glyphFormat = msdf ? TEXTURE_FORMAT_R8G8B8A8 : TEXTURE_FORMAT_R8;
+    // With Atlas, it changes to format of the atlas in CFontAtlas::Build.
+    m_TextureFormat = msdf || desc.Atlas ? glyphFormat : desc.TextureFormat;
+    assert(!dynamic || m_TextureFormat == TEXTURE_FORMAT_R8 || m_TextureFormat == TEXTURE_FORMAT_R8G8B8A8);
+    const bool bc4 = m_TextureFormat == TEXTURE_FORMAT_BC4;
+    // Format in which characters are composed into the texture, before compression or conversion of all mip levels.
+    const TEXTURE_FORMAT composeFormat = bc4 || (m_TextureFormat == TEXTURE_FORMAT_R4 && mipLevelCount > 1) ?
+        TEXTURE_FORMAT_R8 : m_TextureFormat;
+    m_CompressionTime = 0.f;
+    m_CompressionPsnr = 0.f;
+    // Size of the font created in GDI. Metrics are normalized by it, so they don't depend on SdfSupersampling.
+    const uint32_t sdfScale = (sdf || msdf) ? std::max(desc.SdfSupersampling, 1u) : 1;
+    const int gdiHeight = desc.Height * (int)sdfScale;
+    m_SdfCharCount = 0;
+    m_SdfTime = 0.f;
+    m_CompositionTime = 0.f;
+    m_InitTime = 0.f;
+    m_RasterizationTime = 0.f;
+    m_RasterizationThreadCount = 0;
+    m_InitPeakBytes = 0;
+
+    const ivec2 dummyBitmapSize = ivec2(32, 32);
+    // Rows top-down,
+    // for each row pixels from left to right,
+    // for each pixel components B, G, R = 0..255.
+    BITMAPINFO dummyBitmapInfo = { {
+            sizeof(BITMAPINFOHEADER), // biSize
+            dummyBitmapSize.x, -dummyBitmapSize.y, // biWidth, biHeight
+            1, // biPlanes
+            24, // biBitCount
+            BI_RGB, // biCompression
+            0, // biSizeImage
+            72, 72, // biXPelsPerMeter, biYPelsPerMeter
+            0, 0, // biClrUsed, biClrImportant
+        } };
+    unsigned char *dummyBitmapData = nullptr;
+    HBITMAP dummyBitmap = CreateDIBSection(NULL, &dummyBitmapInfo, DIB_RGB_COLORS, (void**)&dummyBitmapData, NULL, 0);
+    if(dummyBitmap == NULL)
+    {
+        m_InitResult = INIT_RESULT_GDI_ERROR;
+        return false;
+    }
+    HDC dc = CreateCompatibleDC(NULL);
+    if(dc == NULL)
+    {
+        DeleteObject(dummyBitmap);
+        m_InitResult = INIT_RESULT_GDI_ERROR;
+        return false;
+    }
+    HGDIOBJ oldBitmap = SelectObject(dc, dummyBitmap);
+    HGDIOBJ oldFont = NULL;
+    const float fontSizeInv = 1.f / (float)gdiHeight;
+    HFONT font = CreateGdiFont(desc, gdiHeight);
+    if(font == NULL)
+    {
+        SelectObject(dc, oldBitmap);
+        DeleteDC(dc);
+        DeleteObject(dummyBitmap);
+        m_InitResult = INIT_RESULT_GDI_ERROR;
+        return false;
+    }
+    oldFont = SelectObject(dc, font);
+    // Before m_MetricsReady, failure leaves the font empty, as documented for Init.
+    auto failEmpty = [this](INIT_RESULT result) -> bool {
+        ReleaseDynamicAtlas();
+        ResetCharPages();
+        ResetKerning();
+        m_InitResult = result;
+        return false;
+    };
+    // Unless the dynamic atlas takes them over, on success and on every failure from now on.
+    auto releaseGdi = [&]() {
+        SelectObject(dc, oldFont);
+        DeleteObject(font);
+        SelectObject(dc, oldBitmap);
+        DeleteDC(dc);
+        DeleteObject(dummyBitmap);
+    };
+
+    LONG ascent = 0, descent = 0, maxCharWidth = 0;
+    {
+        UINT size = GetOutlineTextMetrics(dc, 0, NULL);
+        assert(size >= sizeof(OUTLINETEXTMETRIC));
+        std::vector<char> buf(size);
+        GetOutlineTextMetrics(dc, size, (LPOUTLINETEXTMETRIC)buf.data());
+        const OUTLINETEXTMETRIC* outlineTextMetric = (const OUTLINETEXTMETRIC*)buf.data();
+
+        ascent  = outlineTextMetric->otmTextMetrics.tmAscent;
+        descent = outlineTextMetric->otmTextMetrics.tmDescent;
+        maxCharWidth = outlineTextMetric->otmTextMetrics.tmMaxCharWidth;
+
+        m_LineGap = outlineTextMetric->otmLineGap * fontSizeInv;
+    }
+
+    // Time and memory of Init depend only on the number of requested characters, not on CHAR_COUNT.
+    std::vector<uint16_t> requestedChars;
+    if(desc.CharRangeCount && desc.CharRanges)
+    {
+        // Character 0 is never rasterized.
+        auto getRangeBegin = [&desc](size_t rangeIndex) -> uint32_t {
+            return std::max<uint32_t>(desc.CharRanges[rangeIndex * 2], 1);
+        };
+        // Reserved once for all ranges. Reserving exact size for each range would reallocate every time.
+        size_t charCount = 0;
+        for(size_t rangeIndex = 0; rangeIndex < desc.CharRangeCount; ++rangeIndex)
+        {
+            const uint32_t rangeBegin = getRangeBegin(rangeIndex);
+            const uint32_t rangeEnd = desc.CharRanges[rangeIndex * 2 + 1];
+            if(rangeBegin <= rangeEnd)
+                charCount += rangeEnd - rangeBegin + 1;
+        }
+        requestedChars.reserve(charCount);
+        for(size_t rangeIndex = 0; rangeIndex < desc.CharRangeCount; ++rangeIndex)
+        {
+            const uint32_t rangeEnd = desc.CharRanges[rangeIndex * 2 + 1];
+            for(uint32_t i = getRangeBegin(rangeIndex); i <= rangeEnd; ++i)
+                requestedChars.push_back((uint16_t)i);
+        }
+        // Ranges may be unordered and overlap.
+        std::sort(requestedChars.begin(), requestedChars.end());
+        requestedChars.erase(std::unique(requestedChars.begin(), requestedChars.end()), requestedChars.end());
+    }
+    else
+    {
+        const size_t charMin = 32, charMax = 127;
+        for(size_t i = charMin; i <= charMax; ++i)
+            requestedChars.push_back((uint16_t)i);
+    }
+    assert(!requestedChars.empty());
+
+    // Allocate pages of character information only where some characters were requested.
+    m_CharInfoPageStorage.emplace_back(new SCharInfo[CHAR_PAGE_SIZE]());
+    m_CharMetricsPageStorage.emplace_back(new SCharMetrics[CHAR_PAGE_SIZE]());
+    for(size_t pageIndex = 0; pageIndex < CHAR_PAGE_COUNT; ++pageIndex)
+    {
+        m_CharInfoPages[pageIndex] = m_CharInfoPageStorage[0].get();
+        m_CharMetricsPages[pageIndex] = m_CharMetricsPageStorage[0].get();
+    }
+    for(size_t i = 0; i < requestedChars.size(); ++i)
+        EnsureCharPage((wchar_t)requestedChars[i]);
+
+    const auto rasterizationBeginTime = std::chrono::high_resolution_clock::now();
+    m_InitCharCount = (uint32_t)requestedChars.size();
+    // With FLAG_MSDF, outline is needed instead of the bitmap.
+    const UINT glyphDataFormat = msdf ? GGO_NATIVE : GGO_GRAY8_BITMAP;
+    // Element i describes requestedChars[i]. With lowPeakMemory, only their sizes are known until StreamGlyphs.
+    std::vector<SRasterizedGlyph> rasterizedGlyphs;
+    std::vector<uint8_t> glyphData;
+    if(!RasterizeGlyphs(rasterizedGlyphs, glyphData, m_RasterizationThreadCount,
+        dc, desc, gdiHeight, glyphDataFormat, requestedChars.data(), requestedChars.size(), lowPeakMemory, m_InitPeakBytes))
+    {
+        releaseGdi();
+        return failEmpty(INIT_RESULT_GDI_ERROR);
+    }
+    m_RasterizationTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - rasterizationBeginTime).count();
+
+    // With lowPeakMemory and distance field, sizes of bitmaps or outlines, for StreamGlyphs. rasterizedGlyphs get sizes of distance fields.
+    std::vector<SRasterizedGlyph> measuredGlyphs;
+    if((sdf || msdf) && lowPeakMemory)
+    {
+        measuredGlyphs = rasterizedGlyphs;
+        for(size_t i = 0; i < rasterizedGlyphs.size(); ++i)
+        {
+            if(rasterizedGlyphs[i].HasSprite())
+            {
+                rasterizedGlyphs[i].BlackBoxSize = CalcDistanceFieldSize(rasterizedGlyphs[i].BlackBoxSize, sdfScale, desc.SdfSpread);
+                ++m_SdfCharCount;
+            }
+        }
+    }
+    else if(sdf || msdf)
+    {
+        // Replace coverage or outline of each character with its distance field, downsampled to desc.Height and padded by SdfSpread.
+        const auto sdfBeginTime = std::chrono::high_resolution_clock::now();
+        m_SdfCharCount = CalcGlyphDistanceFields(rasterizedGlyphs, glyphData, msdf, sdfScale, desc.SdfSpread,
+            desc.MaxThreadCount, m_InitPeakBytes);
+        m_SdfTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - sdfBeginTime).count();
+    }
+
+    const uint32_t sdfPadding = (sdf || msdf) ? desc.SdfSpread * sdfScale : 0;
+    std::vector<uint16_t> existingChars;
+    existingChars.reserve(requestedChars.size());
+    for(size_t index = 0; index < rasterizedGlyphs.size(); ++index)
+    {
+        const SRasterizedGlyph& glyph = rasterizedGlyphs[index];
+        if(!glyph.Exists)
+            continue;
+        existingChars.push_back((uint16_t)glyph.Char);
+        SetRasterizedCharInfo(glyph, ascent, fontSizeInv, sdfPadding, sdfScale);
+    }
+
+    BuildKerning(dc, existingChars, fontSizeInv, (float)gdiHeight, dynamic);
+
+    if(dynamic)
+    {
+        m_Dynamic.reset(new SDynamicAtlas());
+        m_Dynamic->DC = dc;
+        m_Dynamic->DummyBitmap = dummyBitmap;
+        m_Dynamic->Font = font;
+        m_Dynamic->OldBitmap = oldBitmap;
+        m_Dynamic->OldFont = oldFont;
+        m_Dynamic->FontSize = desc.Height;
+        m_Dynamic->Ascent = ascent;
+        m_Dynamic->TextureFromLeftBottom = (desc.Flags & SFontDesc::FLAG_TEXTURE_FROM_LEFT_BOTTOM) != 0;
+    }
+    else
+        releaseGdi();
+
+    if(m_InitCanceled)
+        return failEmpty(INIT_RESULT_CANCELED);
+    auto hasSprite = [&requestedChars, &rasterizedGlyphs](wchar_t ch) -> bool {
+        const auto it = std::lower_bound(requestedChars.begin(), requestedChars.end(), (uint16_t)ch);
+        return it != requestedChars.end() && *it == ch && rasterizedGlyphs[it - requestedChars.begin()].HasSprite();
+    };
+    if(!hasSprite(L'?') || !hasSprite(L'-'))
+        return failEmpty(INIT_RESULT_MISSING_REQUIRED_CHARACTER);
+
+    FillMissingCharMetrics(existingChars);
+    // Text can be measured from now on, while the texture is created. Nothing below writes SCharMetrics or kerning.
+    m_MetricsReady = true;
+
+    // Indices to rasterizedGlyphs of characters that have pixels, tallest first.
+    std::vector<uint32_t> sortIndex;
+    sortIndex.reserve(rasterizedGlyphs.size());
+    for(uint32_t i = 0; i < (uint32_t)rasterizedGlyphs.size(); ++i)
+    {
+        if(rasterizedGlyphs[i].HasSprite())
+        {
+            sortIndex.push_back(i);
+        }
+    }
+    std::sort(sortIndex.begin(), sortIndex.end(), [&rasterizedGlyphs](uint32_t lhs, uint32_t rhs) -> bool {
+        return rasterizedGlyphs[lhs].BlackBoxSize.y > rasterizedGlyphs[rhs].BlackBoxSize.y;
+    });
+    // Characters in the same order.
+    std::vector<uint16_t> spriteChars(sortIndex.size());
+    for(size_t i = 0; i < sortIndex.size(); ++i)
+        spriteChars[i] = (uint16_t)rasterizedGlyphs[sortIndex[i]].Char;
+
+    const uint32_t margin = 1;
+    const bool pow2 = (desc.Flags & SFontDesc::FLAG_TEXTURE_POW2) != 0;
+    std::vector<uvec2> spriteSizes(sortIndex.size());
+    // Filled by packing, unless the font uses an atlas.
+    std::vector<uvec2> spritePositions;
+    std::vector<uint32_t> spritePages;
+    m_AtlasUsedTexels = 0;
+    for(uint32_t i = 0; i < sortIndex.size(); ++i)
+    {
+        const SRasterizedGlyph& glyph = rasterizedGlyphs[sortIndex[i]];
+        assert(glyph.HasSprite());
+        spriteSizes[i] = glyph.BlackBoxSize;
+        m_AtlasUsedTexels += glyph.BlackBoxSize.x * glyph.BlackBoxSize.y;
+    }
+
+    if(desc.Atlas)
+    {
+        // Characters are packed later by CFontAtlas::Build, together with characters of other fonts.
+        std::vector<const uint8_t*> spriteData(sortIndex.size());
+        for(uint32_t i = 0; i < sortIndex.size(); ++i)
+            spriteData[i] = glyphData.data() + rasterizedGlyphs[sortIndex[i]].DataOffset;
+        desc.Atlas->AddFont(this, desc.Height, glyphFormat, !sdf && !msdf,
+            spriteChars.data(), spriteSizes.data(), spriteData.data(), spriteChars.size());
+        m_Atlas = desc.Atlas;
+        m_TextureSize = UVEC2_ZERO;
+        m_TextureRowPitch = 0;
+        m_TexturePageCount = 1;
+        m_TextureData.clear();
+        m_PackingTime = 0.f;
+    }
+    else
+    {
+        const auto packingBeginTime = std::chrono::high_resolution_clock::now();
+        if(dynamic)
+        {
+            // Constant grid of cells, each able to hold any character.
+            const uint32_t textureSize = pow2 ? NextPow2(desc.MaxTextureSize + 1) / 2 : desc.MaxTextureSize;
+            m_TextureSize = uvec2(textureSize, textureSize);
+            m_TexturePageCount = 1;
+            uvec2& cellSize = m_Dynamic->CellSize;
+            cellSize = uvec2((uint32_t)maxCharWidth, (uint32_t)(ascent + descent));
+            for(size_t i = 0; i < spriteSizes.size(); ++i)
+            {
+                cellSize.x = std::max(cellSize.x, spriteSizes[i].x);
+                cellSize.y = std::max(cellSize.y, spriteSizes[i].y);
+            }
+            m_Dynamic->CellCountX = (textureSize - margin) / (cellSize.x + margin);
+            const uint32_t cellCountY = (textureSize - margin) / (cellSize.y + margin);
+            if((uint64_t)m_Dynamic->CellCountX * cellCountY < spriteSizes.size())
+            {
+                m_InitResult = INIT_RESULT_TEXTURE_TOO_SMALL;
+                return false;
+            }
+            m_Dynamic->Cells.resize(m_Dynamic->CellCountX * cellCountY);
+            spritePositions.resize(spriteSizes.size());
+            spritePages.assign(spriteSizes.size(), 0);
+            for(uint32_t i = 0; i < spriteSizes.size(); ++i)
+                spritePositions[i] = GetDynamicCellPos(i);
+        }
+        else if(mipLevelCount == 1 && !bc4)
+        {
+            const INIT_RESULT packResult = PackAtlas(spritePositions, spritePages, m_TextureSize, m_TexturePageCount,
+                spriteSizes, desc.Packing, (uint32_t)desc.Height * 8, margin, pow2, desc.MaxTextureSize, desc.MaxTexturePageCount);
+            if(packResult != INIT_RESULT_SUCCESS)
+            {
+                m_InitResult = packResult;
+                return false;
+            }
+        }
+        else
+        {
+            // Pack whole blocks, so each character with its gutter occupies whole texels on every mip level.
+            // With BC4, also whole 4x4 compressed blocks.
+            const uint32_t mipBlockSize = 1u << (mipLevelCount - 1);
+            const uint32_t blockSize = bc4 ? mipBlockSize * 4 : mipBlockSize;
+            const uint32_t gutter = std::max(mipBlockSize / 2, 1u);
+            std::vector<uvec2> blockCounts(spriteSizes.size());
+            for(size_t i = 0; i < spriteSizes.size(); ++i)
+            {
+                blockCounts[i] = uvec2(
+                    (spriteSizes[i].x + gutter * 2 + blockSize - 1) / blockSize,
+                    (spriteSizes[i].y + gutter * 2 + blockSize - 1) / blockSize);
+            }
+            const INIT_RESULT packResult = PackAtlas(spritePositions, spritePages, m_TextureSize, m_TexturePageCount,
+                blockCounts, desc.Packing, ((uint32_t)desc.Height * 8 + blockSize - 1) / blockSize, 0, pow2,
+                desc.MaxTextureSize / blockSize, desc.MaxTexturePageCount);
+            if(packResult != INIT_RESULT_SUCCESS)
+            {
+                m_InitResult = packResult;
+                return false;
+            }
+            m_TextureSize = uvec2(m_TextureSize.x * blockSize, m_TextureSize.y * blockSize);
+            for(size_t i = 0; i < spritePositions.size(); ++i)
+            {
+                spritePositions[i] = uvec2(
+                    spritePositions[i].x * blockSize + gutter,
+                    spritePositions[i].y * blockSize + gutter);
+            }
+        }
+        m_PackingTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - packingBeginTime).count();
+        if(m_InitCanceled)
+        {
+            m_InitResult = INIT_RESULT_CANCELED;
+            return false;
+        }
+        const vec2 textureSizeInv = vec2(1.f / (float)m_TextureSize.x, 1.f / (float)m_TextureSize.y);
+        const auto compositionBeginTime = std::chrono::high_resolution_clock::now();
+        STextureDestination destination;
+        if(desc.GetTextureDestination)
+        {
+            if(!desc.GetTextureDestination(desc.GetTextureDestinationUserData, m_TextureSize, m_TexturePageCount, m_TextureFormat, destination))
+            {
+                m_InitResult = INIT_RESULT_NO_TEXTURE_DESTINATION;
+                return false;
+            }
+            assert(destination.Data && destination.RowPitch >= GetTextureRowPitch(m_TextureFormat, m_TextureSize.x) &&
+                destination.PageStride >= destination.RowPitch * GetTextureRowCount(m_TextureFormat, m_TextureSize.y));
+        }
+        // Without conversion afterwards, characters are composed right in the destination.
+        uint8_t* composeData;
+        size_t composeRowPitch, composePageBytes;
+        if(destination.Data && composeFormat == m_TextureFormat)
+        {
+            composeData = (uint8_t*)destination.Data;
+            composeRowPitch = destination.RowPitch;
+            composePageBytes = destination.PageStride;
+            const size_t rowBytes = GetTextureRowPitch(composeFormat, m_TextureSize.x);
+            for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+                for(uint32_t y = 0; y < m_TextureSize.y; ++y)
+                    memset(composeData + composePageBytes * texturePage + composeRowPitch * y, 0, rowBytes);
+            m_TextureRowPitch = 0;
+            std::vector<uint8_t> tmp;
+            m_TextureData.swap(tmp);
+        }
+        else
+        {
+            m_TextureRowPitch = GetTextureRowPitch(composeFormat, m_TextureSize.x);
+            m_TextureData.assign(m_TextureRowPitch * m_TextureSize.y * m_TexturePageCount, 0);
+            composeData = m_TextureData.data();
+            composeRowPitch = m_TextureRowPitch;
+            composePageBytes = m_TextureRowPitch * m_TextureSize.y;
+        }
+
+        const size_t glyphInfoBytes = (rasterizedGlyphs.capacity() + measuredGlyphs.capacity()) * sizeof(SRasterizedGlyph);
+        if(lowPeakMemory)
+        {
+            if(!StreamGlyphs(measuredGlyphs.empty() ? rasterizedGlyphs : measuredGlyphs, sortIndex, spritePositions, spritePages,
+                composeData, composeRowPitch, composePageBytes, composeFormat, desc, gdiHeight, sdfScale,
+                glyphInfoBytes + m_TextureData.capacity(), m_InitPeakBytes, m_SdfTime))
+            {
+                m_InitResult = INIT_RESULT_GDI_ERROR;
+                return false;
+            }
+        }
+        else
+        {
+            // Characters don't share any bytes of the texture, so they can be copied in parallel.
+            ParallelFor(sortIndex.size(), GetWorkerThreadCount(sortIndex.size(), 256, desc.MaxThreadCount), [&](size_t spriteIndex, uint32_t threadIndex) {
+                const SRasterizedGlyph& glyph = rasterizedGlyphs[sortIndex[spriteIndex]];
+                ComposeGlyph(composeData + composePageBytes * spritePages[spriteIndex], composeRowPitch, spritePositions[spriteIndex], composeFormat,
+                    glyphData.data() + glyph.DataOffset, glyph.BlackBoxSize, sdf, msdf);
+            });
+            m_InitPeakBytes = std::max(m_InitPeakBytes, glyphInfoBytes + glyphData.capacity() + m_TextureData.capacity());
+            // Not needed anymore, freed before mip levels and compression allocate more.
+            std::vector<uint8_t>().swap(glyphData);
+        }
+        m_CompositionTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - compositionBeginTime).count();
+        if(m_InitCanceled)
+        {
+            m_InitResult = INIT_RESULT_CANCELED;
+            return false;
+        }
+
+        for(size_t i = 0; i < sortIndex.size(); ++i)
+        {
+            SCharInfo& charInfo = AccessCharInfo((wchar_t)spriteChars[i]);
+            charInfo.TexturePage = spritePages[i];
+            charInfo.TexCoordsRect = CalcTexCoordsRect(spritePositions[i], spriteSizes[i], textureSizeInv,
+                (desc.Flags & SFontDesc::FLAG_TEXTURE_FROM_LEFT_BOTTOM) != 0);
+        }
+
+        m_TextureMipLevels.resize(mipLevelCount - 1);
+        auto calcTextureBytes = [this]() -> size_t {
+            size_t bytes = m_TextureData.capacity();
+            for(size_t i = 0; i < m_TextureMipLevels.size(); ++i)
+                bytes += m_TextureMipLevels[i].capacity();
+            return bytes;
+        };
+        for(uint32_t level = 1; level < mipLevelCount; ++level)
+        {
+            const uvec2 srcSize = uvec2(m_TextureSize.x >> (level - 1), m_TextureSize.y >> (level - 1));
+            const size_t srcRowPitch = GetTextureRowPitch(composeFormat, srcSize.x);
+            const uint8_t* const src = level > 1 ? m_TextureMipLevels[level - 2].data() : m_TextureData.data();
+            const uvec2 dstSize = uvec2(srcSize.x / 2, srcSize.y / 2);
+            const size_t dstRowPitch = GetTextureRowPitch(composeFormat, dstSize.x);
+            std::vector<uint8_t>& dst = m_TextureMipLevels[level - 1];
+            dst.resize(dstRowPitch * dstSize.y * m_TexturePageCount);
+            m_InitPeakBytes = std::max(m_InitPeakBytes, calcTextureBytes());
+            for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+            {
+                if(composeFormat == TEXTURE_FORMAT_R8G8B8A8)
+                    DownsampleBox<4>(dst.data() + dstRowPitch * dstSize.y * texturePage, dstRowPitch, dstSize,
+                        src + srcRowPitch * srcSize.y * texturePage, srcRowPitch);
+                else
+                    DownsampleBox<1>(dst.data() + dstRowPitch * dstSize.y * texturePage, dstRowPitch, dstSize,
+                        src + srcRowPitch * srcSize.y * texturePage, srcRowPitch);
+            }
+        }
+
+        if(composeFormat != m_TextureFormat)
+        {
+            const auto compressionBeginTime = std::chrono::high_resolution_clock::now();
+            uint64_t error = 0;
+            for(uint32_t level = 0; level < mipLevelCount; ++level)
+            {
+                std::vector<uint8_t>& levelData = level > 0 ? m_TextureMipLevels[level - 1] : m_TextureData;
+                const uvec2 levelSize = uvec2(m_TextureSize.x >> level, m_TextureSize.y >> level);
+                const size_t srcRowPitch = GetTextureRowPitch(composeFormat, levelSize.x);
+                // Level 0 may go to the destination, leaving levelData empty.
+                const bool toDestination = level == 0 && destination.Data;
+                const size_t dstRowPitch = toDestination ? destination.RowPitch : GetTextureRowPitch(m_TextureFormat, levelSize.x);
+                const size_t dstPageBytes = toDestination ? destination.PageStride :
+                    dstRowPitch * GetTextureRowCount(m_TextureFormat, levelSize.y);
+                std::vector<uint8_t> convertedData(toDestination ? 0 : dstPageBytes * m_TexturePageCount);
+                m_InitPeakBytes = std::max(m_InitPeakBytes, calcTextureBytes() + convertedData.capacity());
+                uint8_t* const dstData = toDestination ? (uint8_t*)destination.Data : convertedData.data();
+                for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+                {
+                    uint8_t* const dstPage = dstData + dstPageBytes * texturePage;
+                    const uint8_t* const srcPage = levelData.data() + srcRowPitch * levelSize.y * texturePage;
+                    if(bc4)
+                    {
+                        const uint64_t pageError = CompressBc4(dstPage, dstRowPitch, srcPage, srcRowPitch, levelSize,
+                            desc.MaxThreadCount);
+                        if(level == 0)
+                            error += pageError;
+                    }
+                    else
+                        BlitBitmapToFormat<false>(dstPage, dstRowPitch, uvec2(0, 0), m_TextureFormat, TEXTURE_CHANNEL_ALL,
+                            srcPage, srcRowPitch, uvec2(0, 0), levelSize);
+                }
+                levelData.swap(convertedData);
+            }
+            m_TextureRowPitch = GetTextureRowPitch(m_TextureFormat, m_TextureSize.x);
+            if(bc4)
+            {
+                m_CompressionTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - compressionBeginTime).count();
+                const double texelCount = (double)m_TextureSize.x * m_TextureSize.y * m_TexturePageCount;
+                m_CompressionPsnr = error > 0 ? (float)(10.0 * std::log10(255.0 * 255.0 * texelCount / (double)error)) : INFINITY;
+            }
+        }
+
+        // Texture in the destination is not tracked.
+        if(!destination.Data)
+        {
+            for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+                AddDirtyRect(texturePage, uvec2(0, 0), m_TextureSize);
+        }
+
+        // Take constant position from the center of '-' character as fill texcoord.
+        const SCharInfo& charInfo = GetCharInfo(L'-');
+        m_FillTexCoords.x = (charInfo.TexCoordsRect.x + charInfo.TexCoordsRect.z) * 0.5f;
+        m_FillTexCoords.y = (charInfo.TexCoordsRect.y + charInfo.TexCoordsRect.w) * 0.5f;
+        m_FillTexturePage = charInfo.TexturePage;
+    }
+
+    // Now that '?' is in the texture, like metrics above. With Atlas, SetAtlasTexCoords does it again for texture coordinates.
+    FillMissingCharInfo(existingChars);
+    if(desc.Atlas)
+        m_AtlasExistingChars.swap(existingChars);
+
+    if(!dynamic && !desc.Atlas && !desc.GetTextureDestination && mipLevelCount == 1 && !bc4)
+    {
+        m_AddChars.reset(new SAddCharsState());
+        SAddCharsState& addChars = *m_AddChars;
+        desc.FaceName.to_string(addChars.FaceName);
+        addChars.Desc = desc;
+        addChars.Desc.FaceName = wstr_view(addChars.FaceName);
+        addChars.Desc.CharRangeCount = 0;
+        addChars.Desc.CharRanges = nullptr;
+        addChars.Ascent = ascent;
+        addChars.RequestedChars.swap(requestedChars);
+        addChars.ExistingChars.swap(existingChars);
+        addChars.PackedGlyphs.resize(sortIndex.size());
+        for(size_t i = 0; i < sortIndex.size(); ++i)
+            addChars.PackedGlyphs[i] = SPackedGlyph{(wchar_t)spriteChars[i], spritePages[i], spritePositions[i], spriteSizes[i]};
+    }
+
+    if(dynamic)
+    {
+        // Lookup table for any character that CacheText may meet.
+        m_Dynamic->CharCells.assign(CHAR_COUNT, (uint32_t)DYNAMIC_CHAR_UNKNOWN);
+        for(size_t i = 0; i < rasterizedGlyphs.size(); ++i)
+            m_Dynamic->CharCells[rasterizedGlyphs[i].Char] = rasterizedGlyphs[i].Exists ? DYNAMIC_CHAR_NO_SPRITE : DYNAMIC_CHAR_MISSING;
+        InitDynamicCells(spriteChars.data(), spriteChars.size());
+    }
+
+    m_InitTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - initBeginTime).count();
+    m_InitResult = INIT_RESULT_SUCCESS;
+    return true;
+}
+
+bool CFont::RasterizeGlyphs(std::vector<SRasterizedGlyph>& outGlyphs, std::vector<uint8_t>& outGlyphData, uint32_t& outThreadCount,
+    HDC dc, const SFontDesc& desc, int gdiHeight, UINT glyphDataFormat, const uint16_t* chars, size_t charCount,
+    bool measureOnly, size_t& inoutPeakBytes)
+{
+    /*
+    Characters are rasterized in parallel. Each thread uses its own DC and font and appends bitmaps to its own buffer.
+    Then they are merged in order of characters, so the result doesn't depend on threads.
+    */
+    const uint32_t threadCount = GetWorkerThreadCount(charCount, 64, desc.MaxThreadCount);
+    CGdiWorkerFonts workerFonts(dc, desc, gdiHeight, threadCount);
+    std::vector<std::vector<uint8_t>> threadGlyphData(threadCount);
+
+    outGlyphs.resize(charCount);
+    // Thread whose buffer contains data of each glyph.
+    std::vector<uint32_t> glyphThreadIndices(charCount);
+    std::atomic<bool> rasterError(!workerFonts.IsValid());
+    const MAT2 mat2 = { {0, 1}, {0, 0}, {0, 0}, {0, 1} };
+    if(!rasterError)
+    {
+        ParallelFor(charCount, threadCount, [&](size_t index, uint32_t threadIndex) {
+            const HDC threadDC = workerFonts.GetDC(threadIndex);
+            std::vector<uint8_t>& glyphData = threadGlyphData[threadIndex];
+            SRasterizedGlyph& glyph = outGlyphs[index];
+            const UINT ch = chars[index];
+            glyph.Char = (wchar_t)ch;
+            glyph.Metrics = GLYPHMETRICS{};
+            glyph.Exists = false;
+            glyph.DataOffset = 0;
+            glyph.DataSize = 0;
+            glyph.BlackBoxSize = uvec2(0, 0);
+            glyph.GlyphOrigin = ivec2(0, 0);
+            glyphThreadIndices[index] = threadIndex;
+            // Remaining characters are skipped, Init fails later.
+            if(m_InitCanceled)
+                return;
+            glyph.Exists = GetGlyphOutline(threadDC, ch, GGO_METRICS, &glyph.Metrics, 0, NULL, &mat2) != GDI_ERROR;
+            if(glyph.Exists && glyph.Metrics.gmBlackBoxX && glyph.Metrics.gmBlackBoxY)
+            {
+                GLYPHMETRICS dataMetrics = glyph.Metrics;
+                const DWORD dataSize = GetGlyphOutline(threadDC, ch, glyphDataFormat, &dataMetrics, 0, NULL, &mat2);
+                if(dataSize > 0 && dataSize != GDI_ERROR)
+                {
+                    glyph.DataSize = dataSize;
+                    glyph.BlackBoxSize = uvec2(dataMetrics.gmBlackBoxX, dataMetrics.gmBlackBoxY);
+                    glyph.GlyphOrigin = ivec2(dataMetrics.gmptGlyphOrigin.x, dataMetrics.gmptGlyphOrigin.y);
+                    if(!measureOnly)
+                    {
+                        glyph.DataOffset = glyphData.size();
+                        glyphData.resize(glyph.DataOffset + dataSize);
+                        const DWORD res = GetGlyphOutline(threadDC, ch, glyphDataFormat, &dataMetrics,
+                            dataSize, glyphData.data() + glyph.DataOffset, &mat2);
+                        if(res == 0 || res == GDI_ERROR)
+                            rasterError = true;
+                    }
+                }
+            }
+            ++m_InitRasterizedCharCount;
+        });
+    }
+    if(rasterError)
+        return false;
+    outThreadCount = threadCount;
+    if(measureOnly)
+    {
+        inoutPeakBytes = std::max(inoutPeakBytes, outGlyphs.capacity() * sizeof(SRasterizedGlyph));
+        return true;
+    }
+
+    // With a single thread, its buffer already has all bitmaps in order of characters.
+    if(threadCount == 1)
+        outGlyphData.swap(threadGlyphData[0]);
+    else
+    {
+        size_t glyphDataSize = 0;
+        for(uint32_t threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+            glyphDataSize += threadGlyphData[threadIndex].size();
+        outGlyphData.resize(glyphDataSize);
+    }
+    size_t glyphDataOffset = 0;
+    for(size_t index = 0; index < charCount; ++index)
+    {
+        SRasterizedGlyph& glyph = outGlyphs[index];
+        if(threadCount > 1 && glyph.DataSize)
+            memcpy(outGlyphData.data() + glyphDataOffset, threadGlyphData[glyphThreadIndices[index]].data() + glyph.DataOffset, glyph.DataSize);
+        glyph.DataOffset = glyphDataOffset;
+        glyphDataOffset += glyph.DataSize;
+    }
+    size_t peakBytes = outGlyphs.capacity() * sizeof(SRasterizedGlyph) + outGlyphData.capacity();
+    for(uint32_t threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        peakBytes += threadGlyphData[threadIndex].capacity();
+    inoutPeakBytes = std::max(inoutPeakBytes, peakBytes);
+    return true;
+}
+
+uint32_t CFont::CalcGlyphDistanceFields(std::vector<SRasterizedGlyph>& glyphs, std::vector<uint8_t>& glyphData,
+    bool msdf, uint32_t sdfScale, uint32_t sdfSpread, uint32_t maxThreadCount, size_t& inoutPeakBytes)
+{
+    const uint32_t glyphBytesPerTexel = GetTextureFormatBytesPerTexel(msdf ? TEXTURE_FORMAT_R8G8B8A8 : TEXTURE_FORMAT_R8);
+    struct SSdfChar
+    {
+        size_t GlyphIndex;
+        uvec2 DstSize;
+        size_t DstOffset;
+    };
+    std::vector<SSdfChar> sdfChars;
+    size_t sdfDataSize = 0;
+    for(size_t i = 0; i < glyphs.size(); ++i)
+    {
+        if(glyphs[i].HasSprite())
+        {
+            const uvec2 dstSize = CalcDistanceFieldSize(glyphs[i].BlackBoxSize, sdfScale, sdfSpread);
+            sdfChars.push_back(SSdfChar{i, dstSize, sdfDataSize});
+            sdfDataSize += AlignUp<uint32_t>(dstSize.x * glyphBytesPerTexel, 4) * dstSize.y;
+        }
+    }
+
+    std::vector<uint8_t> sdfData(sdfDataSize);
+    const uint32_t threadCount = GetWorkerThreadCount(sdfChars.size(), 16, maxThreadCount);
+    std::vector<SSdfScratch> scratch(threadCount);
+    ParallelFor(sdfChars.size(), threadCount, [&](size_t sdfCharIndex, uint32_t threadIndex) {
+        if(m_InitCanceled)
+            return;
+        const SSdfChar& sdfChar = sdfChars[sdfCharIndex];
+        const SRasterizedGlyph& glyph = glyphs[sdfChar.GlyphIndex];
+        CalcGlyphDistanceField(sdfData.data() + sdfChar.DstOffset, AlignUp<uint32_t>(sdfChar.DstSize.x * glyphBytesPerTexel, 4), sdfChar.DstSize,
+            glyphData.data() + glyph.DataOffset, glyph.DataSize, glyph.BlackBoxSize, glyph.GlyphOrigin,
+            msdf, sdfScale, sdfSpread, scratch[threadIndex]);
+    });
+    inoutPeakBytes = std::max(inoutPeakBytes, glyphs.capacity() * sizeof(SRasterizedGlyph) + glyphData.capacity() + sdfData.capacity());
+
+    for(size_t i = 0; i < sdfChars.size(); ++i)
+    {
+        const SSdfChar& sdfChar = sdfChars[i];
+        SRasterizedGlyph& glyph = glyphs[sdfChar.GlyphIndex];
+        glyph.DataOffset = sdfChar.DstOffset;
+        glyph.DataSize = AlignUp<uint32_t>(sdfChar.DstSize.x * glyphBytesPerTexel, 4) * sdfChar.DstSize.y;
+        glyph.BlackBoxSize = sdfChar.DstSize;
+    }
+    glyphData.swap(sdfData);
+    return (uint32_t)sdfChars.size();
+}
+
+bool CFont::StreamGlyphs(const std::vector<SRasterizedGlyph>& glyphs, const std::vector<uint32_t>& sortIndex,
+    const std::vector<uvec2>& spritePositions, const std::vector<uint32_t>& spritePages,
+    uint8_t* dstData, size_t dstRowPitch, size_t dstPageBytes, TEXTURE_FORMAT dstFormat,
+    const SFontDesc& desc, int gdiHeight, uint32_t sdfScale, size_t otherBytes, size_t& inoutPeakBytes, float& outSdfTime)
+{
+    const bool sdf = (desc.Flags & SFontDesc::FLAG_SDF) != 0;
+    const bool msdf = (desc.Flags & SFontDesc::FLAG_MSDF) != 0;
+    const UINT glyphDataFormat = msdf ? GGO_NATIVE : GGO_GRAY8_BITMAP;
+    const uint32_t sdfBytesPerTexel = GetTextureFormatBytesPerTexel(msdf ? TEXTURE_FORMAT_R8G8B8A8 : TEXTURE_FORMAT_R8);
+    const uint32_t threadCount = GetWorkerThreadCount(sortIndex.size(), 64, desc.MaxThreadCount);
+    CGdiWorkerFonts workerFonts(NULL, desc, gdiHeight, threadCount);
+    if(!workerFonts.IsValid())
+        return false;
+
+    // Buffers are reused by subsequent characters of the same thread.
+    struct SStreamThread
+    {
+        std::vector<uint8_t> GlyphData;
+        std::vector<uint8_t> SdfData;
+        SSdfScratch SdfScratch;
+        float SdfTime = 0.f;
+    };
+    std::vector<SStreamThread> threads(threadCount);
+    std::atomic<bool> rasterError(false);
+    const MAT2 mat2 = { {0, 1}, {0, 0}, {0, 0}, {0, 1} };
+    // Characters don't share any bytes of the texture, so they can be composed in parallel.
+    ParallelFor(sortIndex.size(), threadCount, [&](size_t spriteIndex, uint32_t threadIndex) {
+        if(m_InitCanceled)
+            return;
+        SStreamThread& thread = threads[threadIndex];
+        const SRasterizedGlyph& glyph = glyphs[sortIndex[spriteIndex]];
+        thread.GlyphData.resize(glyph.DataSize);
+        GLYPHMETRICS dataMetrics = glyph.Metrics;
+        const DWORD res = GetGlyphOutline(workerFonts.GetDC(threadIndex), (UINT)glyph.Char, glyphDataFormat, &dataMetrics,
+            (DWORD)glyph.DataSize, thread.GlyphData.data(), &mat2);
+        // Size must be the same as measured, as the character is already packed.
+        if(res == 0 || res == GDI_ERROR || dataMetrics.gmBlackBoxX != glyph.BlackBoxSize.x || dataMetrics.gmBlackBoxY != glyph.BlackBoxSize.y)
+        {
+            rasterError = true;
+            return;
+        }
+        uint8_t* const dstPage = dstData + dstPageBytes * spritePages[spriteIndex];
+        if(sdf || msdf)
+        {
+            const uvec2 sdfSize = CalcDistanceFieldSize(glyph.BlackBoxSize, sdfScale, desc.SdfSpread);
+            const size_t sdfRowPitch = AlignUp<uint32_t>(sdfSize.x * sdfBytesPerTexel, 4);
+            thread.SdfData.resize(sdfRowPitch * sdfSize.y);
+            const auto sdfBeginTime = std::chrono::high_resolution_clock::now();
+            CalcGlyphDistanceField(thread.SdfData.data(), sdfRowPitch, sdfSize,
+                thread.GlyphData.data(), glyph.DataSize, glyph.BlackBoxSize, glyph.GlyphOrigin,
+                msdf, sdfScale, desc.SdfSpread, thread.SdfScratch);
+            thread.SdfTime += std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - sdfBeginTime).count();
+            ComposeGlyph(dstPage, dstRowPitch, spritePositions[spriteIndex], dstFormat, thread.SdfData.data(), sdfSize, sdf, msdf);
+        }
+        else
+            ComposeGlyph(dstPage, dstRowPitch, spritePositions[spriteIndex], dstFormat, thread.GlyphData.data(), glyph.BlackBoxSize, false, false);
+    });
+
+    size_t peakBytes = otherBytes;
+    float sdfTime = 0.f;
+    for(uint32_t threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        peakBytes += threads[threadIndex].GlyphData.capacity() + threads[threadIndex].SdfData.capacity();
+        sdfTime += threads[threadIndex].SdfTime;
+    }
+    inoutPeakBytes = std::max(inoutPeakBytes, peakBytes);
+    outSdfTime = sdfTime / (float)threadCount;
+    return !rasterError;
+}
+
+void CFont::SetRasterizedCharInfo(const SRasterizedGlyph& glyph, LONG ascent, float fontSizeInv, uint32_t sdfPadding, uint32_t sdfScale)
+{
+    const GLYPHMETRICS& metrics = glyph.Metrics;
+    SCharInfo& charInfo = AccessCharInfo(glyph.Char);
+    //charInfo.TexCoordsRect still uninitialized.
+    charInfo.Advance = (float)metrics.gmCellIncX * fontSizeInv;
+    charInfo.Offset = vec2(
+        (float)metrics.gmptGlyphOrigin.x * fontSizeInv,
+        (float)(ascent - metrics.gmptGlyphOrigin.y) * fontSizeInv);
+    charInfo.Size = vec2(
+        (float)metrics.gmBlackBoxX * fontSizeInv,
+        (float)metrics.gmBlackBoxY * fontSizeInv);
+    // Distance field is padded and its size rounded up to whole texels.
+    if(sdfPadding && glyph.HasSprite())
+    {
+        charInfo.Offset.x -= (float)sdfPadding * fontSizeInv;
+        charInfo.Offset.y -= (float)sdfPadding * fontSizeInv;
+        charInfo.Size = vec2(
+            (float)(glyph.BlackBoxSize.x * sdfScale) * fontSizeInv,
+            (float)(glyph.BlackBoxSize.y * sdfScale) * fontSizeInv);
+    }
+    charInfo.KerningEntryFirstIndex = SIZE_MAX;
+    charInfo.TexturePage = 0;
+    charInfo.TextureChannel = 0;
+    AccessCharMetrics(glyph.Char).Advance = charInfo.Advance;
+}
+
+void CFont::FillMissingCharMetrics(const std::vector<uint16_t>& existingChars)
+{
+    // Missing characters keep their own kerning - only possible in dynamic mode. Copies must not inherit kerning of '?' itself.
+    SCharMetrics questionMarkMetrics = GetCharMetrics(L'?');
+    questionMarkMetrics.KerningBucket = 0;
+    questionMarkMetrics.KerningLeftClass = questionMarkMetrics.KerningRightClass = 0;
+    // Element 0 is the fallback page, made entirely of '?'. Only allocated pages need to be visited.
+    for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        m_CharMetricsPageStorage[0][i] = questionMarkMetrics;
+    size_t existingIndex = 0;
+    for(size_t pageIndex = 0; pageIndex < CHAR_PAGE_COUNT; ++pageIndex)
+    {
+        SCharMetrics* const metricsPage = m_CharMetricsPages[pageIndex];
+        if(metricsPage != m_CharMetricsPageStorage[0].get())
+        {
+            const size_t firstCh = pageIndex << CHAR_PAGE_SHIFT;
+            for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+            {
+                // Characters are visited in ascending order, like existingChars.
+                while(existingIndex < existingChars.size() && existingChars[existingIndex] < firstCh + i)
+                    ++existingIndex;
+                if(existingIndex == existingChars.size() || existingChars[existingIndex] != firstCh + i)
+                    metricsPage[i].Advance = questionMarkMetrics.Advance;
+            }
+        }
+    }
+}
+
+void CFont::FillMissingCharInfo(const std::vector<uint16_t>& existingChars)
+{
+    const SCharInfo questionMarkInfo = GetCharInfo(L'?');
+    for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        m_CharInfoPageStorage[0][i] = questionMarkInfo;
+    size_t existingIndex = 0;
+    for(size_t pageIndex = 0; pageIndex < CHAR_PAGE_COUNT; ++pageIndex)
+    {
+        SCharInfo* const page = m_CharInfoPages[pageIndex];
+        if(page != m_CharInfoPageStorage[0].get())
+        {
+            const size_t firstCh = pageIndex << CHAR_PAGE_SHIFT;
+            for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+            {
+                while(existingIndex < existingChars.size() && existingChars[existingIndex] < firstCh + i)
+                    ++existingIndex;
+                if(existingIndex == existingChars.size() || existingChars[existingIndex] != firstCh + i)
+                    page[i] = questionMarkInfo;
+            }
+        }
+    }
+}
+
+bool CFont::AddCharRanges(const wchar_t* charRanges, size_t charRangeCount, bool* outTexCoordsChanged)
+{
+    WaitInitAsync();
+    if(outTexCoordsChanged)
+        *outTexCoordsChanged = false;
+    if(!m_AddChars || m_TextureData.empty())
+        return false;
+    SAddCharsState& state = *m_AddChars;
+    const SFontDesc& desc = state.Desc;
+
+    std::vector<uint16_t> newChars;
+    for(size_t rangeIndex = 0; rangeIndex < charRangeCount; ++rangeIndex)
+    {
+        for(uint32_t ch = std::max<uint32_t>(charRanges[rangeIndex * 2], 1); ch <= charRanges[rangeIndex * 2 + 1]; ++ch)
+        {
+            if(!std::binary_search(state.RequestedChars.begin(), state.RequestedChars.end(), (uint16_t)ch))
+                newChars.push_back((uint16_t)ch);
+        }
+    }
+    std::sort(newChars.begin(), newChars.end());
+    newChars.erase(std::unique(newChars.begin(), newChars.end()), newChars.end());
+    if(newChars.empty())
+        return true;
+    m_InitCanceled = false;
+    m_InitRasterizedCharCount = 0;
+    m_InitCharCount = (uint32_t)newChars.size();
+
+    const bool sdf = (desc.Flags & SFontDesc::FLAG_SDF) != 0;
+    const bool msdf = (desc.Flags & SFontDesc::FLAG_MSDF) != 0;
+    const uint32_t sdfScale = (sdf || msdf) ? std::max(desc.SdfSupersampling, 1u) : 1;
+    const int gdiHeight = desc.Height * (int)sdfScale;
+    const float fontSizeInv = 1.f / (float)gdiHeight;
+
+    // Rasterize and pack new characters before changing anything, so the font stays unchanged on failure.
+    HDC dc = CreateCompatibleDC(NULL);
+    HFONT font = dc != NULL ? CreateGdiFont(desc, gdiHeight) : NULL;
+    if(font == NULL)
+    {
+        if(dc != NULL)
+            DeleteDC(dc);
+        return false;
+    }
+    const HGDIOBJ oldFont = SelectObject(dc, font);
+    auto releaseGdi = [&]() {
+        SelectObject(dc, oldFont);
+        DeleteObject(font);
+        DeleteDC(dc);
+    };
+    std::vector<SRasterizedGlyph> glyphs;
+    std::vector<uint8_t> glyphData;
+    uint32_t threadCount = 0;
+    // Statistics describe Init only.
+    size_t peakBytes = 0;
+    if(!RasterizeGlyphs(glyphs, glyphData, threadCount, dc, desc, gdiHeight, msdf ? GGO_NATIVE : GGO_GRAY8_BITMAP,
+        newChars.data(), newChars.size(), false, peakBytes))
+    {
+        releaseGdi();
+        return false;
+    }
+    if(sdf || msdf)
+        CalcGlyphDistanceFields(glyphs, glyphData, msdf, sdfScale, desc.SdfSpread, desc.MaxThreadCount, peakBytes);
+    // Characters skipped after CancelInit look missing, so they must not be recorded.
+    if(m_InitCanceled)
+    {
+        releaseGdi();
+        return false;
+    }
+
+    // New characters with pixels, tallest first, like in Init.
+    std::vector<uint32_t> spriteIndices;
+    for(uint32_t i = 0; i < (uint32_t)glyphs.size(); ++i)
+    {
+        if(glyphs[i].HasSprite())
+            spriteIndices.push_back(i);
+    }
+    std::stable_sort(spriteIndices.begin(), spriteIndices.end(), [&glyphs](uint32_t lhs, uint32_t rhs) -> bool {
+        return glyphs[lhs].BlackBoxSize.y > glyphs[rhs].BlackBoxSize.y;
+    });
+
+    /*
+    Free space is found above a skyline of existing characters: for every page, segments of columns of texels sharing
+    the first row that a new character can start at, keeping margin from characters above it and on both sides.
+    Holes under the skyline are not reused, but existing characters never move.
+    First existing pages are tried within their current height, then new pages are added, then the texture grows in height.
+    If that is not enough, the texture grows in width and new characters are packed again.
+    */
+    const uint32_t margin = 1;
+    const bool pow2 = (desc.Flags & SFontDesc::FLAG_TEXTURE_POW2) != 0;
+    const uint32_t maxTexturePageCount = desc.MaxTextureSize ? std::max(desc.MaxTexturePageCount, 1u) : 1;
+    // With FLAG_TEXTURE_POW2, width doesn't grow past the largest power of 2 that fits in MaxTextureSize.
+    const uint32_t maxTextureSizeX = pow2 ? NextPow2(desc.MaxTextureSize + 1) / 2 : desc.MaxTextureSize;
+    uint32_t textureSizeX = m_TextureSize.x;
+    uint32_t textureSizeY = m_TextureSize.y;
+    uint32_t texturePageCount = m_TexturePageCount;
+    struct SSkylineSegment
+    {
+        uint32_t X, Width, Y;
+    };
+    // Per page, sorted by X, covering the whole width.
+    std::vector<std::vector<SSkylineSegment>> skylines;
+    std::vector<SSkylineSegment> newSkyline;
+    std::vector<SPackedGlyph> newPackedGlyphs(spriteIndices.size());
+    auto addToSkyline = [&](uint32_t texturePage, const uvec2& pos, const uvec2& size) {
+        std::vector<SSkylineSegment>& skyline = skylines[texturePage];
+        const uint32_t beginX = pos.x > margin ? pos.x - margin : 0;
+        const uint32_t endX = std::min(pos.x + size.x + margin, textureSizeX);
+        const uint32_t top = pos.y + size.y + margin;
+        newSkyline.clear();
+        // Merges with the previous segment of the same height.
+        auto append = [](std::vector<SSkylineSegment>& segments, uint32_t fromX, uint32_t toX, uint32_t y) {
+            if(fromX >= toX)
+                return;
+            if(!segments.empty() && segments.back().Y == y)
+                segments.back().Width += toX - fromX;
+            else
+                segments.push_back(SSkylineSegment{fromX, toX - fromX, y});
+        };
+        for(size_t i = 0; i < skyline.size(); ++i)
+        {
+            const SSkylineSegment& segment = skyline[i];
+            const uint32_t segmentEndX = segment.X + segment.Width;
+            append(newSkyline, segment.X, std::min(segmentEndX, beginX), segment.Y);
+            append(newSkyline, std::max(segment.X, beginX), std::min(segmentEndX, endX), std::max(segment.Y, top));
+            append(newSkyline, std::max(segment.X, endX), segmentEndX, segment.Y);
+        }
+        skyline.swap(newSkyline);
+    };
+    /*
+    Lowest, then leftmost position on given page. Returns false if the character is too wide.
+    Only starts of segments need to be checked - moving a character left within a segment never makes it go higher.
+    */
+    auto findPos = [&](uint32_t texturePage, const uvec2& size, uvec2& outPos) -> bool {
+        const std::vector<SSkylineSegment>& skyline = skylines[texturePage];
+        outPos = uvec2(0, UINT32_MAX);
+        for(size_t i = 0; i < skyline.size(); ++i)
+        {
+            const uint32_t x = std::max(skyline[i].X, margin);
+            if(x + size.x + margin > textureSizeX)
+                break;
+            if(x >= skyline[i].X + skyline[i].Width)
+                continue;
+            uint32_t y = 0;
+            for(size_t j = i; j < skyline.size() && skyline[j].X < x + size.x && y < outPos.y; ++j)
+                y = std::max(y, skyline[j].Y);
+            if(y < outPos.y)
+                outPos = uvec2(x, y);
+        }
+        return outPos.y != UINT32_MAX;
+    };
+    // Without MaxTextureSize, height is limited to twice the width, so the texture doesn't become a tall strip.
+    auto tryPack = [&]() -> bool {
+        const uint32_t maxTextureSizeY = desc.MaxTextureSize ? desc.MaxTextureSize : std::max(textureSizeX * 2, m_TextureSize.y);
+        textureSizeY = m_TextureSize.y;
+        texturePageCount = m_TexturePageCount;
+        skylines.assign(texturePageCount, std::vector<SSkylineSegment>(1, SSkylineSegment{0, textureSizeX, margin}));
+        for(size_t i = 0; i < state.PackedGlyphs.size(); ++i)
+            addToSkyline(state.PackedGlyphs[i].TexturePage, state.PackedGlyphs[i].Pos, state.PackedGlyphs[i].Size);
+        uint32_t requiredSizeY = textureSizeY;
+        for(size_t i = 0; i < spriteIndices.size(); ++i)
+        {
+            const SRasterizedGlyph& glyph = glyphs[spriteIndices[i]];
+            SPackedGlyph& packedGlyph = newPackedGlyphs[i];
+            packedGlyph.Char = glyph.Char;
+            packedGlyph.Size = glyph.BlackBoxSize;
+            if(packedGlyph.Size.x + margin * 2 > textureSizeX)
+                return false;
+            bool placed = false;
+            uvec2 lowestPos = uvec2(0, UINT32_MAX);
+            uint32_t lowestPage = 0;
+            for(uint32_t texturePage = 0; texturePage < texturePageCount && !placed; ++texturePage)
+            {
+                uvec2 pos;
+                findPos(texturePage, packedGlyph.Size, pos);
+                if(pos.y + packedGlyph.Size.y + margin <= textureSizeY)
+                {
+                    packedGlyph.Pos = pos;
+                    packedGlyph.TexturePage = texturePage;
+                    placed = true;
+                }
+                else if(pos.y < lowestPos.y)
+                {
+                    lowestPos = pos;
+                    lowestPage = texturePage;
+                }
+            }
+            if(!placed && texturePageCount < maxTexturePageCount && packedGlyph.Size.y + margin * 2 <= textureSizeY)
+            {
+                skylines.push_back(std::vector<SSkylineSegment>(1, SSkylineSegment{0, textureSizeX, margin}));
+                packedGlyph.Pos = uvec2(margin, margin);
+                packedGlyph.TexturePage = texturePageCount++;
+                placed = true;
+            }
+            if(!placed)
+            {
+                packedGlyph.Pos = lowestPos;
+                packedGlyph.TexturePage = lowestPage;
+                requiredSizeY = std::max(requiredSizeY, lowestPos.y + packedGlyph.Size.y + margin);
+                if(requiredSizeY > maxTextureSizeY)
+                    return false;
+            }
+            addToSkyline(packedGlyph.TexturePage, packedGlyph.Pos, packedGlyph.Size);
+        }
+        if(requiredSizeY > textureSizeY)
+        {
+            textureSizeY = pow2 ? NextPow2(requiredSizeY) : requiredSizeY;
+            if(textureSizeY > maxTextureSizeY)
+                return false;
+        }
+        return true;
+    };
+    while(!tryPack())
+    {
+        const uint32_t newTextureSizeX = desc.MaxTextureSize ? std::min(textureSizeX * 2, maxTextureSizeX) : textureSizeX * 2;
+        if(newTextureSizeX <= textureSizeX)
+        {
+            releaseGdi();
+            return false;
+        }
+        textureSizeX = newTextureSizeX;
+    }
+
+    // From now on the font changes.
+    const bool sizeChanged = textureSizeX != m_TextureSize.x || textureSizeY != m_TextureSize.y;
+    if(sizeChanged || texturePageCount != m_TexturePageCount)
+    {
+        const size_t rowPitch = GetTextureRowPitch(m_TextureFormat, textureSizeX);
+        const uint32_t oldRowCount = GetTextureRowCount(m_TextureFormat, m_TextureSize.y);
+        const size_t oldPageBytes = m_TextureRowPitch * oldRowCount;
+        const size_t newPageBytes = rowPitch * GetTextureRowCount(m_TextureFormat, textureSizeY);
+        std::vector<uint8_t> textureData(newPageBytes * texturePageCount, 0);
+        for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+        {
+            if(rowPitch == m_TextureRowPitch)
+                memcpy(textureData.data() + newPageBytes * texturePage, m_TextureData.data() + oldPageBytes * texturePage, oldPageBytes);
+            else
+            {
+                for(uint32_t row = 0; row < oldRowCount; ++row)
+                    memcpy(textureData.data() + newPageBytes * texturePage + rowPitch * row,
+                        m_TextureData.data() + oldPageBytes * texturePage + m_TextureRowPitch * row, m_TextureRowPitch);
+            }
+        }
+        m_TextureData.swap(textureData);
+        m_TextureRowPitch = rowPitch;
+    }
+    const uint32_t oldTexturePageCount = m_TexturePageCount;
+    m_TextureSize = uvec2(textureSizeX, textureSizeY);
+    m_TexturePageCount = texturePageCount;
+
+    const uint32_t sdfPadding = (sdf || msdf) ? desc.SdfSpread * sdfScale : 0;
+    for(size_t i = 0; i < glyphs.size(); ++i)
+    {
+        EnsureCharPage(glyphs[i].Char);
+        if(glyphs[i].Exists)
+        {
+            SetRasterizedCharInfo(glyphs[i], state.Ascent, fontSizeInv, sdfPadding, sdfScale);
+            state.ExistingChars.push_back((uint16_t)glyphs[i].Char);
+        }
+    }
+    std::sort(state.ExistingChars.begin(), state.ExistingChars.end());
+    state.RequestedChars.insert(state.RequestedChars.end(), newChars.begin(), newChars.end());
+    std::sort(state.RequestedChars.begin(), state.RequestedChars.end());
+
+    const size_t pageBytes = m_TextureRowPitch * GetTextureRowCount(m_TextureFormat, m_TextureSize.y);
+    ParallelFor(spriteIndices.size(), GetWorkerThreadCount(spriteIndices.size(), 256, desc.MaxThreadCount), [&](size_t i, uint32_t threadIndex) {
+        const SPackedGlyph& packedGlyph = newPackedGlyphs[i];
+        ComposeGlyph(m_TextureData.data() + pageBytes * packedGlyph.TexturePage, m_TextureRowPitch, packedGlyph.Pos, m_TextureFormat,
+            glyphData.data() + glyphs[spriteIndices[i]].DataOffset, packedGlyph.Size, sdf, msdf);
+    });
+    for(size_t i = 0; i < newPackedGlyphs.size(); ++i)
+        m_AtlasUsedTexels += newPackedGlyphs[i].Size.x * newPackedGlyphs[i].Size.y;
+    state.PackedGlyphs.insert(state.PackedGlyphs.end(), newPackedGlyphs.begin(), newPackedGlyphs.end());
+
+    // After the texture grew, texture coordinates of all characters change.
+    const vec2 textureSizeInv = vec2(1.f / (float)m_TextureSize.x, 1.f / (float)m_TextureSize.y);
+    const bool fromLeftBottom = (desc.Flags & SFontDesc::FLAG_TEXTURE_FROM_LEFT_BOTTOM) != 0;
+    for(size_t i = sizeChanged ? 0 : state.PackedGlyphs.size() - newPackedGlyphs.size(); i < state.PackedGlyphs.size(); ++i)
+    {
+        const SPackedGlyph& packedGlyph = state.PackedGlyphs[i];
+        SCharInfo& charInfo = AccessCharInfo(packedGlyph.Char);
+        charInfo.TexturePage = packedGlyph.TexturePage;
+        charInfo.TexCoordsRect = CalcTexCoordsRect(packedGlyph.Pos, packedGlyph.Size, textureSizeInv, fromLeftBottom);
+    }
+    if(sizeChanged)
+    {
+        const SCharInfo& charInfo = GetCharInfo(L'-');
+        m_FillTexCoords.x = (charInfo.TexCoordsRect.x + charInfo.TexCoordsRect.z) * 0.5f;
+        m_FillTexCoords.y = (charInfo.TexCoordsRect.y + charInfo.TexCoordsRect.w) * 0.5f;
+    }
+
+    BuildKerning(dc, state.ExistingChars, fontSizeInv, (float)gdiHeight, false);
+    releaseGdi();
+    FillMissingCharMetrics(state.ExistingChars);
+    FillMissingCharInfo(state.ExistingChars);
+
+    if(sizeChanged)
+    {
+        for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+            AddDirtyRect(texturePage, uvec2(0, 0), m_TextureSize);
+    }
+    else
+    {
+        for(uint32_t texturePage = oldTexturePageCount; texturePage < m_TexturePageCount; ++texturePage)
+            AddDirtyRect(texturePage, uvec2(0, 0), m_TextureSize);
+        for(size_t i = 0; i < newPackedGlyphs.size(); ++i)
+        {
+            if(newPackedGlyphs[i].TexturePage < oldTexturePageCount)
+                AddDirtyRect(newPackedGlyphs[i].TexturePage, newPackedGlyphs[i].Pos, newPackedGlyphs[i].Size);
+        }
+    }
+    if(outTexCoordsChanged)
+        *outTexCoordsChanged = sizeChanged;
+    return true;
+}
+
+CFont::~CFont()
+{
+    CancelInit();
+    WaitInitAsync();
+    ReleaseDynamicAtlas();
+    RemoveFromAtlas();
+}
+
+void CFont::ResetCharPages()
+{
+    // Never written, as AccessCharInfo, AccessCharMetrics are used only on pages created by EnsureCharPage.
+    static SCharInfo emptyCharInfoPage[CHAR_PAGE_SIZE];
+    static SCharMetrics emptyCharMetricsPage[CHAR_PAGE_SIZE];
+    m_CharInfoPageStorage.clear();
+    m_CharMetricsPageStorage.clear();
+    for(size_t pageIndex = 0; pageIndex < CHAR_PAGE_COUNT; ++pageIndex)
+    {
+        m_CharInfoPages[pageIndex] = emptyCharInfoPage;
+        m_CharMetricsPages[pageIndex] = emptyCharMetricsPage;
+    }
+}
+
+void CFont::EnsureCharPage(wchar_t ch)
+{
+    const size_t pageIndex = (size_t)ch >> CHAR_PAGE_SHIFT;
+    if(m_CharInfoPages[pageIndex] == m_CharInfoPageStorage[0].get())
+    {
+        m_CharInfoPageStorage.emplace_back(new SCharInfo[CHAR_PAGE_SIZE]);
+        m_CharMetricsPageStorage.emplace_back(new SCharMetrics[CHAR_PAGE_SIZE]);
+        memcpy(m_CharInfoPageStorage.back().get(), m_CharInfoPageStorage[0].get(), CHAR_PAGE_SIZE * sizeof(SCharInfo));
+        memcpy(m_CharMetricsPageStorage.back().get(), m_CharMetricsPageStorage[0].get(), CHAR_PAGE_SIZE * sizeof(SCharMetrics));
+        m_CharInfoPages[pageIndex] = m_CharInfoPageStorage.back().get();
+        m_CharMetricsPages[pageIndex] = m_CharMetricsPageStorage.back().get();
+    }
+}
+
+void CFont::InitDynamicCells(const uint16_t* chars, size_t charCount)
+{
+    SDynamicAtlas& dyn = *m_Dynamic;
+    const uint32_t cellCount = (uint32_t)dyn.Cells.size();
+    dyn.LruFirst = dyn.LruLast = UINT32_MAX;
+    dyn.Frame = 1;
+    dyn.AddedCharCount = dyn.EvictedCharCount = 0;
+    // Cells of initial characters come first, free cells last, so they are taken first.
+    for(uint32_t i = 0; i < cellCount; ++i)
+    {
+        SDynamicCell& cell = dyn.Cells[i];
+        cell.Char = i < charCount ? (wchar_t)chars[i] : 0;
+        cell.Prev = cell.Next = UINT32_MAX;
+        if(cell.Char)
+            dyn.CharCells[cell.Char] = i;
+        if(cell.Char == L'?' || cell.Char == L'-')
+            cell.LastUsedFrame = UINT32_MAX;
+        else
+        {
+            cell.LastUsedFrame = 0;
+            cell.Prev = dyn.LruLast;
+            if(dyn.LruLast != UINT32_MAX)
+                dyn.Cells[dyn.LruLast].Next = i;
+            else
+                dyn.LruFirst = i;
+            dyn.LruLast = i;
+        }
+    }
+}
+
+uvec2 CFont::GetDynamicCellPos(uint32_t cellIndex) const
+{
+    const uint32_t margin = 1;
+    return uvec2(
+        margin + cellIndex % m_Dynamic->CellCountX * (m_Dynamic->CellSize.x + margin),
+        margin + cellIndex / m_Dynamic->CellCountX * (m_Dynamic->CellSize.y + margin));
+}
+
+void CFont::TouchDynamicCell(uint32_t cellIndex)
+{
+    SDynamicAtlas& dyn = *m_Dynamic;
+    SDynamicCell& cell = dyn.Cells[cellIndex];
+    if(cell.LastUsedFrame == UINT32_MAX)
+        return;
+    cell.LastUsedFrame = dyn.Frame;
+    if(dyn.LruFirst == cellIndex)
+        return;
+    // Unlink.
+    dyn.Cells[cell.Prev].Next = cell.Next;
+    if(cell.Next != UINT32_MAX)
+        dyn.Cells[cell.Next].Prev = cell.Prev;
+    else
+        dyn.LruLast = cell.Prev;
+    // Link as first.
+    cell.Prev = UINT32_MAX;
+    cell.Next = dyn.LruFirst;
+    dyn.Cells[dyn.LruFirst].Prev = cellIndex;
+    dyn.LruFirst = cellIndex;
+}
+
+void CFont::EvictDynamicCell(uint32_t cellIndex)
+{
+    SDynamicAtlas& dyn = *m_Dynamic;
+    SDynamicCell& cell = dyn.Cells[cellIndex];
+    assert(cell.Char && cell.LastUsedFrame != UINT32_MAX);
+    const SCharInfo& charInfo = GetCharInfo(cell.Char);
+    m_AtlasUsedTexels -= (size_t)std::lround(charInfo.Size.x * dyn.FontSize) * (size_t)std::lround(charInfo.Size.y * dyn.FontSize);
+    // Becomes like never rasterized character: '?' keeping its own kerning, so KerningEntryFirstIndex isn't copied.
+    const SCharInfo& questionMarkInfo = GetCharInfo(L'?');
+    SCharInfo& evictedInfo = AccessCharInfo(cell.Char);
+    evictedInfo.TexCoordsRect = questionMarkInfo.TexCoordsRect;
+    evictedInfo.Advance = questionMarkInfo.Advance;
+    evictedInfo.Offset = questionMarkInfo.Offset;
+    evictedInfo.Size = questionMarkInfo.Size;
+    evictedInfo.TexturePage = questionMarkInfo.TexturePage;
+    evictedInfo.TextureChannel = questionMarkInfo.TextureChannel;
+    AccessCharMetrics(cell.Char).Advance = GetCharMetrics(L'?').Advance;
+    dyn.CharCells[cell.Char] = DYNAMIC_CHAR_UNKNOWN;
+    cell.Char = 0;
+    ++dyn.EvictedCharCount;
+}
+
+bool CFont::CacheChar(wchar_t ch)
+{
+    SDynamicAtlas& dyn = *m_Dynamic;
+    const uint32_t state = dyn.CharCells[ch];
+    if(state < DYNAMIC_CHAR_NO_SPRITE)
+    {
+        TouchDynamicCell(state);
+        return true;
+    }
+    if(state != DYNAMIC_CHAR_UNKNOWN)
+        return true;
+
+    const MAT2 mat2 = { {0, 1}, {0, 0}, {0, 0}, {0, 1} };
+    GLYPHMETRICS metrics = {};
+    if(GetGlyphOutline(dyn.DC, (UINT)ch, GGO_METRICS, &metrics, 0, NULL, &mat2) == GDI_ERROR)
+    {
+        dyn.CharCells[ch] = DYNAMIC_CHAR_MISSING;
+        return true;
+    }
+    uvec2 blackBoxSize = uvec2(0, 0);
+    DWORD glyphDataSize = 0;
+    if(metrics.gmBlackBoxX && metrics.gmBlackBoxY)
+    {
+        glyphDataSize = GetGlyphOutline(dyn.DC, (UINT)ch, GGO_GRAY8_BITMAP, &metrics, 0, NULL, &mat2);
+        if(glyphDataSize > 0 && glyphDataSize != GDI_ERROR)
+            blackBoxSize = uvec2(metrics.gmBlackBoxX, metrics.gmBlackBoxY);
+    }
+    if(blackBoxSize.x > dyn.CellSize.x || blackBoxSize.y > dyn.CellSize.y)
+    {
+        dyn.CharCells[ch] = DYNAMIC_CHAR_MISSING;
+        return true;
+    }
+
+    uint32_t cellIndex = DYNAMIC_CHAR_NO_SPRITE;
+    if(blackBoxSize.x && blackBoxSize.y)
+    {
+        // Least recently used cell is last. If it was used in current frame, so were all others.
+        cellIndex = dyn.LruLast;
+        if(cellIndex == UINT32_MAX || dyn.Cells[cellIndex].LastUsedFrame == dyn.Frame)
+            return false;
+
+        dyn.GlyphData.resize(glyphDataSize);
+        DWORD res = GetGlyphOutline(dyn.DC, (UINT)ch, GGO_GRAY8_BITMAP, &metrics, glyphDataSize, dyn.GlyphData.data(), &mat2);
+        if(res == 0 || res == GDI_ERROR)
+        {
+            dyn.CharCells[ch] = DYNAMIC_CHAR_MISSING;
+            return true;
+        }
+
+        if(dyn.Cells[cellIndex].Char)
+            EvictDynamicCell(cellIndex);
+        dyn.Cells[cellIndex].Char = ch;
+        TouchDynamicCell(cellIndex);
+
+        const uvec2 cellPos = GetDynamicCellPos(cellIndex);
+        const uint32_t bytesPerTexel = GetTextureFormatBytesPerTexel(m_TextureFormat);
+        for(uint32_t y = 0; y < dyn.CellSize.y; ++y)
+            memset(m_TextureData.data() + (cellPos.y + y) * m_TextureRowPitch + cellPos.x * bytesPerTexel, 0, dyn.CellSize.x * bytesPerTexel);
+        BlitBitmapToFormat<true>(m_TextureData.data(), m_TextureRowPitch, cellPos, m_TextureFormat, TEXTURE_CHANNEL_ALL,
+            dyn.GlyphData.data(), AlignUp<uint32_t>(blackBoxSize.x, 4), uvec2(0, 0), blackBoxSize);
+        AddDirtyRect(0, cellPos, dyn.CellSize);
+        m_AtlasUsedTexels += blackBoxSize.x * blackBoxSize.y;
+        dyn.AddedChars.push_back(ch);
+        ++dyn.AddedCharCount;
+    }
+
+    const float fontSizeInv = 1.f / (float)dyn.FontSize;
+    EnsureCharPage(ch);
+    SCharInfo& charInfo = AccessCharInfo(ch);
+    charInfo.Advance = (float)metrics.gmCellIncX * fontSizeInv;
+    charInfo.Offset = vec2(
+        (float)metrics.gmptGlyphOrigin.x * fontSizeInv,
+        (float)(dyn.Ascent - metrics.gmptGlyphOrigin.y) * fontSizeInv);
+    charInfo.Size = vec2(
+        (float)blackBoxSize.x * fontSizeInv,
+        (float)blackBoxSize.y * fontSizeInv);
+    charInfo.TexturePage = 0;
+    charInfo.TextureChannel = 0;
+    if(cellIndex != DYNAMIC_CHAR_NO_SPRITE)
+    {
+        const vec2 textureSizeInv = vec2(1.f / (float)m_TextureSize.x, 1.f / (float)m_TextureSize.y);
+        charInfo.TexCoordsRect = CalcTexCoordsRect(GetDynamicCellPos(cellIndex), blackBoxSize, textureSizeInv, dyn.TextureFromLeftBottom);
+    }
+    AccessCharMetrics(ch).Advance = charInfo.Advance;
+    dyn.CharCells[ch] = cellIndex;
+    return true;
+}
+
+bool CFont::CacheText(const wstr_view& text)
+{
+    assert(m_Dynamic && !m_TextureData.empty());
+    bool result = true;
+    for(size_t i = 0, count = text.length(); i < count; ++i)
+    {
+        if(text[i] >= L' ' && !CacheChar(text[i]))
+            result = false;
+    }
+    return result;
+}
+
+void CFont::NewFrame()
+{
+    assert(m_Dynamic);
+    ++m_Dynamic->Frame;
+    m_Dynamic->AddedChars.clear();
+}
+
+void CFont::GetAddedChars(const wchar_t*& outChars, size_t& outCount) const
+{
+    assert(m_Dynamic);
+    outChars = m_Dynamic->AddedChars.data();
+    outCount = m_Dynamic->AddedChars.size();
+}
+
+void CFont::ReleaseDynamicAtlas()
+{
+    if(m_Dynamic)
+    {
+        SelectObject(m_Dynamic->DC, m_Dynamic->OldFont);
+        DeleteObject(m_Dynamic->Font);
+        SelectObject(m_Dynamic->DC, m_Dynamic->OldBitmap);
+        DeleteDC(m_Dynamic->DC);
+        DeleteObject(m_Dynamic->DummyBitmap);
+        m_Dynamic.reset();
+    }
+}
+
+void CFont::RemoveFromAtlas()
+{
+    if(m_Atlas)
+    {
+        m_Atlas->RemoveFont(this);
+        m_Atlas = nullptr;
+    }
+    m_AtlasExistingChars.clear();
+}
+
+// Multiplier for Fibonacci hashing: 2^32 / golden ratio.
+static const uint32_t KERNING_HASH_MULTIPLIER = 0x9E3779B9u;
+
+float CFont::FindKerning(wchar_t firstCh, wchar_t secondCh) const
+{
+    const SCharMetrics& firstMetrics = GetCharMetrics(firstCh);
+    const SCharMetrics& secondMetrics = GetCharMetrics(secondCh);
+    if(firstMetrics.KerningLeftClass != KERNING_CLASS_EXCEPTION && secondMetrics.KerningRightClass != KERNING_CLASS_EXCEPTION)
+    {
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+        m_KerningCounters.ClassMatrix.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return (float)m_KerningClassMatrixData[firstMetrics.KerningLeftClass * m_KerningRightClassCount + secondMetrics.KerningRightClass] *
+            m_KerningClassScale;
+    }
+
+    // Exception - search the hash table.
+    // Bucket 0 has SecondBloom = 0, so it also rejects characters with no kerning.
+    const uint16_t bucketIndex = firstMetrics.KerningBucket;
+    if((m_KerningBucketData[bucketIndex].SecondBloom & KerningBloomBit(secondCh)) == 0)
+    {
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+        if(bucketIndex == 0)
+            m_KerningCounters.RejectedByFirst.fetch_add(1, std::memory_order_relaxed);
+        else
+            m_KerningCounters.RejectedByBloom.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return 0.f;
+    }
+    if(m_KerningHashShift == 0)
+    {
+        // No hash table could be built. Entries of the bucket are sorted by Second.
+        const SKerningBucket& bucket = m_KerningBucketData[bucketIndex];
+        const SKerningEntry* const bucketEnd = m_KerningEntryData + bucket.FirstIndex + bucket.Count;
+        const SKerningEntry* const entry = std::lower_bound(m_KerningEntryData + bucket.FirstIndex, bucketEnd, secondCh,
+            [](const SKerningEntry& lhs, wchar_t rhs) -> bool { return lhs.Second < rhs; });
+        if(entry != bucketEnd && entry->Second == secondCh)
+        {
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+            m_KerningCounters.HashHit.fetch_add(1, std::memory_order_relaxed);
+#endif
+            return entry->Amount;
+        }
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+        m_KerningCounters.HashMiss.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return 0.f;
+    }
+    const uint32_t key = ((uint32_t)firstCh << 16) | (uint32_t)secondCh;
+    const SKerningHashSlot* slot = &m_KerningHashData[(key * KERNING_HASH_MULTIPLIER) >> m_KerningHashShift];
+    for(uint32_t probe = 0; probe < KERNING_HASH_MAX_PROBE; ++probe, ++slot)
+    {
+        if(slot->Key == key)
+        {
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+            m_KerningCounters.HashHit.fetch_add(1, std::memory_order_relaxed);
+#endif
+            return slot->Amount;
+        }
+        if(slot->Key == 0)
+        {
+            break;
+        }
+    }
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+    m_KerningCounters.HashMiss.fetch_add(1, std::memory_order_relaxed);
+#endif
+    return 0.f;
+}
+
+void CFont::GetKerningStatistics(SKerningStatistics& outStats) const
+{
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+    outStats.LookupCount = m_KerningCounters.Lookup.load(std::memory_order_relaxed);
+    outStats.RejectedBySecondCount = m_KerningCounters.RejectedBySecond.load(std::memory_order_relaxed);
+    outStats.ClassMatrixCount = m_KerningCounters.ClassMatrix.load(std::memory_order_relaxed);
+    outStats.RejectedByFirstCount = m_KerningCounters.RejectedByFirst.load(std::memory_order_relaxed);
+    outStats.RejectedByBloomCount = m_KerningCounters.RejectedByBloom.load(std::memory_order_relaxed);
+    outStats.HashHitCount = m_KerningCounters.HashHit.load(std::memory_order_relaxed);
+    outStats.HashMissCount = m_KerningCounters.HashMiss.load(std::memory_order_relaxed);
+#else
+    ZeroMemory(&outStats, sizeof outStats);
+#endif
+}
+
+void CFont::ResetKerningStatistics()
+{
+#if WIN_FONT_RENDER_KERNING_STATISTICS
+    m_KerningCounters.Lookup = 0;
+    m_KerningCounters.RejectedBySecond = 0;
+    m_KerningCounters.ClassMatrix = 0;
+    m_KerningCounters.RejectedByFirst = 0;
+    m_KerningCounters.RejectedByBloom = 0;
+    m_KerningCounters.HashHit = 0;
+    m_KerningCounters.HashMiss = 0;
+#endif
+}
+
+float CFont::CalcSingleLineTextWidth(const wstr_view& text, float fontSize) const
+{
+    float textWidth = 0.f;
+    wchar_t prevCh = 0;
+    for (size_t i = 0; i < text.length(); i++)
+    {
+        const wchar_t currCh = text[i];
+        textWidth += GetCharMetrics(currCh).Advance;
+        if(prevCh)
+        {
+            textWidth += GetKerning(prevCh, currCh);
+        }
+        prevCh = currCh;
+    }
+    return textWidth * fontSize;
+}
+
+void CFont::GetTextureData(const void*& outData, uvec2& outSize, size_t& outRowPitch) const
+{
+    if(!m_TextureData.empty())
+    {
+        outData = m_TextureData.data();
+        outSize = m_TextureSize;
+        outRowPitch = m_TextureRowPitch;
+    }
+    else
+    {
+        outData = nullptr;
+        outSize = UVEC2_ZERO;
+        outRowPitch = 0;
+    }
+}
+
+void CFont::GetTextureData(uint32_t level, const void*& outData, uvec2& outSize, size_t& outRowPitch) const
+{
+    assert(level < GetMipLevelCount());
+    if(level == 0)
+    {
+        GetTextureData(outData, outSize, outRowPitch);
+    }
+    else if(!m_TextureMipLevels[level - 1].empty())
+    {
+        outData = m_TextureMipLevels[level - 1].data();
+        outSize = uvec2(m_TextureSize.x >> level, m_TextureSize.y >> level);
+        outRowPitch = GetTextureRowPitch(m_TextureFormat, outSize.x);
+    }
+    else
+    {
+        outData = nullptr;
+        outSize = UVEC2_ZERO;
+        outRowPitch = 0;
+    }
+}
+
+void CFont::FreeTextureData()
+{
+    std::vector<uint8_t> tmp;
+    m_TextureData.swap(tmp);
+    for(size_t i = 0; i < m_TextureMipLevels.size(); ++i)
+    {
+        std::vector<uint8_t> tmpLevel;
+        m_TextureMipLevels[i].swap(tmpLevel);
+    }
+    m_DirtyRegions.clear();
+}
+
+void CFont::AddDirtyRect(uint32_t texturePage, const uvec2& pos, const uvec2& size)
+{
+    if(size.x == 0 || size.y == 0)
+        return;
+    uvec4 rect = uvec4(pos, pos + size);
+    // Merge with every overlapping region, repeating as the merged rectangle grows, so regions never overlap.
+    size_t pageRegionCount = 0;
+    for(size_t i = 0; i < m_DirtyRegions.size(); )
+    {
+        const SDirtyRegion& region = m_DirtyRegions[i];
+        if(region.TexturePage == texturePage &&
+            region.Rect.x < rect.z && rect.x < region.Rect.z &&
+            region.Rect.y < rect.w && rect.y < region.Rect.w)
+        {
+            rect = uvec4(
+                std::min(rect.x, region.Rect.x), std::min(rect.y, region.Rect.y),
+                std::max(rect.z, region.Rect.z), std::max(rect.w, region.Rect.w));
+            m_DirtyRegions[i] = m_DirtyRegions.back();
+            m_DirtyRegions.pop_back();
+            i = 0;
+            pageRegionCount = 0;
+        }
+        else
+        {
+            if(region.TexturePage == texturePage)
+                ++pageRegionCount;
+            ++i;
+        }
+    }
+    // Too many small regions: merge all of this page into one.
+    if(pageRegionCount >= DIRTY_REGION_MAX_COUNT)
+    {
+        for(size_t i = m_DirtyRegions.size(); i--; )
+        {
+            const SDirtyRegion& region = m_DirtyRegions[i];
+            if(region.TexturePage == texturePage)
+            {
+                rect = uvec4(
+                    std::min(rect.x, region.Rect.x), std::min(rect.y, region.Rect.y),
+                    std::max(rect.z, region.Rect.z), std::max(rect.w, region.Rect.w));
+                m_DirtyRegions[i] = m_DirtyRegions.back();
+                m_DirtyRegions.pop_back();
+            }
+        }
+    }
+    m_DirtyRegions.push_back(SDirtyRegion{texturePage, rect});
+}
+
+void CFont::GetDirtyRects(std::vector<SDirtyRect>& outRects)
+{
+    outRects.clear();
+    if(m_TextureData.empty())
+        return;
+    const size_t texturePageBytes = m_TextureRowPitch * GetTextureRowCount(m_TextureFormat, m_TextureSize.y);
+    outRects.resize(m_DirtyRegions.size());
+    for(size_t i = 0; i < m_DirtyRegions.size(); ++i)
+    {
+        const SDirtyRegion& region = m_DirtyRegions[i];
+        SDirtyRect& dirtyRect = outRects[i];
+        // With BC4 and R4, only whole pages are ever dirty.
+        dirtyRect.Data = m_TextureData.data() + texturePageBytes * region.TexturePage +
+            GetTextureRowCount(m_TextureFormat, region.Rect.y) * m_TextureRowPitch + GetTextureRowOffset(m_TextureFormat, region.Rect.x);
+        dirtyRect.RowPitch = m_TextureRowPitch;
+        dirtyRect.TexturePage = region.TexturePage;
+        dirtyRect.Pos = uvec2(region.Rect.x, region.Rect.y);
+        dirtyRect.Size = uvec2(region.Rect.z - region.Rect.x, region.Rect.w - region.Rect.y);
+    }
+    m_DirtyRegions.clear();
+}
+
+void CFont::GetStatistics(SStatistics& outStats) const
+{
+    outStats.CharInfoPageCount = m_CharInfoPageStorage.size();
+    outStats.CharInfoBytes = sizeof(m_CharInfoPages) + sizeof(m_CharMetricsPages) +
+        m_CharInfoPageStorage.capacity() * sizeof(m_CharInfoPageStorage[0]) +
+        m_CharMetricsPageStorage.capacity() * sizeof(m_CharMetricsPageStorage[0]) +
+        m_CharInfoPageStorage.size() * CHAR_PAGE_SIZE * (sizeof(SCharInfo) + sizeof(SCharMetrics));
+    outStats.KerningBytes = m_KerningEntries.capacity() * sizeof(SKerningEntry) +
+        m_KerningBuckets.capacity() * sizeof(SKerningBucket) +
+        m_KerningClassMatrix.capacity() * sizeof(int16_t) +
+        m_KerningHash.capacity() * sizeof(SKerningHashSlot) +
+        sizeof(m_KerningSecondPages) + m_KerningSecondBits.capacity() * sizeof(uint32_t) + m_BakedKerningBytes;
+    const size_t classMatrixSize = m_KerningClassMatrix.size() + m_BakedKerningClassMatrixSize;
+    outStats.KerningLeftClassCount = (uint32_t)(classMatrixSize / m_KerningRightClassCount);
+    outStats.KerningRightClassCount = m_KerningRightClassCount;
+    outStats.KerningClassMatrixBytes = classMatrixSize * sizeof(int16_t);
+    outStats.KerningExceptionCount = m_BakedKerningExceptionCount;
+    for(size_t i = 0, count = m_KerningEntries.size(); i < count; ++i)
+    {
+        if(IsKerningException(m_KerningEntries[i]))
+            ++outStats.KerningExceptionCount;
+    }
+    outStats.TextureBytes = m_TextureData.capacity();
+    for(size_t i = 0; i < m_TextureMipLevels.size(); ++i)
+        outStats.TextureBytes += m_TextureMipLevels[i].capacity();
+    outStats.AtlasUsedTexels = m_AtlasUsedTexels;
+    outStats.AtlasTotalTexels = (size_t)m_TextureSize.x * m_TextureSize.y * m_TexturePageCount;
+    outStats.RasterizationTime = m_RasterizationTime;
+    outStats.RasterizationThreadCount = m_RasterizationThreadCount;
+    outStats.PackingTime = m_PackingTime;
+    outStats.SdfCharCount = m_SdfCharCount;
+    outStats.SdfTime = m_SdfTime;
+    outStats.CompositionTime = m_CompositionTime;
+    outStats.CompressionTime = m_CompressionTime;
+    outStats.CompressionPsnr = m_CompressionPsnr;
+    outStats.InitTime = m_InitTime;
+    outStats.InitPeakBytes = m_InitPeakBytes;
+    outStats.DynamicCellCount = outStats.DynamicUsedCellCount = 0;
+    outStats.DynamicAddedCharCount = outStats.DynamicEvictedCharCount = 0;
+    size_t dynamicBytes = 0;
+    if(m_Dynamic)
+    {
+        outStats.DynamicCellCount = (uint32_t)m_Dynamic->Cells.size();
+        for(size_t i = 0; i < m_Dynamic->Cells.size(); ++i)
+        {
+            if(m_Dynamic->Cells[i].Char)
+                ++outStats.DynamicUsedCellCount;
+        }
+        outStats.DynamicAddedCharCount = m_Dynamic->AddedCharCount;
+        outStats.DynamicEvictedCharCount = m_Dynamic->EvictedCharCount;
+        dynamicBytes = sizeof(SDynamicAtlas) +
+            m_Dynamic->Cells.capacity() * sizeof(SDynamicCell) +
+            m_Dynamic->CharCells.capacity() * sizeof(uint32_t) +
+            m_Dynamic->AddedChars.capacity() * sizeof(wchar_t) +
+            m_Dynamic->GlyphData.capacity();
+    }
+    if(m_AddChars)
+    {
+        dynamicBytes += sizeof(SAddCharsState) + m_AddChars->FaceName.capacity() * sizeof(wchar_t) +
+            (m_AddChars->RequestedChars.capacity() + m_AddChars->ExistingChars.capacity()) * sizeof(uint16_t) +
+            m_AddChars->PackedGlyphs.capacity() * sizeof(SPackedGlyph);
+    }
+    dynamicBytes += m_AtlasExistingChars.capacity() * sizeof(uint16_t);
+    outStats.TotalBytes = sizeof(CFont) - sizeof(m_CharInfoPages) - sizeof(m_CharMetricsPages) - sizeof(m_KerningSecondPages) +
+        outStats.CharInfoBytes + outStats.KerningBytes + outStats.TextureBytes + dynamicBytes +
+        m_DirtyRegions.capacity() * sizeof(SDirtyRegion);
+}
+
+void CFont::SetAtlasTexCoords(const CFontAtlas& atlas, size_t firstGlyphIndex, size_t glyphCount)
+{
+    m_TextureSize = atlas.m_TextureSize;
+    m_TexturePageCount = atlas.m_TexturePageCount;
+    m_TextureFormat = atlas.m_TextureFormat;
+    const vec2 textureSizeInv = vec2(1.f / (float)m_TextureSize.x, 1.f / (float)m_TextureSize.y);
+    const bool fromLeftBottom = (atlas.m_Desc.Flags & SFontDesc::FLAG_TEXTURE_FROM_LEFT_BOTTOM) != 0;
+
+    for(size_t i = firstGlyphIndex; i < firstGlyphIndex + glyphCount; ++i)
+    {
+        const CFontAtlas::SGlyph& glyph = atlas.m_Glyphs[i];
+        SCharInfo& charInfo = AccessCharInfo(glyph.Char);
+        charInfo.TexCoordsRect = CalcTexCoordsRect(glyph.TexturePos, glyph.Size, textureSizeInv, fromLeftBottom);
+        charInfo.TexturePage = glyph.TexturePage;
+        charInfo.TextureChannel = glyph.TextureChannel;
+    }
+
+    // Characters that don't exist in the font were made copies of '?' by Init, when its texture coordinates weren't known yet.
+    // Like FillMissingCharInfo, but only texture coordinates, as the rest is already there.
+    const SCharInfo questionMarkInfo = GetCharInfo(L'?');
+    auto copyQuestionMarkTexCoords = [&questionMarkInfo](SCharInfo& charInfo) {
+        charInfo.TexCoordsRect = questionMarkInfo.TexCoordsRect;
+        charInfo.TexturePage = questionMarkInfo.TexturePage;
+        charInfo.TextureChannel = questionMarkInfo.TextureChannel;
+    };
+    for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        copyQuestionMarkTexCoords(m_CharInfoPageStorage[0][i]);
+    size_t existingIndex = 0;
+    for(size_t pageIndex = 0; pageIndex < CHAR_PAGE_COUNT; ++pageIndex)
+    {
+        SCharInfo* const page = m_CharInfoPages[pageIndex];
+        if(page != m_CharInfoPageStorage[0].get())
+        {
+            const size_t firstCh = pageIndex << CHAR_PAGE_SHIFT;
+            for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+            {
+                while(existingIndex < m_AtlasExistingChars.size() && m_AtlasExistingChars[existingIndex] < firstCh + i)
+                    ++existingIndex;
+                if(existingIndex == m_AtlasExistingChars.size() || m_AtlasExistingChars[existingIndex] != firstCh + i)
+                    copyQuestionMarkTexCoords(page[i]);
+            }
+        }
+    }
+
+    const SCharInfo& charInfo = GetCharInfo(L'-');
+    m_FillTexCoords.x = (charInfo.TexCoordsRect.x + charInfo.TexCoordsRect.z) * 0.5f;
+    m_FillTexCoords.y = (charInfo.TexCoordsRect.y + charInfo.TexCoordsRect.w) * 0.5f;
+    m_FillTexturePage = charInfo.TexturePage;
+}
+
+bool CFont::LineSplit(
+    size_t *outBegin, size_t *outEnd, float *outWidth, size_t *inoutIndex,
+    const wstr_view& text,
+    float fontSize, uint32_t flags, float textWidth) const
+{
+    assert(ValidateFlags(flags));
+
+    const size_t textLen = text.length();
+
+    if (*inoutIndex >= textLen)
+    {
+        return false;
+    }
+
+    *outBegin = *inoutIndex;
+    *outWidth = 0.f;
+
+    // Single line - special fast mode.
+    if (flags & FLAG_WRAP_SINGLE_LINE)
+    {
+        wchar_t prevCh = 0;
+        while (*inoutIndex < textLen)
+        {
+            const wchar_t currCh = text[*inoutIndex];
+            *outWidth += GetCharMetrics(currCh).Advance;
+            if(prevCh)
+            {
+                *outWidth += GetKerning(prevCh, currCh);
+            }
+            prevCh = currCh;
+            (*inoutIndex)++;
+        }
+        *outEnd = *inoutIndex;
+        *outWidth *= fontSize;
+        return true;
+    }
+
+    wchar_t prevCh = 0;
+    // Remembered state from last occurence ofspace.
+    // Could be useful in case of wrapping on word boundary.
+    size_t lastSpaceIndex = std::wstring::npos;
+    float widthWhenLastSpace = 0.f;
+    for (;;)
+    {
+        // End of text
+        if (*inoutIndex >= textLen)
+        {
+            *outEnd = textLen;
+            break;
+        }
+
+        // Fetch character
+        const wchar_t currCh = text[*inoutIndex];
+
+        // End of line
+        if (currCh == L'\n')
+        {
+            *outEnd = *inoutIndex;
+            (*inoutIndex)++;
+            break;
+        }
+        // End of line '\result'
+        else if (currCh == L'\r')
+        {
+            *outEnd = *inoutIndex;
+            (*inoutIndex)++;
+            // Sequenfce "\result\n" - skip '\n'
+            if (*inoutIndex < textLen && text[*inoutIndex] == L'\n')
+            {
+                (*inoutIndex)++;
+            }
+            break;
+        }
+        // Other character
+        else
+        {
+            // Character width
+            const float charWidth = GetCharWidth_(currCh, fontSize);
+            const float kerning = prevCh ? GetKerning(prevCh, currCh, fontSize) : 0.f;
+
+            /*
+            If automatic word wrap is not enabled or
+            if it all fits or
+            it is a first character (protection against infinite loop when textWidth < width of first character) -
+            include it no matter what.
+            */
+            if ((flags & FLAG_WRAP_NORMAL) || *outWidth + charWidth + kerning <= textWidth || *inoutIndex == *outBegin)
+            {
+                // If this is space - remembers its data.
+                if (currCh == L' ')
+                {
+                    lastSpaceIndex = *inoutIndex;
+                    widthWhenLastSpace = *outWidth;
+                }
+                *outWidth += charWidth + kerning;
+                (*inoutIndex)++;
+            }
+            // If automatic word wrap is enabled and it doesn't fit
+            else
+            {
+                // The character that doesn't fit is space
+                if (currCh == L' ')
+                {
+                    *outEnd = *inoutIndex;
+                    // We can just skip it
+                    (*inoutIndex)++;
+                    break;
+                }
+                // Previous character before this one is space
+                else if (*inoutIndex > *outBegin && text[(*inoutIndex)-1] == L' ')
+                {
+                    // End will be at this space
+                    *outEnd = lastSpaceIndex;
+                    *outWidth = widthWhenLastSpace;
+                    break;
+                }
+
+                // Wrapping lines on word boundaries
+                if (flags & FLAG_WRAP_WORD)
+                {
+                    // There was a space
+                    if (lastSpaceIndex != std::wstring::npos)
+                    {
+                        // The end will be at that space
+                        *outEnd = lastSpaceIndex;
+                        *inoutIndex = lastSpaceIndex+1;
+                        *outWidth = widthWhenLastSpace;
+                        break;
+                    }
+                    // There was no space - well, it will wrap on character boundary
+                }
+
+                *outEnd = *inoutIndex;
+                break;
+            }
+        }
+        prevCh = currCh;
+    }
+
+    return true;
+}
+
+void CFont::CalcTextExtent(vec2& outExtent, const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const
+{
+    assert(ValidateFlags(flags));
+
+    if(text.empty() || fontSize == 0.f)
+    {
+        outExtent = VEC2_ZERO;
+        return;
+    }
+
+    size_t lineBeg, lineEnd, index = 0;
+    float lineWidth;
+    float lineCount = 0.f;
+    outExtent.x = 0.0f;
+    while (LineSplit(&lineBeg, &lineEnd, &lineWidth, &index, text, fontSize, flags, textWidth))
+    {
+        lineCount += 1.f;
+        outExtent.x = std::max(outExtent.x, lineWidth);
+    }
+
+    if(lineCount > 0.f)
+    {
+        outExtent.y = (lineCount + (lineCount - 1.f) * m_LineGap) * fontSize;
+    }
+    else
+        outExtent.y = 0.f;
+}
+
+size_t CFont::CalcSingleLineQuadCount(const wstr_view& text, uint32_t flags) const
+{
+    assert(ValidateFlags(flags));
+
+    const size_t textLen = text.length();
+    size_t result = 0;
+
+    for (size_t i = 0; i < textLen; i++)
+    {
+        if (text[i] != L' ')
+            result++;
+    }
+
+    if (flags & FLAG_DOUBLE_UNDERLINE)
+        result += 2;
+    else if (flags & FLAG_UNDERLINE)
+        result++;
+    if (flags & FLAG_OVERLINE)
+        result++;
+    if (flags & FLAG_STRIKEOUT)
+        result++;
+
+    return result;
+}
+
+size_t CFont::CalcQuadCount(const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const
+{
+    assert(ValidateFlags(flags));
+
+    size_t result = 0;
+    size_t beg, end, index = 0;
+    float width;
+    int lineCount = 0;
+
+    while (LineSplit(&beg, &end, &width, &index, text, fontSize, flags, textWidth))
+    {
+        for (size_t i = beg; i < end; ++i)
+        {
+            if (text[i] != L' ')
+                result++;
+        }
+        lineCount++;
+    }
+
+    if (flags & FLAG_DOUBLE_UNDERLINE)
+        result += 2 * lineCount;
+    else if (flags & FLAG_UNDERLINE)
+        result += lineCount;
+    if (flags & FLAG_OVERLINE)
+        result += lineCount;
+    if (flags & FLAG_STRIKEOUT)
+        result += lineCount;
+
+    return result;
+}
+
+void CFont::CalcTexturePageQuadCounts(size_t* outQuadCounts, const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const
+{
+    assert(ValidateFlags(flags));
+
+    for(uint32_t i = 0; i < m_TexturePageCount; ++i)
+        outQuadCounts[i] = 0;
+
+    size_t beg, end, index = 0;
+    float width;
+    int lineCount = 0;
+
+    while (LineSplit(&beg, &end, &width, &index, text, fontSize, flags, textWidth))
+    {
+        for (size_t i = beg; i < end; ++i)
+        {
+            if (text[i] != L' ')
+                ++outQuadCounts[GetCharInfo(text[i]).TexturePage];
+        }
+        lineCount++;
+    }
+
+    // Lines are drawn using fill texcoords.
+    if (flags & FLAG_DOUBLE_UNDERLINE)
+        outQuadCounts[m_FillTexturePage] += 2 * lineCount;
+    else if (flags & FLAG_UNDERLINE)
+        outQuadCounts[m_FillTexturePage] += lineCount;
+    if (flags & FLAG_OVERLINE)
+        outQuadCounts[m_FillTexturePage] += lineCount;
+    if (flags & FLAG_STRIKEOUT)
+        outQuadCounts[m_FillTexturePage] += lineCount;
+}
+
+bool CFont::HitTestSingleLine(size_t& outIndex, float *outPercent,
+    float posX, float hitX, const wstr_view& text, float fontSize, uint32_t flags) const
+{
+    assert(ValidateFlags(flags));
     const size_t textLen = text.length();
-    size_t result = 0;
 
-    for (size_t i = 0; i < textLen; i++)
+    if (flags & FLAG_HLEFT)
+    {
+        float currX = posX;
+        // On the left
+        if (hitX < currX)
+            return false;
+        // Traverse characters
+        wchar_t prevCh = 0;
+        for (size_t i = 0; i < textLen; i++)
+        {
+            const wchar_t currCh = text[i];
+            const float charWidth = GetCharWidth_(currCh, fontSize);
+            const float kerning = prevCh ? GetKerning(prevCh, currCh, fontSize) : 0.f;
+            const float newX = currX + charWidth;
+            // Found
+            if (hitX < newX)
+            {
+                outIndex = i;
+                if(outPercent)
+                    *outPercent = (hitX-currX) / charWidth;
+                return true;
+            }
+            currX = newX + kerning;
+            prevCh = currCh;
+        }
+        // Not found
+        return false;
+    }
+    else if (flags & FLAG_HRIGHT)
+    {
+        float currX = posX;
+        // On the right
+        if (hitX > currX)
+            return false;
+        // Traverse characters
+        wchar_t prevCh = 0;
+        for (size_t i = textLen; i--; )
+        {
+            const wchar_t currCh = text[i];
+            const float charWidth = GetCharWidth_(currCh, fontSize);
+            const float kerning = prevCh ? GetKerning(currCh, prevCh, fontSize) : 0.f;
+            const float newX = currX - charWidth;
+            // Found
+            if (hitX >= newX)
+            {
+                outIndex = i;
+                if(outPercent)
+                    *outPercent = (hitX-newX) / charWidth;
+                return true;
+            }
+            currX = newX - kerning;
+            prevCh = currCh;
+        }
+        // Not found
+        return false;
+    }
+    else // flags & FLAG_HCENTER
+    {
+        // Calculate width of whole line
+        const float lineWidth = CalcSingleLineTextWidth(text, fontSize);
+        // Calculate position of the beginning
+        posX -= lineWidth * 0.5f;
+        // Rest is the same as with alignment to the left:
+
+        float currX = posX;
+        // On the left
+        if (hitX < currX)
+            return false;
+        // Traverse characters
+        wchar_t prevCh = 0;
+        for (size_t i = 0; i < textLen; i++)
+        {
+            const wchar_t currCh = text[i];
+            const float charWidth = GetCharWidth_(currCh, fontSize);
+            const float kerning = prevCh ? GetKerning(prevCh, currCh, fontSize) : 0.f;
+            const float newX = currX + charWidth;
+            // Found
+            if (hitX < newX)
+            {
+                outIndex = i;
+                if(outPercent)
+                    *outPercent = (hitX-currX) / charWidth;
+                return true;
+            }
+            currX = newX + kerning;
+            prevCh = currCh;
+        }
+        // Not found
+        return false;
+    }
+}
+
+bool CFont::HitTest(size_t& outIndex, vec2 *outPercent,
+    const vec2& pos, const vec2& hit, const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const
+{
+    assert(ValidateFlags(flags));
+
+    if (flags & FLAG_VTOP)
+    {
+        size_t beg, end, index = 0;
+        float width;
+        float currY = pos.y;
+        // Above
+        if (hit.y < currY)
+            return false;
+        // Traverse lines
+        while (LineSplit(&beg, &end, &width, &index, text, fontSize, flags, textWidth))
+        {
+            // Found
+            if (hit.y < currY + (1.f + m_LineGap * 0.5f) * fontSize)
+            {
+                // Check x
+                if (HitTestSingleLine(
+                    outIndex, outPercent ? &outPercent->x : nullptr,
+                    pos.x, hit.x,
+                    text.substr(beg, end - beg),
+                    fontSize, flags))
+                {
+                    outIndex += beg;
+                    if(outPercent)
+                        outPercent->y = (hit.y-currY) / fontSize;
+                    return true;
+                }
+                else
+                    return false;
+            }
+            currY += (1.f + m_LineGap) * fontSize;
+        }
+        // Not found
+        return false;
+    }
+    // Bottom of vertical center
+    else
+    {
+        // Split into lines, remember them, see how many lines do we have.
+        size_t lineCount = 0;
+        std::vector<size_t> begs, ends;
+        size_t beg, end, index = 0;
+        float width;
+        while (LineSplit(&beg, &end, &width, &index, text, fontSize, flags, textWidth))
+        {
+            begs.push_back(beg);
+            ends.push_back(end);
+            lineCount++;
+        }
+
+        float currY = pos.y;
+        // Calculate new beginning Y.
+        if (flags & FLAG_VBOTTOM)
+            currY -= lineCount * fontSize;
+        else // flags & FLAG_VMIDDLE
+            currY -= lineCount * fontSize * 0.5f;
+        // Rest is the same as with alignment to the top:
+
+        // Above
+        if (hit.y < currY)
+            return false;
+        // Traverse lines
+        for (size_t Line = 0; Line < lineCount; Line++)
+        {
+            const float newY = currY + (1.f + m_LineGap) * fontSize;
+            // Found
+            if (hit.y < currY + (1.f + m_LineGap * 0.5f) * fontSize)
+            {
+                // Check x
+                if (HitTestSingleLine(
+                    outIndex, outPercent ? &outPercent->x : nullptr,
+                    pos.x, hit.x,
+                    text.substr(begs[Line], ends[Line] - begs[Line]),
+                    fontSize, flags))
+                {
+                    outIndex += begs[Line];
+                    if(outPercent)
+                        outPercent->y = (hit.y - currY) / fontSize;
+                    return true;
+                }
+                else
+                    return false;
+            }
+            currY += (1.f + m_LineGap) * fontSize;
+        }
+        // Not found
+        return false;
+    }
+}
+
+void CFont::BuildKerning(HDC dc, const std::vector<uint16_t>& existingChars, float fontSizeInv, float fontSize, bool dynamic)
+{
+    m_KerningEntries.clear();
+    m_KerningBuckets.assign(1, SKerningBucket{0, 0, 0});
+    m_KerningClassMatrix.assign(1, 0);
+    m_KerningRightClassCount = 1;
+    m_KerningHash.clear();
+    // Characters may have kerning from before, when called by AddCharRanges.
+    for(size_t pageIndex = 0; pageIndex < m_CharInfoPageStorage.size(); ++pageIndex)
+    {
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            m_CharInfoPageStorage[pageIndex][i].KerningEntryFirstIndex = SIZE_MAX;
+            SCharMetrics& metrics = m_CharMetricsPageStorage[pageIndex][i];
+            metrics.KerningBucket = 0;
+            metrics.KerningLeftClass = metrics.KerningRightClass = 0;
+        }
+    }
+    auto exists = [&existingChars](wchar_t ch) -> bool {
+        return std::binary_search(existingChars.begin(), existingChars.end(), (uint16_t)ch);
+    };
+
+    DWORD kerningPairCount = GetKerningPairs(dc, 0, NULL);
+    if(kerningPairCount)
+    {
+        std::vector<KERNINGPAIR> kerningPairs(kerningPairCount);
+        DWORD res = GetKerningPairs(dc, kerningPairCount, kerningPairs.data());
+        assert(res);
+
+        for(size_t i = 0; i < kerningPairCount; ++i)
+        {
+            if(kerningPairs[i].iKernAmount)
+            {
+                SKerningEntry entry;
+                entry.First = kerningPairs[i].wFirst;
+                entry.Second = kerningPairs[i].wSecond;
+                // In dynamic mode any character may be rasterized later, so keep all pairs.
+                if(dynamic || (exists(entry.First) && exists(entry.Second)))
+                {
+                    entry.Amount = (float)kerningPairs[i].iKernAmount * fontSizeInv;
+                    m_KerningEntries.push_back(entry);
+                    if(dynamic)
+                    {
+                        EnsureCharPage(entry.First);
+                        EnsureCharPage(entry.Second);
+                    }
+                }
+            }
+        }
+        SortKerningEntries();
+
+        for(size_t i = 0, count = m_KerningEntries.size(); i < count; ++i)
+        {
+            const SKerningEntry& kerningEntry = m_KerningEntries[i];
+            if(dynamic || exists(kerningEntry.First))
+            {
+                // Entries are sorted, so first entry of a character starts its bucket.
+                if(i == 0 || m_KerningEntries[i - 1].First != kerningEntry.First)
+                {
+                    AccessCharInfo(kerningEntry.First).KerningEntryFirstIndex = i;
+                    AccessCharMetrics(kerningEntry.First).KerningBucket = (uint16_t)m_KerningBuckets.size();
+                    m_KerningBuckets.push_back(SKerningBucket{(uint32_t)i, 0, 0});
+                }
+                ++m_KerningBuckets.back().Count;
+                m_KerningBuckets.back().SecondBloom |= KerningBloomBit(kerningEntry.Second);
+            }
+        }
+
+        BuildKerningClasses(fontSize);
+        BuildKerningHash();
+    }
+
+    // Needs all pairs, as it is checked before the class matrix.
+    BuildKerningFilters();
+    if(m_KerningHashShift != 0)
+        RemoveClassMatrixKerningEntries();
+    UseOwnKerningData();
+}
+
+void CFont::SortKerningEntries()
+{
+    std::stable_sort(m_KerningEntries.begin(), m_KerningEntries.end(), [](const SKerningEntry& lhs, const SKerningEntry& rhs) -> bool {
+        if(lhs.First < rhs.First) { return true; }
+        if(lhs.First > rhs.First) { return false; }
+        return lhs.Second < rhs.Second;
+    });
+    // If the same pair was returned more than once, keep the first one, so all lookup structures agree.
+    m_KerningEntries.erase(std::unique(m_KerningEntries.begin(), m_KerningEntries.end(), [](const SKerningEntry& lhs, const SKerningEntry& rhs) -> bool {
+        return lhs.First == rhs.First && lhs.Second == rhs.Second;
+    }), m_KerningEntries.end());
+}
+
+void CFont::BuildKerningClasses(float fontSize)
+{
+    const size_t entryCount = m_KerningEntries.size();
+    m_KerningClassScale = 1.f / fontSize;
+    if(entryCount == 0)
+        return;
+
+    // Kerning amounts in pixels, as returned by GetKerningPairs.
+    std::vector<int32_t> amounts(entryCount);
+    for(size_t i = 0; i < entryCount; ++i)
+    {
+        amounts[i] = (int32_t)std::lround(m_KerningEntries[i].Amount * fontSize);
+    }
+
+    std::map<std::vector<uint32_t>, uint8_t> signatureToClass;
+    std::vector<uint32_t> signature;
+
+    // Right classes: group characters that have the same column - same amounts with all First characters.
+    std::vector<uint32_t> bySecond(entryCount);
+    for(uint32_t i = 0; i < (uint32_t)entryCount; ++i)
+    {
+        bySecond[i] = i;
+    }
+    std::sort(bySecond.begin(), bySecond.end(), [this](uint32_t lhs, uint32_t rhs) -> bool {
+        const SKerningEntry& lhsEntry = m_KerningEntries[lhs];
+        const SKerningEntry& rhsEntry = m_KerningEntries[rhs];
+        if(lhsEntry.Second < rhsEntry.Second) { return true; }
+        if(lhsEntry.Second > rhsEntry.Second) { return false; }
+        return lhsEntry.First < rhsEntry.First;
+    });
+    for(size_t i = 0; i < entryCount; )
+    {
+        const wchar_t second = m_KerningEntries[bySecond[i]].Second;
+        signature.clear();
+        for(; i < entryCount && m_KerningEntries[bySecond[i]].Second == second; ++i)
+        {
+            signature.push_back(((uint32_t)m_KerningEntries[bySecond[i]].First << 16) | (uint16_t)amounts[bySecond[i]]);
+        }
+        uint8_t rightClass = KERNING_CLASS_EXCEPTION;
+        const auto it = signatureToClass.find(signature);
+        if(it != signatureToClass.end())
+            rightClass = it->second;
+        else if(signatureToClass.size() + 1 < KERNING_CLASS_EXCEPTION)
+        {
+            rightClass = (uint8_t)(signatureToClass.size() + 1);
+            signatureToClass.emplace(signature, rightClass);
+        }
+        AccessCharMetrics(second).KerningRightClass = rightClass;
+    }
+    const uint32_t rightClassCount = (uint32_t)signatureToClass.size() + 1;
+
+    // Left classes: group characters that have the same row - same amounts with all right classes.
+    // Pairs with Second being an exception don't matter here, they are in the hash table anyway.
+    signatureToClass.clear();
+    for(size_t bucketIndex = 1; bucketIndex < m_KerningBuckets.size(); ++bucketIndex)
+    {
+        const SKerningBucket& bucket = m_KerningBuckets[bucketIndex];
+        const wchar_t first = m_KerningEntries[bucket.FirstIndex].First;
+        bool exception = false;
+        signature.clear();
+        for(uint32_t i = bucket.FirstIndex; i < bucket.FirstIndex + bucket.Count; ++i)
+        {
+            const uint8_t rightClass = GetCharMetrics(m_KerningEntries[i].Second).KerningRightClass;
+            if(amounts[i] < INT16_MIN || amounts[i] > INT16_MAX)
+                exception = true;
+            else if(rightClass != KERNING_CLASS_EXCEPTION)
+                signature.push_back(((uint32_t)rightClass << 16) | (uint16_t)amounts[i]);
+        }
+        std::sort(signature.begin(), signature.end());
+        signature.erase(std::unique(signature.begin(), signature.end()), signature.end());
+
+        // Empty signature means the row is all zeros, which is class 0.
+        uint8_t leftClass = 0;
+        if(exception)
+            leftClass = KERNING_CLASS_EXCEPTION;
+        else if(!signature.empty())
+        {
+            leftClass = KERNING_CLASS_EXCEPTION;
+            const auto it = signatureToClass.find(signature);
+            if(it != signatureToClass.end())
+                leftClass = it->second;
+            else if(signatureToClass.size() + 1 < KERNING_CLASS_EXCEPTION)
+            {
+                leftClass = (uint8_t)(signatureToClass.size() + 1);
+                signatureToClass.emplace(signature, leftClass);
+            }
+        }
+        AccessCharMetrics(first).KerningLeftClass = leftClass;
+    }
+    const uint32_t leftClassCount = (uint32_t)signatureToClass.size() + 1;
+
+    // Use the matrix only if it is smaller than the list of pairs it replaces.
+    // Otherwise make all characters exceptions, so all lookups go to the hash table.
+    if(leftClassCount * rightClassCount * sizeof(int16_t) > entryCount * sizeof(SKerningEntry))
+    {
+        for(size_t i = 0; i < entryCount; ++i)
+        {
+            AccessCharMetrics(m_KerningEntries[i].First).KerningLeftClass = KERNING_CLASS_EXCEPTION;
+            AccessCharMetrics(m_KerningEntries[i].Second).KerningRightClass = KERNING_CLASS_EXCEPTION;
+        }
+        return;
+    }
+
+    m_KerningRightClassCount = rightClassCount;
+    m_KerningClassMatrix.assign(leftClassCount * rightClassCount, 0);
+    for(size_t i = 0; i < entryCount; ++i)
+    {
+        const uint8_t leftClass = GetCharMetrics(m_KerningEntries[i].First).KerningLeftClass;
+        const uint8_t rightClass = GetCharMetrics(m_KerningEntries[i].Second).KerningRightClass;
+        if(leftClass != KERNING_CLASS_EXCEPTION && rightClass != KERNING_CLASS_EXCEPTION)
+        {
+            m_KerningClassMatrix[leftClass * rightClassCount + rightClass] = (int16_t)amounts[i];
+        }
+    }
+}
+
+bool CFont::IsKerningException(const SKerningEntry& entry) const
+{
+    return GetCharMetrics(entry.First).KerningLeftClass == KERNING_CLASS_EXCEPTION ||
+        GetCharMetrics(entry.Second).KerningRightClass == KERNING_CLASS_EXCEPTION;
+}
+
+void CFont::BuildKerningHash()
+{
+    size_t exceptionCount = 0;
+    for(size_t i = 0, count = m_KerningEntries.size(); i < count; ++i)
+    {
+        if(IsKerningException(m_KerningEntries[i]))
+            ++exceptionCount;
+    }
+
+    // Start with load factor <= 0.5. Double the size until every key fits within KERNING_HASH_MAX_PROBE slots.
+    uint32_t sizeLog2 = 4;
+    while(sizeLog2 < KERNING_HASH_MAX_SIZE_LOG2 && (1u << sizeLog2) < exceptionCount * 2)
+    {
+        ++sizeLog2;
+    }
+    for(; sizeLog2 <= KERNING_HASH_MAX_SIZE_LOG2; ++sizeLog2)
+    {
+        m_KerningHashShift = 32 - sizeLog2;
+        m_KerningHash.assign((1u << sizeLog2) + KERNING_HASH_MAX_PROBE - 1, SKerningHashSlot{0, 0.f});
+        bool success = true;
+        for(size_t i = 0, count = m_KerningEntries.size(); i < count && success; ++i)
+        {
+            const SKerningEntry& entry = m_KerningEntries[i];
+            if(!IsKerningException(entry))
+                continue;
+            const uint32_t key = ((uint32_t)entry.First << 16) | (uint32_t)entry.Second;
+            assert(key != 0);
+            SKerningHashSlot* slot = &m_KerningHash[(key * KERNING_HASH_MULTIPLIER) >> m_KerningHashShift];
+            uint32_t probe = 0;
+            while(probe < KERNING_HASH_MAX_PROBE && slot->Key != 0)
+            {
+                ++probe;
+                ++slot;
+            }
+            if(probe < KERNING_HASH_MAX_PROBE)
+            {
+                slot->Key = key;
+                slot->Amount = entry.Amount;
+            }
+            else
+                success = false;
+        }
+        if(success)
+            return;
+    }
+    // Fall back to binary search in m_KerningEntries.
+    m_KerningHash.clear();
+    m_KerningHashShift = 0;
+}
+
+void CFont::RemoveClassMatrixKerningEntries()
+{
+    // Entries only move towards the beginning, so they can be compacted in place.
+    std::vector<SKerningBucket> buckets(1, SKerningBucket{0, 0, 0});
+    size_t entryCount = 0;
+    for(size_t bucketIndex = 1; bucketIndex < m_KerningBuckets.size(); ++bucketIndex)
+    {
+        const SKerningBucket& oldBucket = m_KerningBuckets[bucketIndex];
+        const wchar_t first = m_KerningEntries[oldBucket.FirstIndex].First;
+        SKerningBucket bucket = {(uint32_t)entryCount, 0, 0};
+        for(uint32_t i = oldBucket.FirstIndex; i < oldBucket.FirstIndex + oldBucket.Count; ++i)
+        {
+            const SKerningEntry entry = m_KerningEntries[i];
+            if(IsKerningException(entry))
+            {
+                m_KerningEntries[entryCount++] = entry;
+                ++bucket.Count;
+                bucket.SecondBloom |= KerningBloomBit(entry.Second);
+            }
+        }
+        // Character with all pairs in the class matrix gets bucket 0, which rejects all exceptions.
+        if(bucket.Count)
+        {
+            AccessCharInfo(first).KerningEntryFirstIndex = bucket.FirstIndex;
+            AccessCharMetrics(first).KerningBucket = (uint16_t)buckets.size();
+            buckets.push_back(bucket);
+        }
+        else
+        {
+            AccessCharInfo(first).KerningEntryFirstIndex = SIZE_MAX;
+            AccessCharMetrics(first).KerningBucket = 0;
+        }
+    }
+    m_KerningEntries.resize(entryCount);
+    // Frees memory of the removed entries.
+    std::vector<SKerningEntry>(m_KerningEntries).swap(m_KerningEntries);
+    m_KerningBuckets.swap(buckets);
+}
+
+void CFont::BuildKerningFilters()
+{
+    const size_t wordsPerPage = CHAR_PAGE_SIZE / 32;
+    // Page 0 stays all zeros.
+    m_KerningSecondBits.assign(wordsPerPage, 0);
+    ZeroMemory(m_KerningSecondPages, sizeof m_KerningSecondPages);
+    for(size_t i = 0, count = m_KerningEntries.size(); i < count; ++i)
+    {
+        const wchar_t ch = m_KerningEntries[i].Second;
+        uint16_t& page = m_KerningSecondPages[ch >> CHAR_PAGE_SHIFT];
+        if(page == 0)
+        {
+            page = (uint16_t)(m_KerningSecondBits.size() / wordsPerPage);
+            m_KerningSecondBits.resize(m_KerningSecondBits.size() + wordsPerPage, 0);
+        }
+        const size_t lowBits = ch & CHAR_PAGE_MASK;
+        m_KerningSecondBits[page * wordsPerPage + (lowBits >> 5)] |= 1u << (lowBits & 31);
+    }
+}
+
+void CFont::ResetKerning()
+{
+    m_KerningEntries.clear();
+    m_KerningBuckets.assign(1, SKerningBucket{0, 0, 0});
+    m_KerningClassMatrix.assign(1, 0);
+    m_KerningRightClassCount = 1;
+    m_KerningClassScale = 0.f;
+    m_KerningHash.clear();
+    m_KerningHashShift = 32;
+    BuildKerningFilters();
+    UseOwnKerningData();
+}
+
+void CFont::UseOwnKerningData()
+{
+    m_KerningEntryData = m_KerningEntries.data();
+    m_KerningBucketData = m_KerningBuckets.data();
+    m_KerningClassMatrixData = m_KerningClassMatrix.data();
+    m_KerningHashData = m_KerningHash.data();
+    m_KerningSecondBitsData = m_KerningSecondBits.data();
+    m_BakedKerningBytes = 0;
+    m_BakedKerningClassMatrixSize = 0;
+    m_BakedKerningExceptionCount = 0;
+}
+
+bool CFont::Save(std::vector<uint8_t>& outData, const SFontDesc& desc) const
+{
+    if(m_Dynamic || desc.Atlas || m_TextureData.empty())
+        return false;
+
+    // Header is written at the end, when checksum of the payload is known.
+    outData.assign(CACHE_HEADER_SIZE, 0);
+    CCacheWriter writer(outData);
+    writer.WriteFloat(m_LineGap);
+    writer.WriteFloat(m_FillTexCoords.x);
+    writer.WriteFloat(m_FillTexCoords.y);
+    writer.WriteU32(m_FillTexturePage);
+
+    const size_t pageCount = m_CharInfoPageStorage.size();
+    writer.WriteU32((uint32_t)pageCount);
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+    {
+        // Pages of SCharInfo and SCharMetrics are always created together, so they have the same index.
+        size_t storageIndex = 0;
+        while(m_CharInfoPageStorage[storageIndex].get() != m_CharInfoPages[i])
+            ++storageIndex;
+        assert(m_CharMetricsPageStorage[storageIndex].get() == m_CharMetricsPages[i]);
+        writer.WriteU16((uint16_t)storageIndex);
+    }
+    for(size_t pageIndex = 0; pageIndex < pageCount; ++pageIndex)
+    {
+        const SCharInfo* const page = m_CharInfoPageStorage[pageIndex].get();
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            const SCharInfo& charInfo = page[i];
+            writer.WriteFloat(charInfo.TexCoordsRect.x);
+            writer.WriteFloat(charInfo.TexCoordsRect.y);
+            writer.WriteFloat(charInfo.TexCoordsRect.z);
+            writer.WriteFloat(charInfo.TexCoordsRect.w);
+            writer.WriteFloat(charInfo.Advance);
+            writer.WriteFloat(charInfo.Offset.x);
+            writer.WriteFloat(charInfo.Offset.y);
+            writer.WriteFloat(charInfo.Size.x);
+            writer.WriteFloat(charInfo.Size.y);
+            writer.WriteU32(charInfo.KerningEntryFirstIndex == SIZE_MAX ? UINT32_MAX : (uint32_t)charInfo.KerningEntryFirstIndex);
+            writer.WriteU32(charInfo.TexturePage);
+            writer.WriteU32(charInfo.TextureChannel);
+        }
+    }
+    for(size_t pageIndex = 0; pageIndex < pageCount; ++pageIndex)
+    {
+        const SCharMetrics* const page = m_CharMetricsPageStorage[pageIndex].get();
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            writer.WriteFloat(page[i].Advance);
+            writer.WriteU16(page[i].KerningBucket);
+            writer.WriteU8(page[i].KerningLeftClass);
+            writer.WriteU8(page[i].KerningRightClass);
+        }
+    }
+
+    writer.WriteU32((uint32_t)m_KerningEntries.size());
+    for(size_t i = 0; i < m_KerningEntries.size(); ++i)
+    {
+        writer.WriteU16((uint16_t)m_KerningEntries[i].First);
+        writer.WriteU16((uint16_t)m_KerningEntries[i].Second);
+        writer.WriteFloat(m_KerningEntries[i].Amount);
+    }
+    writer.WriteU32((uint32_t)m_KerningBuckets.size());
+    for(size_t i = 0; i < m_KerningBuckets.size(); ++i)
+    {
+        writer.WriteU32(m_KerningBuckets[i].FirstIndex);
+        writer.WriteU32(m_KerningBuckets[i].Count);
+        writer.WriteU32(m_KerningBuckets[i].SecondBloom);
+    }
+    writer.WriteU32(m_KerningRightClassCount);
+    writer.WriteFloat(m_KerningClassScale);
+    writer.WriteU32((uint32_t)m_KerningClassMatrix.size());
+    for(size_t i = 0; i < m_KerningClassMatrix.size(); ++i)
+        writer.WriteU16((uint16_t)m_KerningClassMatrix[i]);
+    writer.WriteU32(m_KerningHashShift);
+    writer.WriteU32((uint32_t)m_KerningHash.size());
+    for(size_t i = 0; i < m_KerningHash.size(); ++i)
+    {
+        writer.WriteU32(m_KerningHash[i].Key);
+        writer.WriteFloat(m_KerningHash[i].Amount);
+    }
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+        writer.WriteU16(m_KerningSecondPages[i]);
+    writer.WriteU32((uint32_t)m_KerningSecondBits.size());
+    for(size_t i = 0; i < m_KerningSecondBits.size(); ++i)
+        writer.WriteU32(m_KerningSecondBits[i]);
+
+    writer.WriteU32(m_TextureSize.x);
+    writer.WriteU32(m_TextureSize.y);
+    writer.WriteU32(m_TexturePageCount);
+    writer.WriteU32((uint32_t)m_TextureFormat);
+    writer.WriteU32(GetMipLevelCount());
+    writer.WriteU64(m_AtlasUsedTexels);
+    for(uint32_t level = 0; level < GetMipLevelCount(); ++level)
+    {
+        const std::vector<uint8_t>& levelData = level > 0 ? m_TextureMipLevels[level - 1] : m_TextureData;
+        writer.WriteU64(levelData.size());
+        writer.WriteBytes(levelData.data(), levelData.size());
+    }
+
+    std::vector<uint8_t> header;
+    CCacheWriter headerWriter(header);
+    headerWriter.WriteBytes(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    headerWriter.WriteU32(CACHE_VERSION);
+    headerWriter.WriteU64(CalcDescHash(desc));
+    headerWriter.WriteU64(outData.size() - CACHE_HEADER_SIZE);
+    headerWriter.WriteU64(CalcCacheChecksum(outData.data() + CACHE_HEADER_SIZE, outData.size() - CACHE_HEADER_SIZE));
+    assert(header.size() == CACHE_HEADER_SIZE);
+    memcpy(outData.data(), header.data(), CACHE_HEADER_SIZE);
+    return true;
+}
+
+bool CFont::Load(const void* data, size_t dataSize, const SFontDesc& desc)
+{
+    WaitInitAsync();
+    assert(!desc.GetTextureDestination || (!desc.Atlas && desc.MipLevelCount <= 1));
+    uint64_t descHash = 0;
+    if(!ValidateCache(data, dataSize, &descHash) || descHash != CalcDescHash(desc))
+        return false;
+
+    // Checksum only detects damage. Every index used by lookups is still checked, so data can't make them read out of bounds.
+    // All data is decoded and checked before the font is modified.
+    CCacheReader reader((const uint8_t*)data + CACHE_HEADER_SIZE, dataSize - CACHE_HEADER_SIZE);
+    const float lineGap = reader.ReadFloat();
+    vec2 fillTexCoords;
+    fillTexCoords.x = reader.ReadFloat();
+    fillTexCoords.y = reader.ReadFloat();
+    const uint32_t fillTexturePage = reader.ReadU32();
+
+    // Sizes of SCharInfo and SCharMetrics in data.
+    const size_t charInfoDataSize = 48, charMetricsDataSize = 8;
+    const uint32_t pageCount = reader.ReadCount(CHAR_PAGE_SIZE * (charInfoDataSize + charMetricsDataSize));
+    if(pageCount == 0)
+        return false;
+    uint16_t pageIndices[CHAR_PAGE_COUNT];
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+    {
+        pageIndices[i] = reader.ReadU16();
+        if(pageIndices[i] >= pageCount)
+            return false;
+    }
+    std::vector<std::unique_ptr<SCharInfo[]>> charInfoPageStorage(pageCount);
+    for(uint32_t pageIndex = 0; pageIndex < pageCount; ++pageIndex)
+    {
+        charInfoPageStorage[pageIndex].reset(new SCharInfo[CHAR_PAGE_SIZE]);
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            SCharInfo& charInfo = charInfoPageStorage[pageIndex][i];
+            charInfo.TexCoordsRect.x = reader.ReadFloat();
+            charInfo.TexCoordsRect.y = reader.ReadFloat();
+            charInfo.TexCoordsRect.z = reader.ReadFloat();
+            charInfo.TexCoordsRect.w = reader.ReadFloat();
+            charInfo.Advance = reader.ReadFloat();
+            charInfo.Offset.x = reader.ReadFloat();
+            charInfo.Offset.y = reader.ReadFloat();
+            charInfo.Size.x = reader.ReadFloat();
+            charInfo.Size.y = reader.ReadFloat();
+            const uint32_t kerningEntryFirstIndex = reader.ReadU32();
+            charInfo.KerningEntryFirstIndex = kerningEntryFirstIndex == UINT32_MAX ? SIZE_MAX : kerningEntryFirstIndex;
+            charInfo.TexturePage = reader.ReadU32();
+            charInfo.TextureChannel = reader.ReadU32();
+        }
+    }
+    std::vector<std::unique_ptr<SCharMetrics[]>> charMetricsPageStorage(pageCount);
+    for(uint32_t pageIndex = 0; pageIndex < pageCount; ++pageIndex)
+    {
+        charMetricsPageStorage[pageIndex].reset(new SCharMetrics[CHAR_PAGE_SIZE]);
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            SCharMetrics& charMetrics = charMetricsPageStorage[pageIndex][i];
+            charMetrics.Advance = reader.ReadFloat();
+            charMetrics.KerningBucket = reader.ReadU16();
+            charMetrics.KerningLeftClass = reader.ReadU8();
+            charMetrics.KerningRightClass = reader.ReadU8();
+        }
+    }
+
+    std::vector<SKerningEntry> kerningEntries(reader.ReadCount(8));
+    for(size_t i = 0; i < kerningEntries.size(); ++i)
+    {
+        kerningEntries[i].First = (wchar_t)reader.ReadU16();
+        kerningEntries[i].Second = (wchar_t)reader.ReadU16();
+        kerningEntries[i].Amount = reader.ReadFloat();
+    }
+    std::vector<SKerningBucket> kerningBuckets(reader.ReadCount(12));
+    for(size_t i = 0; i < kerningBuckets.size(); ++i)
+    {
+        kerningBuckets[i].FirstIndex = reader.ReadU32();
+        kerningBuckets[i].Count = reader.ReadU32();
+        kerningBuckets[i].SecondBloom = reader.ReadU32();
+    }
+    const uint32_t kerningRightClassCount = reader.ReadU32();
+    const float kerningClassScale = reader.ReadFloat();
+    std::vector<int16_t> kerningClassMatrix(reader.ReadCount(2));
+    for(size_t i = 0; i < kerningClassMatrix.size(); ++i)
+        kerningClassMatrix[i] = (int16_t)reader.ReadU16();
+    const uint32_t kerningHashShift = reader.ReadU32();
+    std::vector<SKerningHashSlot> kerningHash(reader.ReadCount(8));
+    for(size_t i = 0; i < kerningHash.size(); ++i)
+    {
+        kerningHash[i].Key = reader.ReadU32();
+        kerningHash[i].Amount = reader.ReadFloat();
+    }
+    uint16_t kerningSecondPages[CHAR_PAGE_COUNT];
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+        kerningSecondPages[i] = reader.ReadU16();
+    std::vector<uint32_t> kerningSecondBits(reader.ReadCount(4));
+    for(size_t i = 0; i < kerningSecondBits.size(); ++i)
+        kerningSecondBits[i] = reader.ReadU32();
+
+    uvec2 textureSize;
+    textureSize.x = reader.ReadU32();
+    textureSize.y = reader.ReadU32();
+    const uint32_t texturePageCount = reader.ReadU32();
+    const uint32_t textureFormat = reader.ReadU32();
+    const uint32_t mipLevelCount = reader.ReadU32();
+    const uint64_t atlasUsedTexels = reader.ReadU64();
+    // Same as in Init.
+    const TEXTURE_FORMAT expectedTextureFormat = (desc.Flags & SFontDesc::FLAG_MSDF) ? TEXTURE_FORMAT_R8G8B8A8 : desc.TextureFormat;
+    if(!reader.IsValid() || textureFormat != (uint32_t)expectedTextureFormat || mipLevelCount != CalcMipLevelCount(desc) ||
+        textureSize.x == 0 || textureSize.y == 0 || textureSize.x > UINT32_MAX / 4 || texturePageCount == 0)
+        return false;
+    std::vector<const uint8_t*> levelData(mipLevelCount);
+    std::vector<size_t> levelDataSizes(mipLevelCount);
+    for(uint32_t level = 0; level < mipLevelCount; ++level)
+    {
+        levelDataSizes[level] = GetTextureRowPitch(expectedTextureFormat, textureSize.x >> level) *
+            GetTextureRowCount(expectedTextureFormat, textureSize.y >> level) * texturePageCount;
+        if(reader.ReadU64() != levelDataSizes[level])
+            return false;
+        levelData[level] = reader.ReadBytes(levelDataSizes[level]);
+    }
+    if(!reader.IsValid() || !reader.IsAtEnd())
+        return false;
+
+    if(kerningBuckets.empty() || kerningRightClassCount == 0 || kerningClassMatrix.empty() ||
+        kerningClassMatrix.size() % kerningRightClassCount != 0 || fillTexturePage >= texturePageCount)
+        return false;
+    const size_t kerningLeftClassCount = kerningClassMatrix.size() / kerningRightClassCount;
+    for(uint32_t pageIndex = 0; pageIndex < pageCount; ++pageIndex)
+    {
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            const SCharInfo& charInfo = charInfoPageStorage[pageIndex][i];
+            const SCharMetrics& charMetrics = charMetricsPageStorage[pageIndex][i];
+            if(charInfo.TexturePage >= texturePageCount || charInfo.TextureChannel >= 4 ||
+                (charInfo.KerningEntryFirstIndex != SIZE_MAX && charInfo.KerningEntryFirstIndex >= kerningEntries.size()) ||
+                charMetrics.KerningBucket >= kerningBuckets.size() ||
+                (charMetrics.KerningLeftClass != KERNING_CLASS_EXCEPTION && charMetrics.KerningLeftClass >= kerningLeftClassCount) ||
+                (charMetrics.KerningRightClass != KERNING_CLASS_EXCEPTION && charMetrics.KerningRightClass >= kerningRightClassCount))
+                return false;
+        }
+    }
+    for(size_t i = 0; i < kerningBuckets.size(); ++i)
+    {
+        if((uint64_t)kerningBuckets[i].FirstIndex + kerningBuckets[i].Count > kerningEntries.size() ||
+            (kerningHash.empty() && kerningHashShift != 0 && kerningBuckets[i].SecondBloom != 0))
+            return false;
+    }
+    if(!kerningHash.empty() && (kerningHashShift == 0 || kerningHashShift >= 32 ||
+        kerningHash.size() != (1u << (32 - kerningHashShift)) + KERNING_HASH_MAX_PROBE - 1))
+        return false;
+    const size_t kerningSecondWordsPerPage = CHAR_PAGE_SIZE / 32;
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+    {
+        if((kerningSecondPages[i] + 1u) * kerningSecondWordsPerPage > kerningSecondBits.size())
+            return false;
+    }
+
+    STextureDestination destination;
+    if(desc.GetTextureDestination)
+    {
+        if(!desc.GetTextureDestination(desc.GetTextureDestinationUserData, textureSize, texturePageCount, expectedTextureFormat, destination))
+            return false;
+        assert(destination.Data && destination.RowPitch >= GetTextureRowPitch(expectedTextureFormat, textureSize.x) &&
+            destination.PageStride >= destination.RowPitch * GetTextureRowCount(expectedTextureFormat, textureSize.y));
+    }
+
+    ReleaseDynamicAtlas();
+    RemoveFromAtlas();
+    m_AddChars.reset();
+    m_CharInfoPageStorage.swap(charInfoPageStorage);
+    m_CharMetricsPageStorage.swap(charMetricsPageStorage);
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+    {
+        m_CharInfoPages[i] = m_CharInfoPageStorage[pageIndices[i]].get();
+        m_CharMetricsPages[i] = m_CharMetricsPageStorage[pageIndices[i]].get();
+    }
+    m_KerningEntries.swap(kerningEntries);
+    m_KerningBuckets.swap(kerningBuckets);
+    m_KerningClassMatrix.swap(kerningClassMatrix);
+    m_KerningRightClassCount = kerningRightClassCount;
+    m_KerningClassScale = kerningClassScale;
+    m_KerningHash.swap(kerningHash);
+    m_KerningHashShift = kerningHashShift;
+    memcpy(m_KerningSecondPages, kerningSecondPages, sizeof(m_KerningSecondPages));
+    m_KerningSecondBits.swap(kerningSecondBits);
+    UseOwnKerningData();
+    m_FillTexCoords = fillTexCoords;
+    m_FillTexturePage = fillTexturePage;
+    m_LineGap = lineGap;
+
+    m_TextureSize = textureSize;
+    m_TexturePageCount = texturePageCount;
+    m_TextureFormat = expectedTextureFormat;
+    m_AtlasUsedTexels = (size_t)atlasUsedTexels;
+    m_TextureMipLevels.resize(mipLevelCount - 1);
+    for(uint32_t level = 1; level < mipLevelCount; ++level)
+        m_TextureMipLevels[level - 1].assign(levelData[level], levelData[level] + levelDataSizes[level]);
+    m_DirtyRegions.clear();
+    const size_t rowPitch = GetTextureRowPitch(m_TextureFormat, m_TextureSize.x);
+    if(destination.Data)
+    {
+        const uint32_t rowCount = GetTextureRowCount(m_TextureFormat, m_TextureSize.y);
+        for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+        {
+            for(uint32_t y = 0; y < rowCount; ++y)
+            {
+                memcpy((uint8_t*)destination.Data + destination.PageStride * texturePage + destination.RowPitch * y,
+                    levelData[0] + rowPitch * (rowCount * texturePage + y), rowPitch);
+            }
+        }
+        m_TextureRowPitch = 0;
+        std::vector<uint8_t> tmp;
+        m_TextureData.swap(tmp);
+    }
+    else
+    {
+        m_TextureRowPitch = rowPitch;
+        m_TextureData.assign(levelData[0], levelData[0] + levelDataSizes[0]);
+        for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+            AddDirtyRect(texturePage, uvec2(0, 0), m_TextureSize);
+    }
+
+    // Nothing was packed, rasterized or compressed.
+    m_RasterizationTime = 0.f;
+    m_RasterizationThreadCount = 0;
+    m_PackingTime = 0.f;
+    m_SdfCharCount = 0;
+    m_SdfTime = 0.f;
+    m_CompositionTime = 0.f;
+    m_InitTime = 0.f;
+    m_InitPeakBytes = 0;
+    m_CompressionTime = 0.f;
+    m_CompressionPsnr = 0.f;
+    m_InitResult = INIT_RESULT_SUCCESS;
+    m_MetricsReady = true;
+    return true;
+}
+
+bool CFont::ValidateCache(const void* data, size_t dataSize, uint64_t* outDescHash)
+{
+    return ValidateFontCache(data, dataSize, outDescHash);
+}
+
+uint64_t CFont::CalcDescHash(const SFontDesc& desc)
+{
+    // Atlas and GetTextureDestination are not included - fonts using them can't be saved, and destination can change.
+    std::vector<uint8_t> data;
+    CCacheWriter writer(data);
+    writer.WriteU32((uint32_t)desc.FaceName.length());
+    for(size_t i = 0; i < desc.FaceName.length(); ++i)
+        writer.WriteU16((uint16_t)desc.FaceName[i]);
+    writer.WriteU32((uint32_t)desc.Height);
+    // FLAG_LOW_PEAK_MEMORY doesn't change the font.
+    writer.WriteU32(desc.Flags & ~(uint32_t)SFontDesc::FLAG_LOW_PEAK_MEMORY);
+    writer.WriteU32((uint32_t)desc.CharSet);
+    writer.WriteU32((uint32_t)desc.PitchAndFamily);
+    writer.WriteU32((uint32_t)desc.CharRangeCount);
+    for(size_t i = 0; i < desc.CharRangeCount * 2; ++i)
+        writer.WriteU16((uint16_t)desc.CharRanges[i]);
+    writer.WriteU32((uint32_t)desc.Packing);
+    writer.WriteU32(desc.MaxTextureSize);
+    writer.WriteU32(desc.MaxTexturePageCount);
+    writer.WriteU32(desc.MipLevelCount);
+    writer.WriteU32((uint32_t)desc.TextureFormat);
+    writer.WriteU32(desc.SdfSpread);
+    writer.WriteU32(desc.SdfSupersampling);
+    return CalcCacheChecksum(data.data(), data.size());
+}
+
+bool CFont::WriteBakedFont(std::string& outCode, const char* name) const
+{
+    if(m_Dynamic || m_TextureData.empty())
+        return false;
+
+    std::string& out = outCode;
+    out = "// Font baked by WinFontRender::CFont::WriteBakedFont. Include it after WinFontRender.h in one CPP file.\n"
+        "// Pass Font to CFont::InitBaked. Upload texture from TextureMipLevels.\n"
+        "namespace ";
+    out += name;
+    out += "\n{\n\n";
+
+    const size_t pageCount = m_CharInfoPageStorage.size();
+    out += "static const uint16_t CharPageIndices[256] = {";
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+    {
+        size_t storageIndex = 0;
+        while(m_CharInfoPageStorage[storageIndex].get() != m_CharInfoPages[i])
+            ++storageIndex;
+        AppendBakedSeparator(out, i, 32);
+        AppendBakedUint(out, storageIndex);
+        out += ',';
+    }
+    out += "\n};\n"
+        "// Not const, because CFont keeps non-const pointers to pages of characters. They are never modified in a baked font.\n"
+        "static WinFontRender::CFont::SCharInfo CharInfoPages[] = {";
+    for(size_t pageIndex = 0; pageIndex < pageCount; ++pageIndex)
+    {
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            const SCharInfo& charInfo = m_CharInfoPageStorage[pageIndex][i];
+            out += "\n    {{";
+            AppendBakedFloat(out, charInfo.TexCoordsRect.x); out += ", ";
+            AppendBakedFloat(out, charInfo.TexCoordsRect.y); out += ", ";
+            AppendBakedFloat(out, charInfo.TexCoordsRect.z); out += ", ";
+            AppendBakedFloat(out, charInfo.TexCoordsRect.w); out += "}, ";
+            AppendBakedFloat(out, charInfo.Advance); out += ", {";
+            AppendBakedFloat(out, charInfo.Offset.x); out += ", ";
+            AppendBakedFloat(out, charInfo.Offset.y); out += "}, {";
+            AppendBakedFloat(out, charInfo.Size.x); out += ", ";
+            AppendBakedFloat(out, charInfo.Size.y); out += "}, ";
+            // KerningEntryFirstIndex. InitBaked leaves m_KerningEntries empty, so it can't point there.
+            out += "SIZE_MAX, ";
+            AppendBakedUint(out, charInfo.TexturePage); out += ", ";
+            AppendBakedUint(out, charInfo.TextureChannel); out += "},";
+        }
+    }
+    out += "\n};\nstatic WinFontRender::CFont::SCharMetrics CharMetricsPages[] = {";
+    for(size_t pageIndex = 0; pageIndex < pageCount; ++pageIndex)
+    {
+        for(size_t i = 0; i < CHAR_PAGE_SIZE; ++i)
+        {
+            const SCharMetrics& charMetrics = m_CharMetricsPageStorage[pageIndex][i];
+            AppendBakedSeparator(out, pageIndex * CHAR_PAGE_SIZE + i, 4);
+            out += '{';
+            AppendBakedFloat(out, charMetrics.Advance); out += ", ";
+            AppendBakedUint(out, charMetrics.KerningBucket); out += ", ";
+            AppendBakedUint(out, charMetrics.KerningLeftClass); out += ", ";
+            AppendBakedUint(out, charMetrics.KerningRightClass); out += "},";
+        }
+    }
+    out += "\n};\n\nstatic const WinFontRender::CFont::SKerningBucket KerningBuckets[] = {";
+    for(size_t i = 0; i < m_KerningBuckets.size(); ++i)
+    {
+        AppendBakedSeparator(out, i, 4);
+        out += '{';
+        AppendBakedUint(out, m_KerningBuckets[i].FirstIndex); out += "u, ";
+        AppendBakedUint(out, m_KerningBuckets[i].Count); out += "u, ";
+        AppendBakedUint(out, m_KerningBuckets[i].SecondBloom); out += "u},";
+    }
+    out += "\n};\nstatic const int16_t KerningClassMatrix[] = {";
+    for(size_t i = 0; i < m_KerningClassMatrix.size(); ++i)
+    {
+        AppendBakedSeparator(out, i, 32);
+        AppendBakedInt(out, m_KerningClassMatrix[i]);
+        out += ',';
+    }
+    out += "\n};\n";
+    if(m_KerningHashShift == 0)
+    {
+        out += "static const WinFontRender::CFont::SKerningEntry KerningEntries[] = {";
+        for(size_t i = 0; i < m_KerningEntries.size(); ++i)
+        {
+            AppendBakedSeparator(out, i, 4);
+            out += '{';
+            AppendBakedUint(out, m_KerningEntries[i].First); out += ", ";
+            AppendBakedUint(out, m_KerningEntries[i].Second); out += ", ";
+            AppendBakedFloat(out, m_KerningEntries[i].Amount); out += "},";
+        }
+        out += "\n};\n";
+    }
+    if(!m_KerningHash.empty())
+    {
+        out += "static const WinFontRender::CFont::SKerningHashSlot KerningHash[] = {";
+        for(size_t i = 0; i < m_KerningHash.size(); ++i)
+        {
+            AppendBakedSeparator(out, i, 4);
+            out += '{';
+            AppendBakedUint(out, m_KerningHash[i].Key); out += "u, ";
+            AppendBakedFloat(out, m_KerningHash[i].Amount); out += "},";
+        }
+        out += "\n};\n";
+    }
+    out += "static const uint16_t KerningSecondPages[256] = {";
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
+    {
+        AppendBakedSeparator(out, i, 32);
+        AppendBakedUint(out, m_KerningSecondPages[i]);
+        out += ',';
+    }
+    out += "\n};\nstatic const uint32_t KerningSecondBits[] = {";
+    for(size_t i = 0; i < m_KerningSecondBits.size(); ++i)
+    {
+        AppendBakedSeparator(out, i, 8);
+        AppendBakedUint(out, m_KerningSecondBits[i]);
+        out += "u,";
+    }
+    out += "\n};\n\n";
+
+    // Each level has all texture pages, like GetTextureData returns it.
+    const uint32_t mipLevelCount = GetMipLevelCount();
+    for(uint32_t level = 0; level < mipLevelCount; ++level)
+    {
+        const std::vector<uint8_t>& levelData = level > 0 ? m_TextureMipLevels[level - 1] : m_TextureData;
+        out += "static const uint8_t TextureMipLevel";
+        AppendBakedUint(out, level);
+        out += "[] = {";
+        for(size_t i = 0; i < levelData.size(); ++i)
+        {
+            AppendBakedSeparator(out, i, 32);
+            AppendBakedUint(out, levelData[i]);
+            out += ',';
+        }
+        // Level can be empty, e.g. 2x2 texels of TEXTURE_FORMAT_BC4.
+        if(levelData.empty())
+            out += '0';
+        out += "\n};\n";
+    }
+    out += "static const uint8_t* const TextureMipLevels[] = {";
+    for(uint32_t level = 0; level < mipLevelCount; ++level)
+    {
+        out += " TextureMipLevel";
+        AppendBakedUint(out, level);
+        out += ',';
+    }
+    out += " };\nstatic const size_t TextureMipLevelRowPitches[] = {";
+    for(uint32_t level = 0; level < mipLevelCount; ++level)
+    {
+        out += ' ';
+        AppendBakedUint(out, GetTextureRowPitch(m_TextureFormat, m_TextureSize.x >> level));
+        out += ',';
+    }
+    out += " };\nstatic const uint32_t TextureMipLevelCount = ";
+    AppendBakedUint(out, mipLevelCount);
+    out += ";\n\nstatic const WinFontRender::CFont::SBakedFont Font = {\n    ";
+    AppendBakedFloat(out, m_LineGap);
+    out += ", {";
+    AppendBakedFloat(out, m_FillTexCoords.x);
+    out += ", ";
+    AppendBakedFloat(out, m_FillTexCoords.y);
+    out += "}, ";
+    AppendBakedUint(out, m_FillTexturePage);
+    out += ",\n    CharPageIndices, CharInfoPages, CharMetricsPages,\n    KerningBuckets, KerningClassMatrix, ";
+    AppendBakedUint(out, m_KerningRightClassCount);
+    out += ", ";
+    AppendBakedFloat(out, m_KerningClassScale);
+    out += m_KerningHash.empty() ? ", nullptr, " : ", KerningHash, ";
+    AppendBakedUint(out, m_KerningHashShift);
+    out += m_KerningHashShift == 0 ? ", KerningEntries," : ", nullptr,";
+    out += "\n    KerningSecondPages, KerningSecondBits,\n    {";
+    AppendBakedUint(out, m_TextureSize.x);
+    out += "u, ";
+    AppendBakedUint(out, m_TextureSize.y);
+    out += "u}, ";
+    AppendBakedUint(out, m_TexturePageCount);
+    out += ", (WinFontRender::TEXTURE_FORMAT)";
+    AppendBakedUint(out, (uint32_t)m_TextureFormat);
+    out += ",\n    ";
+    AppendBakedUint(out, m_KerningBuckets.size());
+    out += ", ";
+    AppendBakedUint(out, m_KerningClassMatrix.size());
+    out += ", ";
+    AppendBakedUint(out, m_KerningHash.size());
+    out += ", ";
+    AppendBakedUint(out, m_KerningHashShift == 0 ? m_KerningEntries.size() : 0);
+    out += ", ";
+    AppendBakedUint(out, m_KerningSecondBits.size());
+    out += ", ";
+    size_t exceptionCount = 0;
+    for(size_t i = 0, count = m_KerningEntries.size(); i < count; ++i)
+    {
+        if(IsKerningException(m_KerningEntries[i]))
+            ++exceptionCount;
+    }
+    AppendBakedUint(out, exceptionCount);
+    out += ",\n};\n\n} // namespace ";
+    out += name;
+    out += '\n';
+    return true;
+}
+
+void CFont::InitBaked(const SBakedFont& baked)
+{
+    WaitInitAsync();
+    ReleaseDynamicAtlas();
+    RemoveFromAtlas();
+    m_AddChars.reset();
+    m_CharInfoPageStorage.clear();
+    m_CharMetricsPageStorage.clear();
+    for(size_t i = 0; i < CHAR_PAGE_COUNT; ++i)
     {
-        if (text[i] != L' ')
-            result++;
+        m_CharInfoPages[i] = baked.CharInfoPages + baked.CharPageIndices[i] * CHAR_PAGE_SIZE;
+        m_CharMetricsPages[i] = baked.CharMetricsPages + baked.CharPageIndices[i] * CHAR_PAGE_SIZE;
     }
+    m_KerningEntries.clear();
+    m_KerningBuckets.clear();
+    m_KerningClassMatrix.clear();
+    m_KerningHash.clear();
+    m_KerningSecondBits.clear();
+    m_KerningBucketData = baked.KerningBuckets;
+    m_KerningClassMatrixData = baked.KerningClassMatrix;
+    m_KerningRightClassCount = baked.KerningRightClassCount;
+    m_KerningClassScale = baked.KerningClassScale;
+    m_KerningEntryData = baked.KerningEntries;
+    m_KerningHashData = baked.KerningHash;
+    m_KerningHashShift = baked.KerningHashShift;
+    memcpy(m_KerningSecondPages, baked.KerningSecondPages, sizeof(m_KerningSecondPages));
+    m_KerningSecondBitsData = baked.KerningSecondBits;
+    m_BakedKerningBytes = baked.KerningBucketCount * sizeof(SKerningBucket) +
+        baked.KerningClassMatrixSize * sizeof(int16_t) +
+        baked.KerningHashSize * sizeof(SKerningHashSlot) +
+        baked.KerningEntryCount * sizeof(SKerningEntry) +
+        baked.KerningSecondBitsCount * sizeof(uint32_t);
+    m_BakedKerningClassMatrixSize = baked.KerningClassMatrixSize;
+    m_BakedKerningExceptionCount = baked.KerningExceptionCount;
+    m_FillTexCoords = baked.FillTexCoords;
+    m_FillTexturePage = baked.FillTexturePage;
+    m_LineGap = baked.LineGap;
+
+    FreeTextureData();
+    m_TextureMipLevels.clear();
+    m_TextureSize = baked.TextureSize;
+    m_TextureRowPitch = 0;
+    m_TexturePageCount = baked.TexturePageCount;
+    m_TextureFormat = baked.TextureFormat;
+    m_AtlasUsedTexels = 0;
+    m_RasterizationTime = 0.f;
+    m_RasterizationThreadCount = 0;
+    m_PackingTime = 0.f;
+    m_SdfCharCount = 0;
+    m_SdfTime = 0.f;
+    m_CompositionTime = 0.f;
+    m_InitTime = 0.f;
+    m_InitPeakBytes = 0;
+    m_CompressionTime = 0.f;
+    m_CompressionPsnr = 0.f;
+    m_InitResult = INIT_RESULT_SUCCESS;
+    m_MetricsReady = true;
+}
 
-    if (flags & FLAG_DOUBLE_UNDERLINE)
-        result += 2;
-    else if (flags & FLAG_UNDERLINE)
-        result++;
-    if (flags & FLAG_OVERLINE)
-        result++;
-    if (flags & FLAG_STRIKEOUT)
-        result++;
+////////////////////////////////////////////////////////////////////////////////
+// class CFontAtlas
 
-    return result;
+CFontAtlas::CFontAtlas()
+{
 }
 
-size_t CFont::CalcQuadCount(const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const
+CFontAtlas::~CFontAtlas()
 {
-    assert(ValidateFlags(flags));
+    ForgetFonts();
+}
 
-    size_t result = 0;
-    size_t beg, end, index = 0;
-    float width;
-    int lineCount = 0;
+void CFontAtlas::Init(const SFontAtlasDesc& desc)
+{
+    ForgetFonts();
+    m_Desc = desc;
+    m_Glyphs.clear();
+    m_Fonts.clear();
+    m_GlyphData.clear();
+    m_GlyphFormat = TEXTURE_FORMAT_R8;
+    m_BuildResult = CFont::INIT_RESULT_SUCCESS;
+    m_TextureSize = UVEC2_ZERO;
+    m_TextureRowPitch = 0;
+    m_TexturePageCount = 0;
+    assert(desc.TextureFormat == TEXTURE_FORMAT_R8 || desc.TextureFormat == TEXTURE_FORMAT_R4 ||
+        desc.TextureFormat == TEXTURE_FORMAT_R8G8B8A8);
+    assert(!(desc.Flags & SFontAtlasDesc::FLAG_CHANNEL_PACKING) || desc.TextureFormat == TEXTURE_FORMAT_R8G8B8A8);
+    m_TextureFormat = desc.TextureFormat;
+    m_TextureChannelCount = 1;
+    m_TextureData.clear();
+    m_AtlasUsedTexels = 0;
+    m_PackingTime = 0.f;
+    m_CompositionTime = 0.f;
+}
 
-    while (LineSplit(&beg, &end, &width, &index, text, fontSize, flags, textWidth))
+void CFontAtlas::AddFont(CFont* font, int height, TEXTURE_FORMAT glyphFormat, bool gray8,
+    const uint16_t* chars, const uvec2* sizes, const uint8_t* const* data, size_t count)
+{
+    assert(m_Fonts.empty() || glyphFormat == m_GlyphFormat);
+    // Multi-channel distance field makes the whole texture TEXTURE_FORMAT_R8G8B8A8.
+    assert(glyphFormat == TEXTURE_FORMAT_R8 || !(m_Desc.Flags & SFontAtlasDesc::FLAG_CHANNEL_PACKING));
+    m_GlyphFormat = glyphFormat;
+    m_TextureFormat = glyphFormat == TEXTURE_FORMAT_R8G8B8A8 ? glyphFormat : m_Desc.TextureFormat;
+    const uint32_t bytesPerTexel = GetTextureFormatBytesPerTexel(glyphFormat);
+    m_Fonts.push_back(SFontRange{font, height, m_Glyphs.size(), count});
+    for(size_t i = 0; i < count; ++i)
     {
-        for (size_t i = beg; i < end; ++i)
+        const uint32_t rowPitch = AlignUp<uint32_t>(sizes[i].x * bytesPerTexel, 4);
+        const size_t dataOffset = m_GlyphData.size();
+        m_Glyphs.push_back(SGlyph{(wchar_t)chars[i], sizes[i], dataOffset, UVEC2_ZERO, 0, 0});
+        m_GlyphData.resize(dataOffset + rowPitch * sizes[i].y);
+        if(gray8)
+            BlitGray8Bitmap(m_GlyphData.data() + dataOffset, rowPitch, uvec2(0, 0), data[i], rowPitch, uvec2(0, 0), sizes[i]);
+        else
+            BlitBitmap(m_GlyphData.data() + dataOffset, rowPitch, uvec2(0, 0), data[i], rowPitch, uvec2(0, 0), sizes[i], bytesPerTexel);
+    }
+}
+
+void CFontAtlas::RemoveFont(CFont* font)
+{
+    for(size_t fontIndex = 0; fontIndex < m_Fonts.size(); ++fontIndex)
+    {
+        const SFontRange range = m_Fonts[fontIndex];
+        if(range.Font != font)
+            continue;
+        // Glyphs of a font and their data are contiguous, as added by AddFont.
+        const size_t endGlyphIndex = range.FirstGlyphIndex + range.GlyphCount;
+        if(range.GlyphCount)
         {
-            if (text[i] != L' ')
-                result++;
+            const size_t dataBegin = m_Glyphs[range.FirstGlyphIndex].DataOffset;
+            const size_t dataEnd = endGlyphIndex < m_Glyphs.size() ? m_Glyphs[endGlyphIndex].DataOffset : m_GlyphData.size();
+            m_GlyphData.erase(m_GlyphData.begin() + dataBegin, m_GlyphData.begin() + dataEnd);
+            for(size_t i = endGlyphIndex; i < m_Glyphs.size(); ++i)
+                m_Glyphs[i].DataOffset -= dataEnd - dataBegin;
+            m_Glyphs.erase(m_Glyphs.begin() + range.FirstGlyphIndex, m_Glyphs.begin() + endGlyphIndex);
         }
-        lineCount++;
+        m_Fonts.erase(m_Fonts.begin() + fontIndex);
+        for(size_t i = fontIndex; i < m_Fonts.size(); ++i)
+            m_Fonts[i].FirstGlyphIndex -= range.GlyphCount;
+        return;
     }
+}
 
-    if (flags & FLAG_DOUBLE_UNDERLINE)
-        result += 2 * lineCount;
-    else if (flags & FLAG_UNDERLINE)
-        result += lineCount;
-    if (flags & FLAG_OVERLINE)
-        result += lineCount;
-    if (flags & FLAG_STRIKEOUT)
-        result += lineCount;
-
-    return result;
+void CFontAtlas::ForgetFonts()
+{
+    for(size_t i = 0; i < m_Fonts.size(); ++i)
+    {
+        if(m_Fonts[i].Font && m_Fonts[i].Font->m_Atlas == this)
+        {
+            m_Fonts[i].Font->m_Atlas = nullptr;
+            m_Fonts[i].Font->m_AtlasExistingChars.clear();
+        }
+    }
 }
 
-bool CFont::HitTestSingleLine(size_t& outIndex, float *outPercent,
-    float posX, float hitX, const wstr_view& text, float fontSize, uint32_t flags) const
+bool CFontAtlas::Build()
 {
-    assert(ValidateFlags(flags));
-    const size_t textLen = text.length();
+    assert(!m_Fonts.empty());
+    const auto packingBeginTime = std::chrono::high_resolution_clock::now();
+    const uint32_t margin = 1;
+    const bool pow2 = (m_Desc.Flags & SFontDesc::FLAG_TEXTURE_POW2) != 0;
+    const bool channelPacking = (m_Desc.Flags & SFontAtlasDesc::FLAG_CHANNEL_PACKING) != 0;
+    m_TextureChannelCount = channelPacking ? (uint32_t)std::min<size_t>(m_Fonts.size(), 4) : 1;
+    for(size_t fontIndex = 0; fontIndex < m_Fonts.size(); ++fontIndex)
+    {
+        const SFontRange& font = m_Fonts[fontIndex];
+        for(size_t i = font.FirstGlyphIndex; i < font.FirstGlyphIndex + font.GlyphCount; ++i)
+            m_Glyphs[i].TextureChannel = (uint32_t)(fontIndex % m_TextureChannelCount);
+    }
 
-    if (flags & FLAG_HLEFT)
+    // Glyphs of all fonts sorted together by height.
+    std::vector<uint32_t> sortIndex(m_Glyphs.size());
+    for(uint32_t i = 0; i < (uint32_t)m_Glyphs.size(); ++i)
+        sortIndex[i] = i;
+    std::stable_sort(sortIndex.begin(), sortIndex.end(), [this](uint32_t lhs, uint32_t rhs) -> bool {
+        return m_Glyphs[lhs].Size.y > m_Glyphs[rhs].Size.y;
+    });
+    m_AtlasUsedTexels = 0;
+    for(size_t i = 0; i < sortIndex.size(); ++i)
+        m_AtlasUsedTexels += m_Glyphs[sortIndex[i]].Size.x * m_Glyphs[sortIndex[i]].Size.y;
+    int maxHeight = 0;
+    for(size_t i = 0; i < m_Fonts.size(); ++i)
+        maxHeight = std::max(maxHeight, m_Fonts[i].Height);
+
+    // Each channel is packed separately. The texture is large enough for all of them.
+    m_TextureSize = UVEC2_ZERO;
+    m_TexturePageCount = 0;
+    for(uint32_t channel = 0; channel < m_TextureChannelCount; ++channel)
     {
-        float currX = posX;
-        // On the left
-        if (hitX < currX)
-            return false;
-        // Traverse characters
-        wchar_t prevCh = 0;
-        for (size_t i = 0; i < textLen; i++)
+        std::vector<uint32_t> channelSortIndex;
+        std::vector<uvec2> spriteSizes;
+        for(size_t i = 0; i < sortIndex.size(); ++i)
         {
-            const wchar_t currCh = text[i];
-            const float charWidth = GetCharWidth_(currCh, fontSize);
-            const float kerning = prevCh ? GetKerning(prevCh, currCh, fontSize) : 0.f;
-            const float newX = currX + charWidth;
-            // Found
-            if (hitX < newX)
+            if(m_Glyphs[sortIndex[i]].TextureChannel == channel)
             {
-                outIndex = i;
-                if(outPercent)
-                    *outPercent = (hitX-currX) / charWidth;
-                return true;
+                channelSortIndex.push_back(sortIndex[i]);
+                spriteSizes.push_back(m_Glyphs[sortIndex[i]].Size);
             }
-            currX = newX + kerning;
-            prevCh = currCh;
         }
-        // Not found
-        return false;
-    }
-    else if (flags & FLAG_HRIGHT)
-    {
-        float currX = posX;
-        // On the right
-        if (hitX > currX)
+        std::vector<uvec2> spritePositions;
+        std::vector<uint32_t> spritePages;
+        uvec2 channelTextureSize;
+        uint32_t channelTexturePageCount;
+        m_BuildResult = PackAtlas(spritePositions, spritePages, channelTextureSize, channelTexturePageCount,
+            spriteSizes, m_Desc.Packing, (uint32_t)maxHeight * 8, margin, pow2, m_Desc.MaxTextureSize, m_Desc.MaxTexturePageCount);
+        if(m_BuildResult != CFont::INIT_RESULT_SUCCESS)
             return false;
-        // Traverse characters
-        wchar_t prevCh = 0;
-        for (size_t i = textLen; i--; )
+        m_TextureSize = uvec2(std::max(m_TextureSize.x, channelTextureSize.x), std::max(m_TextureSize.y, channelTextureSize.y));
+        m_TexturePageCount = std::max(m_TexturePageCount, channelTexturePageCount);
+        for(size_t i = 0; i < channelSortIndex.size(); ++i)
         {
-            const wchar_t currCh = text[i];
-            const float charWidth = GetCharWidth_(currCh, fontSize);
-            const float kerning = prevCh ? GetKerning(currCh, prevCh, fontSize) : 0.f;
-            const float newX = currX - charWidth;
-            // Found
-            if (hitX >= newX)
-            {
-                outIndex = i;
-                if(outPercent)
-                    *outPercent = (hitX-newX) / charWidth;
-                return true;
-            }
-            currX = newX - kerning;
-            prevCh = currCh;
+            m_Glyphs[channelSortIndex[i]].TexturePos = spritePositions[i];
+            m_Glyphs[channelSortIndex[i]].TexturePage = spritePages[i];
         }
-        // Not found
-        return false;
     }
-    else // flags & FLAG_HCENTER
-    {
-        // Calculate width of whole line
-        const float lineWidth = CalcSingleLineTextWidth(text, fontSize);
-        // Calculate position of the beginning
-        posX -= lineWidth * 0.5f;
-        // Rest is the same as with alignment to the left:
+    m_PackingTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - packingBeginTime).count();
 
-        float currX = posX;
-        // On the left
-        if (hitX < currX)
-            return false;
-        // Traverse characters
-        wchar_t prevCh = 0;
-        for (size_t i = 0; i < textLen; i++)
+    const auto compositionBeginTime = std::chrono::high_resolution_clock::now();
+    uint8_t* textureData;
+    size_t textureRowPitch, texturePageBytes;
+    if(m_Desc.GetTextureDestination)
+    {
+        STextureDestination destination;
+        if(!m_Desc.GetTextureDestination(m_Desc.GetTextureDestinationUserData, m_TextureSize, m_TexturePageCount, m_TextureFormat, destination))
         {
-            const wchar_t currCh = text[i];
-            const float charWidth = GetCharWidth_(currCh, fontSize);
-            const float kerning = prevCh ? GetKerning(prevCh, currCh, fontSize) : 0.f;
-            const float newX = currX + charWidth;
-            // Found
-            if (hitX < newX)
-            {
-                outIndex = i;
-                if(outPercent)
-                    *outPercent = (hitX-currX) / charWidth;
-                return true;
-            }
-            currX = newX + kerning;
-            prevCh = currCh;
+            m_BuildResult = CFont::INIT_RESULT_NO_TEXTURE_DESTINATION;
+            return false;
         }
-        // Not found
-        return false;
+        assert(destination.Data && destination.RowPitch >= GetTextureRowPitch(m_TextureFormat, m_TextureSize.x) &&
+            destination.PageStride >= destination.RowPitch * m_TextureSize.y);
+        textureData = (uint8_t*)destination.Data;
+        textureRowPitch = destination.RowPitch;
+        texturePageBytes = destination.PageStride;
+        const size_t rowBytes = GetTextureRowPitch(m_TextureFormat, m_TextureSize.x);
+        for(uint32_t texturePage = 0; texturePage < m_TexturePageCount; ++texturePage)
+            for(uint32_t y = 0; y < m_TextureSize.y; ++y)
+                memset(textureData + texturePageBytes * texturePage + textureRowPitch * y, 0, rowBytes);
+        m_TextureRowPitch = 0;
+        std::vector<uint8_t> tmp;
+        m_TextureData.swap(tmp);
+    }
+    else
+    {
+        m_TextureRowPitch = GetTextureRowPitch(m_TextureFormat, m_TextureSize.x);
+        m_TextureData.assign(m_TextureRowPitch * m_TextureSize.y * m_TexturePageCount, 0);
+        textureData = m_TextureData.data();
+        textureRowPitch = m_TextureRowPitch;
+        texturePageBytes = m_TextureRowPitch * m_TextureSize.y;
     }
+    const uint32_t glyphBytesPerTexel = GetTextureFormatBytesPerTexel(m_GlyphFormat);
+    /*
+    With FLAG_CHANNEL_PACKING, characters of fonts in different channels overlap on the same texels. BlitBitmapToFormat
+    writes only bytes of dstChannel then, so no byte of the texture is written by two characters and they can be copied in parallel.
+    */
+    ParallelFor(m_Glyphs.size(), GetWorkerThreadCount(m_Glyphs.size(), 256), [&](size_t glyphIndex, uint32_t threadIndex) {
+        const SGlyph& glyph = m_Glyphs[glyphIndex];
+        uint8_t* const dstPage = textureData + texturePageBytes * glyph.TexturePage;
+        const uint8_t* const src = m_GlyphData.data() + glyph.DataOffset;
+        const uint32_t srcRowPitch = AlignUp<uint32_t>(glyph.Size.x * glyphBytesPerTexel, 4);
+        if(m_GlyphFormat == m_TextureFormat)
+            BlitBitmap(dstPage, textureRowPitch, glyph.TexturePos, src, srcRowPitch, uvec2(0, 0), glyph.Size, glyphBytesPerTexel);
+        else
+            BlitBitmapToFormat<false>(dstPage, textureRowPitch, glyph.TexturePos, m_TextureFormat,
+                channelPacking ? glyph.TextureChannel : TEXTURE_CHANNEL_ALL, src, srcRowPitch, uvec2(0, 0), glyph.Size);
+    });
+    m_CompositionTime = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - compositionBeginTime).count();
+
+    for(size_t i = 0; i < m_Fonts.size(); ++i)
+        m_Fonts[i].Font->SetAtlasTexCoords(*this, m_Fonts[i].FirstGlyphIndex, m_Fonts[i].GlyphCount);
+
+    // Fonts may be destroyed or initialized again from now on. Sizes of glyphs remain for GetStatistics.
+    ForgetFonts();
+    for(size_t i = 0; i < m_Fonts.size(); ++i)
+        m_Fonts[i].Font = nullptr;
+    std::vector<uint8_t> tmp;
+    m_GlyphData.swap(tmp);
+    return true;
 }
 
-bool CFont::HitTest(size_t& outIndex, vec2 *outPercent,
-    const vec2& pos, const vec2& hit, const wstr_view& text, float fontSize, uint32_t flags, float textWidth) const
+void CFontAtlas::GetTextureData(const void*& outData, uvec2& outSize, size_t& outRowPitch) const
 {
-    assert(ValidateFlags(flags));
-
-    if (flags & FLAG_VTOP)
+    if(!m_TextureData.empty())
     {
-        size_t beg, end, index = 0;
-        float width;
-        float currY = pos.y;
-        // Above
-        if (hit.y < currY)
-            return false;
-        // Traverse lines
-        while (LineSplit(&beg, &end, &width, &index, text, fontSize, flags, textWidth))
-        {
-            // Found
-            if (hit.y < currY + (1.f + m_LineGap * 0.5f) * fontSize)
-            {
-                // Check x
-                if (HitTestSingleLine(
-                    outIndex, outPercent ? &outPercent->x : nullptr,
-                    pos.x, hit.x,
-                    text.substr(beg, end - beg),
-                    fontSize, flags))
-                {
-                    outIndex += beg;
-                    if(outPercent)
-                        outPercent->y = (hit.y-currY) / fontSize;
-                    return true;
-                }
-                else
-                    return false;
-            }
-            currY += (1.f + m_LineGap) * fontSize;
-        }
-        // Not found
-        return false;
+        outData = m_TextureData.data();
+        outSize = m_TextureSize;
+        outRowPitch = m_TextureRowPitch;
     }
-    // Bottom of vertical center
     else
     {
-        // Split into lines, remember them, see how many lines do we have.
-        size_t lineCount = 0;
-        std::vector<size_t> begs, ends;
-        size_t beg, end, index = 0;
-        float width;
-        while (LineSplit(&beg, &end, &width, &index, text, fontSize, flags, textWidth))
-        {
-            begs.push_back(beg);
-            ends.push_back(end);
-            lineCount++;
-        }
+        outData = nullptr;
+        outSize = UVEC2_ZERO;
+        outRowPitch = 0;
+    }
+}
 
-        float currY = pos.y;
-        // Calculate new beginning Y.
-        if (flags & FLAG_VBOTTOM)
-            currY -= lineCount * fontSize;
-        else // flags & FLAG_VMIDDLE
-            currY -= lineCount * fontSize * 0.5f;
-        // Rest is the same as with alignment to the top:
+void CFontAtlas::FreeTextureData()
+{
+    std::vector<uint8_t> tmp;
+    m_TextureData.swap(tmp);
+}
 
-        // Above
-        if (hit.y < currY)
-            return false;
-        // Traverse lines
-        for (size_t Line = 0; Line < lineCount; Line++)
+void CFontAtlas::GetStatistics(SStatistics& outStats) const
+{
+    outStats.FontCount = m_Fonts.size();
+    outStats.CharCount = m_Glyphs.size();
+    outStats.AtlasUsedTexels = m_AtlasUsedTexels;
+    outStats.AtlasTotalTexels = (size_t)m_TextureSize.x * m_TextureSize.y * m_TexturePageCount * m_TextureChannelCount;
+    outStats.PackingTime = m_PackingTime;
+    outStats.CompositionTime = m_CompositionTime;
+
+    const uint32_t margin = 1;
+    const bool pow2 = (m_Desc.Flags & SFontDesc::FLAG_TEXTURE_POW2) != 0;
+    outStats.SeparateTotalTexels = 0;
+    for(size_t fontIndex = 0; fontIndex < m_Fonts.size(); ++fontIndex)
+    {
+        // Glyphs of each font were already sorted by height by CFont::Init.
+        const SFontRange& font = m_Fonts[fontIndex];
+        std::vector<uvec2> spriteSizes(font.GlyphCount);
+        for(size_t i = 0; i < font.GlyphCount; ++i)
+            spriteSizes[i] = m_Glyphs[font.FirstGlyphIndex + i].Size;
+        std::vector<uvec2> spritePositions;
+        std::vector<uint32_t> spritePages;
+        uvec2 textureSize = UVEC2_ZERO;
+        uint32_t texturePageCount = 0;
+        if(PackAtlas(spritePositions, spritePages, textureSize, texturePageCount, spriteSizes, m_Desc.Packing,
+            (uint32_t)font.Height * 8, margin, pow2, m_Desc.MaxTextureSize, m_Desc.MaxTexturePageCount) != CFont::INIT_RESULT_SUCCESS)
         {
-            const float newY = currY + (1.f + m_LineGap) * fontSize;
-            // Found
-            if (hit.y < currY + (1.f + m_LineGap * 0.5f) * fontSize)
-            {
-                // Check x
-                if (HitTestSingleLine(
-                    outIndex, outPercent ? &outPercent->x : nullptr,
-                    pos.x, hit.x,
-                    text.substr(begs[Line], ends[Line] - begs[Line]),
-                    fontSize, flags))
-                {
-                    outIndex += begs[Line];
-                    if(outPercent)
-                        outPercent->y = (hit.y - currY) / fontSize;
-                    return true;
-                }
-                else
-                    return false;
-            }
-            currY += (1.f + m_LineGap) * fontSize;
+            outStats.SeparateTotalTexels = SIZE_MAX;
+            break;
         }
-        // Not found
-        return false;
+        outStats.SeparateTotalTexels += (size_t)textureSize.x * textureSize.y * texturePageCount;
     }
 }
 
-void CFont::SortKerningEntries()
-{
-    std::sort(m_KerningEntries.begin(), m_KerningEntries.end(), [](const SKerningEntry& lhs, const SKerningEntry& rhs) -> bool {
-        if(lhs.First < rhs.First) { return true; }
-        if(lhs.First > rhs.First) { return false; }
-        return lhs.Second < rhs.Second;
-    });
-}
-
 } // namespace WinFontRender
 
 #pragma endregion
 
+#endif // #ifndef WIN_FONT_RENDER_CACHE_ONLY
+
 #endif // #ifdef WIN_FONT_RENDER_IMPLEMENTATION